@@ -0,0 +1,45 @@
+#include <atomic>
+#include <cstdlib>
+#include <new>
+
+#include "AllocationCounter.h"
+
+// The array and nothrow forms are defined in terms of the throwing operator
+// new and operator delete. Sized delete is too, but some runtimes don't
+// forward it, so it is replaced as well. Aligned allocations aren't counted.
+
+namespace {
+
+std::atomic<uint64_t> s_allocations{ 0 };
+
+}
+
+uint64_t AllocationCounter::getCount()
+{
+	return s_allocations.load(std::memory_order_relaxed);
+}
+
+void* operator new(std::size_t size)
+{
+	s_allocations.fetch_add(1, std::memory_order_relaxed);
+	while (true) {
+		if (void* memory = std::malloc(size > 0 ? size : 1)) {
+			return memory;
+		}
+		std::new_handler handler = std::get_new_handler();
+		if (!handler) {
+			throw std::bad_alloc();
+		}
+		handler();
+	}
+}
+
+void operator delete(void* memory) noexcept
+{
+	std::free(memory);
+}
+
+void operator delete(void* memory, std::size_t) noexcept
+{
+	std::free(memory);
+}
@@ -0,0 +1,13 @@
+#pragma once
+
+#include <cstdint>
+
+// Counts calls to the global operator new, to check that code that should
+// not touch the heap (like the renderer's frame path in steady state)
+// really doesn't. Allocations on every thread are counted; memory the C
+// runtime or the Vulkan driver allocates with malloc is not.
+class AllocationCounter
+{
+public:
+	static uint64_t getCount();
+};
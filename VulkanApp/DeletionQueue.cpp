@@ -0,0 +1,22 @@
+#include "DeletionQueue.h"
+
+void DeletionQueue::push(uint64_t submittedFrames, std::function<void()> deleter)
+{
+	m_entries.push_back({ submittedFrames, std::move(deleter) });
+}
+
+void DeletionQueue::flush(uint64_t completedFrames)
+{
+	while (!m_entries.empty() && m_entries.front().submittedFrames <= completedFrames) {
+		m_entries.front().deleter();
+		m_entries.pop_front();
+	}
+}
+
+void DeletionQueue::flushAll()
+{
+	while (!m_entries.empty()) {
+		m_entries.front().deleter();
+		m_entries.pop_front();
+	}
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+#include <cstdint>
+#include <deque>
+#include <functional>
+
+// Defers the destruction of GPU objects until the frames that may still
+// be using them have retired. Entries are tagged with the number of frames
+// that had been submitted when the object was retired, and are run once
+// that many frames are known to have completed on the GPU.
+class DeletionQueue
+{
+public:
+	void push(uint64_t submittedFrames, std::function<void()> deleter);
+
+	// Run every deleter whose frames have all completed
+	void flush(uint64_t completedFrames);
+
+	// Run every deleter, only valid once the device is idle
+	void flushAll();
+
+private:
+	struct Entry {
+		uint64_t submittedFrames;
+		std::function<void()> deleter;
+	};
+
+	// Entries are pushed with non-decreasing frame numbers, so the
+	// queue is always sorted and only the front needs checking
+	std::deque<Entry> m_entries;
+};
@@ -0,0 +1,121 @@
+#include <algorithm>
+#include <stdexcept>
+
+#include "DepthPyramid.h"
+#include "Utils.h"
+
+DepthPyramid::DepthPyramid(VkPhysicalDevice physicalDevice, VkDevice device, VkExtent2D depthExtent)
+	: m_device(device), m_depthExtent(depthExtent)
+{
+	// Power of two sized, so that every mip level is exactly half the size
+	// of the previous one and at least as big as the part that covers the
+	// depth buffer, down to a single texel covering all of it
+	VkExtent2D covered = getLevelExtent(0);
+	VkExtent2D extent = { 1, 1 };
+	while (extent.width < covered.width) {
+		extent.width *= 2;
+	}
+	while (extent.height < covered.height) {
+		extent.height *= 2;
+	}
+	uint32_t levelCount = 1;
+	while ((std::max(extent.width, extent.height) >> (levelCount - 1)) > 1) {
+		levelCount++;
+	}
+
+	VkImageCreateInfo imageCreateInfo{};
+	imageCreateInfo.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+	imageCreateInfo.imageType = VK_IMAGE_TYPE_2D;
+	imageCreateInfo.format = FORMAT;
+	imageCreateInfo.extent = { extent.width, extent.height, 1 };
+	imageCreateInfo.mipLevels = levelCount;
+	imageCreateInfo.arrayLayers = 1;
+	imageCreateInfo.samples = VK_SAMPLE_COUNT_1_BIT;
+	imageCreateInfo.tiling = VK_IMAGE_TILING_OPTIMAL;
+	imageCreateInfo.usage = VK_IMAGE_USAGE_STORAGE_BIT | VK_IMAGE_USAGE_SAMPLED_BIT;
+	imageCreateInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+	imageCreateInfo.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+
+	VkResult result = vkCreateImage(m_device, &imageCreateInfo, nullptr, &m_image);
+	if (result != VK_SUCCESS) {
+		throw std::runtime_error("Failed to create the depth pyramid");
+	}
+
+	VkMemoryRequirements memoryRequirements;
+	vkGetImageMemoryRequirements(m_device, m_image, &memoryRequirements);
+
+	VkMemoryAllocateInfo allocInfo{};
+	allocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+	allocInfo.allocationSize = memoryRequirements.size;
+	allocInfo.memoryTypeIndex = findMemoryTypeIndex(physicalDevice, memoryRequirements.memoryTypeBits,
+		VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+
+	RenderStats::countAllocation();
+	result = vkAllocateMemory(m_device, &allocInfo, nullptr, &m_memory);
+	if (result != VK_SUCCESS) {
+		throw std::runtime_error("Failed to allocate depth pyramid memory");
+	}
+	vkBindImageMemory(m_device, m_image, m_memory, 0);
+
+	VkImageViewCreateInfo viewCreateInfo{};
+	viewCreateInfo.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
+	viewCreateInfo.image = m_image;
+	viewCreateInfo.viewType = VK_IMAGE_VIEW_TYPE_2D;
+	viewCreateInfo.format = FORMAT;
+	viewCreateInfo.components.r = VK_COMPONENT_SWIZZLE_IDENTITY;
+	viewCreateInfo.components.g = VK_COMPONENT_SWIZZLE_IDENTITY;
+	viewCreateInfo.components.b = VK_COMPONENT_SWIZZLE_IDENTITY;
+	viewCreateInfo.components.a = VK_COMPONENT_SWIZZLE_IDENTITY;
+	viewCreateInfo.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+	viewCreateInfo.subresourceRange.baseMipLevel = 0;
+	viewCreateInfo.subresourceRange.levelCount = levelCount;
+	viewCreateInfo.subresourceRange.baseArrayLayer = 0;
+	viewCreateInfo.subresourceRange.layerCount = 1;
+
+	result = vkCreateImageView(m_device, &viewCreateInfo, nullptr, &m_imageView);
+	if (result != VK_SUCCESS) {
+		throw std::runtime_error("Failed to create the depth pyramid view");
+	}
+
+	viewCreateInfo.subresourceRange.levelCount = 1;
+	for (uint32_t level = 0; level < levelCount; level++) {
+		viewCreateInfo.subresourceRange.baseMipLevel = level;
+		VkImageView levelView;
+		result = vkCreateImageView(m_device, &viewCreateInfo, nullptr, &levelView);
+		if (result != VK_SUCCESS) {
+			throw std::runtime_error("Failed to create a depth pyramid level view");
+		}
+		m_levelViews.push_back(levelView);
+	}
+}
+
+void DepthPyramid::destroy()
+{
+	if (m_device == VK_NULL_HANDLE) {
+		return;
+	}
+	for (VkImageView levelView : m_levelViews) {
+		vkDestroyImageView(m_device, levelView, nullptr);
+	}
+	m_levelViews.clear();
+	vkDestroyImageView(m_device, m_imageView, nullptr);
+	vkDestroyImage(m_device, m_image, nullptr);
+	vkFreeMemory(m_device, m_memory, nullptr);
+	m_imageView = VK_NULL_HANDLE;
+	m_image = VK_NULL_HANDLE;
+	m_memory = VK_NULL_HANDLE;
+}
+
+VkExtent2D DepthPyramid::getLevelExtent(uint32_t level) const
+{
+	return getCoveringExtent(m_depthExtent, level);
+}
+
+VkExtent2D DepthPyramid::getCoveringExtent(VkExtent2D depthExtent, uint32_t level)
+{
+	uint32_t texelSize = 2u << level;
+	return {
+		std::max((depthExtent.width + texelSize - 1) / texelSize, 1u),
+		std::max((depthExtent.height + texelSize - 1) / texelSize, 1u)
+	};
+}
@@ -0,0 +1,48 @@
+#pragma once
+
+#define GLFW_INCLUDE_VULKAN
+#include <GLFW/glfw3.h>
+
+#include <vector>
+
+// Hierarchical-Z buffer for occlusion culling: a chain of R32 levels in
+// which every texel holds the farthest depth of the 2x2 texels below it.
+// A texel of level L covers exactly the pixels [x, x + 1) * 2^(L + 1) of
+// the depth buffer, so level 0 covers 2x2 pixels and the top level, a
+// single texel, all of them. The renderer writes the levels from a compute
+// shader and keeps the image from one frame to the next, in the shader
+// read only layout.
+class DepthPyramid
+{
+public:
+	static constexpr VkFormat FORMAT = VK_FORMAT_R32_SFLOAT;
+
+	DepthPyramid() {}
+	DepthPyramid(VkPhysicalDevice physicalDevice, VkDevice device, VkExtent2D depthExtent);
+
+	// Frees the image, which no frame in flight may still be using
+	void destroy();
+
+	VkImage getImage() const { return m_image; }
+
+	// All levels, for sampling, and one per level, for writing as a storage image
+	VkImageView getImageView() const { return m_imageView; }
+	VkImageView getLevelView(uint32_t level) const { return m_levelViews[level]; }
+
+	uint32_t getLevelCount() const { return static_cast<uint32_t>(m_levelViews.size()); }
+
+	// Texels of a level that cover the depth buffer, the rest of the level
+	// is never written
+	VkExtent2D getLevelExtent(uint32_t level) const;
+
+	// Texels of a level that cover the given top left corner of the depth buffer
+	static VkExtent2D getCoveringExtent(VkExtent2D depthExtent, uint32_t level);
+
+private:
+	VkDevice m_device = VK_NULL_HANDLE;
+	VkExtent2D m_depthExtent = {};
+	VkImage m_image = VK_NULL_HANDLE;
+	VkDeviceMemory m_memory = VK_NULL_HANDLE;
+	VkImageView m_imageView = VK_NULL_HANDLE;
+	std::vector<VkImageView> m_levelViews;
+};
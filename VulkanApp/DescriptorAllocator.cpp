@@ -0,0 +1,232 @@
+#include <algorithm>
+#include <cstring>
+#include <functional>
+#include <stdexcept>
+
+#include "DescriptorAllocator.h"
+
+namespace {
+
+// Each pool is twice the size of the previous one, up to this many sets
+const uint32_t MAX_SETS_PER_POOL = 4096;
+
+void hashCombine(size_t& seed, uint64_t value)
+{
+	seed ^= std::hash<uint64_t>()(value) + 0x9e3779b97f4a7c15ull + (seed << 6) + (seed >> 2);
+}
+
+template <typename T>
+uint64_t handleBits(T handle)
+{
+	// Non-dispatchable handles are pointers on 64-bit and integers on 32-bit builds
+	uint64_t bits = 0;
+	memcpy(&bits, &handle, std::min(sizeof(handle), sizeof(bits)));
+	return bits;
+}
+
+}
+
+DescriptorAllocator::DescriptorAllocator(VkDevice device, const std::vector<PoolRatio>& ratios, uint32_t setsPerPool,
+	VkDescriptorPoolCreateFlags flags)
+	: m_device(device), m_ratios(ratios), m_setsPerPool(setsPerPool), m_flags(flags)
+{
+}
+
+VkDescriptorSet DescriptorAllocator::allocate(VkDescriptorSetLayout layout, const void* pNext)
+{
+	VkDescriptorSetAllocateInfo setAllocInfo{};
+	setAllocInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+	setAllocInfo.pNext = pNext;
+	setAllocInfo.descriptorPool = getPool();
+	setAllocInfo.descriptorSetCount = 1;
+	setAllocInfo.pSetLayouts = &layout;
+
+	VkDescriptorSet set = VK_NULL_HANDLE;
+	VkResult result = vkAllocateDescriptorSets(m_device, &setAllocInfo, &set);
+
+	// The current pool is exhausted: retire it and try once more with a fresh one
+	if (result == VK_ERROR_OUT_OF_POOL_MEMORY || result == VK_ERROR_FRAGMENTED_POOL) {
+		m_fullPools.push_back(m_readyPools.back());
+		m_readyPools.pop_back();
+
+		setAllocInfo.descriptorPool = getPool();
+		result = vkAllocateDescriptorSets(m_device, &setAllocInfo, &set);
+	}
+
+	if (result != VK_SUCCESS) {
+		throw std::runtime_error("Failed to allocate descriptor set.");
+	}
+
+	return set;
+}
+
+void DescriptorAllocator::reset()
+{
+	for (auto pool : m_readyPools) {
+		vkResetDescriptorPool(m_device, pool, 0);
+	}
+	for (auto pool : m_fullPools) {
+		vkResetDescriptorPool(m_device, pool, 0);
+		m_readyPools.push_back(pool);
+	}
+	m_fullPools.clear();
+}
+
+void DescriptorAllocator::destroy()
+{
+	for (auto pool : m_readyPools) {
+		vkDestroyDescriptorPool(m_device, pool, nullptr);
+	}
+	for (auto pool : m_fullPools) {
+		vkDestroyDescriptorPool(m_device, pool, nullptr);
+	}
+	m_readyPools.clear();
+	m_fullPools.clear();
+}
+
+size_t DescriptorAllocator::getPoolCount() const
+{
+	return m_readyPools.size() + m_fullPools.size();
+}
+
+VkDescriptorPool DescriptorAllocator::getPool()
+{
+	if (m_readyPools.empty()) {
+		m_readyPools.push_back(createPool(m_setsPerPool));
+		m_setsPerPool = std::min(m_setsPerPool * 2, MAX_SETS_PER_POOL);
+	}
+
+	return m_readyPools.back();
+}
+
+VkDescriptorPool DescriptorAllocator::createPool(uint32_t setCount)
+{
+	std::vector<VkDescriptorPoolSize> poolSizes;
+	for (const auto& ratio : m_ratios) {
+		VkDescriptorPoolSize poolSize{};
+		poolSize.type = ratio.type;
+		poolSize.descriptorCount = std::max(1u, static_cast<uint32_t>(ratio.perSet * setCount));
+		poolSizes.push_back(poolSize);
+	}
+
+	VkDescriptorPoolCreateInfo createInfo{};
+	createInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+	createInfo.flags = m_flags;
+	createInfo.maxSets = setCount;
+	createInfo.poolSizeCount = static_cast<uint32_t>(poolSizes.size());
+	createInfo.pPoolSizes = poolSizes.data();
+
+	VkDescriptorPool pool;
+	VkResult result = vkCreateDescriptorPool(m_device, &createInfo, nullptr, &pool);
+	if (result != VK_SUCCESS) {
+		throw std::runtime_error("Failed to create descriptor pool.");
+	}
+
+	return pool;
+}
+
+DescriptorSetCache::Binding DescriptorSetCache::Binding::buffer(uint32_t binding, VkDescriptorType type, VkBuffer buffer,
+	VkDeviceSize offset, VkDeviceSize range)
+{
+	Binding result;
+	result.binding = binding;
+	result.type = type;
+	result.bufferInfo.buffer = buffer;
+	result.bufferInfo.offset = offset;
+	result.bufferInfo.range = range;
+	return result;
+}
+
+DescriptorSetCache::Binding DescriptorSetCache::Binding::image(uint32_t binding, VkDescriptorType type,
+	VkImageView imageView, VkSampler sampler, VkImageLayout imageLayout)
+{
+	Binding result;
+	result.binding = binding;
+	result.type = type;
+	result.imageInfo.imageView = imageView;
+	result.imageInfo.sampler = sampler;
+	result.imageInfo.imageLayout = imageLayout;
+	return result;
+}
+
+void DescriptorSetCache::setAllocator(DescriptorAllocator* allocator)
+{
+	m_allocator = allocator;
+}
+
+VkDescriptorSet DescriptorSetCache::getSet(VkDescriptorSetLayout layout, const std::vector<Binding>& bindings)
+{
+	size_t key = hashKey(layout, bindings);
+
+	auto range = m_sets.equal_range(key);
+	for (auto it = range.first; it != range.second; ++it) {
+		if (it->second.layout == layout && sameBindings(it->second.bindings, bindings)) {
+			m_hits++;
+			return it->second.set;
+		}
+	}
+
+	m_misses++;
+	VkDescriptorSet set = m_allocator->allocate(layout);
+
+	std::vector<VkWriteDescriptorSet> writeSets;
+	for (const auto& binding : bindings) {
+		VkWriteDescriptorSet setWrite{};
+		setWrite.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+		setWrite.dstSet = set;
+		setWrite.dstBinding = binding.binding;
+		setWrite.dstArrayElement = 0;
+		setWrite.descriptorType = binding.type;
+		setWrite.descriptorCount = 1;
+		setWrite.pBufferInfo = &binding.bufferInfo;
+		setWrite.pImageInfo = &binding.imageInfo;
+		writeSets.push_back(setWrite);
+	}
+
+	vkUpdateDescriptorSets(m_allocator->getDevice(), static_cast<uint32_t>(writeSets.size()), writeSets.data(), 0, nullptr);
+
+	m_sets.insert({ key, { layout, bindings, set } });
+	return set;
+}
+
+void DescriptorSetCache::clear()
+{
+	m_sets.clear();
+}
+
+size_t DescriptorSetCache::hashKey(VkDescriptorSetLayout layout, const std::vector<Binding>& bindings)
+{
+	size_t seed = 0;
+	hashCombine(seed, handleBits(layout));
+	for (const auto& binding : bindings) {
+		hashCombine(seed, binding.binding);
+		hashCombine(seed, binding.type);
+		hashCombine(seed, handleBits(binding.bufferInfo.buffer));
+		hashCombine(seed, binding.bufferInfo.offset);
+		hashCombine(seed, binding.bufferInfo.range);
+		hashCombine(seed, handleBits(binding.imageInfo.imageView));
+		hashCombine(seed, handleBits(binding.imageInfo.sampler));
+		hashCombine(seed, binding.imageInfo.imageLayout);
+	}
+	return seed;
+}
+
+bool DescriptorSetCache::sameBindings(const std::vector<Binding>& a, const std::vector<Binding>& b)
+{
+	if (a.size() != b.size()) {
+		return false;
+	}
+
+	for (size_t i = 0; i < a.size(); i++) {
+		if (a[i].binding != b[i].binding || a[i].type != b[i].type
+			|| a[i].bufferInfo.buffer != b[i].bufferInfo.buffer
+			|| a[i].bufferInfo.offset != b[i].bufferInfo.offset
+			|| a[i].bufferInfo.range != b[i].bufferInfo.range
+			|| a[i].imageInfo.imageView != b[i].imageInfo.imageView
+			|| a[i].imageInfo.sampler != b[i].imageInfo.sampler
+			|| a[i].imageInfo.imageLayout != b[i].imageInfo.imageLayout) {
+			return false;
+		}
+	}
+	return true;
+}
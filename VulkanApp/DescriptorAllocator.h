@@ -0,0 +1,94 @@
+#pragma once
+
+#define GLFW_INCLUDE_VULKAN
+#include <GLFW/glfw3.h>
+
+#include <unordered_map>
+#include <vector>
+
+// Hands out descriptor sets from a chain of pools. When a pool runs out a
+// new, bigger one is added, so callers never have to size pools up front.
+// reset() returns every set at once, which is how per-frame allocators are
+// recycled once the frame's fence has signalled.
+class DescriptorAllocator
+{
+public:
+	// Descriptors of each type per set, used to size the pools
+	struct PoolRatio {
+		VkDescriptorType type;
+		float perSet;
+	};
+
+	DescriptorAllocator() {}
+	DescriptorAllocator(VkDevice device, const std::vector<PoolRatio>& ratios, uint32_t setsPerPool = 32,
+		VkDescriptorPoolCreateFlags flags = 0);
+
+	VkDescriptorSet allocate(VkDescriptorSetLayout layout, const void* pNext = nullptr);
+
+	// Every set allocated so far becomes invalid
+	void reset();
+	void destroy();
+
+	VkDevice getDevice() const { return m_device; }
+	size_t getPoolCount() const;
+
+private:
+	VkDevice m_device = VK_NULL_HANDLE;
+	std::vector<PoolRatio> m_ratios;
+	uint32_t m_setsPerPool = 0;
+	VkDescriptorPoolCreateFlags m_flags = 0;
+
+	std::vector<VkDescriptorPool> m_fullPools;
+	std::vector<VkDescriptorPool> m_readyPools;
+
+	VkDescriptorPool getPool();
+	VkDescriptorPool createPool(uint32_t setCount);
+};
+
+// Long lived descriptor sets, keyed by their layout and what is bound to
+// them. Asking twice for the same bindings returns the same set without
+// allocating or calling vkUpdateDescriptorSets again. Sets are keyed by
+// raw handles and never evicted, so only resources that outlive the cache
+// (until clear()) may be bound through it; a destroyed handle can be
+// reused by the driver for another resource.
+class DescriptorSetCache
+{
+public:
+	struct Binding {
+		uint32_t binding = 0;
+		VkDescriptorType type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+		VkDescriptorBufferInfo bufferInfo = {};
+		VkDescriptorImageInfo imageInfo = {};
+
+		static Binding buffer(uint32_t binding, VkDescriptorType type, VkBuffer buffer,
+			VkDeviceSize offset = 0, VkDeviceSize range = VK_WHOLE_SIZE);
+		static Binding image(uint32_t binding, VkDescriptorType type, VkImageView imageView,
+			VkSampler sampler, VkImageLayout imageLayout);
+	};
+
+	explicit DescriptorSetCache(DescriptorAllocator* allocator = nullptr) : m_allocator(allocator) {}
+	void setAllocator(DescriptorAllocator* allocator);
+
+	VkDescriptorSet getSet(VkDescriptorSetLayout layout, const std::vector<Binding>& bindings);
+
+	// Forget all sets, e.g. after the allocator was reset
+	void clear();
+
+	size_t getHits() const { return m_hits; }
+	size_t getMisses() const { return m_misses; }
+
+private:
+	struct Entry {
+		VkDescriptorSetLayout layout;
+		std::vector<Binding> bindings;
+		VkDescriptorSet set;
+	};
+
+	DescriptorAllocator* m_allocator;
+	std::unordered_multimap<size_t, Entry> m_sets;
+	size_t m_hits = 0;
+	size_t m_misses = 0;
+
+	static size_t hashKey(VkDescriptorSetLayout layout, const std::vector<Binding>& bindings);
+	static bool sameBindings(const std::vector<Binding>& a, const std::vector<Binding>& b);
+};
@@ -0,0 +1,64 @@
+#include <algorithm>
+#include <cmath>
+
+#include "DynamicResolution.h"
+
+namespace {
+
+// Number of frames the hit rate is computed over
+const size_t HIT_WINDOW = 120;
+
+// Aim a little below the budget so that noise doesn't push frames over it
+const double HEADROOM = 0.9;
+
+// How much of the way to the ideal scale is covered each frame, to avoid oscillating
+const float SMOOTHING = 0.1f;
+
+}
+
+DynamicResolution::DynamicResolution(double targetFrameMs, float minScale, float maxScale)
+	: m_targetFrameMs(targetFrameMs), m_minScale(minScale), m_maxScale(maxScale), m_scale(maxScale),
+	m_hits(HIT_WINDOW, false)
+{
+}
+
+void DynamicResolution::setEnabled(bool enabled)
+{
+	m_enabled = enabled;
+	if (!m_enabled) {
+		m_scale = m_maxScale;
+	}
+}
+
+void DynamicResolution::update(double gpuFrameMs)
+{
+	m_gpuFrameMs = gpuFrameMs;
+
+	bool hit = gpuFrameMs <= m_targetFrameMs;
+	if (m_frameCount == HIT_WINDOW) {
+		m_hitCount -= m_hits[m_nextHit] ? 1 : 0;
+	}
+	else {
+		m_frameCount++;
+	}
+	m_hits[m_nextHit] = hit;
+	m_hitCount += hit ? 1 : 0;
+	m_nextHit = (m_nextHit + 1) % HIT_WINDOW;
+
+	if (!m_enabled || gpuFrameMs <= 0.0) {
+		return;
+	}
+
+	// Scale at which the last frame would have taken the target time
+	float ideal = m_scale * static_cast<float>(std::sqrt(m_targetFrameMs * HEADROOM / gpuFrameMs));
+	m_scale += (ideal - m_scale) * SMOOTHING;
+	m_scale = std::clamp(m_scale, m_minScale, m_maxScale);
+}
+
+double DynamicResolution::getHitRate() const
+{
+	if (m_frameCount == 0) {
+		return 1.0;
+	}
+	return static_cast<double>(m_hitCount) / m_frameCount;
+}
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <cstddef>
+#include <vector>
+
+// Picks the scale the scene is rendered at from measured GPU frame times,
+// so that the frame stays within its time budget. Cost is assumed to grow
+// with the number of pixels, i.e. with the square of the scale.
+class DynamicResolution
+{
+public:
+	DynamicResolution(double targetFrameMs = 16.6, float minScale = 0.5f, float maxScale = 1.0f);
+
+	void setEnabled(bool enabled);
+	bool isEnabled() const { return m_enabled; }
+
+	// Feed the GPU time of a finished frame, updates the scale for the next one
+	void update(double gpuFrameMs);
+
+	float getScale() const { return m_scale; }
+	double getTargetFrameMs() const { return m_targetFrameMs; }
+	double getGpuFrameMs() const { return m_gpuFrameMs; }
+
+	// Fraction of the recent frames that were within the budget
+	double getHitRate() const;
+
+private:
+	bool m_enabled = false;
+	double m_targetFrameMs;
+	float m_minScale;
+	float m_maxScale;
+	float m_scale;
+	double m_gpuFrameMs = 0.0;
+
+	// Ring of the last frames, true if the frame was within the budget
+	std::vector<bool> m_hits;
+	size_t m_nextHit = 0;
+	size_t m_hitCount = 0;
+	size_t m_frameCount = 0;
+};
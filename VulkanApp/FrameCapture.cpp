@@ -0,0 +1,412 @@
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+
+#include "FrameCapture.h"
+#include "Utils.h"
+
+namespace {
+
+uint32_t crc32(uint32_t crc, const uint8_t* data, size_t size)
+{
+	static uint32_t table[256];
+	static bool tableReady = false;
+	if (!tableReady) {
+		for (uint32_t i = 0; i < 256; i++) {
+			uint32_t c = i;
+			for (int k = 0; k < 8; k++) {
+				c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+			}
+			table[i] = c;
+		}
+		tableReady = true;
+	}
+
+	crc = ~crc;
+	for (size_t i = 0; i < size; i++) {
+		crc = table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+	}
+	return ~crc;
+}
+
+void putBigEndian(std::vector<uint8_t>& out, uint32_t value)
+{
+	out.push_back(static_cast<uint8_t>(value >> 24));
+	out.push_back(static_cast<uint8_t>(value >> 16));
+	out.push_back(static_cast<uint8_t>(value >> 8));
+	out.push_back(static_cast<uint8_t>(value));
+}
+
+void writeChunk(std::ofstream& out, const char* type, const std::vector<uint8_t>& data)
+{
+	std::vector<uint8_t> chunk;
+	chunk.reserve(data.size() + 12);
+	putBigEndian(chunk, static_cast<uint32_t>(data.size()));
+	chunk.insert(chunk.end(), type, type + 4);
+	chunk.insert(chunk.end(), data.begin(), data.end());
+	putBigEndian(chunk, crc32(0, chunk.data() + 4, chunk.size() - 4));
+	out.write(reinterpret_cast<const char*>(chunk.data()), chunk.size());
+}
+
+// Tightly packed RGB, optionally with a zero filter byte in front of every row as PNG wants
+void toRgb(const std::vector<uint8_t>& pixels, VkExtent2D extent, bool bgra, bool filterBytes, std::vector<uint8_t>& rgb)
+{
+	size_t rowSize = extent.width * 3 + (filterBytes ? 1 : 0);
+	rgb.resize(rowSize * extent.height);
+
+	const uint8_t* src = pixels.data();
+	uint8_t* dst = rgb.data();
+	size_t r = bgra ? 2 : 0;
+	size_t b = bgra ? 0 : 2;
+	for (uint32_t y = 0; y < extent.height; y++) {
+		if (filterBytes) {
+			*dst++ = 0;
+		}
+		for (uint32_t x = 0; x < extent.width; x++) {
+			dst[0] = src[r];
+			dst[1] = src[1];
+			dst[2] = src[b];
+			dst += 3;
+			src += 4;
+		}
+	}
+}
+
+}
+
+FrameCapture::FrameCapture(VkPhysicalDevice physicalDevice, VkDevice device, uint32_t bufferCount,
+	const std::string& pathPattern, uint32_t frameLimit)
+	: m_physicalDevice(physicalDevice), m_device(device), m_readbacks(bufferCount),
+	m_pathPattern(pathPattern), m_frameLimit(frameLimit)
+{
+	// Cached memory makes reading the pixels on the CPU much faster, but
+	// isn't always there (or coherent)
+	VkPhysicalDeviceMemoryProperties memoryProperties;
+	vkGetPhysicalDeviceMemoryProperties(m_physicalDevice, &memoryProperties);
+
+	VkMemoryPropertyFlags cached = VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_CACHED_BIT;
+	m_memoryProperties = VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
+	for (uint32_t i = 0; i < memoryProperties.memoryTypeCount; i++) {
+		if ((memoryProperties.memoryTypes[i].propertyFlags & cached) == cached) {
+			m_memoryProperties = memoryProperties.memoryTypes[i].propertyFlags & (cached | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
+			break;
+		}
+	}
+
+	m_writer = std::thread([this] { writerLoop(); });
+}
+
+FrameCapture::~FrameCapture()
+{
+	destroy();
+}
+
+bool FrameCapture::isSupported(VkFormat format)
+{
+	switch (format) {
+	case VK_FORMAT_B8G8R8A8_UNORM:
+	case VK_FORMAT_B8G8R8A8_SRGB:
+	case VK_FORMAT_R8G8B8A8_UNORM:
+	case VK_FORMAT_R8G8B8A8_SRGB:
+		return true;
+	default:
+		return false;
+	}
+}
+
+bool FrameCapture::isActive() const
+{
+	return m_frameLimit == 0 || m_captured < m_frameLimit;
+}
+
+void FrameCapture::recordCopy(VkCommandBuffer commandBuffer, VkImage image, VkFormat format, VkExtent2D extent,
+	uint64_t frameNumber)
+{
+	if (!isActive() || !isSupported(format)) {
+		return;
+	}
+
+	// Never wait for a buffer, a frame that finds them all in flight is dropped
+	auto readback = std::find_if(m_readbacks.begin(), m_readbacks.end(),
+		[](const Readback& readback) { return !readback.pending; });
+	if (readback == m_readbacks.end()) {
+		m_dropped++;
+		return;
+	}
+
+	VkDeviceSize size = static_cast<VkDeviceSize>(extent.width) * extent.height * 4;
+	if (readback->size < size) {
+		destroyReadback(*readback);
+		createReadback(*readback, size);
+	}
+
+	VkBufferImageCopy region{};
+	region.bufferOffset = 0;
+	region.bufferRowLength = 0; // tightly packed
+	region.bufferImageHeight = 0;
+	region.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+	region.imageSubresource.mipLevel = 0;
+	region.imageSubresource.baseArrayLayer = 0;
+	region.imageSubresource.layerCount = 1;
+	region.imageOffset = { 0, 0, 0 };
+	region.imageExtent = { extent.width, extent.height, 1 };
+	vkCmdCopyImageToBuffer(commandBuffer, image, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, readback->buffer, 1, &region);
+
+	// Make the copy visible to the host once the frame's fence has signalled
+	VkBufferMemoryBarrier barrier{};
+	barrier.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
+	barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+	barrier.dstAccessMask = VK_ACCESS_HOST_READ_BIT;
+	barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+	barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+	barrier.buffer = readback->buffer;
+	barrier.offset = 0;
+	barrier.size = size;
+	vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_HOST_BIT, 0,
+		0, nullptr, 1, &barrier, 0, nullptr);
+
+	readback->pending = true;
+	readback->frameNumber = frameNumber;
+	readback->extent = extent;
+	readback->bgra = format == VK_FORMAT_B8G8R8A8_UNORM || format == VK_FORMAT_B8G8R8A8_SRGB;
+
+	if (m_captured == 0) {
+		m_firstCapture = Clock::now();
+	}
+	m_captured++;
+}
+
+void FrameCapture::collect(uint64_t completedFrames)
+{
+	for (auto& readback : m_readbacks) {
+		if (!readback.pending || readback.frameNumber >= completedFrames) {
+			continue;
+		}
+		readback.pending = false;
+
+		VkDeviceSize size = static_cast<VkDeviceSize>(readback.extent.width) * readback.extent.height * 4;
+		if (!(m_memoryProperties & VK_MEMORY_PROPERTY_HOST_COHERENT_BIT)) {
+			VkMappedMemoryRange range{};
+			range.sType = VK_STRUCTURE_TYPE_MAPPED_MEMORY_RANGE;
+			range.memory = readback.memory;
+			range.offset = 0;
+			range.size = VK_WHOLE_SIZE;
+			vkInvalidateMappedMemoryRanges(m_device, 1, &range);
+		}
+
+		// The copy out of the mapped buffer is all the frame loop pays for,
+		// the writer does the rest
+		std::lock_guard<std::mutex> lock(m_mutex);
+		if (m_queue.size() >= MAX_QUEUED_IMAGES) {
+			m_dropped++;
+			continue;
+		}
+
+		Image image;
+		if (!m_freePixels.empty()) {
+			image.pixels = std::move(m_freePixels.back());
+			m_freePixels.pop_back();
+		}
+		image.pixels.resize(static_cast<size_t>(size));
+		memcpy(image.pixels.data(), readback.mapped, static_cast<size_t>(size));
+		image.extent = readback.extent;
+		image.bgra = readback.bgra;
+		image.frameNumber = readback.frameNumber;
+		m_queue.push_back(std::move(image));
+		m_wake.notify_one();
+	}
+}
+
+void FrameCapture::printStats(std::ostream& out) const
+{
+	uint32_t written = m_written.load(std::memory_order_relaxed);
+	out << "Frame capture: " << m_captured << " captured, " << written << " written, " << m_dropped << " dropped";
+
+	double seconds = m_lastWriteNs.load(std::memory_order_relaxed) / 1e9;
+	if (written > 1 && seconds > 0.0) {
+		double megabytes = m_bytesWritten.load(std::memory_order_relaxed) / (1024.0 * 1024.0);
+		out << ", " << written / seconds << " frames/s, " << megabytes / seconds << " MB/s";
+	}
+	out << std::endl;
+}
+
+void FrameCapture::destroy()
+{
+	if (m_writer.joinable()) {
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_stopping = true;
+		}
+		m_wake.notify_one();
+		m_writer.join();
+	}
+
+	for (auto& readback : m_readbacks) {
+		destroyReadback(readback);
+	}
+	m_readbacks.clear();
+}
+
+void FrameCapture::createReadback(Readback& readback, VkDeviceSize size)
+{
+	VkResult result = tryCreateBuffer(m_physicalDevice, m_device, size, VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+		m_memoryProperties, &readback.buffer, &readback.memory);
+	if (result != VK_SUCCESS) {
+		throw std::runtime_error("Failed to create a frame capture buffer");
+	}
+
+	// Stays mapped for as long as the buffer lives
+	vkMapMemory(m_device, readback.memory, 0, size, 0, &readback.mapped);
+	readback.size = size;
+}
+
+void FrameCapture::destroyReadback(Readback& readback)
+{
+	if (readback.buffer == VK_NULL_HANDLE) {
+		return;
+	}
+	vkUnmapMemory(m_device, readback.memory);
+	vkDestroyBuffer(m_device, readback.buffer, nullptr);
+	vkFreeMemory(m_device, readback.memory, nullptr);
+	readback.buffer = VK_NULL_HANDLE;
+	readback.memory = VK_NULL_HANDLE;
+	readback.mapped = nullptr;
+	readback.size = 0;
+}
+
+void FrameCapture::writerLoop()
+{
+	bool png = m_pathPattern.size() >= 4 && m_pathPattern.compare(m_pathPattern.size() - 4, 4, ".png") == 0;
+	std::vector<uint8_t> rgb;
+
+	while (true) {
+		Image image;
+		{
+			std::unique_lock<std::mutex> lock(m_mutex);
+			m_wake.wait(lock, [this] { return m_stopping || !m_queue.empty(); });
+			if (m_queue.empty()) {
+				return; // stopping, and everything has been written
+			}
+			image = std::move(m_queue.front());
+			m_queue.pop_front();
+		}
+
+		std::string path = makePath(image.frameNumber);
+		bool written = png ? writePng(path, image, rgb) : writePpm(path, image, rgb);
+		if (written) {
+			m_bytesWritten.fetch_add(rgb.size(), std::memory_order_relaxed);
+			m_written.fetch_add(1, std::memory_order_relaxed);
+			m_lastWriteNs.store(static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+				Clock::now() - m_firstCapture).count()), std::memory_order_relaxed);
+		}
+		else {
+			std::cout << "Failed to write captured frame " << path << std::endl;
+		}
+
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_freePixels.push_back(std::move(image.pixels));
+	}
+}
+
+std::string FrameCapture::makePath(uint64_t frameNumber) const
+{
+	// "frame_####.png" -> "frame_0042.png", "frame.ppm" -> "frame_000042.ppm"
+	std::string path = m_pathPattern;
+	size_t first = path.find('#');
+	size_t digits = 0;
+	if (first == std::string::npos) {
+		size_t dot = path.find_last_of('.');
+		size_t slash = path.find_last_of("/\\");
+		first = dot != std::string::npos && (slash == std::string::npos || dot > slash) ? dot : path.size();
+		path.insert(first, "_");
+		first++;
+		digits = 6;
+	}
+	else {
+		while (first + digits < path.size() && path[first + digits] == '#') {
+			digits++;
+		}
+		path.erase(first, digits);
+	}
+
+	std::string number = std::to_string(frameNumber);
+	if (number.size() < digits) {
+		number.insert(0, digits - number.size(), '0');
+	}
+	path.insert(first, number);
+	return path;
+}
+
+bool FrameCapture::writePpm(const std::string& path, const Image& image, std::vector<uint8_t>& rgb)
+{
+	std::ofstream out(path, std::ios::binary);
+	if (!out) {
+		return false;
+	}
+
+	toRgb(image.pixels, image.extent, image.bgra, false, rgb);
+	out << "P6\n" << image.extent.width << " " << image.extent.height << "\n255\n";
+	out.write(reinterpret_cast<const char*>(rgb.data()), rgb.size());
+	return static_cast<bool>(out);
+}
+
+bool FrameCapture::writePng(const std::string& path, const Image& image, std::vector<uint8_t>& rgb)
+{
+	std::ofstream out(path, std::ios::binary);
+	if (!out) {
+		return false;
+	}
+
+	toRgb(image.pixels, image.extent, image.bgra, true, rgb);
+
+	static const uint8_t signature[] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n' };
+	out.write(reinterpret_cast<const char*>(signature), sizeof(signature));
+
+	std::vector<uint8_t> header;
+	putBigEndian(header, image.extent.width);
+	putBigEndian(header, image.extent.height);
+	header.push_back(8); // bits per channel
+	header.push_back(2); // RGB
+	header.push_back(0); // deflate
+	header.push_back(0); // adaptive filtering, every row uses none
+	header.push_back(0); // not interlaced
+	writeChunk(out, "IHDR", header);
+
+	// A zlib stream of uncompressed deflate blocks: compressing would cost
+	// more time than writing the extra bytes
+	const size_t MAX_BLOCK = 65535;
+	std::vector<uint8_t> data;
+	data.reserve(rgb.size() + (rgb.size() / MAX_BLOCK + 1) * 5 + 6);
+	data.push_back(0x78);
+	data.push_back(0x01);
+	size_t offset = 0;
+	do {
+		size_t length = std::min(MAX_BLOCK, rgb.size() - offset);
+		data.push_back(offset + length == rgb.size() ? 1 : 0); // final block
+		data.push_back(static_cast<uint8_t>(length));
+		data.push_back(static_cast<uint8_t>(length >> 8));
+		data.push_back(static_cast<uint8_t>(~length));
+		data.push_back(static_cast<uint8_t>(~length >> 8));
+		data.insert(data.end(), rgb.begin() + offset, rgb.begin() + offset + length);
+		offset += length;
+	} while (offset < rgb.size());
+
+	// Adler-32, taking the modulo only as often as needed to avoid overflow
+	uint32_t a = 1;
+	uint32_t b = 0;
+	for (size_t start = 0; start < rgb.size(); start += 5552) {
+		size_t end = std::min(rgb.size(), start + 5552);
+		for (size_t i = start; i < end; i++) {
+			a += rgb[i];
+			b += a;
+		}
+		a %= 65521;
+		b %= 65521;
+	}
+	putBigEndian(data, (b << 16) | a);
+	writeChunk(out, "IDAT", data);
+	writeChunk(out, "IEND", {});
+
+	return static_cast<bool>(out);
+}
@@ -0,0 +1,106 @@
+#pragma once
+
+#define GLFW_INCLUDE_VULKAN
+#include <GLFW/glfw3.h>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Copies rendered frames back to the host and writes them out as PPM or PNG
+// images, without ever stalling the frame loop. Each capture is copied into
+// one of a ring of host visible readback buffers, and only read once the
+// frame that copied it has completed, which the renderer learns from its
+// frame fences a few frames later. Files are written by a background thread.
+// When every buffer is in use, or the writer falls behind, frames are
+// dropped rather than waited for.
+class FrameCapture
+{
+public:
+	// Files are named after pathPattern, with its run of '#' replaced by the
+	// zero padded frame number (appended if there is none); a .png extension
+	// writes PNG, anything else PPM. Captures frameLimit frames, or every
+	// frame if 0.
+	FrameCapture(VkPhysicalDevice physicalDevice, VkDevice device, uint32_t bufferCount,
+		const std::string& pathPattern, uint32_t frameLimit);
+	~FrameCapture();
+
+	FrameCapture(const FrameCapture&) = delete;
+	FrameCapture& operator=(const FrameCapture&) = delete;
+
+	// 8 bit RGBA and BGRA images can be captured
+	static bool isSupported(VkFormat format);
+
+	bool isActive() const;
+
+	// Records a copy of the image, which must be in the transfer source
+	// layout, into a free readback buffer. The frame number is the one
+	// collect() is later told has completed.
+	void recordCopy(VkCommandBuffer commandBuffer, VkImage image, VkFormat format, VkExtent2D extent,
+		uint64_t frameNumber);
+
+	// Hands the copies of the first completedFrames frames to the writer
+	void collect(uint64_t completedFrames);
+
+	void printStats(std::ostream& out) const;
+
+	// Writes what is left and frees the buffers. The device must be idle.
+	void destroy();
+
+private:
+	struct Readback {
+		VkBuffer buffer = VK_NULL_HANDLE;
+		VkDeviceMemory memory = VK_NULL_HANDLE;
+		void* mapped = nullptr;
+		VkDeviceSize size = 0;
+		bool pending = false;
+		uint64_t frameNumber = 0;
+		VkExtent2D extent = {};
+		bool bgra = false;
+	};
+
+	struct Image {
+		std::vector<uint8_t> pixels; // RGBA or BGRA, tightly packed
+		VkExtent2D extent = {};
+		bool bgra = false;
+		uint64_t frameNumber = 0;
+	};
+
+	VkPhysicalDevice m_physicalDevice = VK_NULL_HANDLE;
+	VkDevice m_device = VK_NULL_HANDLE;
+	VkMemoryPropertyFlags m_memoryProperties = 0;
+	std::vector<Readback> m_readbacks;
+	std::string m_pathPattern;
+	uint32_t m_frameLimit = 0;
+
+	// Writer thread
+	static const size_t MAX_QUEUED_IMAGES = 8;
+	std::thread m_writer;
+	std::mutex m_mutex;
+	std::condition_variable m_wake;
+	std::deque<Image> m_queue;
+	std::vector<std::vector<uint8_t>> m_freePixels; // recycled image storage
+	bool m_stopping = false;
+
+	// Statistics
+	using Clock = std::chrono::steady_clock;
+	uint32_t m_captured = 0;
+	uint32_t m_dropped = 0;
+	std::atomic<uint32_t> m_written{ 0 };
+	std::atomic<uint64_t> m_bytesWritten{ 0 };
+	std::atomic<uint64_t> m_lastWriteNs{ 0 }; // since the first capture
+	Clock::time_point m_firstCapture;
+
+	void createReadback(Readback& readback, VkDeviceSize size);
+	void destroyReadback(Readback& readback);
+	void writerLoop();
+	std::string makePath(uint64_t frameNumber) const;
+	static bool writePpm(const std::string& path, const Image& image, std::vector<uint8_t>& rgb);
+	static bool writePng(const std::string& path, const Image& image, std::vector<uint8_t>& rgb);
+};
@@ -0,0 +1,399 @@
+#include <algorithm>
+#include <cstring>
+#include <iterator>
+#include <stdexcept>
+#include <string>
+
+#include "GeometryCache.h"
+#include "Utils.h"
+#include "Profiler.h"
+
+namespace {
+
+// xxHash64, as specified at https://github.com/Cyan4973/xxHash
+const uint64_t PRIME64_1 = 0x9E3779B185EBCA87ull;
+const uint64_t PRIME64_2 = 0xC2B2AE3D27D4EB4Full;
+const uint64_t PRIME64_3 = 0x165667B19E3779F9ull;
+const uint64_t PRIME64_4 = 0x85EBCA77C2B2AE63ull;
+const uint64_t PRIME64_5 = 0x27D4EB2F165667C5ull;
+
+uint64_t rotateLeft(uint64_t value, int bits)
+{
+	return (value << bits) | (value >> (64 - bits));
+}
+
+// Little endian, like every platform the renderer runs on
+uint64_t read64(const uint8_t* data)
+{
+	uint64_t value;
+	memcpy(&value, data, sizeof(value));
+	return value;
+}
+
+uint32_t read32(const uint8_t* data)
+{
+	uint32_t value;
+	memcpy(&value, data, sizeof(value));
+	return value;
+}
+
+uint64_t hashRound(uint64_t accumulator, uint64_t input)
+{
+	accumulator += input * PRIME64_2;
+	accumulator = rotateLeft(accumulator, 31);
+	return accumulator * PRIME64_1;
+}
+
+uint64_t mergeRound(uint64_t accumulator, uint64_t value)
+{
+	accumulator ^= hashRound(0, value);
+	return accumulator * PRIME64_1 + PRIME64_4;
+}
+
+uint64_t xxHash64(const void* input, size_t length, uint64_t seed)
+{
+	const uint8_t* data = static_cast<const uint8_t*>(input);
+	const uint8_t* end = data + length;
+	uint64_t hash;
+
+	// Four lanes over 32 byte stripes, then whatever is left
+	if (length >= 32) {
+		const uint8_t* limit = end - 32;
+		uint64_t v1 = seed + PRIME64_1 + PRIME64_2;
+		uint64_t v2 = seed + PRIME64_2;
+		uint64_t v3 = seed;
+		uint64_t v4 = seed - PRIME64_1;
+		do {
+			v1 = hashRound(v1, read64(data));
+			v2 = hashRound(v2, read64(data + 8));
+			v3 = hashRound(v3, read64(data + 16));
+			v4 = hashRound(v4, read64(data + 24));
+			data += 32;
+		} while (data <= limit);
+
+		hash = rotateLeft(v1, 1) + rotateLeft(v2, 7) + rotateLeft(v3, 12) + rotateLeft(v4, 18);
+		hash = mergeRound(hash, v1);
+		hash = mergeRound(hash, v2);
+		hash = mergeRound(hash, v3);
+		hash = mergeRound(hash, v4);
+	}
+	else {
+		hash = seed + PRIME64_5;
+	}
+	hash += length;
+
+	for (; data + 8 <= end; data += 8) {
+		hash ^= hashRound(0, read64(data));
+		hash = rotateLeft(hash, 27) * PRIME64_1 + PRIME64_4;
+	}
+	if (data + 4 <= end) {
+		hash ^= read32(data) * PRIME64_1;
+		hash = rotateLeft(hash, 23) * PRIME64_2 + PRIME64_3;
+		data += 4;
+	}
+	for (; data < end; data++) {
+		hash ^= *data * PRIME64_5;
+		hash = rotateLeft(hash, 11) * PRIME64_1;
+	}
+
+	hash ^= hash >> 33;
+	hash *= PRIME64_2;
+	hash ^= hash >> 29;
+	hash *= PRIME64_3;
+	hash ^= hash >> 32;
+	return hash;
+}
+
+// 64 bit FNV-1a, to confirm an xxHash64 match with a hash that shares
+// nothing with it
+uint64_t fnv1a64(const void* input, size_t length)
+{
+	const uint8_t* data = static_cast<const uint8_t*>(input);
+	uint64_t hash = 0xCBF29CE484222325ull;
+	for (size_t i = 0; i < length; i++) {
+		hash ^= data[i];
+		hash *= 0x100000001B3ull;
+	}
+	return hash;
+}
+
+}
+
+GeometryCache::GeometryCache(VkPhysicalDevice physicalDevice, VkDevice device, VkQueue transferQueue,
+	VkCommandPool transferCommandPool, ResidencyManager* residency, Defer defer)
+	: m_physicalDevice(physicalDevice), m_device(device), m_transferQueue(transferQueue),
+	m_transferCommandPool(transferCommandPool), m_residency(residency), m_defer(std::move(defer))
+{
+}
+
+GeometryCache::Handle GeometryCache::acquire(const void* data, VkDeviceSize size, VkBufferUsageFlags usage,
+	uint64_t frame)
+{
+	PROFILE_ZONE("GeometryCache::acquire");
+
+	// The usage seeds the hash, so vertex and index data of the same bytes
+	// get ranges of their own
+	uint64_t key = xxHash64(data, static_cast<size_t>(size), usage);
+	uint64_t check = fnv1a64(data, static_cast<size_t>(size));
+	auto found = m_lookup.find(key);
+	if (found != m_lookup.end()) {
+		Entry* entry = m_entries.get(found->second);
+		if (entry->size == size && entry->usage == usage && entry->check == check) {
+			entry->references++;
+			m_savedBytes += size;
+			return found->second;
+		}
+	}
+
+	size_t poolIndex = getPoolIndex(usage);
+	Pool& pool = m_pools[poolIndex];
+
+	Entry entry{};
+	entry.key = key;
+	entry.check = check;
+	entry.size = size;
+	entry.usage = usage;
+	entry.offset = allocateRange(poolIndex, size, frame);
+	entry.references = 1;
+
+	// Create a staging buffer
+	VkBuffer stagingBuffer;
+	VkDeviceMemory stagingBufferMemory;
+
+	::createBuffer(m_physicalDevice, m_device, size, VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+		VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, &stagingBuffer, &stagingBufferMemory);
+
+	// Map memory to staging buffer and copy the data into it
+	void* mapped;
+	vkMapMemory(m_device, stagingBufferMemory, 0, size, 0, &mapped);
+	memcpy(mapped, data, static_cast<size_t>(size));
+	vkUnmapMemory(m_device, stagingBufferMemory);
+
+	// The range is free for every frame in flight, nothing draws from it
+	copyBuffer(m_device, m_transferQueue, m_transferCommandPool, stagingBuffer, pool.buffer.buffer, size, entry.offset);
+
+	vkDestroyBuffer(m_device, stagingBuffer, nullptr);
+	vkFreeMemory(m_device, stagingBufferMemory, nullptr);
+
+	// A collision keeps the entry that was there first
+	Handle handle = m_entries.insert(entry);
+	if (found == m_lookup.end()) {
+		m_lookup[key] = handle;
+	}
+	m_uploadedBytes += size;
+
+	return handle;
+}
+
+void GeometryCache::release(Handle handle)
+{
+	Entry* entry = m_entries.get(handle);
+	if (!entry || --entry->references > 0) {
+		return;
+	}
+
+	// Frames in flight may still draw from the range, it is only reused
+	// once they are done
+	size_t poolIndex = getPoolIndex(entry->usage);
+	VkDeviceSize offset = entry->offset;
+	VkDeviceSize size = entry->size;
+	m_defer([this, poolIndex, offset, size]() { freeRange(poolIndex, offset, size); });
+
+	auto found = m_lookup.find(entry->key);
+	if (found != m_lookup.end() && found->second == handle) {
+		m_lookup.erase(found);
+	}
+	m_entries.remove(handle);
+}
+
+VkDeviceSize GeometryCache::getOffset(Handle handle) const
+{
+	return m_entries.get(handle)->offset;
+}
+
+void GeometryCache::markUsed(uint64_t frame)
+{
+	for (const auto& pool : m_pools) {
+		if (pool.capacity > 0) {
+			m_residency->markUsed(pool.residency, frame);
+		}
+	}
+}
+
+void GeometryCache::destroy()
+{
+	for (auto& pool : m_pools) {
+		if (pool.capacity > 0) {
+			vkDestroyBuffer(m_device, pool.buffer.buffer, nullptr);
+			vkFreeMemory(m_device, pool.buffer.memory, nullptr);
+		}
+		pool.buffer = {};
+		pool.capacity = 0;
+		pool.freeRanges.clear();
+	}
+	m_entries = SlotMap<Entry>();
+	m_lookup.clear();
+}
+
+void GeometryCache::printStats(std::ostream& out) const
+{
+	// Bytes that more than one mesh is drawn from count once for each extra mesh
+	uint64_t liveBytes = 0;
+	uint64_t sharedBytes = 0;
+	for (const auto& entry : m_entries) {
+		liveBytes += entry.size;
+		sharedBytes += entry.size * (entry.references - 1);
+	}
+	uint64_t capacity = m_pools[VERTEX_POOL].capacity + m_pools[INDEX_POOL].capacity;
+
+	out << "Geometry: " << m_entries.size() << " ranges, " << liveBytes / 1024 << " KB of "
+		<< capacity / 1024 << " KB used, " << sharedBytes / 1024 << " KB saved by sharing them; "
+		<< m_uploadedBytes / 1024 << " KB uploaded and " << m_savedBytes / 1024 << " KB deduplicated since start"
+		<< std::endl;
+}
+
+size_t GeometryCache::getPoolIndex(VkBufferUsageFlags usage)
+{
+	return (usage & VK_BUFFER_USAGE_INDEX_BUFFER_BIT) != 0 ? INDEX_POOL : VERTEX_POOL;
+}
+
+VkDeviceSize GeometryCache::allocateRange(size_t poolIndex, VkDeviceSize size, uint64_t frame)
+{
+	Pool& pool = m_pools[poolIndex];
+	auto range = pool.freeRanges.begin();
+	while (range != pool.freeRanges.end() && range->second < size) {
+		++range;
+	}
+	if (range == pool.freeRanges.end()) {
+		grow(poolIndex, size, frame);
+		range = std::prev(pool.freeRanges.end()); // growing frees a range at the end
+	}
+
+	VkDeviceSize offset = range->first;
+	VkDeviceSize remaining = range->second - size;
+	pool.freeRanges.erase(range);
+	if (remaining > 0) {
+		pool.freeRanges[offset + size] = remaining;
+	}
+	return offset;
+}
+
+void GeometryCache::freeRange(size_t poolIndex, VkDeviceSize offset, VkDeviceSize size)
+{
+	Pool& pool = m_pools[poolIndex];
+	if (size == 0 || offset + size > pool.capacity) {
+		return; // destroyed since
+	}
+
+	auto range = pool.freeRanges.emplace(offset, size).first;
+	auto next = std::next(range);
+	if (next != pool.freeRanges.end() && range->first + range->second == next->first) {
+		range->second += next->second;
+		pool.freeRanges.erase(next);
+	}
+	if (range != pool.freeRanges.begin()) {
+		auto previous = std::prev(range);
+		if (previous->first + previous->second == range->first) {
+			previous->second += range->second;
+			pool.freeRanges.erase(range);
+		}
+	}
+}
+
+void GeometryCache::grow(size_t poolIndex, VkDeviceSize size, uint64_t frame)
+{
+	PROFILE_ZONE("GeometryCache::grow");
+	Pool& pool = m_pools[poolIndex];
+	VkDeviceSize capacity = std::max(pool.capacity, INITIAL_POOL_SIZE);
+	while (capacity < pool.capacity + size) {
+		capacity *= 2;
+	}
+
+	// Make room first, so that the buffer only falls back to host memory
+	// when nothing else could be evicted
+	uint32_t deviceHeap = m_residency->getHeapIndex(~0u, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+	m_residency->makeRoom(deviceHeap, capacity, frame);
+
+	// The ranges keep their offsets, the previous buffer is retired as
+	// frames in flight may still draw from it
+	bool deviceLocal = false;
+	Buffer buffer = createBuffer(capacity, pool.usage, &deviceLocal);
+	if (pool.capacity > 0) {
+		copyBuffer(m_device, m_transferQueue, m_transferCommandPool, pool.buffer.buffer, buffer.buffer, pool.capacity);
+		retire(pool.buffer);
+		m_residency->remove(pool.residency);
+	}
+
+	VkDeviceSize previousCapacity = pool.capacity;
+	pool.buffer = buffer;
+	pool.capacity = capacity;
+	pool.deviceLocal = deviceLocal;
+	freeRange(poolIndex, previousCapacity, capacity - previousCapacity);
+	registerPool(poolIndex);
+}
+
+void GeometryCache::retire(const Buffer& buffer)
+{
+	VkDevice device = m_device;
+	m_defer([device, buffer]() {
+		vkDestroyBuffer(device, buffer.buffer, nullptr);
+		vkFreeMemory(device, buffer.memory, nullptr);
+	});
+}
+
+GeometryCache::Buffer GeometryCache::createBuffer(VkDeviceSize size, VkBufferUsageFlags usage, bool* deviceLocal)
+{
+	// Transfer source too, so that the buffer can be moved when it is evicted
+	usage |= VK_BUFFER_USAGE_TRANSFER_SRC_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT;
+
+	Buffer buffer{};
+	VkResult result = tryCreateBuffer(m_physicalDevice, m_device, size, usage, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+		&buffer.buffer, &buffer.memory);
+	if (result == VK_SUCCESS) {
+		*deviceLocal = true;
+		return buffer;
+	}
+
+	// Out of video memory: draw from host memory rather than fail
+	::createBuffer(m_physicalDevice, m_device, size, usage,
+		VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, &buffer.buffer, &buffer.memory);
+	*deviceLocal = false;
+	return buffer;
+}
+
+void GeometryCache::registerPool(size_t poolIndex)
+{
+	Pool& pool = m_pools[poolIndex];
+	VkMemoryRequirements requirements;
+	vkGetBufferMemoryRequirements(m_device, pool.buffer.buffer, &requirements);
+	uint32_t heap = m_residency->getHeapIndex(requirements.memoryTypeBits, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+
+	pool.residency = m_residency->add(poolIndex == INDEX_POOL ? "indices" : "vertices", heap,
+		pool.deviceLocal ? pool.capacity : 0,
+		[this, poolIndex]() { return relocate(poolIndex, false); },
+		[this, poolIndex]() { return relocate(poolIndex, true); });
+}
+
+VkDeviceSize GeometryCache::relocate(size_t poolIndex, bool deviceLocal)
+{
+	PROFILE_ZONE("GeometryCache::relocate");
+	Pool& pool = m_pools[poolIndex];
+	if (pool.deviceLocal != deviceLocal) {
+		VkMemoryPropertyFlags properties = deviceLocal ? VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT
+			: VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
+		Buffer buffer{};
+		VkResult result = tryCreateBuffer(m_physicalDevice, m_device, pool.capacity,
+			pool.usage | VK_BUFFER_USAGE_TRANSFER_SRC_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT, properties,
+			&buffer.buffer, &buffer.memory);
+
+		// The copy goes through the GPU, the data never has to be on the CPU.
+		// The previous buffer is retired, frames in flight may still draw from it.
+		if (result == VK_SUCCESS) {
+			copyBuffer(m_device, m_transferQueue, m_transferCommandPool, pool.buffer.buffer, buffer.buffer, pool.capacity);
+			retire(pool.buffer);
+			pool.buffer = buffer;
+			pool.deviceLocal = deviceLocal;
+		}
+	}
+	return pool.deviceLocal ? pool.capacity : VkDeviceSize(0);
+}
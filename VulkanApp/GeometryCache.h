@@ -0,0 +1,120 @@
+#pragma once
+
+#define GLFW_INCLUDE_VULKAN
+#include <GLFW/glfw3.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <ostream>
+#include <unordered_map>
+
+#include "ResidencyManager.h"
+#include "SlotMap.h"
+
+// Vertex and index data keyed by their content, so that meshes made of the
+// same data share a single upload. acquire() only uploads data that isn't
+// held yet, and the last release() of it frees its range. Content is looked
+// up by its xxHash64, and a hit only counts when the size, the usage and a
+// second, unrelated hash (FNV-1a) match as well, so that a collision uploads
+// the data separately instead of sharing the wrong range.
+//
+// All vertices live in one buffer and all indices in another, so that a
+// pass binds them once and a single indirect draw can cover every mesh.
+// Meshes are ranges of them, found through the offsets. A buffer that is
+// full is replaced by one twice the size, with the ranges where they were.
+// Each buffer is a resource of the residency manager, evicted or restored
+// as a whole.
+class GeometryCache
+{
+public:
+	using Handle = SlotHandle;
+
+	struct Buffer {
+		VkBuffer buffer;
+		VkDeviceMemory memory;
+	};
+
+	// Runs work that frees what frames in flight may still be using, once
+	// they are done
+	using Defer = std::function<void(std::function<void()>)>;
+
+	GeometryCache() {}
+	GeometryCache(VkPhysicalDevice physicalDevice, VkDevice device, VkQueue transferQueue,
+		VkCommandPool transferCommandPool, ResidencyManager* residency, Defer defer);
+
+	// A range holding these bytes, in the vertex or the index buffer
+	// depending on the usage. Sizes are whole vertices or indices, so that
+	// every offset is too. Every acquire() needs a release().
+	Handle acquire(const void* data, VkDeviceSize size, VkBufferUsageFlags usage, uint64_t frame);
+	void release(Handle handle);
+
+	// Both change when they grow or are evicted, so they are looked up for
+	// each frame
+	VkBuffer getVertexBuffer() const { return m_pools[VERTEX_POOL].buffer.buffer; }
+	VkBuffer getIndexBuffer() const { return m_pools[INDEX_POOL].buffer.buffer; }
+
+	// Bytes from the start of the buffer, which never change
+	VkDeviceSize getOffset(Handle handle) const;
+
+	// Both buffers are needed by the frame being recorded
+	void markUsed(uint64_t frame);
+
+	// Destroys every buffer right away, once the device is idle
+	void destroy();
+
+	void printStats(std::ostream& out) const;
+
+private:
+	struct Entry {
+		uint64_t key;
+		uint64_t check; // FNV-1a of the data
+		VkDeviceSize size;
+		VkBufferUsageFlags usage;
+		VkDeviceSize offset;
+		uint32_t references;
+	};
+
+	struct Pool {
+		VkBufferUsageFlags usage;
+		Buffer buffer;
+		VkDeviceSize capacity;
+		bool deviceLocal;
+		ResidencyManager::ResourceId residency;
+		std::map<VkDeviceSize, VkDeviceSize> freeRanges; // size by offset, neighbours are merged
+	};
+
+	static constexpr size_t VERTEX_POOL = 0;
+	static constexpr size_t INDEX_POOL = 1;
+	static constexpr VkDeviceSize INITIAL_POOL_SIZE = 4 * 1024 * 1024;
+
+	VkPhysicalDevice m_physicalDevice = VK_NULL_HANDLE;
+	VkDevice m_device = VK_NULL_HANDLE;
+	VkQueue m_transferQueue = VK_NULL_HANDLE;
+	VkCommandPool m_transferCommandPool = VK_NULL_HANDLE;
+	ResidencyManager* m_residency = nullptr;
+	Defer m_defer;
+
+	Pool m_pools[2] = {
+		{ VK_BUFFER_USAGE_VERTEX_BUFFER_BIT, {}, 0, false, 0, {} },
+		{ VK_BUFFER_USAGE_INDEX_BUFFER_BIT, {}, 0, false, 0, {} },
+	};
+	SlotMap<Entry> m_entries;
+	std::unordered_map<uint64_t, Handle> m_lookup; // by key, colliding entries aren't in it
+
+	uint64_t m_uploadedBytes = 0; // since creation
+	uint64_t m_savedBytes = 0;    // acquired from a buffer that was already there
+
+	static size_t getPoolIndex(VkBufferUsageFlags usage);
+
+	// First fit, growing the pool when no free range is big enough
+	VkDeviceSize allocateRange(size_t poolIndex, VkDeviceSize size, uint64_t frame);
+	void freeRange(size_t poolIndex, VkDeviceSize offset, VkDeviceSize size);
+	void grow(size_t poolIndex, VkDeviceSize size, uint64_t frame);
+	void retire(const Buffer& buffer);
+
+	Buffer createBuffer(VkDeviceSize size, VkBufferUsageFlags usage, bool* deviceLocal);
+	void registerPool(size_t poolIndex);
+	VkDeviceSize relocate(size_t poolIndex, bool deviceLocal);
+};
@@ -0,0 +1,358 @@
+#include <algorithm>
+#include <string>
+
+#include "JobSystem.h"
+#include "Profiler.h"
+
+namespace {
+
+// Lets a worker find its own queue. Workers of another pool (or none) see a
+// different system and use the shared queue.
+thread_local const JobSystem* t_system = nullptr;
+thread_local size_t t_queue = 0;
+
+// Keeps the memory of finished jobs for the next ones. There is one list per
+// type that allocate_shared rebinds to, which in practice is exactly one.
+template <typename T>
+class JobAllocator
+{
+public:
+	using value_type = T;
+
+	JobAllocator() = default;
+	template <typename U>
+	JobAllocator(const JobAllocator<U>&) {}
+
+	T* allocate(size_t count)
+	{
+		if (count == 1) {
+			std::lock_guard<std::mutex> lock(getMutex());
+			Block*& free = getFreeList();
+			if (free) {
+				Block* block = free;
+				free = block->next;
+				return reinterpret_cast<T*>(block);
+			}
+		}
+		return static_cast<T*>(::operator new(std::max(sizeof(T), sizeof(Block)) * count));
+	}
+
+	void deallocate(T* pointer, size_t count)
+	{
+		if (count == 1) {
+			std::lock_guard<std::mutex> lock(getMutex());
+			Block* block = reinterpret_cast<Block*>(pointer);
+			block->next = getFreeList();
+			getFreeList() = block;
+			return;
+		}
+		::operator delete(pointer);
+	}
+
+	template <typename U>
+	bool operator==(const JobAllocator<U>&) const { return true; }
+	template <typename U>
+	bool operator!=(const JobAllocator<U>&) const { return false; }
+
+private:
+	struct Block {
+		Block* next;
+	};
+
+	// Never destroyed, jobs may still be released while statics are torn down
+	static std::mutex& getMutex()
+	{
+		static std::mutex* mutex = new std::mutex;
+		return *mutex;
+	}
+
+	static Block*& getFreeList()
+	{
+		static Block* free = nullptr;
+		return free;
+	}
+};
+
+}
+
+uint32_t JobSystem::getDefaultWorkerCount()
+{
+	uint32_t threads = std::thread::hardware_concurrency();
+	return threads > 1 ? threads - 1 : 0;
+}
+
+JobSystem::JobSystem(uint32_t workerCount)
+{
+	for (uint32_t i = 0; i <= workerCount; i++) {
+		m_queues.push_back(std::make_unique<Queue>());
+	}
+	for (uint32_t i = 0; i < workerCount; i++) {
+		m_workers.emplace_back([this, i] { workerLoop(i); });
+	}
+}
+
+JobSystem::~JobSystem()
+{
+	{
+		std::lock_guard<std::mutex> lock(m_sleepMutex);
+		m_stopping = true;
+	}
+	m_wake.notify_all();
+	for (auto& worker : m_workers) {
+		worker.join();
+	}
+}
+
+JobSystem::JobHandle JobSystem::schedule(std::function<void()> work, const std::vector<JobHandle>& dependencies)
+{
+	JobHandle job = std::allocate_shared<Job>(JobAllocator<Job>());
+	job->m_work = std::move(work);
+
+	// One extra count keeps the job from being queued by a dependency that
+	// finishes while the others are still being registered
+	job->m_unfinishedDependencies.store(static_cast<uint32_t>(dependencies.size()) + 1, std::memory_order_relaxed);
+	uint32_t finished = 1;
+	for (const auto& dependency : dependencies) {
+		std::lock_guard<std::mutex> lock(dependency->m_mutex);
+		if (dependency->m_finished) {
+			if (dependency->m_error) {
+				std::lock_guard<std::mutex> jobLock(job->m_mutex);
+				job->m_error = dependency->m_error;
+			}
+			finished++;
+		}
+		else {
+			dependency->m_dependents.push_back(job);
+		}
+	}
+
+	if (job->m_unfinishedDependencies.fetch_sub(finished, std::memory_order_acq_rel) == finished) {
+		enqueue(job);
+	}
+	return job;
+}
+
+void JobSystem::wait(const JobHandle& job)
+{
+	while (!job->isDone()) {
+		if (!runOne()) {
+			std::this_thread::yield();
+		}
+	}
+
+	std::lock_guard<std::mutex> lock(job->m_mutex);
+	if (job->m_error) {
+		std::rethrow_exception(job->m_error);
+	}
+}
+
+void JobSystem::runParallelFor(size_t count, size_t grainSize, const std::function<void(size_t, size_t)>& body)
+{
+	grainSize = std::max<size_t>(grainSize, 1);
+	size_t rangeCount = (count + grainSize - 1) / grainSize;
+	if (rangeCount <= 1 || m_workers.empty()) {
+		if (count > 0) {
+			body(0, count);
+		}
+		return;
+	}
+
+	// Ranges are handed out from a shared counter, so a helper that starts
+	// late simply finds less left to do. The calling thread is one of them.
+	// Helpers report back through a counter rather than their handles, which
+	// saves collecting the handles in a vector.
+	std::atomic<size_t> nextRange{ 0 };
+	std::atomic<size_t> helpersDone{ 0 };
+	std::mutex errorMutex;
+	std::exception_ptr error;
+	auto runRanges = [&]() {
+		PROFILE_ZONE("parallelFor");
+		try {
+			for (size_t range = nextRange.fetch_add(1); range < rangeCount; range = nextRange.fetch_add(1)) {
+				size_t begin = range * grainSize;
+				body(begin, std::min(count, begin + grainSize));
+			}
+		}
+		catch (...) {
+			std::lock_guard<std::mutex> lock(errorMutex);
+			if (!error) {
+				error = std::current_exception();
+			}
+			nextRange.store(rangeCount); // stop the others early
+		}
+	};
+
+	auto runHelper = [&]() {
+		runRanges();
+		helpersDone.fetch_add(1, std::memory_order_release);
+	};
+
+	size_t helperCount = std::min<size_t>(rangeCount, getThreadCount()) - 1;
+	for (size_t i = 0; i < helperCount; i++) {
+		schedule(std::ref(runHelper));
+	}
+
+	runRanges();
+
+	// Every helper has to finish before the ranges (on this stack) go away
+	while (helpersDone.load(std::memory_order_acquire) < helperCount) {
+		if (!runOne()) {
+			std::this_thread::yield();
+		}
+	}
+	if (error) {
+		std::rethrow_exception(error);
+	}
+}
+
+void JobSystem::workerLoop(size_t index)
+{
+	t_system = this;
+	t_queue = index;
+	Profiler::setThreadName(Profiler::intern("worker " + std::to_string(index + 1)));
+
+	while (true) {
+		if (runOne()) {
+			continue;
+		}
+
+		std::unique_lock<std::mutex> lock(m_sleepMutex);
+		m_wake.wait(lock, [this] { return m_stopping || m_queuedJobs.load() > 0; });
+		if (m_stopping) {
+			return;
+		}
+	}
+}
+
+void JobSystem::enqueue(JobHandle job)
+{
+	Queue& queue = *m_queues[ownQueue()];
+	{
+		std::lock_guard<std::mutex> lock(queue.mutex);
+		queue.pushBack(std::move(job));
+	}
+
+	// Counted under the sleep mutex so that a worker about to sleep can't miss it
+	{
+		std::lock_guard<std::mutex> lock(m_sleepMutex);
+		m_queuedJobs++;
+	}
+	m_wake.notify_one();
+}
+
+bool JobSystem::runOne()
+{
+	JobHandle job = take(ownQueue());
+	if (!job) {
+		return false;
+	}
+	execute(job);
+	return true;
+}
+
+JobSystem::JobHandle JobSystem::take(size_t own)
+{
+	if (m_queuedJobs.load() == 0) {
+		return nullptr;
+	}
+
+	// Newest first from our own queue, it is the most likely to be in cache
+	{
+		Queue& queue = *m_queues[own];
+		std::lock_guard<std::mutex> lock(queue.mutex);
+		if (queue.count > 0) {
+			m_queuedJobs--;
+			return queue.popBack();
+		}
+	}
+
+	// Oldest first from the others
+	for (size_t i = 1; i < m_queues.size(); i++) {
+		Queue& queue = *m_queues[(own + i) % m_queues.size()];
+		std::lock_guard<std::mutex> lock(queue.mutex);
+		if (queue.count > 0) {
+			m_queuedJobs--;
+			return queue.popFront();
+		}
+	}
+	return nullptr;
+}
+
+void JobSystem::execute(const JobHandle& job)
+{
+	bool skip;
+	{
+		std::lock_guard<std::mutex> lock(job->m_mutex);
+		skip = job->m_error != nullptr; // a dependency failed
+	}
+
+	if (!skip) {
+		try {
+			job->m_work();
+		}
+		catch (...) {
+			std::lock_guard<std::mutex> lock(job->m_mutex);
+			job->m_error = std::current_exception();
+		}
+	}
+	job->m_work = nullptr; // release captures now rather than with the last handle
+
+	finish(job);
+}
+
+void JobSystem::finish(const JobHandle& job)
+{
+	std::vector<JobHandle> dependents;
+	std::exception_ptr error;
+	{
+		std::lock_guard<std::mutex> lock(job->m_mutex);
+		job->m_finished = true;
+		dependents.swap(job->m_dependents);
+		error = job->m_error;
+	}
+	job->m_done.store(true, std::memory_order_release);
+
+	for (auto& dependent : dependents) {
+		if (error) {
+			std::lock_guard<std::mutex> lock(dependent->m_mutex);
+			dependent->m_error = error;
+		}
+		if (dependent->m_unfinishedDependencies.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+			enqueue(std::move(dependent));
+		}
+	}
+}
+
+size_t JobSystem::ownQueue() const
+{
+	return t_system == this ? t_queue : m_queues.size() - 1;
+}
+
+void JobSystem::Queue::pushBack(JobHandle job)
+{
+	if (count == jobs.size()) {
+		// Unwrap into a bigger ring
+		std::vector<JobHandle> grown(std::max<size_t>(jobs.size() * 2, 16));
+		for (size_t i = 0; i < count; i++) {
+			grown[i] = std::move(jobs[(head + i) % jobs.size()]);
+		}
+		jobs.swap(grown);
+		head = 0;
+	}
+	jobs[(head + count) % jobs.size()] = std::move(job);
+	count++;
+}
+
+JobSystem::JobHandle JobSystem::Queue::popBack()
+{
+	count--;
+	return std::move(jobs[(head + count) % jobs.size()]);
+}
+
+JobSystem::JobHandle JobSystem::Queue::popFront()
+{
+	JobHandle job = std::move(jobs[head]);
+	head = (head + 1) % jobs.size();
+	count--;
+	return job;
+}
@@ -0,0 +1,109 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Work-stealing scheduler for CPU work that is spread over many cores.
+//
+// Every worker thread has a deque of its own: it pushes and pops jobs at
+// the back, and when it runs dry it steals from the front of the others'.
+// Threads outside the pool (the one calling draw(), for instance) submit to
+// a shared deque, and help running jobs while they wait for one, so a pool
+// of N workers keeps N + 1 threads busy.
+//
+// Jobs may depend on other jobs and only become runnable once those have
+// finished. A job that throws skips its dependents, and the exception is
+// rethrown from wait().
+//
+// Jobs come from a pool and the queues are rings that only ever grow, so
+// once the pool has warmed up, scheduling work whose callable fits in
+// std::function's own storage (parallelFor's does) doesn't touch the heap.
+class JobSystem
+{
+public:
+	class Job;
+	using JobHandle = std::shared_ptr<Job>;
+
+	// One less than the number of hardware threads, the waiting thread makes up the rest
+	static uint32_t getDefaultWorkerCount();
+
+	explicit JobSystem(uint32_t workerCount = getDefaultWorkerCount());
+	~JobSystem();
+
+	JobSystem(const JobSystem&) = delete;
+	JobSystem& operator=(const JobSystem&) = delete;
+
+	// Threads that run jobs, including the waiting one
+	uint32_t getThreadCount() const { return static_cast<uint32_t>(m_workers.size()) + 1; }
+
+	JobHandle schedule(std::function<void()> work, const std::vector<JobHandle>& dependencies = {});
+
+	// Runs other jobs until this one has finished
+	void wait(const JobHandle& job);
+
+	// Calls body(begin, end) for consecutive ranges of about grainSize
+	// indices that together cover [0, count), on as many threads as there
+	// are ranges, and returns once all of them are done
+	template <typename Body>
+	void parallelFor(size_t count, size_t grainSize, const Body& body)
+	{
+		// A reference wrapper is stored in place, a capturing lambda might not be
+		runParallelFor(count, grainSize, std::cref(body));
+	}
+
+	class Job
+	{
+	public:
+		bool isDone() const { return m_done.load(std::memory_order_acquire); }
+
+	private:
+		friend class JobSystem;
+
+		std::function<void()> m_work;
+		std::atomic<uint32_t> m_unfinishedDependencies{ 0 };
+		std::mutex m_mutex; // guards the fields below
+		std::vector<JobHandle> m_dependents;
+		bool m_finished = false;
+		std::exception_ptr m_error;
+		std::atomic<bool> m_done{ false };
+	};
+
+private:
+	// Growable ring buffer of jobs, guarded by its mutex
+	struct Queue {
+		std::mutex mutex;
+		std::vector<JobHandle> jobs;
+		size_t head = 0; // oldest job
+		size_t count = 0;
+
+		void pushBack(JobHandle job);
+		JobHandle popBack();
+		JobHandle popFront();
+	};
+
+	// One per worker, followed by the one other threads submit to
+	std::vector<std::unique_ptr<Queue>> m_queues;
+	std::vector<std::thread> m_workers;
+
+	// Workers sleep while there is nothing queued anywhere
+	std::mutex m_sleepMutex;
+	std::condition_variable m_wake;
+	std::atomic<size_t> m_queuedJobs{ 0 };
+	bool m_stopping = false;
+
+	void runParallelFor(size_t count, size_t grainSize, const std::function<void(size_t, size_t)>& body);
+	void workerLoop(size_t index);
+	void enqueue(JobHandle job);
+	bool runOne();
+	JobHandle take(size_t own);
+	void execute(const JobHandle& job);
+	void finish(const JobHandle& job);
+	size_t ownQueue() const;
+};
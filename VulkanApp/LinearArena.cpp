@@ -0,0 +1,96 @@
+#include <algorithm>
+#include <new>
+#include <utility>
+
+#include "LinearArena.h"
+
+LinearArena::LinearArena(size_t capacity) : m_capacity(capacity)
+{
+	if (m_capacity > 0) {
+		m_memory = static_cast<uint8_t*>(::operator new(m_capacity));
+	}
+}
+
+LinearArena::~LinearArena()
+{
+	release();
+}
+
+LinearArena::LinearArena(LinearArena&& other) noexcept
+{
+	*this = std::move(other);
+}
+
+LinearArena& LinearArena::operator=(LinearArena&& other) noexcept
+{
+	if (this != &other) {
+		release();
+		m_memory = other.m_memory;
+		m_capacity = other.m_capacity;
+		m_used = other.m_used;
+		m_overflow = std::move(other.m_overflow);
+		m_overflowUsed = other.m_overflowUsed;
+		m_peak = other.m_peak;
+
+		other.m_memory = nullptr;
+		other.m_capacity = 0;
+		other.m_used = 0;
+		other.m_overflow.clear();
+		other.m_overflowUsed = 0;
+	}
+	return *this;
+}
+
+void* LinearArena::allocate(size_t size, size_t alignment)
+{
+	size_t offset = (m_used + alignment - 1) & ~(alignment - 1);
+	if (offset + size <= m_capacity) {
+		m_used = offset + size;
+		m_peak = std::max(m_peak, getUsed());
+		return m_memory + offset;
+	}
+
+	// operator new aligns for any standard type, the padding covers the rest
+	size_t padding = alignment > alignof(std::max_align_t) ? alignment : 0;
+	uint8_t* block = static_cast<uint8_t*>(::operator new(size + padding));
+	m_overflow.push_back(block);
+	m_overflowUsed += size + padding;
+	m_peak = std::max(m_peak, getUsed());
+
+	uintptr_t address = reinterpret_cast<uintptr_t>(block);
+	return block + (((address + alignment - 1) & ~(alignment - 1)) - address);
+}
+
+void LinearArena::reset()
+{
+	if (!m_overflow.empty()) {
+		for (void* block : m_overflow) {
+			::operator delete(block);
+		}
+		m_overflow.clear();
+
+		// A bit of headroom, so that a frame slightly bigger than the biggest
+		// so far doesn't grow the arena again
+		size_t capacity = m_peak + m_peak / 4;
+		::operator delete(m_memory);
+		m_memory = static_cast<uint8_t*>(::operator new(capacity));
+		m_capacity = capacity;
+	}
+
+	m_used = 0;
+	m_overflowUsed = 0;
+	m_peak = 0;
+}
+
+void LinearArena::release()
+{
+	for (void* block : m_overflow) {
+		::operator delete(block);
+	}
+	m_overflow.clear();
+	::operator delete(m_memory);
+	m_memory = nullptr;
+	m_capacity = 0;
+	m_used = 0;
+	m_overflowUsed = 0;
+}
@@ -0,0 +1,81 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <type_traits>
+#include <vector>
+
+// Bump allocator for memory that only lives until a known point, like the
+// end of the frame it was allocated for. Allocating moves a pointer along,
+// freeing does nothing, and reset() releases everything at once in O(1).
+//
+// When a frame needs more than the arena holds, the rest comes from
+// overflow blocks, and the next reset() replaces them with one block big
+// enough for all of it. After a few frames every allocation fits, and the
+// arena stops touching the heap.
+class LinearArena
+{
+public:
+	explicit LinearArena(size_t capacity = 0);
+	~LinearArena();
+
+	LinearArena(const LinearArena&) = delete;
+	LinearArena& operator=(const LinearArena&) = delete;
+	LinearArena(LinearArena&& other) noexcept;
+	LinearArena& operator=(LinearArena&& other) noexcept;
+
+	void* allocate(size_t size, size_t alignment);
+
+	// Everything allocated so far must no longer be in use
+	void reset();
+
+	size_t getCapacity() const { return m_capacity; }
+	size_t getUsed() const { return m_used + m_overflowUsed; }
+	size_t getPeak() const { return m_peak; } // most used between two resets
+
+private:
+	uint8_t* m_memory = nullptr;
+	size_t m_capacity = 0;
+	size_t m_used = 0;
+
+	std::vector<void*> m_overflow;
+	size_t m_overflowUsed = 0;
+	size_t m_peak = 0;
+
+	void release();
+};
+
+// Lets standard containers allocate from an arena. Deallocation is a no-op,
+// so a container must not outlive the arena's next reset.
+template <typename T>
+class ArenaAllocator
+{
+public:
+	using value_type = T;
+
+	// Containers that are moved take the arena along with their memory
+	using propagate_on_container_move_assignment = std::true_type;
+	using propagate_on_container_copy_assignment = std::true_type;
+	using propagate_on_container_swap = std::true_type;
+
+	ArenaAllocator(LinearArena& arena) : m_arena(&arena) {}
+
+	template <typename U>
+	ArenaAllocator(const ArenaAllocator<U>& other) : m_arena(other.getArena()) {}
+
+	T* allocate(size_t count) { return static_cast<T*>(m_arena->allocate(sizeof(T) * count, alignof(T))); }
+	void deallocate(T*, size_t) {}
+
+	LinearArena* getArena() const { return m_arena; }
+
+	template <typename U>
+	bool operator==(const ArenaAllocator<U>& other) const { return m_arena == other.getArena(); }
+	template <typename U>
+	bool operator!=(const ArenaAllocator<U>& other) const { return m_arena != other.getArena(); }
+
+private:
+	LinearArena* m_arena;
+};
+
+template <typename T>
+using ArenaVector = std::vector<T, ArenaAllocator<T>>;
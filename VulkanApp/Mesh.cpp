@@ -1,21 +1,25 @@
-#include <stdexcept>
-#include <cstring>
+#include <algorithm>
 
 #include "Mesh.h"
+#include "Profiler.h"
 
-Mesh::Mesh(VkPhysicalDevice physicalDevice, VkDevice device, VkQueue transferQueue, VkCommandPool transferCommandPool,
-	std::vector<Vertex>* vertices, std::vector<uint32_t>* indices)
+Mesh::Mesh(GeometryCache* geometry, std::vector<Vertex>* vertices, std::vector<uint32_t>* indices, uint64_t frame)
 {
+	PROFILE_ZONE("Mesh::Mesh");
 	m_model.model = glm::mat4(1.0f);
+	m_materialIndex = NO_TEXTURE;
+	m_transparent = false;
 	m_vertexCount = vertices->size();
 	m_indexCount = indices->size();
-	m_physicalDevice = physicalDevice;
-	m_device = device;
-	m_transferQueue = transferQueue;
-	m_transferCommandPool = transferCommandPool;
-
-	createVertexBuffer(vertices);
-	createIndexBuffer(indices);
+	m_geometry = geometry;
+
+	computeBounds(vertices);
+	m_vertexBuffer = m_geometry->acquire(vertices->data(), sizeof(Vertex) * vertices->size(),
+		VK_BUFFER_USAGE_VERTEX_BUFFER_BIT, frame);
+	m_indexBuffer = m_geometry->acquire(indices->data(), sizeof(uint32_t) * indices->size(),
+		VK_BUFFER_USAGE_INDEX_BUFFER_BIT, frame);
+	m_vertexOffset = static_cast<int32_t>(m_geometry->getOffset(m_vertexBuffer) / sizeof(Vertex));
+	m_firstIndex = static_cast<uint32_t>(m_geometry->getOffset(m_indexBuffer) / sizeof(uint32_t));
 }
 
 void Mesh::setModel(glm::mat4 newModel)
@@ -28,87 +32,76 @@ Model Mesh::getModel()
 	return m_model;
 }
 
-int Mesh::getVertexCount()
+void Mesh::setMaterialIndex(uint32_t materialIndex)
 {
-	return m_vertexCount;
+	m_materialIndex = materialIndex;
 }
 
-VkBuffer Mesh::getVertexBuffer()
+uint32_t Mesh::getMaterialIndex()
 {
-	return m_vertexBuffer;
+	return m_materialIndex;
 }
 
-int Mesh::getIndexCount()
+void Mesh::setTransparent(bool transparent)
 {
-	return m_indexCount;
+	m_transparent = transparent;
 }
 
-VkBuffer Mesh::getIndexBuffer()
+bool Mesh::isTransparent()
 {
-	return m_indexBuffer;
+	return m_transparent;
 }
 
-void Mesh::destroyBuffers()
+glm::vec4 Mesh::getBounds()
 {
-	vkDestroyBuffer(m_device, m_vertexBuffer, nullptr);
-	vkFreeMemory(m_device, m_vertexBufferMemory, nullptr);
-	vkDestroyBuffer(m_device, m_indexBuffer, nullptr);
-	vkFreeMemory(m_device, m_indexBufferMemory, nullptr);
+	return m_bounds;
 }
 
-void Mesh::createVertexBuffer(std::vector<Vertex>* vertices)
+int Mesh::getVertexCount()
 {
-
-	VkDeviceSize bufferSize = sizeof(Vertex) * vertices->size();
-
-	// Create a staging buffer
-	VkBuffer stagingBuffer;
-	VkDeviceMemory stagingBufferMemory;
-
-	createBuffer(m_physicalDevice, m_device, bufferSize, VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
-		VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, &stagingBuffer, &stagingBufferMemory);
-
-	//Map memory to staging buffer and copy vertex data into it
-	void* data;
-	vkMapMemory(m_device, stagingBufferMemory, 0, bufferSize, 0, &data); // data now points to the buffer memory
-	memcpy(data, vertices->data(), static_cast<size_t>(bufferSize));
-	vkUnmapMemory(m_device, stagingBufferMemory);
-
-	// Create vertex buffer in memory only visible by the GPU. The buffer is set up to be
-	// both a vertex buffer and the destination for a memory transfer from the staging buffer
-	createBuffer(m_physicalDevice, m_device, bufferSize, VK_BUFFER_USAGE_VERTEX_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
-		VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &m_vertexBuffer, &m_vertexBufferMemory);
-
-	copyBuffer(m_device, m_transferQueue, m_transferCommandPool, stagingBuffer, m_vertexBuffer, bufferSize);
-
-	vkDestroyBuffer(m_device, stagingBuffer, nullptr);
-	vkFreeMemory(m_device, stagingBufferMemory, nullptr);
+	return m_vertexCount;
 }
 
-void Mesh::createIndexBuffer(std::vector<uint32_t>* indices)
+int Mesh::getIndexCount()
 {
-	VkDeviceSize bufferSize = sizeof(uint32_t) * indices->size();
-
-	// Create a staging buffer
-	VkBuffer stagingBuffer;
-	VkDeviceMemory stagingBufferMemory;
-
-	createBuffer(m_physicalDevice, m_device, bufferSize, VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
-		VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, &stagingBuffer, &stagingBufferMemory);
+	return m_indexCount;
+}
 
-	//Map memory to staging buffer and copy index data into it
-	void* data;
-	vkMapMemory(m_device, stagingBufferMemory, 0, bufferSize, 0, &data); // data now points to the buffer memory
-	memcpy(data, indices->data(), static_cast<size_t>(bufferSize));
-	vkUnmapMemory(m_device, stagingBufferMemory);
+int32_t Mesh::getVertexOffset()
+{
+	return m_vertexOffset;
+}
 
-	// Create index buffer in memory only visible by the GPU. The buffer is set up to be
-	// both an index buffer and the destination for a memory transfer from the staging buffer
-	createBuffer(m_physicalDevice, m_device, bufferSize, VK_BUFFER_USAGE_INDEX_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
-		VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &m_indexBuffer, &m_indexBufferMemory);
+uint32_t Mesh::getFirstIndex()
+{
+	return m_firstIndex;
+}
 
-	copyBuffer(m_device, m_transferQueue, m_transferCommandPool, stagingBuffer, m_indexBuffer, bufferSize);
+void Mesh::releaseBuffers()
+{
+	m_geometry->release(m_vertexBuffer);
+	m_geometry->release(m_indexBuffer);
+}
 
-	vkDestroyBuffer(m_device, stagingBuffer, nullptr);
-	vkFreeMemory(m_device, stagingBufferMemory, nullptr);
+void Mesh::computeBounds(std::vector<Vertex>* vertices)
+{
+	// Sphere around the centre of the axis aligned box, not the tightest
+	// one but good enough for culling
+	glm::vec3 minPos(0.0f);
+	glm::vec3 maxPos(0.0f);
+	if (!vertices->empty()) {
+		minPos = maxPos = (*vertices)[0].pos;
+	}
+	for (const auto& vertex : *vertices) {
+		minPos = glm::min(minPos, vertex.pos);
+		maxPos = glm::max(maxPos, vertex.pos);
+	}
+
+	glm::vec3 centre = (minPos + maxPos) * 0.5f;
+	float radius = 0.0f;
+	for (const auto& vertex : *vertices) {
+		radius = std::max(radius, glm::length(vertex.pos - centre));
+	}
+
+	m_bounds = glm::vec4(centre, radius);
 }
@@ -5,48 +5,69 @@
 
 #include <vector>
 #include "Utils.h"
+#include "SlotMap.h"
+#include "GeometryCache.h"
 
 struct Model {
 	glm::mat4 model;
 };
 
+// Meshes are handed out by the renderer as handles into a slot map
+using MeshHandle = SlotHandle;
+
+// Vertices and indices are ranges of the geometry cache's buffers, shared
+// with any other mesh made of the same data
 class Mesh
 {
 public:
-
 	Mesh() {};
-	Mesh(VkPhysicalDevice physicalDevice, VkDevice device, VkQueue transferQueue, VkCommandPool transferCommandPool,
-		std::vector<Vertex>* vertices, std::vector<uint32_t>* indices);
+	Mesh(GeometryCache* geometry, std::vector<Vertex>* vertices, std::vector<uint32_t>* indices, uint64_t frame);
 
 	~Mesh() {};
 
 	void setModel(glm::mat4 newModel);
 	Model getModel();
 
+	void setMaterialIndex(uint32_t materialIndex);
+	uint32_t getMaterialIndex();
+
+	// Transparent meshes are blended with what is behind them, by their
+	// texture's alpha, and drawn after the opaque ones
+	void setTransparent(bool transparent);
+	bool isTransparent();
+
+	// Bounding sphere of the vertices in model space: centre, radius
+	glm::vec4 getBounds();
+
 	int getVertexCount();
-	VkBuffer getVertexBuffer();
 	int getIndexCount();
-	VkBuffer getIndexBuffer();
-	void destroyBuffers();
+
+	// Where the mesh starts in the geometry cache's buffers, as the draw
+	// parameters of the same names
+	int32_t getVertexOffset();
+	uint32_t getFirstIndex();
+
+	// Drops the mesh's references to its buffers, which are freed once no
+	// mesh uses them and the frames in flight are done with them
+	void releaseBuffers();
 
 private:
 
 	Model m_model;
+	uint32_t m_materialIndex;
+	bool m_transparent;
+	glm::vec4 m_bounds;
+
+	GeometryCache* m_geometry;
 
 	int m_vertexCount;
-	VkBuffer m_vertexBuffer;
-	VkDeviceMemory m_vertexBufferMemory;
+	GeometryCache::Handle m_vertexBuffer;
+	int32_t m_vertexOffset;
 
 	int m_indexCount;
-	VkBuffer m_indexBuffer;
-	VkDeviceMemory m_indexBufferMemory;
-
-	VkPhysicalDevice m_physicalDevice;
-	VkDevice m_device;
-	VkQueue m_transferQueue;
-	VkCommandPool m_transferCommandPool;
+	GeometryCache::Handle m_indexBuffer;
+	uint32_t m_firstIndex;
 
-	void createVertexBuffer(std::vector<Vertex>* vertices);
-	void createIndexBuffer(std::vector<uint32_t>* indices);
+	void computeBounds(std::vector<Vertex>* vertices);
 };
 
@@ -0,0 +1,226 @@
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <vector>
+
+#include "Profiler.h"
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+const uint32_t BLOCK_EVENTS = 4096;
+
+struct Event {
+	const char* name;
+	uint64_t beginNs;
+	uint64_t endNs;
+};
+
+// Written by the owning thread only. The count is published with release
+// semantics, so the exporter sees complete events up to it.
+struct Block {
+	Event events[BLOCK_EVENTS];
+	std::atomic<uint32_t> count{ 0 };
+	std::atomic<Block*> next{ nullptr };
+};
+
+struct ThreadBuffer {
+	uint32_t id = 0;
+	std::atomic<const char*> name{ nullptr };
+	Block first;
+	Block* last = &first; // owner only
+};
+
+const Clock::time_point s_epoch = Clock::now();
+std::atomic<bool> s_capturing{ false };
+
+// Buffers are never freed, threads that exit leave their zones behind
+std::mutex s_registryMutex;
+std::vector<std::unique_ptr<ThreadBuffer>> s_buffers;
+std::unique_ptr<ThreadBuffer> s_gpuBuffers[2]; // graphics and compute queue
+std::set<std::string> s_names;
+
+thread_local ThreadBuffer* t_buffer = nullptr;
+
+ThreadBuffer* threadBuffer()
+{
+	if (t_buffer == nullptr) {
+		std::lock_guard<std::mutex> lock(s_registryMutex);
+		s_buffers.push_back(std::make_unique<ThreadBuffer>());
+		t_buffer = s_buffers.back().get();
+		t_buffer->id = static_cast<uint32_t>(s_buffers.size());
+	}
+	return t_buffer;
+}
+
+ThreadBuffer* gpuBuffer(uint32_t queue)
+{
+	std::lock_guard<std::mutex> lock(s_registryMutex);
+	std::unique_ptr<ThreadBuffer>& buffer = s_gpuBuffers[queue];
+	if (!buffer) {
+		// The compute track gets an id no thread will reach, so it sorts last
+		buffer = std::make_unique<ThreadBuffer>();
+		buffer->id = queue == Profiler::GPU_QUEUE_COMPUTE ? 1u << 30 : 0;
+		buffer->name = queue == Profiler::GPU_QUEUE_COMPUTE ? "GPU async compute" : "GPU";
+	}
+	return buffer.get();
+}
+
+void append(ThreadBuffer* buffer, const char* name, uint64_t beginNs, uint64_t endNs)
+{
+	Block* block = buffer->last;
+	uint32_t count = block->count.load(std::memory_order_relaxed);
+	if (count == BLOCK_EVENTS) {
+		Block* next = new Block();
+		block->next.store(next, std::memory_order_release);
+		buffer->last = next;
+		block = next;
+		count = 0;
+	}
+
+	block->events[count] = { name, beginNs, endNs };
+	block->count.store(count + 1, std::memory_order_release);
+}
+
+void writeString(std::ostream& out, const char* text)
+{
+	out << '"';
+	for (const char* c = text; *c; c++) {
+		if (*c == '"' || *c == '\\') {
+			out << '\\' << *c;
+		}
+		else if (static_cast<unsigned char>(*c) < 0x20) {
+			out << ' ';
+		}
+		else {
+			out << *c;
+		}
+	}
+	out << '"';
+}
+
+void writeEvents(std::ostream& out, const ThreadBuffer& buffer, bool& first)
+{
+	const char* name = buffer.name.load(std::memory_order_acquire);
+	if (name != nullptr) {
+		out << (first ? "" : ",\n") << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << buffer.id
+			<< ",\"args\":{\"name\":";
+		writeString(out, name);
+		out << "}}";
+		first = false;
+	}
+
+	for (const Block* block = &buffer.first; block != nullptr; block = block->next.load(std::memory_order_acquire)) {
+		uint32_t count = block->count.load(std::memory_order_acquire);
+		for (uint32_t i = 0; i < count; i++) {
+			const Event& event = block->events[i];
+
+			// Microseconds, as the format wants them
+			out << (first ? "" : ",\n") << "{\"name\":";
+			writeString(out, event.name);
+			out << ",\"ph\":\"X\",\"pid\":1,\"tid\":" << buffer.id
+				<< ",\"ts\":" << event.beginNs / 1000.0
+				<< ",\"dur\":" << (event.endNs - event.beginNs) / 1000.0 << "}";
+			first = false;
+		}
+	}
+}
+
+}
+
+void Profiler::start()
+{
+#ifndef ENABLE_PROFILER
+	std::cout << "Profiling zones were compiled out, build with ENABLE_PROFILER to record them" << std::endl;
+#endif
+	s_capturing.store(true, std::memory_order_relaxed);
+}
+
+void Profiler::stop()
+{
+	s_capturing.store(false, std::memory_order_relaxed);
+}
+
+bool Profiler::isCapturing()
+{
+	return s_capturing.load(std::memory_order_relaxed);
+}
+
+void Profiler::setThreadName(const char* name)
+{
+	threadBuffer()->name.store(name, std::memory_order_release);
+}
+
+uint64_t Profiler::now()
+{
+	// Starts at 1, 0 marks zones that began outside a capture
+	return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+		Clock::now() - s_epoch).count()) + 1;
+}
+
+void Profiler::recordZone(const char* name, uint64_t beginNs, uint64_t endNs)
+{
+	if (isCapturing()) {
+		append(threadBuffer(), name, beginNs, endNs);
+	}
+}
+
+void Profiler::recordGpuZone(const char* name, uint64_t beginNs, uint64_t endNs, uint32_t queue)
+{
+	if (isCapturing()) {
+		static ThreadBuffer* buffers[2] = {};
+		if (buffers[queue] == nullptr) {
+			buffers[queue] = gpuBuffer(queue);
+		}
+		append(buffers[queue], name, beginNs, endNs);
+	}
+}
+
+const char* Profiler::intern(const std::string& name)
+{
+	std::lock_guard<std::mutex> lock(s_registryMutex);
+	return s_names.insert(name).first->c_str();
+}
+
+bool Profiler::writeChromeTrace(const std::string& path)
+{
+	std::ofstream out(path);
+	if (!out) {
+		std::cout << "Failed to open " << path << " for the trace" << std::endl;
+		return false;
+	}
+	out << std::fixed << std::setprecision(3);
+
+	out << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+	out << "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"args\":{\"name\":\"VulkanApp\"}}";
+	bool first = false;
+
+	// Holding the lock keeps new threads from registering meanwhile, the
+	// existing ones keep recording into their own buffers
+	{
+		std::lock_guard<std::mutex> lock(s_registryMutex);
+		for (const auto& buffer : s_buffers) {
+			writeEvents(out, *buffer, first);
+		}
+		for (const auto& buffer : s_gpuBuffers) {
+			if (buffer) {
+				writeEvents(out, *buffer, first);
+			}
+		}
+	}
+
+	out << "\n]}\n";
+	if (!out) {
+		std::cout << "Failed to write the trace to " << path << std::endl;
+		return false;
+	}
+
+	std::cout << "Wrote profiling trace to " << path << std::endl;
+	return true;
+}
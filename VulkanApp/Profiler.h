@@ -0,0 +1,73 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+// Scoped CPU zones and GPU timings, exported as Chrome trace_event JSON
+// that chrome://tracing and Perfetto can open.
+//
+// Every thread appends its zones to its own buffer, a list of fixed size
+// blocks that only that thread writes to, so recording a zone takes no
+// locks; a lock is only taken once per thread to register its buffer.
+// Zones are only recorded between start() and stop(). Building without
+// ENABLE_PROFILER compiles PROFILE_ZONE out entirely.
+//
+// Zone names must outlive the capture: string literals, or names passed
+// through intern().
+class Profiler
+{
+public:
+	static void start();
+	static void stop();
+	static bool isCapturing();
+
+	// Shown as the thread's track name in the trace
+	static void setThreadName(const char* name);
+
+	// Nanoseconds on the clock zones are recorded with
+	static uint64_t now();
+
+	static void recordZone(const char* name, uint64_t beginNs, uint64_t endNs);
+
+	// GPU work, already converted to the CPU clock, on a track per queue
+	// (GPU_QUEUE_GRAPHICS or GPU_QUEUE_COMPUTE). Only one thread may record
+	// GPU zones.
+	static constexpr uint32_t GPU_QUEUE_GRAPHICS = 0;
+	static constexpr uint32_t GPU_QUEUE_COMPUTE = 1;
+	static void recordGpuZone(const char* name, uint64_t beginNs, uint64_t endNs, uint32_t queue = GPU_QUEUE_GRAPHICS);
+
+	// A copy of the name that lives until the program exits
+	static const char* intern(const std::string& name);
+
+	// Writes everything recorded so far. Threads may keep recording meanwhile.
+	static bool writeChromeTrace(const std::string& path);
+};
+
+class ProfileZone
+{
+public:
+	explicit ProfileZone(const char* name)
+		: m_name(name), m_begin(Profiler::isCapturing() ? Profiler::now() : 0) {}
+
+	~ProfileZone()
+	{
+		if (m_begin != 0) {
+			Profiler::recordZone(m_name, m_begin, Profiler::now());
+		}
+	}
+
+	ProfileZone(const ProfileZone&) = delete;
+	ProfileZone& operator=(const ProfileZone&) = delete;
+
+private:
+	const char* m_name;
+	uint64_t m_begin;
+};
+
+#ifdef ENABLE_PROFILER
+#define PROFILE_CONCAT_INNER(a, b) a##b
+#define PROFILE_CONCAT(a, b) PROFILE_CONCAT_INNER(a, b)
+#define PROFILE_ZONE(name) ProfileZone PROFILE_CONCAT(profileZone, __LINE__)(name)
+#else
+#define PROFILE_ZONE(name)
+#endif
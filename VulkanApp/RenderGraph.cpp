@@ -0,0 +1,735 @@
+#include <algorithm>
+#include <stdexcept>
+#include <vector>
+
+#include "RenderGraph.h"
+#include "Profiler.h"
+#include "Utils.h"
+
+namespace {
+
+struct UsageInfo {
+	VkPipelineStageFlags stage;
+	VkAccessFlags access;
+	VkImageLayout layout;
+	VkImageUsageFlags imageUsage;
+};
+
+UsageInfo getUsageInfo(RenderGraph::Usage usage)
+{
+	using Usage = RenderGraph::Usage;
+
+	switch (usage) {
+	case Usage::ColorAttachment:
+		return { VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT,
+			VK_ACCESS_COLOR_ATTACHMENT_READ_BIT | VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT,
+			VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL, VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT };
+	case Usage::DepthAttachment:
+		return { VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT | VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT,
+			VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_READ_BIT | VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT,
+			VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL, VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT };
+	case Usage::DepthRead:
+		return { VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT | VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT,
+			VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_READ_BIT,
+			VK_IMAGE_LAYOUT_DEPTH_STENCIL_READ_ONLY_OPTIMAL, VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT };
+	case Usage::FragmentSampled:
+		return { VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, VK_ACCESS_SHADER_READ_BIT,
+			VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL, VK_IMAGE_USAGE_SAMPLED_BIT };
+	case Usage::ComputeSampled:
+		return { VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_SHADER_READ_BIT,
+			VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL, VK_IMAGE_USAGE_SAMPLED_BIT };
+	case Usage::VertexStorageRead:
+		return { VK_PIPELINE_STAGE_VERTEX_SHADER_BIT, VK_ACCESS_SHADER_READ_BIT,
+			VK_IMAGE_LAYOUT_GENERAL, VK_IMAGE_USAGE_STORAGE_BIT };
+	case Usage::FragmentStorageRead:
+		return { VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, VK_ACCESS_SHADER_READ_BIT,
+			VK_IMAGE_LAYOUT_GENERAL, VK_IMAGE_USAGE_STORAGE_BIT };
+	case Usage::ComputeStorageRead:
+		return { VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_SHADER_READ_BIT,
+			VK_IMAGE_LAYOUT_GENERAL, VK_IMAGE_USAGE_STORAGE_BIT };
+	case Usage::ComputeStorageWrite:
+		return { VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT,
+			VK_IMAGE_LAYOUT_GENERAL, VK_IMAGE_USAGE_STORAGE_BIT };
+	case Usage::IndirectRead:
+		return { VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT, VK_ACCESS_INDIRECT_COMMAND_READ_BIT,
+			VK_IMAGE_LAYOUT_UNDEFINED, 0 };
+	case Usage::TransferSrc:
+		return { VK_PIPELINE_STAGE_TRANSFER_BIT, VK_ACCESS_TRANSFER_READ_BIT,
+			VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, VK_IMAGE_USAGE_TRANSFER_SRC_BIT };
+	case Usage::TransferDst:
+		return { VK_PIPELINE_STAGE_TRANSFER_BIT, VK_ACCESS_TRANSFER_WRITE_BIT,
+			VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, VK_IMAGE_USAGE_TRANSFER_DST_BIT };
+	case Usage::HostRead:
+		return { VK_PIPELINE_STAGE_HOST_BIT, VK_ACCESS_HOST_READ_BIT,
+			VK_IMAGE_LAYOUT_GENERAL, 0 };
+	}
+
+	throw std::runtime_error("Unknown render graph usage");
+}
+
+const VkAccessFlags WRITE_ACCESS_MASK = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT | VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT
+	| VK_ACCESS_SHADER_WRITE_BIT | VK_ACCESS_TRANSFER_WRITE_BIT | VK_ACCESS_HOST_WRITE_BIT;
+
+}
+
+RenderGraph::PassBuilder& RenderGraph::PassBuilder::read(ResourceId resource, Usage usage)
+{
+	m_graph->addAccess(m_pass, resource, usage, false);
+	return *this;
+}
+
+RenderGraph::PassBuilder& RenderGraph::PassBuilder::write(ResourceId resource, Usage usage)
+{
+	m_graph->addAccess(m_pass, resource, usage, true);
+	return *this;
+}
+
+RenderGraph::PassBuilder& RenderGraph::PassBuilder::execute(std::function<void(VkCommandBuffer)> callback)
+{
+	m_graph->m_passes[m_pass].callback = std::move(callback);
+	return *this;
+}
+
+RenderGraph::PassBuilder& RenderGraph::PassBuilder::hasSideEffects()
+{
+	m_graph->m_passes[m_pass].sideEffects = true;
+	return *this;
+}
+
+RenderGraph::PassBuilder& RenderGraph::PassBuilder::asyncCompute()
+{
+	m_graph->m_passes[m_pass].asyncCompute = true;
+	return *this;
+}
+
+RenderGraph::RenderGraph(VkPhysicalDevice physicalDevice, VkDevice device)
+	: m_physicalDevice(physicalDevice), m_device(device)
+{
+}
+
+RenderGraph::ResourceId RenderGraph::importImage(const std::string& name, const ImageDesc& desc,
+	const ImportState& initialState, const ImportState& finalState)
+{
+	Resource resource = {};
+	resource.name = name;
+	resource.isImage = true;
+	resource.imported = true;
+	resource.desc = desc;
+	resource.initialState = initialState;
+	resource.finalState = finalState;
+	m_resources.push_back(resource);
+
+	return static_cast<ResourceId>(m_resources.size() - 1);
+}
+
+RenderGraph::ResourceId RenderGraph::importBuffer(const std::string& name)
+{
+	Resource resource = {};
+	resource.name = name;
+	resource.imported = true;
+	m_resources.push_back(resource);
+
+	return static_cast<ResourceId>(m_resources.size() - 1);
+}
+
+RenderGraph::ResourceId RenderGraph::createImage(const std::string& name, const ImageDesc& desc)
+{
+	Resource resource = {};
+	resource.name = name;
+	resource.isImage = true;
+	resource.desc = desc;
+	m_resources.push_back(resource);
+
+	return static_cast<ResourceId>(m_resources.size() - 1);
+}
+
+RenderGraph::PassBuilder RenderGraph::addPass(const std::string& name)
+{
+	Pass pass = {};
+	pass.name = name;
+	pass.profileName = Profiler::intern(name);
+	m_passes.push_back(pass);
+
+	return PassBuilder(this, m_passes.size() - 1);
+}
+
+void RenderGraph::markOutput(ResourceId resource)
+{
+	m_resources.at(resource).output = true;
+}
+
+void RenderGraph::addAccess(size_t pass, ResourceId resource, Usage usage, bool write)
+{
+	if (resource >= m_resources.size()) {
+		throw std::runtime_error("Pass " + m_passes[pass].name + " uses a resource that does not exist");
+	}
+
+	UsageInfo info = getUsageInfo(usage);
+	if (!m_resources[resource].isImage) {
+		info.layout = VK_IMAGE_LAYOUT_UNDEFINED;
+		info.imageUsage = 0;
+	}
+
+	// A pass that uses a resource in several ways gets a single access, so
+	// no barrier ends up between two uses inside the same pass
+	for (auto& access : m_passes[pass].accesses) {
+		if (access.resource == resource) {
+			if (access.layout != info.layout) {
+				throw std::runtime_error("Pass " + m_passes[pass].name + " uses " + m_resources[resource].name
+					+ " in two different layouts");
+			}
+			access.stage |= info.stage;
+			access.access |= info.access;
+			access.imageUsage |= info.imageUsage;
+			access.write = access.write || write;
+			return;
+		}
+	}
+
+	m_passes[pass].accesses.push_back({ resource, info.stage, info.access, info.layout, info.imageUsage, write });
+}
+
+void RenderGraph::compile()
+{
+	cullPasses();
+	checkAsyncCompute();
+	computeLifetimes();
+	allocateTransients();
+	buildBarriers();
+}
+
+void RenderGraph::destroy()
+{
+	for (auto& resource : m_resources) {
+		if (!resource.imported) {
+			vkDestroyImageView(m_device, resource.imageView, nullptr);
+			vkDestroyImage(m_device, resource.image, nullptr);
+			resource.imageView = VK_NULL_HANDLE;
+			resource.image = VK_NULL_HANDLE;
+		}
+	}
+
+	for (auto& block : m_memoryBlocks) {
+		vkFreeMemory(m_device, block.memory, nullptr);
+	}
+	m_memoryBlocks.clear();
+}
+
+void RenderGraph::cullPasses()
+{
+	// Walk backwards from the outputs: a pass is kept if something later
+	// needs a resource it writes, and then everything it reads is needed too
+	std::vector<bool> needed(m_resources.size(), false);
+	for (size_t i = 0; i < m_resources.size(); i++) {
+		needed[i] = m_resources[i].output;
+	}
+
+	for (size_t i = m_passes.size(); i-- > 0;) {
+		Pass& pass = m_passes[i];
+
+		bool keep = pass.sideEffects;
+		for (const auto& access : pass.accesses) {
+			if (access.write && needed[access.resource]) {
+				keep = true;
+			}
+		}
+
+		pass.culled = !keep;
+		if (keep) {
+			for (const auto& access : pass.accesses) {
+				if (!access.write) {
+					needed[access.resource] = true;
+				}
+			}
+		}
+	}
+}
+
+void RenderGraph::checkAsyncCompute()
+{
+	// The graphics stages that use what the async passes touch wait for them
+	m_asyncComputeWaitStages = 0;
+	bool anyAsync = false;
+	for (size_t p = 0; p < m_passes.size(); p++) {
+		const Pass& pass = m_passes[p];
+		if (pass.culled || !pass.asyncCompute) {
+			continue;
+		}
+		anyAsync = true;
+
+		for (const auto& access : pass.accesses) {
+			const Resource& resource = m_resources[access.resource];
+			if (resource.isImage) {
+				throw std::runtime_error("Async compute pass " + pass.name + " uses image " + resource.name
+					+ ", only buffers can be shared with the compute queue");
+			}
+
+			for (size_t other = 0; other < m_passes.size(); other++) {
+				const Pass& otherPass = m_passes[other];
+				if (otherPass.culled || otherPass.asyncCompute) {
+					continue;
+				}
+				for (const auto& otherAccess : otherPass.accesses) {
+					if (otherAccess.resource != access.resource) {
+						continue;
+					}
+					if (other < p) {
+						throw std::runtime_error("Async compute pass " + pass.name + " uses " + resource.name
+							+ " after the graphics pass " + otherPass.name + ", but runs before every graphics pass");
+					}
+					m_asyncComputeWaitStages |= otherAccess.stage;
+				}
+			}
+		}
+	}
+
+	// Nothing on the graphics queue consumes the results: wait for them
+	// anyway, so that the frame's fence covers the compute work too
+	if (anyAsync && m_asyncComputeWaitStages == 0) {
+		m_asyncComputeWaitStages = VK_PIPELINE_STAGE_ALL_COMMANDS_BIT;
+	}
+}
+
+void RenderGraph::computeLifetimes()
+{
+	for (auto& resource : m_resources) {
+		resource.used = false;
+		resource.usage = 0;
+	}
+
+	for (size_t i = 0; i < m_passes.size(); i++) {
+		if (m_passes[i].culled) {
+			continue;
+		}
+
+		for (const auto& access : m_passes[i].accesses) {
+			Resource& resource = m_resources[access.resource];
+			if (!resource.used) {
+				resource.firstPass = i;
+				resource.used = true;
+			}
+			resource.lastPass = i;
+			resource.usage |= access.imageUsage;
+		}
+	}
+}
+
+void RenderGraph::allocateTransients()
+{
+	std::vector<ResourceId> transients;
+	for (ResourceId id = 0; id < m_resources.size(); id++) {
+		Resource& resource = m_resources[id];
+		if (resource.imported || !resource.used) {
+			continue;
+		}
+
+		VkImageCreateInfo imageCreateInfo = {};
+		imageCreateInfo.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+		imageCreateInfo.imageType = VK_IMAGE_TYPE_2D;
+		imageCreateInfo.format = resource.desc.format;
+		imageCreateInfo.extent = { resource.desc.extent.width, resource.desc.extent.height, 1 };
+		imageCreateInfo.mipLevels = resource.desc.mipLevels;
+		imageCreateInfo.arrayLayers = 1;
+		imageCreateInfo.samples = VK_SAMPLE_COUNT_1_BIT;
+		imageCreateInfo.tiling = VK_IMAGE_TILING_OPTIMAL;
+		imageCreateInfo.usage = resource.usage;
+		imageCreateInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+		imageCreateInfo.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+
+		VkResult result = vkCreateImage(m_device, &imageCreateInfo, nullptr, &resource.image);
+		if (result != VK_SUCCESS) {
+			throw std::runtime_error("Failed to create render graph image " + resource.name);
+		}
+
+		vkGetImageMemoryRequirements(m_device, resource.image, &resource.memoryRequirements);
+		transients.push_back(id);
+	}
+
+	// Largest images first, each one goes into the first block whose
+	// images are all dead before it is first used (or born after its last use)
+	std::sort(transients.begin(), transients.end(), [this](ResourceId a, ResourceId b) {
+		return m_resources[a].memoryRequirements.size > m_resources[b].memoryRequirements.size;
+	});
+
+	for (ResourceId id : transients) {
+		Resource& resource = m_resources[id];
+
+		for (size_t b = 0; b < m_memoryBlocks.size() && resource.memoryBlock < 0; b++) {
+			MemoryBlock& block = m_memoryBlocks[b];
+			if ((block.memoryTypeBits & resource.memoryRequirements.memoryTypeBits) == 0) {
+				continue;
+			}
+
+			bool overlaps = false;
+			for (ResourceId other : block.resources) {
+				const Resource& otherResource = m_resources[other];
+				if (resource.firstPass <= otherResource.lastPass && otherResource.firstPass <= resource.lastPass) {
+					overlaps = true;
+				}
+			}
+
+			if (!overlaps) {
+				block.memoryTypeBits &= resource.memoryRequirements.memoryTypeBits;
+				block.size = std::max(block.size, resource.memoryRequirements.size);
+				block.resources.push_back(id);
+				resource.memoryBlock = static_cast<int>(b);
+			}
+		}
+
+		if (resource.memoryBlock < 0) {
+			MemoryBlock block = {};
+			block.memoryTypeBits = resource.memoryRequirements.memoryTypeBits;
+			block.size = resource.memoryRequirements.size;
+			block.resources.push_back(id);
+			m_memoryBlocks.push_back(block);
+			resource.memoryBlock = static_cast<int>(m_memoryBlocks.size() - 1);
+		}
+	}
+
+	for (auto& block : m_memoryBlocks) {
+		VkMemoryAllocateInfo memoryAllocInfo = {};
+		memoryAllocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+		memoryAllocInfo.allocationSize = block.size;
+		memoryAllocInfo.memoryTypeIndex = findMemoryTypeIndex(m_physicalDevice, block.memoryTypeBits,
+			VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+
+		RenderStats::countAllocation();
+		VkResult result = vkAllocateMemory(m_device, &memoryAllocInfo, nullptr, &block.memory);
+		if (result != VK_SUCCESS) {
+			throw std::runtime_error("Failed to allocate render graph memory");
+		}
+
+		// Every image in a block starts at offset 0, the block is as big as the largest one
+		for (ResourceId id : block.resources) {
+			Resource& resource = m_resources[id];
+			vkBindImageMemory(m_device, resource.image, block.memory, 0);
+
+			VkImageViewCreateInfo viewCreateInfo = {};
+			viewCreateInfo.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
+			viewCreateInfo.image = resource.image;
+			viewCreateInfo.viewType = VK_IMAGE_VIEW_TYPE_2D;
+			viewCreateInfo.format = resource.desc.format;
+			viewCreateInfo.components.r = VK_COMPONENT_SWIZZLE_IDENTITY;
+			viewCreateInfo.components.g = VK_COMPONENT_SWIZZLE_IDENTITY;
+			viewCreateInfo.components.b = VK_COMPONENT_SWIZZLE_IDENTITY;
+			viewCreateInfo.components.a = VK_COMPONENT_SWIZZLE_IDENTITY;
+			viewCreateInfo.subresourceRange.aspectMask = resource.desc.aspect;
+			viewCreateInfo.subresourceRange.baseMipLevel = 0;
+			viewCreateInfo.subresourceRange.levelCount = resource.desc.mipLevels;
+			viewCreateInfo.subresourceRange.baseArrayLayer = 0;
+			viewCreateInfo.subresourceRange.layerCount = 1;
+
+			result = vkCreateImageView(m_device, &viewCreateInfo, nullptr, &resource.imageView);
+			if (result != VK_SUCCESS) {
+				throw std::runtime_error("Failed to create render graph image view " + resource.name);
+			}
+		}
+	}
+}
+
+void RenderGraph::buildBarriers()
+{
+	// Buffers the async compute passes touch are synchronised with the
+	// graphics queue by the semaphore, not by barriers
+	std::vector<bool> asyncTouched(m_resources.size(), false);
+	for (const auto& pass : m_passes) {
+		if (!pass.culled && pass.asyncCompute) {
+			for (const auto& access : pass.accesses) {
+				asyncTouched[access.resource] = true;
+			}
+		}
+	}
+
+	// Each queue only gets barriers between its own passes
+	m_barrierCount = 0;
+	buildQueueBarriers(true, asyncTouched);
+	std::vector<BarrierState> states = buildQueueBarriers(false, asyncTouched);
+
+	// Leave imported images in the state the rest of the frame expects
+	m_finalBarriers = {};
+	for (ResourceId id = 0; id < m_resources.size(); id++) {
+		const Resource& resource = m_resources[id];
+		if (!resource.imported || !resource.isImage || resource.finalState.layout == VK_IMAGE_LAYOUT_UNDEFINED) {
+			continue;
+		}
+
+		BarrierState& state = states[id];
+		if (state.layout != resource.finalState.layout || resource.finalState.access != 0) {
+			addBarrier(m_finalBarriers, id, state.writeStages | state.readStages, state.writeAccess,
+				resource.finalState.stage, resource.finalState.access, state.layout, resource.finalState.layout);
+		}
+	}
+}
+
+std::vector<RenderGraph::BarrierState> RenderGraph::buildQueueBarriers(bool asyncQueue, const std::vector<bool>& asyncTouched)
+{
+	auto onQueue = [this, asyncQueue](size_t p) { return !m_passes[p].culled && m_passes[p].asyncCompute == asyncQueue; };
+
+	// Anything that may still be running from the previous frame (or, for
+	// aliased images, from the other images sharing the memory) has to be
+	// waited for at the first use. Host writes before the submit are
+	// visible without a barrier.
+	std::vector<BarrierState> states(m_resources.size());
+	for (size_t p = 0; p < m_passes.size(); p++) {
+		if (!onQueue(p)) {
+			continue;
+		}
+		for (const auto& access : m_passes[p].accesses) {
+			if (!asyncQueue && asyncTouched[access.resource]) {
+				continue; // the semaphore covers these
+			}
+			const Resource& resource = m_resources[access.resource];
+			std::vector<ResourceId> sharing = { access.resource };
+			if (resource.memoryBlock >= 0) {
+				sharing = m_memoryBlocks[resource.memoryBlock].resources;
+			}
+			for (ResourceId id : sharing) {
+				if (m_resources[id].imported && m_resources[id].isImage) {
+					continue;
+				}
+				if (access.write) {
+					states[id].writeStages |= access.stage;
+					states[id].writeAccess |= access.access & WRITE_ACCESS_MASK;
+				}
+				else {
+					states[id].readStages |= access.stage;
+				}
+			}
+		}
+	}
+
+	for (size_t id = 0; id < m_resources.size(); id++) {
+		const Resource& resource = m_resources[id];
+		states[id].layout = VK_IMAGE_LAYOUT_UNDEFINED;
+		if (resource.imported && resource.isImage) {
+			states[id].layout = resource.initialState.layout;
+			states[id].writeStages = resource.initialState.stage;
+			states[id].writeAccess = resource.initialState.access;
+			states[id].readStages = 0;
+		}
+	}
+
+	for (size_t p = 0; p < m_passes.size(); p++) {
+		Pass& pass = m_passes[p];
+		if (!onQueue(p)) {
+			continue;
+		}
+		pass.barriers = {};
+
+		for (const auto& access : pass.accesses) {
+			BarrierState& state = states[access.resource];
+			bool isImage = m_resources[access.resource].isImage;
+			bool layoutChange = isImage && access.layout != state.layout;
+
+			// Readers that directly follow in the same layout are folded into this
+			// barrier, so the write only has to be made visible once
+			VkPipelineStageFlags dstStage = access.stage;
+			VkAccessFlags dstAccess = access.access;
+			if (!access.write) {
+				for (size_t next = p + 1; next < m_passes.size(); next++) {
+					if (!onQueue(next)) {
+						continue;
+					}
+					auto it = std::find_if(m_passes[next].accesses.begin(), m_passes[next].accesses.end(),
+						[&access](const Access& other) { return other.resource == access.resource; });
+					if (it == m_passes[next].accesses.end()) {
+						continue;
+					}
+					if (it->write || it->layout != access.layout) {
+						break;
+					}
+					dstStage |= it->stage;
+					dstAccess |= it->access;
+				}
+			}
+
+			if (access.write || layoutChange) {
+				// Write after write/read, or a layout transition: wait for everything since the last write
+				VkPipelineStageFlags srcStage = state.writeStages | state.readStages;
+				if (layoutChange || srcStage != 0) {
+					addBarrier(pass.barriers, access.resource, srcStage, state.writeAccess, dstStage, dstAccess,
+						isImage ? state.layout : VK_IMAGE_LAYOUT_UNDEFINED, isImage ? access.layout : VK_IMAGE_LAYOUT_UNDEFINED);
+				}
+
+				// The readers folded in above already see the layout transition
+				state.layout = access.layout;
+				state.writeStages = access.write ? access.stage : 0;
+				state.writeAccess = access.write ? (access.access & WRITE_ACCESS_MASK) : 0;
+				state.readStages = access.write ? 0 : access.stage;
+				state.visibleTo = { { dstStage, dstAccess } };
+				continue;
+			}
+
+			// Read after write: only needs a barrier if no earlier one covered this stage and access
+			bool visible = state.writeStages == 0;
+			for (const auto& covered : state.visibleTo) {
+				if ((access.stage & ~covered.first) == 0 && (access.access & ~covered.second) == 0) {
+					visible = true;
+				}
+			}
+
+			if (!visible) {
+				addBarrier(pass.barriers, access.resource, state.writeStages, state.writeAccess, dstStage, dstAccess,
+					state.layout, state.layout);
+				state.visibleTo.push_back({ dstStage, dstAccess });
+			}
+			state.readStages |= access.stage;
+		}
+	}
+
+	return states;
+}
+
+void RenderGraph::addBarrier(BarrierBatch& batch, ResourceId resource, VkPipelineStageFlags srcStage, VkAccessFlags srcAccess,
+	VkPipelineStageFlags dstStage, VkAccessFlags dstAccess, VkImageLayout oldLayout, VkImageLayout newLayout)
+{
+	batch.srcStage |= srcStage ? srcStage : VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT;
+	batch.dstStage |= dstStage;
+	batch.barriers.push_back({ resource, srcAccess, dstAccess, oldLayout, newLayout });
+	m_barrierCount++;
+}
+
+void RenderGraph::setImage(ResourceId resource, VkImage image, VkImageView imageView)
+{
+	m_resources.at(resource).image = image;
+	m_resources.at(resource).imageView = imageView;
+}
+
+void RenderGraph::setBuffer(ResourceId resource, VkBuffer buffer)
+{
+	m_resources.at(resource).buffer = buffer;
+}
+
+VkImage RenderGraph::getImage(ResourceId resource) const
+{
+	return m_resources.at(resource).image;
+}
+
+VkImageView RenderGraph::getImageView(ResourceId resource) const
+{
+	return m_resources.at(resource).imageView;
+}
+
+void RenderGraph::execute(VkCommandBuffer commandBuffer, LinearArena& scratch, VkQueryPool timestampPool, uint32_t firstQuery)
+{
+	executePasses(commandBuffer, scratch, timestampPool, firstQuery, false);
+	recordBarriers(commandBuffer, m_finalBarriers, scratch);
+}
+
+void RenderGraph::executeAsyncCompute(VkCommandBuffer commandBuffer, LinearArena& scratch, VkQueryPool timestampPool,
+	uint32_t firstQuery)
+{
+	executePasses(commandBuffer, scratch, timestampPool, firstQuery, true);
+}
+
+void RenderGraph::executePasses(VkCommandBuffer commandBuffer, LinearArena& scratch, VkQueryPool timestampPool,
+	uint32_t firstQuery, bool asyncCompute)
+{
+	uint32_t query = firstQuery;
+	for (const auto& pass : m_passes) {
+		if (pass.culled || pass.asyncCompute != asyncCompute) {
+			continue;
+		}
+
+		PROFILE_ZONE(pass.profileName);
+		if (timestampPool != VK_NULL_HANDLE) {
+			vkCmdWriteTimestamp(commandBuffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, timestampPool, query++);
+		}
+
+		recordBarriers(commandBuffer, pass.barriers, scratch);
+		if (pass.callback) {
+			pass.callback(commandBuffer);
+		}
+
+		if (timestampPool != VK_NULL_HANDLE) {
+			vkCmdWriteTimestamp(commandBuffer, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, timestampPool, query++);
+		}
+	}
+}
+
+std::vector<const char*> RenderGraph::getExecutedPasses(bool asyncCompute) const
+{
+	std::vector<const char*> names;
+	for (const auto& pass : m_passes) {
+		if (!pass.culled && pass.asyncCompute == asyncCompute) {
+			names.push_back(pass.profileName);
+		}
+	}
+	return names;
+}
+
+void RenderGraph::recordBarriers(VkCommandBuffer commandBuffer, const BarrierBatch& batch, LinearArena& scratch)
+{
+	if (batch.barriers.empty()) {
+		return;
+	}
+
+	ArenaVector<VkImageMemoryBarrier> imageBarriers(scratch);
+	ArenaVector<VkBufferMemoryBarrier> bufferBarriers(scratch);
+	imageBarriers.reserve(batch.barriers.size());
+	bufferBarriers.reserve(batch.barriers.size());
+
+	for (const auto& barrier : batch.barriers) {
+		const Resource& resource = m_resources[barrier.resource];
+
+		if (resource.isImage) {
+			VkImageMemoryBarrier imageBarrier = {};
+			imageBarrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+			imageBarrier.srcAccessMask = barrier.srcAccess;
+			imageBarrier.dstAccessMask = barrier.dstAccess;
+			imageBarrier.oldLayout = barrier.oldLayout;
+			imageBarrier.newLayout = barrier.newLayout;
+			imageBarrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+			imageBarrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+			imageBarrier.image = resource.image;
+			imageBarrier.subresourceRange.aspectMask = resource.desc.aspect;
+			imageBarrier.subresourceRange.baseMipLevel = 0;
+			imageBarrier.subresourceRange.levelCount = resource.desc.mipLevels;
+			imageBarrier.subresourceRange.baseArrayLayer = 0;
+			imageBarrier.subresourceRange.layerCount = 1;
+			imageBarriers.push_back(imageBarrier);
+		}
+		else {
+			VkBufferMemoryBarrier bufferBarrier = {};
+			bufferBarrier.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
+			bufferBarrier.srcAccessMask = barrier.srcAccess;
+			bufferBarrier.dstAccessMask = barrier.dstAccess;
+			bufferBarrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+			bufferBarrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+			bufferBarrier.buffer = resource.buffer;
+			bufferBarrier.offset = 0;
+			bufferBarrier.size = VK_WHOLE_SIZE;
+			bufferBarriers.push_back(bufferBarrier);
+		}
+	}
+
+	vkCmdPipelineBarrier(commandBuffer, batch.srcStage, batch.dstStage, 0,
+		0, nullptr,
+		static_cast<uint32_t>(bufferBarriers.size()), bufferBarriers.data(),
+		static_cast<uint32_t>(imageBarriers.size()), imageBarriers.data());
+}
+
+void RenderGraph::printSummary(std::ostream& out) const
+{
+	size_t culled = 0;
+	for (const auto& pass : m_passes) {
+		culled += pass.culled ? 1 : 0;
+	}
+
+	VkDeviceSize aliasedBytes = 0;
+	VkDeviceSize separateBytes = 0;
+	for (const auto& block : m_memoryBlocks) {
+		aliasedBytes += block.size;
+		for (ResourceId id : block.resources) {
+			separateBytes += m_resources[id].memoryRequirements.size;
+		}
+	}
+
+	out << "Render graph: " << m_passes.size() - culled << " passes (" << culled << " culled), "
+		<< m_barrierCount << " barriers, transient memory " << aliasedBytes / 1024 << " KB ("
+		<< separateBytes / 1024 << " KB without aliasing)" << std::endl;
+	for (const auto& pass : m_passes) {
+		out << "  " << pass.name << (pass.asyncCompute ? " (async compute)" : "") << (pass.culled ? " (culled)" : "")
+			<< std::endl;
+	}
+}
@@ -0,0 +1,229 @@
+#pragma once
+
+#define GLFW_INCLUDE_VULKAN
+#include <GLFW/glfw3.h>
+
+#include <functional>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include "LinearArena.h"
+
+// Declarative description of a frame. Passes declare which resources they
+// read and write, and compile() works out from that:
+//  - which passes can be culled because nothing uses what they produce
+//  - the pipeline barriers (and layout transitions) needed between passes,
+//    using only the stages and access types that are actually involved
+//  - which transient images can share memory because their lifetimes
+//    within the frame don't overlap
+// execute() then records the passes with the barriers in between.
+//
+// Passes marked asyncCompute are recorded separately by
+// executeAsyncCompute(), for a compute queue that runs alongside the
+// graphics one. They run before the graphics passes of the frame: the
+// graphics submission waits for them with a semaphore at
+// getAsyncComputeWaitStages(), which stands in for the barriers between the
+// two queues. They may only use buffers, which must be shared with the
+// compute queue family, and whatever they touch must not be in use by the
+// previous frame's graphics passes (the frame's fence has to cover that).
+class RenderGraph
+{
+public:
+	using ResourceId = uint32_t;
+
+	// How a pass uses a resource. Each usage maps to the pipeline stage,
+	// the access mask and the image layout that barriers are built from.
+	enum class Usage {
+		ColorAttachment,
+		DepthAttachment,
+		DepthRead,
+		FragmentSampled,
+		ComputeSampled,
+		VertexStorageRead,
+		FragmentStorageRead,
+		ComputeStorageRead,
+		ComputeStorageWrite,
+		IndirectRead,
+		TransferSrc,
+		TransferDst,
+		HostRead
+	};
+
+	struct ImageDesc {
+		VkFormat format = VK_FORMAT_UNDEFINED;
+		VkExtent2D extent = {};
+		uint32_t mipLevels = 1;
+		VkImageAspectFlags aspect = VK_IMAGE_ASPECT_COLOR_BIT;
+	};
+
+	// State an imported image is in before the graph runs, or has to
+	// be left in once it is done (e.g. ready for presentation)
+	struct ImportState {
+		VkImageLayout layout = VK_IMAGE_LAYOUT_UNDEFINED;
+		VkPipelineStageFlags stage = VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT;
+		VkAccessFlags access = 0;
+	};
+
+	class PassBuilder {
+	public:
+		PassBuilder(RenderGraph* graph, size_t pass) : m_graph(graph), m_pass(pass) {}
+
+		PassBuilder& read(ResourceId resource, Usage usage);
+		PassBuilder& write(ResourceId resource, Usage usage);
+		PassBuilder& execute(std::function<void(VkCommandBuffer)> callback);
+
+		// The pass is never culled, e.g. because it copies data to the host
+		PassBuilder& hasSideEffects();
+
+		// The pass is recorded by executeAsyncCompute() instead of execute()
+		PassBuilder& asyncCompute();
+
+	private:
+		RenderGraph* m_graph;
+		size_t m_pass;
+	};
+
+	RenderGraph(VkPhysicalDevice physicalDevice, VkDevice device);
+
+	// Imported resources are owned elsewhere, and may change from one frame
+	// to the next (e.g. the swapchain image); set them before execute()
+	ResourceId importImage(const std::string& name, const ImageDesc& desc,
+		const ImportState& initialState, const ImportState& finalState);
+	ResourceId importBuffer(const std::string& name);
+
+	// Transient images are created by the graph and only live for a frame
+	ResourceId createImage(const std::string& name, const ImageDesc& desc);
+
+	PassBuilder addPass(const std::string& name);
+
+	// The contents of an output are needed after the frame. Passes that
+	// don't contribute to any output are culled.
+	void markOutput(ResourceId resource);
+
+	void compile();
+	void destroy();
+
+	void setImage(ResourceId resource, VkImage image, VkImageView imageView);
+	void setBuffer(ResourceId resource, VkBuffer buffer);
+	VkImage getImage(ResourceId resource) const;
+	VkImageView getImageView(ResourceId resource) const;
+
+	// With a query pool, a timestamp is written before and after every pass
+	// that runs, starting at firstQuery. The barriers are gathered in scratch.
+	void execute(VkCommandBuffer commandBuffer, LinearArena& scratch,
+		VkQueryPool timestampPool = VK_NULL_HANDLE, uint32_t firstQuery = 0);
+	void executeAsyncCompute(VkCommandBuffer commandBuffer, LinearArena& scratch,
+		VkQueryPool timestampPool = VK_NULL_HANDLE, uint32_t firstQuery = 0);
+
+	// Whether any async compute pass runs, and the graphics stages that
+	// have to wait for them
+	bool hasAsyncCompute() const { return m_asyncComputeWaitStages != 0; }
+	VkPipelineStageFlags getAsyncComputeWaitStages() const { return m_asyncComputeWaitStages; }
+
+	// Names of the passes that run on either queue, in order, one per pair of timestamps
+	std::vector<const char*> getExecutedPasses(bool asyncCompute = false) const;
+
+	void printSummary(std::ostream& out) const;
+
+private:
+	struct Resource {
+		std::string name;
+		bool isImage = false;
+		bool imported = false;
+		bool output = false;
+		ImageDesc desc;
+		ImportState initialState;
+		ImportState finalState;
+
+		VkImage image = VK_NULL_HANDLE;
+		VkImageView imageView = VK_NULL_HANDLE;
+		VkBuffer buffer = VK_NULL_HANDLE;
+
+		// Transient images only
+		VkImageUsageFlags usage = 0;
+		size_t firstPass = 0;
+		size_t lastPass = 0;
+		bool used = false;
+		VkMemoryRequirements memoryRequirements = {};
+		int memoryBlock = -1;
+	};
+
+	// Every use of a resource by a pass, merged if the pass declares several
+	struct Access {
+		ResourceId resource;
+		VkPipelineStageFlags stage;
+		VkAccessFlags access;
+		VkImageLayout layout;
+		VkImageUsageFlags imageUsage;
+		bool write;
+	};
+
+	struct Barrier {
+		ResourceId resource;
+		VkAccessFlags srcAccess;
+		VkAccessFlags dstAccess;
+		VkImageLayout oldLayout;
+		VkImageLayout newLayout;
+	};
+
+	// All barriers that have to be recorded before a pass, as one call
+	struct BarrierBatch {
+		VkPipelineStageFlags srcStage = 0;
+		VkPipelineStageFlags dstStage = 0;
+		std::vector<Barrier> barriers;
+	};
+
+	struct Pass {
+		std::string name;
+		const char* profileName; // interned, for profiling zones
+		std::vector<Access> accesses;
+		std::function<void(VkCommandBuffer)> callback;
+		bool sideEffects = false;
+		bool asyncCompute = false;
+		bool culled = false;
+		BarrierBatch barriers;
+	};
+
+	// Synchronisation state of a resource as the passes are walked in order
+	struct BarrierState {
+		VkImageLayout layout;
+		VkPipelineStageFlags writeStages; // last write (or layout transition)
+		VkAccessFlags writeAccess;
+		VkPipelineStageFlags readStages;  // reads since the last write
+		std::vector<std::pair<VkPipelineStageFlags, VkAccessFlags>> visibleTo; // where the last write is visible
+	};
+
+	struct MemoryBlock {
+		VkDeviceMemory memory = VK_NULL_HANDLE;
+		VkDeviceSize size = 0;
+		uint32_t memoryTypeBits = 0;
+		std::vector<ResourceId> resources;
+	};
+
+	VkPhysicalDevice m_physicalDevice;
+	VkDevice m_device;
+
+	std::vector<Resource> m_resources;
+	std::vector<Pass> m_passes;
+	std::vector<MemoryBlock> m_memoryBlocks;
+	BarrierBatch m_finalBarriers;
+	size_t m_barrierCount = 0;
+	VkPipelineStageFlags m_asyncComputeWaitStages = 0;
+
+	void addAccess(size_t pass, ResourceId resource, Usage usage, bool write);
+
+	void cullPasses();
+	void computeLifetimes();
+	void allocateTransients();
+	void checkAsyncCompute();
+	void buildBarriers();
+	std::vector<BarrierState> buildQueueBarriers(bool asyncQueue, const std::vector<bool>& asyncTouched);
+	void addBarrier(BarrierBatch& batch, ResourceId resource, VkPipelineStageFlags srcStage, VkAccessFlags srcAccess,
+		VkPipelineStageFlags dstStage, VkAccessFlags dstAccess, VkImageLayout oldLayout, VkImageLayout newLayout);
+
+	void executePasses(VkCommandBuffer commandBuffer, LinearArena& scratch, VkQueryPool timestampPool,
+		uint32_t firstQuery, bool asyncCompute);
+
+	void recordBarriers(VkCommandBuffer commandBuffer, const BarrierBatch& batch, LinearArena& scratch);
+};
@@ -0,0 +1,208 @@
+#include <algorithm>
+
+#include "RenderStats.h"
+
+RenderStats::Counters RenderStats::s_current;
+std::mutex RenderStats::s_historyMutex;
+FrameStats RenderStats::s_history[RenderStats::HISTORY_SIZE];
+uint64_t RenderStats::s_frames = 0;
+
+void RenderStats::endFrame(uint64_t frameNumber, double cpuMs)
+{
+	auto take = [](auto& counter) { return counter.exchange(0, std::memory_order_relaxed); };
+
+	FrameStats stats;
+	stats.frameNumber = frameNumber;
+	stats.cpuMs = cpuMs;
+	stats.drawCalls = take(s_current.drawCalls);
+	stats.dispatches = take(s_current.dispatches);
+	stats.triangles = take(s_current.triangles);
+	stats.pipelineBinds = take(s_current.pipelineBinds);
+	stats.descriptorSetBinds = take(s_current.descriptorSetBinds);
+	stats.vertexBufferBinds = take(s_current.vertexBufferBinds);
+	stats.indexBufferBinds = take(s_current.indexBufferBinds);
+	stats.pushConstantBytes = take(s_current.pushConstantBytes);
+	stats.bufferUploadBytes = take(s_current.bufferUploadBytes);
+	stats.textureUploadBytes = take(s_current.textureUploadBytes);
+	stats.memoryAllocations = take(s_current.memoryAllocations);
+	stats.heapAllocations = take(s_current.heapAllocations);
+	stats.fenceWaitMs = take(s_current.fenceWaitMicroseconds) / 1000.0;
+	stats.acquireMs = take(s_current.acquireMicroseconds) / 1000.0;
+
+	std::lock_guard<std::mutex> lock(s_historyMutex);
+	s_history[s_frames % HISTORY_SIZE] = stats;
+	s_frames++;
+}
+
+void RenderStats::setGpuTime(uint64_t frameNumber, double gpuMs)
+{
+	std::lock_guard<std::mutex> lock(s_historyMutex);
+	FrameStats* stats = findFrame(frameNumber);
+	if (stats) {
+		stats->gpuMs = gpuMs;
+	}
+}
+
+void RenderStats::setOcclusion(uint64_t frameNumber, uint32_t occludedObjects, uint32_t lateObjects, uint64_t triangles)
+{
+	std::lock_guard<std::mutex> lock(s_historyMutex);
+	FrameStats* stats = findFrame(frameNumber);
+	if (stats) {
+		stats->occludedObjects = occludedObjects;
+		stats->lateObjects = lateObjects;
+		stats->triangles += triangles;
+	}
+}
+
+FrameStats* RenderStats::findFrame(uint64_t frameNumber)
+{
+	size_t count = static_cast<size_t>(std::min<uint64_t>(s_frames, HISTORY_SIZE));
+	for (size_t i = 1; i <= count; i++) {
+		FrameStats& stats = s_history[(s_frames - i) % HISTORY_SIZE];
+		if (stats.frameNumber == frameNumber) {
+			return &stats;
+		}
+	}
+	return nullptr;
+}
+
+std::vector<FrameStats> RenderStats::getHistory(size_t count)
+{
+	std::vector<FrameStats> history;
+	history.reserve(std::min(count, HISTORY_SIZE));
+	forEachRecent(count, [&history](const FrameStats& stats) { history.push_back(stats); });
+	return history;
+}
+
+FrameStats RenderStats::getAverage(size_t count)
+{
+	FrameStats average;
+	double gpuMs = 0.0;
+	size_t gpuFrames = 0;
+	size_t frames = forEachRecent(count, [&](const FrameStats& stats) {
+		average.frameNumber = stats.frameNumber;
+		average.cpuMs += stats.cpuMs;
+		average.drawCalls += stats.drawCalls;
+		average.dispatches += stats.dispatches;
+		average.triangles += stats.triangles;
+		average.pipelineBinds += stats.pipelineBinds;
+		average.descriptorSetBinds += stats.descriptorSetBinds;
+		average.vertexBufferBinds += stats.vertexBufferBinds;
+		average.indexBufferBinds += stats.indexBufferBinds;
+		average.pushConstantBytes += stats.pushConstantBytes;
+		average.bufferUploadBytes += stats.bufferUploadBytes;
+		average.textureUploadBytes += stats.textureUploadBytes;
+		average.memoryAllocations += stats.memoryAllocations;
+		average.heapAllocations += stats.heapAllocations;
+		average.fenceWaitMs += stats.fenceWaitMs;
+		average.acquireMs += stats.acquireMs;
+		average.occludedObjects += stats.occludedObjects;
+		average.lateObjects += stats.lateObjects;
+		if (stats.gpuMs >= 0.0) {
+			gpuMs += stats.gpuMs;
+			gpuFrames++;
+		}
+	});
+	if (frames == 0) {
+		return average;
+	}
+
+	uint32_t n = static_cast<uint32_t>(frames);
+	average.cpuMs /= n;
+	average.gpuMs = gpuFrames > 0 ? gpuMs / gpuFrames : -1.0;
+	average.drawCalls /= n;
+	average.dispatches /= n;
+	average.triangles /= n;
+	average.pipelineBinds /= n;
+	average.descriptorSetBinds /= n;
+	average.vertexBufferBinds /= n;
+	average.indexBufferBinds /= n;
+	average.pushConstantBytes /= n;
+	average.bufferUploadBytes /= n;
+	average.textureUploadBytes /= n;
+	average.memoryAllocations /= n;
+	average.heapAllocations /= n;
+	average.fenceWaitMs /= n;
+	average.acquireMs /= n;
+	average.occludedObjects /= n;
+	average.lateObjects /= n;
+	return average;
+}
+
+FrameStats RenderStats::getMaximum(size_t count)
+{
+	FrameStats maximum;
+	maximum.gpuMs = -1.0;
+	forEachRecent(count, [&maximum](const FrameStats& stats) {
+		maximum.frameNumber = stats.frameNumber;
+		maximum.cpuMs = std::max(maximum.cpuMs, stats.cpuMs);
+		maximum.gpuMs = std::max(maximum.gpuMs, stats.gpuMs);
+		maximum.drawCalls = std::max(maximum.drawCalls, stats.drawCalls);
+		maximum.dispatches = std::max(maximum.dispatches, stats.dispatches);
+		maximum.triangles = std::max(maximum.triangles, stats.triangles);
+		maximum.pipelineBinds = std::max(maximum.pipelineBinds, stats.pipelineBinds);
+		maximum.descriptorSetBinds = std::max(maximum.descriptorSetBinds, stats.descriptorSetBinds);
+		maximum.vertexBufferBinds = std::max(maximum.vertexBufferBinds, stats.vertexBufferBinds);
+		maximum.indexBufferBinds = std::max(maximum.indexBufferBinds, stats.indexBufferBinds);
+		maximum.pushConstantBytes = std::max(maximum.pushConstantBytes, stats.pushConstantBytes);
+		maximum.bufferUploadBytes = std::max(maximum.bufferUploadBytes, stats.bufferUploadBytes);
+		maximum.textureUploadBytes = std::max(maximum.textureUploadBytes, stats.textureUploadBytes);
+		maximum.memoryAllocations = std::max(maximum.memoryAllocations, stats.memoryAllocations);
+		maximum.heapAllocations = std::max(maximum.heapAllocations, stats.heapAllocations);
+		maximum.fenceWaitMs = std::max(maximum.fenceWaitMs, stats.fenceWaitMs);
+		maximum.acquireMs = std::max(maximum.acquireMs, stats.acquireMs);
+		maximum.occludedObjects = std::max(maximum.occludedObjects, stats.occludedObjects);
+		maximum.lateObjects = std::max(maximum.lateObjects, stats.lateObjects);
+	});
+	return maximum;
+}
+
+void RenderStats::writeText(std::ostream& out, const FrameStats& stats)
+{
+	out << "Frame " << stats.frameNumber << ": CPU " << stats.cpuMs << " ms, GPU ";
+	if (stats.gpuMs >= 0.0) {
+		out << stats.gpuMs << " ms";
+	}
+	else {
+		out << "n/a";
+	}
+	out << ", " << stats.drawCalls << " draws, " << stats.dispatches << " dispatches, "
+		<< stats.triangles << " triangles, " << stats.pipelineBinds << " pipeline binds, "
+		<< stats.descriptorSetBinds << " descriptor set binds, " << stats.vertexBufferBinds << " vertex / "
+		<< stats.indexBufferBinds << " index buffer binds, " << stats.pushConstantBytes << " push constant bytes, "
+		<< stats.bufferUploadBytes << " buffer / " << stats.textureUploadBytes << " texture bytes uploaded, "
+		<< stats.memoryAllocations << " allocations, " << stats.heapAllocations << " heap allocations, "
+		<< stats.fenceWaitMs << " ms fence wait, "
+		<< stats.acquireMs << " ms acquire, " << stats.occludedObjects << " occluded / "
+		<< stats.lateObjects << " late objects" << std::endl;
+}
+
+void RenderStats::writeJson(std::ostream& out, const FrameStats& stats)
+{
+	out << "{\"frame\":" << stats.frameNumber
+		<< ",\"cpuMs\":" << stats.cpuMs
+		<< ",\"gpuMs\":";
+	if (stats.gpuMs >= 0.0) {
+		out << stats.gpuMs;
+	}
+	else {
+		out << "null";
+	}
+	out << ",\"drawCalls\":" << stats.drawCalls
+		<< ",\"dispatches\":" << stats.dispatches
+		<< ",\"triangles\":" << stats.triangles
+		<< ",\"pipelineBinds\":" << stats.pipelineBinds
+		<< ",\"descriptorSetBinds\":" << stats.descriptorSetBinds
+		<< ",\"vertexBufferBinds\":" << stats.vertexBufferBinds
+		<< ",\"indexBufferBinds\":" << stats.indexBufferBinds
+		<< ",\"pushConstantBytes\":" << stats.pushConstantBytes
+		<< ",\"bufferUploadBytes\":" << stats.bufferUploadBytes
+		<< ",\"textureUploadBytes\":" << stats.textureUploadBytes
+		<< ",\"memoryAllocations\":" << stats.memoryAllocations
+		<< ",\"heapAllocations\":" << stats.heapAllocations
+		<< ",\"fenceWaitMs\":" << stats.fenceWaitMs
+		<< ",\"acquireMs\":" << stats.acquireMs
+		<< ",\"occludedObjects\":" << stats.occludedObjects
+		<< ",\"lateObjects\":" << stats.lateObjects
+		<< "}" << std::endl;
+}
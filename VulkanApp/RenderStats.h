@@ -0,0 +1,133 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <ostream>
+#include <vector>
+
+// Work done for one frame
+struct FrameStats {
+	uint64_t frameNumber = 0;
+	double cpuMs = 0.0; // draw() from start to end
+	double gpuMs = -1.0; // negative until the frame's timestamps have been read
+
+	uint32_t drawCalls = 0;
+	uint32_t dispatches = 0;
+	uint64_t triangles = 0; // the culled draws' are counted by the GPU, and read back with its time
+	uint32_t pipelineBinds = 0;
+	uint32_t descriptorSetBinds = 0;
+	uint32_t vertexBufferBinds = 0;
+	uint32_t indexBufferBinds = 0;
+	uint32_t pushConstantBytes = 0;
+
+	uint64_t bufferUploadBytes = 0;  // through copyBuffer
+	uint64_t textureUploadBytes = 0; // staged by the texture streamer
+	uint32_t memoryAllocations = 0;  // vkAllocateMemory calls
+	uint32_t heapAllocations = 0;    // operator new calls on any thread, see AllocationCounter
+
+	double fenceWaitMs = 0.0;
+	double acquireMs = 0.0;
+
+	// Occlusion culling, read back with the GPU time
+	uint32_t occludedObjects = 0; // in view but drawn by neither pass
+	uint32_t lateObjects = 0;     // drawn by the late pass only
+};
+
+// Counts the work of the frame being recorded, and keeps the last
+// HISTORY_SIZE frames in a ring. The counters can be bumped from any thread
+// (uploads and allocations happen on init workers, for instance); work that
+// isn't part of a frame is counted towards the next one.
+class RenderStats
+{
+public:
+	static constexpr size_t HISTORY_SIZE = 256;
+
+	static void countDraw(uint64_t triangles) { add(s_current.drawCalls, 1); add(s_current.triangles, triangles); }
+	static void countDispatch() { add(s_current.dispatches, 1); }
+	static void countPipelineBind() { add(s_current.pipelineBinds, 1); }
+	static void countDescriptorSetBinds(uint32_t count) { add(s_current.descriptorSetBinds, count); }
+	static void countVertexBufferBind() { add(s_current.vertexBufferBinds, 1); }
+	static void countIndexBufferBind() { add(s_current.indexBufferBinds, 1); }
+	static void countPushConstants(uint32_t bytes) { add(s_current.pushConstantBytes, bytes); }
+	static void countBufferUpload(uint64_t bytes) { add(s_current.bufferUploadBytes, bytes); }
+	static void countTextureUpload(uint64_t bytes) { add(s_current.textureUploadBytes, bytes); }
+	static void countAllocation() { add(s_current.memoryAllocations, 1); }
+	static void countHeapAllocations(uint64_t count) { add(s_current.heapAllocations, count); }
+	static void addFenceWait(double ms) { addMs(s_current.fenceWaitMicroseconds, ms); }
+	static void addAcquire(double ms) { addMs(s_current.acquireMicroseconds, ms); }
+
+	// Moves the counters into the history as the stats of this frame
+	static void endFrame(uint64_t frameNumber, double cpuMs);
+
+	// GPU times arrive some frames later. Ignored once the frame has left
+	// the history.
+	static void setGpuTime(uint64_t frameNumber, double gpuMs);
+	static void setOcclusion(uint64_t frameNumber, uint32_t occludedObjects, uint32_t lateObjects, uint64_t triangles);
+
+	// Oldest first, at most count frames
+	static std::vector<FrameStats> getHistory(size_t count = HISTORY_SIZE);
+
+	// Means of the last count frames (GPU time over the frames that have
+	// one), with the frame number of the latest. Neither allocates, so
+	// they can be called from the frame path.
+	static FrameStats getAverage(size_t count);
+	static FrameStats getMaximum(size_t count);
+
+	static void writeText(std::ostream& out, const FrameStats& stats);
+
+	// One line holding a JSON object, e.g. for JSON Lines files
+	static void writeJson(std::ostream& out, const FrameStats& stats);
+
+private:
+	struct Counters {
+		std::atomic<uint32_t> drawCalls{ 0 };
+		std::atomic<uint32_t> dispatches{ 0 };
+		std::atomic<uint64_t> triangles{ 0 };
+		std::atomic<uint32_t> pipelineBinds{ 0 };
+		std::atomic<uint32_t> descriptorSetBinds{ 0 };
+		std::atomic<uint32_t> vertexBufferBinds{ 0 };
+		std::atomic<uint32_t> indexBufferBinds{ 0 };
+		std::atomic<uint32_t> pushConstantBytes{ 0 };
+		std::atomic<uint64_t> bufferUploadBytes{ 0 };
+		std::atomic<uint64_t> textureUploadBytes{ 0 };
+		std::atomic<uint32_t> memoryAllocations{ 0 };
+		std::atomic<uint32_t> heapAllocations{ 0 };
+		std::atomic<uint64_t> fenceWaitMicroseconds{ 0 };
+		std::atomic<uint64_t> acquireMicroseconds{ 0 };
+	};
+
+	static Counters s_current;
+
+	static std::mutex s_historyMutex;
+	static FrameStats s_history[HISTORY_SIZE];
+	static uint64_t s_frames; // frames in the history so far, including overwritten ones
+
+	// The frame's entry in the history, or null. Needs s_historyMutex.
+	static FrameStats* findFrame(uint64_t frameNumber);
+
+	template <typename T>
+	static void add(std::atomic<T>& counter, uint64_t value)
+	{
+		counter.fetch_add(static_cast<T>(value), std::memory_order_relaxed);
+	}
+
+	static void addMs(std::atomic<uint64_t>& counter, double ms)
+	{
+		counter.fetch_add(static_cast<uint64_t>(ms * 1000.0), std::memory_order_relaxed);
+	}
+
+	// Calls visit with each of the last count frames, oldest first, and
+	// returns how many there were
+	template <typename Visit>
+	static size_t forEachRecent(size_t count, Visit visit)
+	{
+		std::lock_guard<std::mutex> lock(s_historyMutex);
+		count = std::min(count, static_cast<size_t>(std::min<uint64_t>(s_frames, HISTORY_SIZE)));
+		for (size_t i = count; i > 0; i--) {
+			visit(s_history[(s_frames - i) % HISTORY_SIZE]);
+		}
+		return count;
+	}
+};
@@ -0,0 +1,277 @@
+#include <algorithm>
+#include <stdexcept>
+#include <vector>
+
+#include "ResidencyManager.h"
+#include "Utils.h"
+
+namespace {
+
+// Share of a heap assumed to be available without VK_EXT_memory_budget
+const double FALLBACK_BUDGET_SHARE = 0.8;
+
+// Evict above the high watermark, only restore while below the low one,
+// so that resources don't bounce in and out every frame
+const double HIGH_WATERMARK = 0.9;
+const double LOW_WATERMARK = 0.75;
+
+// Replacement images are swapped in a frame or two after they are made,
+// and what they replace is freed once the frames in flight are done
+const uint64_t EVICTION_COOLDOWN_FRAMES = MAX_FRAME_DRAWS + 2;
+
+// Restoring meshes copies their buffers synchronously, so spread it out
+const VkDeviceSize RESTORE_BYTES_PER_FRAME = 32 * 1024 * 1024;
+
+}
+
+ResidencyManager::ResidencyManager(VkPhysicalDevice physicalDevice, bool hasMemoryBudget)
+	: m_physicalDevice(physicalDevice), m_hasMemoryBudget(hasMemoryBudget)
+{
+	VkPhysicalDeviceMemoryProperties memoryProperties;
+	vkGetPhysicalDeviceMemoryProperties(m_physicalDevice, &memoryProperties);
+
+	m_heaps.resize(memoryProperties.memoryHeapCount);
+	for (uint32_t i = 0; i < memoryProperties.memoryHeapCount; i++) {
+		m_heaps[i].size = memoryProperties.memoryHeaps[i].size;
+		m_heaps[i].deviceLocal = memoryProperties.memoryHeaps[i].flags & VK_MEMORY_HEAP_DEVICE_LOCAL_BIT;
+	}
+
+	readBudgets();
+}
+
+ResidencyManager::ResourceId ResidencyManager::add(const std::string& name, uint32_t heap, VkDeviceSize size,
+	Callback evict, Callback restore)
+{
+	if (heap >= m_heaps.size()) {
+		throw std::runtime_error("Invalid memory heap for " + name);
+	}
+
+	Resource resource;
+	resource.name = name;
+	resource.heap = heap;
+	resource.size = size;
+	resource.residentSize = size;
+	resource.evict = evict;
+	resource.restore = restore;
+
+	if (!m_hasMemoryBudget) {
+		m_heaps[heap].usage += size;
+	}
+
+	if (!m_freeIds.empty()) {
+		ResourceId id = m_freeIds.back();
+		m_freeIds.pop_back();
+		m_resources[id] = resource;
+		return id;
+	}
+	m_resources.push_back(resource);
+	return static_cast<ResourceId>(m_resources.size() - 1);
+}
+
+void ResidencyManager::remove(ResourceId resource)
+{
+	Resource& entry = m_resources[resource];
+	if (entry.removed) {
+		return;
+	}
+
+	// With a budget the memory leaves the heap usage on its own once freed
+	if (!m_hasMemoryBudget) {
+		Heap& heap = m_heaps[entry.heap];
+		heap.usage -= std::min(entry.size, heap.usage);
+	}
+
+	// A size of 0 and no evicted flag keep it out of evictions and restores
+	entry = Resource();
+	entry.removed = true;
+	m_freeIds.push_back(resource);
+}
+
+void ResidencyManager::markUsed(ResourceId resource, uint64_t frame)
+{
+	Resource& entry = m_resources[resource];
+	entry.lastUsed = frame;
+	if (entry.evicted) {
+		entry.wanted = true;
+	}
+}
+
+bool ResidencyManager::isEvicted(ResourceId resource) const
+{
+	return m_resources[resource].evicted;
+}
+
+void ResidencyManager::update(uint64_t frame)
+{
+	readBudgets();
+
+	for (uint32_t i = 0; i < m_heaps.size(); i++) {
+		Heap& heap = m_heaps[i];
+		auto freed = std::partition(heap.releases.begin(), heap.releases.end(),
+			[frame](const std::pair<uint64_t, VkDeviceSize>& entry) { return entry.first > frame; });
+		for (auto it = freed; it != heap.releases.end(); ++it) {
+			heap.usage -= std::min(it->second, heap.usage);
+		}
+		heap.releases.erase(freed, heap.releases.end());
+
+		VkDeviceSize limit = static_cast<VkDeviceSize>(heap.budget * HIGH_WATERMARK);
+		if (frame >= heap.cooldownUntil && heap.usage > limit) {
+			evictFrom(i, heap.usage - limit, frame);
+		}
+	}
+
+	restoreWanted(frame);
+}
+
+bool ResidencyManager::makeRoom(uint32_t heap, VkDeviceSize size, uint64_t frame)
+{
+	readBudgets();
+
+	Heap& entry = m_heaps[heap];
+	VkDeviceSize limit = static_cast<VkDeviceSize>(entry.budget * HIGH_WATERMARK);
+	if (entry.usage + size > limit) {
+		evictFrom(heap, entry.usage + size - limit, frame);
+	}
+
+	return entry.usage + size <= entry.budget;
+}
+
+uint32_t ResidencyManager::getHeapIndex(uint32_t memoryTypeBits, VkMemoryPropertyFlags properties) const
+{
+	VkPhysicalDeviceMemoryProperties memoryProperties;
+	vkGetPhysicalDeviceMemoryProperties(m_physicalDevice, &memoryProperties);
+
+	// The same type findMemoryTypeIndex picks when the memory is allocated
+	uint32_t memoryType = findMemoryTypeIndex(m_physicalDevice, memoryTypeBits, properties);
+	return memoryProperties.memoryTypes[memoryType].heapIndex;
+}
+
+void ResidencyManager::printStats(std::ostream& out) const
+{
+	size_t evicted = std::count_if(m_resources.begin(), m_resources.end(),
+		[](const Resource& resource) { return resource.evicted; });
+
+	out << "Residency: " << evicted << " of " << m_resources.size() - m_freeIds.size() << " resources evicted, "
+		<< m_evictions << " evictions, " << m_restores << " restores";
+	for (uint32_t i = 0; i < m_heaps.size(); i++) {
+		if (m_heaps[i].deviceLocal) {
+			out << ", heap " << i << " " << m_heaps[i].usage / (1024 * 1024) << " of "
+				<< m_heaps[i].budget / (1024 * 1024) << " MB";
+		}
+	}
+	out << (m_hasMemoryBudget ? "" : " (estimated)") << std::endl;
+}
+
+void ResidencyManager::release(uint32_t heap, VkDeviceSize bytes, uint64_t frame)
+{
+	// With a budget the driver reports the memory as used until it is freed
+	if (m_hasMemoryBudget) {
+		return;
+	}
+	m_heaps[heap].releases.push_back({ frame + EVICTION_COOLDOWN_FRAMES, bytes });
+}
+
+void ResidencyManager::readBudgets()
+{
+	if (m_hasMemoryBudget) {
+		VkPhysicalDeviceMemoryBudgetPropertiesEXT budgetProperties{};
+		budgetProperties.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_MEMORY_BUDGET_PROPERTIES_EXT;
+
+		VkPhysicalDeviceMemoryProperties2 memoryProperties{};
+		memoryProperties.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_MEMORY_PROPERTIES_2;
+		memoryProperties.pNext = &budgetProperties;
+		vkGetPhysicalDeviceMemoryProperties2(m_physicalDevice, &memoryProperties);
+
+		// Usage covers everything the process has allocated, not just the
+		// registered resources
+		for (uint32_t i = 0; i < m_heaps.size(); i++) {
+			m_heaps[i].budget = budgetProperties.heapBudget[i];
+			m_heaps[i].usage = budgetProperties.heapUsage[i];
+		}
+	}
+	else {
+		for (auto& heap : m_heaps) {
+			heap.budget = static_cast<VkDeviceSize>(heap.size * FALLBACK_BUDGET_SHARE);
+		}
+	}
+}
+
+VkDeviceSize ResidencyManager::evictFrom(uint32_t heap, VkDeviceSize bytes, uint64_t frame)
+{
+	std::vector<Resource*> candidates;
+	for (auto& resource : m_resources) {
+		if (resource.heap == heap && !resource.evicted && resource.size > 0) {
+			candidates.push_back(&resource);
+		}
+	}
+	std::sort(candidates.begin(), candidates.end(),
+		[](const Resource* a, const Resource* b) { return a->lastUsed < b->lastUsed; });
+
+	VkDeviceSize freed = 0;
+	for (Resource* resource : candidates) {
+		if (freed >= bytes) {
+			break;
+		}
+
+		// A resource that can't shrink right now keeps its size
+		VkDeviceSize size = resource->evict();
+		if (size >= resource->size) {
+			continue;
+		}
+
+		// The smaller copy is already allocated, while the memory it
+		// replaces is only freed a few frames later
+		m_heaps[heap].usage += size;
+		release(heap, resource->size, frame);
+
+		freed += resource->size - size;
+		resource->size = size;
+		resource->evicted = true;
+		resource->wanted = false;
+		m_evictions++;
+	}
+
+	if (freed > 0) {
+		m_heaps[heap].cooldownUntil = frame + EVICTION_COOLDOWN_FRAMES;
+	}
+
+	return freed;
+}
+
+void ResidencyManager::restoreWanted(uint64_t frame)
+{
+	std::vector<Resource*> candidates;
+	for (auto& resource : m_resources) {
+		if (resource.evicted && resource.wanted) {
+			candidates.push_back(&resource);
+		}
+	}
+	std::sort(candidates.begin(), candidates.end(),
+		[](const Resource* a, const Resource* b) { return a->lastUsed > b->lastUsed; });
+
+	VkDeviceSize restored = 0;
+	for (Resource* resource : candidates) {
+		Heap& heap = m_heaps[resource->heap];
+		VkDeviceSize growth = resource->residentSize - resource->size;
+		VkDeviceSize limit = static_cast<VkDeviceSize>(heap.budget * LOW_WATERMARK);
+
+		// The full copy is allocated next to the evicted one
+		if (frame < heap.cooldownUntil || heap.usage + resource->residentSize > limit
+			|| restored + growth > RESTORE_BYTES_PER_FRAME) {
+			continue;
+		}
+
+		VkDeviceSize size = resource->restore();
+		if (size <= resource->size) {
+			continue;
+		}
+
+		heap.usage += size;
+		release(resource->heap, resource->size, frame);
+		restored += size - resource->size;
+		resource->size = size;
+		resource->evicted = false;
+		resource->wanted = false;
+		m_restores++;
+	}
+}
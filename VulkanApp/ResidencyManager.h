@@ -0,0 +1,102 @@
+#pragma once
+
+#define GLFW_INCLUDE_VULKAN
+#include <GLFW/glfw3.h>
+
+#include <functional>
+#include <ostream>
+#include <string>
+#include <utility>
+#include <vector>
+
+// Keeps device memory use within budget. Resources (meshes, textures) are
+// registered with callbacks that shrink or restore their device local
+// footprint. When a heap goes over budget the least recently used resources
+// are evicted until it fits again; an evicted resource that is used again
+// is restored once there is room, so a scene that doesn't fit degrades to
+// slower or blurrier resources instead of failing allocations.
+//
+// Budgets come from VK_EXT_memory_budget when the device has it. Without
+// it a fixed share of each heap is assumed to be ours, and only the sizes
+// of the registered resources are counted against it.
+class ResidencyManager
+{
+public:
+	using ResourceId = uint32_t;
+
+	// Both return the device local bytes the resource uses afterwards. That
+	// memory may be allocated before the memory it replaces is freed, which
+	// only happens once the frames in flight are done with it, so until
+	// then both count against the heap.
+	using Callback = std::function<VkDeviceSize()>;
+
+	ResidencyManager() {}
+	ResidencyManager(VkPhysicalDevice physicalDevice, bool hasMemoryBudget);
+
+	ResourceId add(const std::string& name, uint32_t heap, VkDeviceSize size, Callback evict, Callback restore);
+
+	// Forgets a resource that is being destroyed. Its id is reused by a later add().
+	void remove(ResourceId resource);
+
+	// The resource is needed by the frame being recorded
+	void markUsed(ResourceId resource, uint64_t frame);
+	bool isEvicted(ResourceId resource) const;
+
+	// Reads the budgets and evicts or restores resources. Called once a
+	// frame, before anything for it is recorded.
+	void update(uint64_t frame);
+
+	// Evicts until size more bytes fit into the heap's budget. Returns
+	// whether they do.
+	bool makeRoom(uint32_t heap, VkDeviceSize size, uint64_t frame);
+
+	// Heap that memory with these type bits and properties comes from
+	uint32_t getHeapIndex(uint32_t memoryTypeBits, VkMemoryPropertyFlags properties) const;
+
+	bool hasMemoryBudget() const { return m_hasMemoryBudget; }
+	void printStats(std::ostream& out) const;
+
+private:
+	struct Heap {
+		VkDeviceSize size = 0;
+		VkDeviceSize budget = 0;
+		VkDeviceSize usage = 0;
+		bool deviceLocal = false;
+
+		// Freed memory only shows up in the budget once the frames that used
+		// it have retired, so evictions pause for a few frames after each round
+		uint64_t cooldownUntil = 0;
+
+		// Without VK_EXT_memory_budget, the bytes replaced by evictions and
+		// restores, by the frame they are freed by
+		std::vector<std::pair<uint64_t, VkDeviceSize>> releases;
+	};
+
+	struct Resource {
+		std::string name;
+		uint32_t heap = 0;
+		VkDeviceSize size = 0;
+		VkDeviceSize residentSize = 0;
+		bool evicted = false;
+		bool wanted = false; // evicted but used since
+		uint64_t lastUsed = 0;
+		bool removed = false;
+		Callback evict;
+		Callback restore;
+	};
+
+	VkPhysicalDevice m_physicalDevice = VK_NULL_HANDLE;
+	bool m_hasMemoryBudget = false;
+
+	std::vector<Heap> m_heaps;
+	std::vector<Resource> m_resources;
+	std::vector<ResourceId> m_freeIds;
+
+	uint64_t m_evictions = 0;
+	uint64_t m_restores = 0;
+
+	void readBudgets();
+	void release(uint32_t heap, VkDeviceSize bytes, uint64_t frame);
+	VkDeviceSize evictFrom(uint32_t heap, VkDeviceSize bytes, uint64_t frame);
+	void restoreWanted(uint64_t frame);
+};
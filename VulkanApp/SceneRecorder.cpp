@@ -0,0 +1,150 @@
+#include <iostream>
+#include <stdexcept>
+
+#include "SceneRecorder.h"
+
+void SceneRecorder::open(const std::string& path, const SceneLogHeader& header)
+{
+	m_out.open(path, std::ios::binary | std::ios::trunc);
+	if (!m_out) {
+		throw std::runtime_error("Failed to create scene log " + path);
+	}
+	m_path = path;
+	m_records = 0;
+
+	m_out.write(SCENE_LOG_MAGIC, sizeof(SCENE_LOG_MAGIC));
+	write(SCENE_LOG_VERSION);
+	write(header.extent.width);
+	write(header.extent.height);
+	write(static_cast<uint8_t>(header.demoScene ? 1 : 0));
+}
+
+void SceneRecorder::close()
+{
+	if (!isOpen()) {
+		return;
+	}
+
+	m_out.close();
+	if (!m_out) {
+		std::cout << "Failed to write scene log " << m_path << std::endl;
+	}
+	else {
+		std::cout << "Recorded " << m_records << " scene calls to " << m_path << std::endl;
+	}
+}
+
+void SceneRecorder::addMesh(uint64_t frame, const std::vector<Vertex>& vertices, const std::vector<uint32_t>& indices)
+{
+	if (!isOpen()) {
+		return;
+	}
+	begin(SceneRecord::AddMesh, frame);
+	write(static_cast<uint32_t>(vertices.size()));
+	m_out.write(reinterpret_cast<const char*>(vertices.data()), sizeof(Vertex) * vertices.size());
+	write(static_cast<uint32_t>(indices.size()));
+	m_out.write(reinterpret_cast<const char*>(indices.data()), sizeof(uint32_t) * indices.size());
+}
+
+void SceneRecorder::removeMesh(uint64_t frame, MeshHandle mesh)
+{
+	if (!isOpen()) {
+		return;
+	}
+	begin(SceneRecord::RemoveMesh, frame);
+	write(mesh);
+}
+
+void SceneRecorder::updateModel(uint64_t frame, MeshHandle mesh, const glm::mat4& model)
+{
+	if (!isOpen()) {
+		return;
+	}
+	begin(SceneRecord::UpdateModel, frame);
+	write(mesh);
+	write(model);
+}
+
+void SceneRecorder::setAnimation(uint64_t frame, MeshHandle mesh, const ObjectAnimation& animation)
+{
+	if (!isOpen()) {
+		return;
+	}
+	begin(SceneRecord::SetAnimation, frame);
+	write(mesh);
+	write(animation);
+}
+
+void SceneRecorder::loadTexture(uint64_t frame, const std::string& path)
+{
+	if (!isOpen()) {
+		return;
+	}
+	begin(SceneRecord::LoadTexture, frame);
+	write(static_cast<uint32_t>(path.size()));
+	m_out.write(path.data(), path.size());
+}
+
+void SceneRecorder::setTexture(uint64_t frame, MeshHandle mesh, uint32_t texture)
+{
+	if (!isOpen()) {
+		return;
+	}
+	begin(SceneRecord::SetTexture, frame);
+	write(mesh);
+	write(texture);
+}
+
+void SceneRecorder::setTransparent(uint64_t frame, MeshHandle mesh, bool transparent)
+{
+	if (!isOpen()) {
+		return;
+	}
+	begin(SceneRecord::SetTransparent, frame);
+	write(mesh);
+	write(static_cast<uint8_t>(transparent ? 1 : 0));
+}
+
+void SceneRecorder::setView(uint64_t frame, const glm::mat4& view)
+{
+	if (!isOpen()) {
+		return;
+	}
+	begin(SceneRecord::SetView, frame);
+	write(view);
+}
+
+void SceneRecorder::setLights(uint64_t frame, const std::vector<PointLight>& lights)
+{
+	if (!isOpen()) {
+		return;
+	}
+	begin(SceneRecord::SetLights, frame);
+	write(static_cast<uint32_t>(lights.size()));
+	m_out.write(reinterpret_cast<const char*>(lights.data()), sizeof(PointLight) * lights.size());
+}
+
+void SceneRecorder::setPresentMode(uint64_t frame, VkPresentModeKHR presentMode)
+{
+	if (!isOpen()) {
+		return;
+	}
+	begin(SceneRecord::SetPresentMode, frame);
+	write(static_cast<uint32_t>(presentMode));
+}
+
+void SceneRecorder::draw(uint64_t frame, double animationTime)
+{
+	if (!isOpen()) {
+		return;
+	}
+	begin(SceneRecord::Draw, frame);
+	write(animationTime);
+}
+
+void SceneRecorder::begin(SceneRecord type, uint64_t frame)
+{
+	write(static_cast<uint8_t>(type));
+	write(static_cast<uint32_t>(frame));
+	m_records++;
+}
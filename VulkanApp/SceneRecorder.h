@@ -0,0 +1,83 @@
+#pragma once
+
+#define GLFW_INCLUDE_VULKAN
+#include <GLFW/glfw3.h>
+
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include "Utils.h"
+#include "Mesh.h"
+
+// Scene logs hold every call made to the renderer's scene API, tagged with
+// the number of frames submitted before it, so that a workload can be
+// played back (see SceneReplay) exactly as it was recorded.
+//
+// A log is a header followed by records, in the byte order of the machine
+// that wrote it:
+//   header: "VKSL", version, swapchain width and height, demo scene flag
+//   record: type (uint8), frame (uint32), then the type's arguments
+// Vertices, mesh handles, model matrices, animations and lights are stored
+// as their raw structs. Handles are stored as the renderer returned them, a replay
+// that makes the same calls gets the same ones.
+enum class SceneRecord : uint8_t {
+	AddMesh,        // vertex count, vertices, index count, indices
+	UpdateModel,    // mesh, matrix
+	SetAnimation,   // mesh, ObjectAnimation
+	LoadTexture,    // path length, path
+	SetTexture,     // mesh, texture
+	SetView,        // matrix
+	SetPresentMode, // VkPresentModeKHR
+	Draw,           // animation time in seconds
+	RemoveMesh,     // mesh
+	SetTransparent, // mesh, transparent (uint8)
+	SetLights       // light count, lights
+};
+
+const char SCENE_LOG_MAGIC[4] = { 'V', 'K', 'S', 'L' };
+const uint32_t SCENE_LOG_VERSION = 4;
+
+struct SceneLogHeader {
+	VkExtent2D extent = {};
+	bool demoScene = true;
+};
+
+class SceneRecorder
+{
+public:
+	// Starts a new log, replacing the file. Throws if it can't be created.
+	void open(const std::string& path, const SceneLogHeader& header);
+
+	// Flushes the log and reports how much was recorded
+	void close();
+
+	bool isOpen() const { return m_out.is_open(); }
+
+	// Each call is ignored unless a log is open
+	void addMesh(uint64_t frame, const std::vector<Vertex>& vertices, const std::vector<uint32_t>& indices);
+	void removeMesh(uint64_t frame, MeshHandle mesh);
+	void updateModel(uint64_t frame, MeshHandle mesh, const glm::mat4& model);
+	void setAnimation(uint64_t frame, MeshHandle mesh, const ObjectAnimation& animation);
+	void loadTexture(uint64_t frame, const std::string& path);
+	void setTexture(uint64_t frame, MeshHandle mesh, uint32_t texture);
+	void setTransparent(uint64_t frame, MeshHandle mesh, bool transparent);
+	void setView(uint64_t frame, const glm::mat4& view);
+	void setLights(uint64_t frame, const std::vector<PointLight>& lights);
+	void setPresentMode(uint64_t frame, VkPresentModeKHR presentMode);
+	void draw(uint64_t frame, double animationTime);
+
+private:
+	std::ofstream m_out;
+	std::string m_path;
+	uint64_t m_records = 0;
+
+	void begin(SceneRecord type, uint64_t frame);
+
+	template <typename T>
+	void write(const T& value)
+	{
+		m_out.write(reinterpret_cast<const char*>(&value), sizeof(T));
+	}
+};
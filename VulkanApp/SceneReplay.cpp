@@ -0,0 +1,109 @@
+#include <cstring>
+#include <stdexcept>
+#include <vector>
+
+#include "SceneReplay.h"
+
+SceneReplay::SceneReplay(const std::string& path) : m_file(path), m_path(path)
+{
+	char magic[sizeof(SCENE_LOG_MAGIC)];
+	read(magic, sizeof(magic));
+	if (memcmp(magic, SCENE_LOG_MAGIC, sizeof(magic)) != 0) {
+		throw std::runtime_error(path + " is not a scene log");
+	}
+	uint32_t version = read<uint32_t>();
+	if (version != SCENE_LOG_VERSION) {
+		throw std::runtime_error(path + " has unsupported scene log version " + std::to_string(version));
+	}
+
+	m_header.extent.width = read<uint32_t>();
+	m_header.extent.height = read<uint32_t>();
+	m_header.demoScene = read<uint8_t>() != 0;
+}
+
+uint64_t SceneReplay::run(VulkanRenderer& renderer, GLFWwindow* window)
+{
+	uint64_t frames = 0;
+	std::vector<Vertex> vertices;
+	std::vector<uint32_t> indices;
+	std::vector<PointLight> lights;
+
+	while (m_offset < m_file.size() && !glfwWindowShouldClose(window)) {
+		SceneRecord type = static_cast<SceneRecord>(read<uint8_t>());
+		uint64_t frame = read<uint32_t>();
+
+		switch (type) {
+		case SceneRecord::AddMesh: {
+			vertices.resize(read<uint32_t>());
+			read(vertices.data(), sizeof(Vertex) * vertices.size());
+			indices.resize(read<uint32_t>());
+			read(indices.data(), sizeof(uint32_t) * indices.size());
+			renderer.addMesh(&vertices, &indices);
+			break;
+		}
+		case SceneRecord::RemoveMesh:
+			renderer.removeMesh(read<MeshHandle>());
+			break;
+		case SceneRecord::UpdateModel: {
+			MeshHandle mesh = read<MeshHandle>();
+			renderer.updateModel(mesh, read<glm::mat4>());
+			break;
+		}
+		case SceneRecord::SetAnimation: {
+			MeshHandle mesh = read<MeshHandle>();
+			renderer.setAnimation(mesh, read<ObjectAnimation>());
+			break;
+		}
+		case SceneRecord::LoadTexture: {
+			std::string path(read<uint32_t>(), '\0');
+			read(&path[0], path.size());
+			renderer.loadTexture(path);
+			break;
+		}
+		case SceneRecord::SetTexture: {
+			MeshHandle mesh = read<MeshHandle>();
+			renderer.setTexture(mesh, read<uint32_t>());
+			break;
+		}
+		case SceneRecord::SetTransparent: {
+			MeshHandle mesh = read<MeshHandle>();
+			renderer.setTransparent(mesh, read<uint8_t>() != 0);
+			break;
+		}
+		case SceneRecord::SetView:
+			renderer.setView(read<glm::mat4>());
+			break;
+		case SceneRecord::SetLights:
+			lights.resize(read<uint32_t>());
+			read(lights.data(), sizeof(PointLight) * lights.size());
+			renderer.setLights(lights);
+			break;
+		case SceneRecord::SetPresentMode:
+			// Ignored, a replay always runs as fast as it can
+			read<uint32_t>();
+			break;
+		case SceneRecord::Draw:
+			if (renderer.getFrameNumber() != frame) {
+				m_framesOutOfStep++;
+			}
+			glfwPollEvents();
+			renderer.setAnimationTime(read<double>());
+			renderer.draw();
+			frames++;
+			break;
+		default:
+			throw std::runtime_error(m_path + " has an unknown record type at offset " + std::to_string(m_offset - 5));
+		}
+	}
+
+	return frames;
+}
+
+void SceneReplay::read(void* data, size_t size)
+{
+	if (size > m_file.size() - m_offset) {
+		throw std::runtime_error(m_path + " is truncated");
+	}
+	memcpy(data, m_file.data() + m_offset, size);
+	m_offset += size;
+}
@@ -0,0 +1,48 @@
+#pragma once
+
+#include <string>
+
+#include "MappedFile.h"
+#include "SceneRecorder.h"
+#include "VulkanRenderer.h"
+
+// Plays a scene log (see SceneRecorder) back into a renderer. Every recorded
+// call is made again in order, and a frame is drawn for every recorded one
+// with its recorded animation time, so that the renderer does the same work
+// per frame as when it was recorded.
+class SceneReplay
+{
+public:
+	// Throws if the file can't be read or isn't a scene log
+	explicit SceneReplay(const std::string& path);
+
+	// The renderer should be set up to match: the demo scene setting and a
+	// window with the recorded swapchain size
+	const SceneLogHeader& getHeader() const { return m_header; }
+
+	// Plays the whole log as fast as the renderer can draw, or until the
+	// window is closed, and returns the number of frames drawn. Throws on a
+	// truncated or corrupt log.
+	uint64_t run(VulkanRenderer& renderer, GLFWwindow* window);
+
+	// Frames whose recorded frame number didn't match the renderer's, e.g.
+	// because the swapchain had to skip a frame in one run but not the other
+	uint64_t getFramesOutOfStep() const { return m_framesOutOfStep; }
+
+private:
+	MappedFile m_file;
+	std::string m_path;
+	size_t m_offset = 0;
+	SceneLogHeader m_header;
+	uint64_t m_framesOutOfStep = 0;
+
+	void read(void* data, size_t size);
+
+	template <typename T>
+	T read()
+	{
+		T value;
+		read(&value, sizeof(T));
+		return value;
+	}
+};
@@ -0,0 +1,109 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+// Refers to an element of a SlotMap. A handle stays valid until its element
+// is removed, and is recognised as stale afterwards, even once the slot has
+// been reused for another element.
+struct SlotHandle {
+	uint32_t index = 0xFFFFFFFF;
+	uint32_t generation = 0; // never 0 in a live handle
+
+	bool operator==(const SlotHandle& other) const { return index == other.index && generation == other.generation; }
+	bool operator!=(const SlotHandle& other) const { return !(*this == other); }
+};
+
+// Elements addressed by generational handles, stored densely so that they
+// can be iterated like a vector. Inserting and removing are O(1): a removed
+// element is replaced by the last one, so dense indices (unlike handles)
+// change on removal.
+template <typename T>
+class SlotMap
+{
+public:
+	using Handle = SlotHandle;
+
+	Handle insert(T value)
+	{
+		uint32_t index;
+		if (m_freeSlots.empty()) {
+			index = static_cast<uint32_t>(m_slots.size());
+			m_slots.push_back({ 0, 1 });
+		}
+		else {
+			index = m_freeSlots.back();
+			m_freeSlots.pop_back();
+		}
+
+		m_slots[index].denseIndex = static_cast<uint32_t>(m_values.size());
+		m_values.push_back(std::move(value));
+		m_slotOf.push_back(index);
+		return { index, m_slots[index].generation };
+	}
+
+	// Returns false if the handle was stale
+	bool remove(Handle handle)
+	{
+		if (!contains(handle)) {
+			return false;
+		}
+
+		uint32_t dense = m_slots[handle.index].denseIndex;
+		uint32_t last = static_cast<uint32_t>(m_values.size() - 1);
+		if (dense != last) {
+			m_values[dense] = std::move(m_values[last]);
+			m_slotOf[dense] = m_slotOf[last];
+			m_slots[m_slotOf[dense]].denseIndex = dense;
+		}
+		m_values.pop_back();
+		m_slotOf.pop_back();
+
+		// Skipping 0 keeps default constructed handles invalid after a wrap
+		Slot& slot = m_slots[handle.index];
+		slot.generation = slot.generation + 1 == 0 ? 1 : slot.generation + 1;
+		m_freeSlots.push_back(handle.index);
+		return true;
+	}
+
+	bool contains(Handle handle) const
+	{
+		// Removal bumps the generation, so only live elements match
+		return handle.index < m_slots.size() && handle.generation != 0
+			&& m_slots[handle.index].generation == handle.generation;
+	}
+
+	// Null for a stale handle
+	T* get(Handle handle) { return contains(handle) ? &m_values[m_slots[handle.index].denseIndex] : nullptr; }
+	const T* get(Handle handle) const { return contains(handle) ? &m_values[m_slots[handle.index].denseIndex] : nullptr; }
+
+	// Dense access, valid until the next removal
+	size_t size() const { return m_values.size(); }
+	bool empty() const { return m_values.empty(); }
+	T& operator[](size_t denseIndex) { return m_values[denseIndex]; }
+	const T& operator[](size_t denseIndex) const { return m_values[denseIndex]; }
+	uint32_t getDenseIndex(Handle handle) const { return m_slots[handle.index].denseIndex; }
+	Handle getHandle(size_t denseIndex) const
+	{
+		uint32_t index = m_slotOf[denseIndex];
+		return { index, m_slots[index].generation };
+	}
+
+	typename std::vector<T>::iterator begin() { return m_values.begin(); }
+	typename std::vector<T>::iterator end() { return m_values.end(); }
+	typename std::vector<T>::const_iterator begin() const { return m_values.begin(); }
+	typename std::vector<T>::const_iterator end() const { return m_values.end(); }
+
+private:
+	struct Slot {
+		uint32_t denseIndex;
+		uint32_t generation;
+	};
+
+	std::vector<T> m_values;
+	std::vector<uint32_t> m_slotOf; // slot of every dense element
+	std::vector<Slot> m_slots;
+	std::vector<uint32_t> m_freeSlots;
+};
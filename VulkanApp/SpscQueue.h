@@ -0,0 +1,60 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <vector>
+
+// Fixed size ring buffer for passing values from exactly one producer
+// thread to exactly one consumer thread without locks. Each side only
+// writes its own index, and publishes it with release semantics once the
+// slot it refers to has been written or read.
+template <typename T>
+class SpscQueue
+{
+public:
+	// The capacity is rounded up to a power of two
+	explicit SpscQueue(size_t capacity)
+	{
+		size_t size = 1;
+		while (size < capacity) {
+			size *= 2;
+		}
+		m_items.resize(size);
+		m_mask = size - 1;
+	}
+
+	SpscQueue(const SpscQueue&) = delete;
+	SpscQueue& operator=(const SpscQueue&) = delete;
+
+	// Producer only. Fails when the queue is full.
+	bool push(const T& value)
+	{
+		size_t tail = m_tail.load(std::memory_order_relaxed);
+		if (tail - m_head.load(std::memory_order_acquire) == m_items.size()) {
+			return false;
+		}
+		m_items[tail & m_mask] = value;
+		m_tail.store(tail + 1, std::memory_order_release);
+		return true;
+	}
+
+	// Consumer only. Fails when the queue is empty.
+	bool pop(T& value)
+	{
+		size_t head = m_head.load(std::memory_order_relaxed);
+		if (head == m_tail.load(std::memory_order_acquire)) {
+			return false;
+		}
+		value = m_items[head & m_mask];
+		m_head.store(head + 1, std::memory_order_release);
+		return true;
+	}
+
+private:
+	std::vector<T> m_items;
+	size_t m_mask = 0;
+
+	// On separate cache lines, so the two threads don't keep stealing each other's
+	alignas(64) std::atomic<size_t> m_head{ 0 }; // next slot to pop
+	alignas(64) std::atomic<size_t> m_tail{ 0 }; // next slot to push
+};
@@ -0,0 +1,280 @@
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <iostream>
+#include <stdexcept>
+
+#include <glm/gtc/matrix_transform.hpp>
+
+#include "StressScene.h"
+#include "JobSystem.h"
+#include "VulkanRenderer.h"
+
+namespace {
+
+// Must match the camera and projection set up by VulkanRenderer
+const float CAMERA_Z = 2.0f;
+const float FIELD_OF_VIEW = glm::radians(45.0f);
+
+// Distance of the nearest layer from the camera, and between layers
+const float NEAREST_LAYER = 4.0f;
+const float LAYER_SPACING = 0.5f;
+
+// splitmix64. The standard library's distributions differ between
+// implementations, which would make scenes differ between platforms.
+class Random
+{
+public:
+	explicit Random(uint64_t seed) : m_state(seed) {}
+
+	uint64_t next()
+	{
+		uint64_t z = (m_state += 0x9E3779B97F4A7C15ull);
+		z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+		z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+		return z ^ (z >> 31);
+	}
+
+	// Uniform in [min, max)
+	float range(float min, float max)
+	{
+		float unit = static_cast<float>(next() >> 40) / static_cast<float>(1ull << 24);
+		return min + (max - min) * unit;
+	}
+
+private:
+	uint64_t m_state;
+};
+
+// A wavy patch of exactly triangleCount triangles, fitting into a unit square
+StressScene::Geometry generateGeometry(Random& random, uint32_t triangleCount)
+{
+	uint32_t cells = (triangleCount + 1) / 2;
+	uint32_t columns = static_cast<uint32_t>(std::ceil(std::sqrt(static_cast<double>(cells))));
+	uint32_t rows = (cells + columns - 1) / columns;
+
+	float aspect = random.range(0.5f, 1.5f);
+	float width = aspect > 1.0f ? 1.0f : aspect;
+	float height = aspect > 1.0f ? 1.0f / aspect : 1.0f;
+
+	float frequency = random.range(1.0f, 4.0f);
+	float phase = random.range(0.0f, 6.2831853f);
+	float amplitude = random.range(0.0f, 0.1f);
+	glm::vec3 baseColour(random.range(0.2f, 1.0f), random.range(0.2f, 1.0f), random.range(0.2f, 1.0f));
+	glm::vec3 edgeColour(random.range(0.0f, 0.6f), random.range(0.0f, 0.6f), random.range(0.0f, 0.6f));
+
+	StressScene::Geometry geometry;
+	geometry.vertices.reserve((columns + 1) * (rows + 1));
+	for (uint32_t y = 0; y <= rows; y++) {
+		for (uint32_t x = 0; x <= columns; x++) {
+			float u = static_cast<float>(x) / columns;
+			float v = static_cast<float>(y) / rows;
+			float z = amplitude * std::sin(frequency * (u + v) * 6.2831853f + phase);
+			float edge = std::max(std::abs(u - 0.5f), std::abs(v - 0.5f)) * 2.0f;
+
+			Vertex vertex;
+			vertex.pos = glm::vec3((u - 0.5f) * width, (0.5f - v) * height, z);
+			vertex.col = glm::mix(baseColour, edgeColour, edge);
+			vertex.tex = glm::vec2(u, v);
+			geometry.vertices.push_back(vertex);
+		}
+	}
+
+	// Row by row, so an odd count leaves the last cell half filled
+	geometry.indices.reserve(triangleCount * 3);
+	for (uint32_t i = 0; i < triangleCount; i++) {
+		uint32_t cell = i / 2;
+		uint32_t x = cell % columns;
+		uint32_t y = cell / columns;
+		uint32_t topLeft = y * (columns + 1) + x;
+		uint32_t bottomLeft = topLeft + columns + 1;
+
+		if (i % 2 == 0) {
+			geometry.indices.insert(geometry.indices.end(), { topLeft, bottomLeft, bottomLeft + 1 });
+		}
+		else {
+			geometry.indices.insert(geometry.indices.end(), { bottomLeft + 1, topLeft + 1, topLeft });
+		}
+	}
+
+	return geometry;
+}
+
+}
+
+StressScene StressScene::generate(const StressSceneSettings& settings, float aspect, JobSystem* jobs)
+{
+	if (settings.meshCount == 0 || settings.geometryCount == 0 || settings.trianglesPerMesh == 0
+		|| settings.depthLayers == 0) {
+		throw std::runtime_error("Stress scene counts must be at least 1");
+	}
+
+	StressScene scene;
+	scene.m_settings = settings;
+
+	Random random(settings.seed);
+
+	// Every geometry gets a generator of its own, so they can be made in any order
+	uint32_t geometryCount = std::min(settings.geometryCount, settings.meshCount);
+	std::vector<uint64_t> geometrySeeds(geometryCount);
+	for (auto& seed : geometrySeeds) {
+		seed = random.next();
+	}
+
+	scene.m_geometries.resize(geometryCount);
+	auto generateRange = [&](size_t begin, size_t end) {
+		for (size_t i = begin; i < end; i++) {
+			Random geometryRandom(geometrySeeds[i]);
+			scene.m_geometries[i] = generateGeometry(geometryRandom, settings.trianglesPerMesh);
+		}
+	};
+	if (jobs != nullptr) {
+		jobs->parallelFor(geometryCount, 1, generateRange);
+	}
+	else {
+		generateRange(0, geometryCount);
+	}
+
+	// Every layer is a grid that fills the view at its distance. The layers
+	// are added back to front, the worst order for the depth test, which
+	// the renderer's render queue sorts out.
+	uint32_t perLayer = (settings.meshCount + settings.depthLayers - 1) / settings.depthLayers;
+	uint32_t columns = std::max(1u, static_cast<uint32_t>(std::ceil(std::sqrt(perLayer * aspect))));
+	uint32_t rows = (perLayer + columns - 1) / columns;
+	float scale = 1.0f + std::max(settings.overlap, 0.0f);
+
+	for (uint32_t i = 0; i < settings.meshCount; i++) {
+		uint32_t layer = settings.depthLayers - 1 - i / perLayer;
+		uint32_t cell = i % perLayer;
+
+		float distance = NEAREST_LAYER + layer * LAYER_SPACING;
+		float halfHeight = distance * std::tan(FIELD_OF_VIEW / 2.0f);
+		float halfWidth = halfHeight * aspect;
+		float cellWidth = 2.0f * halfWidth / columns;
+		float cellHeight = 2.0f * halfHeight / rows;
+		float size = std::min(cellWidth, cellHeight) * scale;
+
+		glm::vec3 position(
+			-halfWidth + (cell % columns + 0.5f + random.range(-0.1f, 0.1f)) * cellWidth,
+			halfHeight - (cell / columns + 0.5f + random.range(-0.1f, 0.1f)) * cellHeight,
+			CAMERA_Z - distance);
+
+		Object object;
+		object.geometry = i % geometryCount;
+		object.model = glm::translate(glm::mat4(1.0f), position);
+		object.model = glm::rotate(object.model, random.range(0.0f, 6.2831853f), glm::vec3(0.0f, 0.0f, 1.0f));
+		object.model = glm::scale(object.model, glm::vec3(size));
+
+		// Picked without the random generator, so that the rest of the
+		// scene doesn't depend on it
+		float transparent = std::min(std::max(settings.transparent, 0.0f), 1.0f);
+		object.transparent = std::floor((i + 1) * transparent) > std::floor(i * transparent);
+
+		object.animation = {};
+		if (settings.animated) {
+			float speed = random.range(0.2f, 1.5f) * (random.next() & 1 ? 1.0f : -1.0f);
+			float angle = random.range(0.0f, 6.2831853f);
+			object.animation.spin = glm::vec4(0.0f, 0.0f, 1.0f, speed);
+			object.animation.oscillation = glm::vec4(glm::vec3(std::cos(angle), std::sin(angle), 0.0f) * size * 0.25f,
+				random.range(0.1f, 0.5f));
+		}
+
+		scene.m_objects.push_back(object);
+	}
+
+	return scene;
+}
+
+uint64_t StressScene::getTriangleCount() const
+{
+	return static_cast<uint64_t>(m_objects.size()) * m_settings.trianglesPerMesh;
+}
+
+uint32_t StressScene::getTransparentCount() const
+{
+	uint32_t count = 0;
+	for (const auto& object : m_objects) {
+		if (object.transparent) {
+			count++;
+		}
+	}
+	return count;
+}
+
+std::vector<MeshHandle> StressScene::addTo(VulkanRenderer& renderer) const
+{
+	auto start = std::chrono::steady_clock::now();
+
+	// Mesh takes its data by (non-const) pointer
+	std::vector<Geometry> geometries = m_geometries;
+	std::vector<MeshHandle> meshes;
+	meshes.reserve(m_objects.size());
+	for (const auto& object : m_objects) {
+		meshes.push_back(addObject(renderer, object, geometries[object.geometry]));
+	}
+
+	double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+	std::cout << "Stress scene uploaded in " << ms << " ms" << std::endl;
+	return meshes;
+}
+
+void StressScene::churn(VulkanRenderer& renderer, std::vector<MeshHandle>& meshes, uint64_t frame) const
+{
+	if (meshes.empty()) {
+		return;
+	}
+
+	uint32_t count = std::min<uint32_t>(m_settings.churn, static_cast<uint32_t>(meshes.size()));
+	size_t first = static_cast<size_t>((frame * count) % meshes.size());
+	for (uint32_t i = 0; i < count; i++) {
+		size_t index = (first + i) % meshes.size();
+		const Object& object = m_objects[index];
+		Geometry geometry = m_geometries[object.geometry];
+
+		renderer.removeMesh(meshes[index]);
+		meshes[index] = addObject(renderer, object, geometry);
+	}
+}
+
+MeshHandle StressScene::addObject(VulkanRenderer& renderer, const Object& object, Geometry& geometry) const
+{
+	MeshHandle mesh = renderer.addMesh(&geometry.vertices, &geometry.indices);
+	renderer.updateModel(mesh, object.model);
+	if (object.transparent) {
+		renderer.setTransparent(mesh, true);
+	}
+	if (m_settings.animated) {
+		renderer.setAnimation(mesh, object.animation);
+	}
+	return mesh;
+}
+
+std::vector<PointLight> StressScene::generateLights(uint32_t count, float aspect) const
+{
+	Random random(m_settings.seed + count);
+	float farthest = NEAREST_LAYER + m_settings.depthLayers * LAYER_SPACING + 1.0f;
+
+	std::vector<PointLight> lights(count);
+	for (PointLight& light : lights) {
+		float distance = random.range(1.0f, farthest);
+		float halfHeight = distance * std::tan(FIELD_OF_VIEW / 2.0f);
+		float halfWidth = halfHeight * aspect;
+		light.position = glm::vec3(random.range(-halfWidth, halfWidth), random.range(-halfHeight, halfHeight),
+			CAMERA_Z - distance);
+		light.radius = random.range(0.2f, 0.6f);
+		light.color = glm::vec3(random.range(0.2f, 1.0f), random.range(0.2f, 1.0f), random.range(0.2f, 1.0f));
+		light.intensity = random.range(0.5f, 2.0f);
+	}
+	return lights;
+}
+
+void StressScene::printSummary(std::ostream& out) const
+{
+	float scale = 1.0f + std::max(m_settings.overlap, 0.0f);
+
+	out << "Stress scene (seed " << m_settings.seed << "): " << m_objects.size() << " meshes, "
+		<< m_geometries.size() << " geometries, " << m_settings.trianglesPerMesh << " triangles each, "
+		<< getTriangleCount() << " triangles in total, " << (m_settings.animated ? "animated" : "static")
+		<< ", depth complexity about " << m_settings.depthLayers * scale * scale
+		<< ", " << getTransparentCount() << " transparent" << std::endl;
+}
@@ -0,0 +1,89 @@
+#pragma once
+
+#include <cstdint>
+#include <ostream>
+#include <vector>
+
+#include "Utils.h"
+#include "Mesh.h"
+
+class VulkanRenderer;
+class JobSystem;
+
+struct StressSceneSettings {
+	uint32_t meshCount = 1000;
+	uint32_t geometryCount = 16;     // unique geometries shared out between the meshes
+	uint32_t trianglesPerMesh = 128;
+	bool animated = false;
+
+	// 0 places the objects side by side, 1 makes each one twice the size of
+	// its cell so that it overlaps its neighbours
+	float overlap = 0.0f;
+
+	// Layers of objects behind each other, each covering the whole view, so
+	// every pixel is drawn about this many times
+	uint32_t depthLayers = 1;
+
+	// Share of the objects that are transparent (see Mesh::setTransparent),
+	// spread evenly through the layers
+	float transparent = 0.0f;
+
+	uint32_t seed = 1;
+
+	// Meshes removed and added again every frame, see StressScene::churn
+	uint32_t churn = 0;
+};
+
+// A procedurally generated scene for measuring how the renderer scales with
+// object and triangle counts. The same settings always generate the same
+// scene, on every platform.
+class StressScene
+{
+public:
+	struct Geometry {
+		std::vector<Vertex> vertices;
+		std::vector<uint32_t> indices;
+	};
+
+	struct Object {
+		uint32_t geometry;
+		glm::mat4 model;
+		ObjectAnimation animation; // only used in animated scenes
+		bool transparent;
+	};
+
+	// Lays the objects out to fill a 45 degree view of this aspect ratio
+	// from the renderer's default camera. Geometries are generated on the
+	// job system when one is given, the scene is the same either way.
+	static StressScene generate(const StressSceneSettings& settings, float aspect, JobSystem* jobs = nullptr);
+
+	const StressSceneSettings& getSettings() const { return m_settings; }
+	const std::vector<Geometry>& getGeometries() const { return m_geometries; }
+	const std::vector<Object>& getObjects() const { return m_objects; }
+	uint64_t getTriangleCount() const;
+	uint32_t getTransparentCount() const;
+
+	// Creates a mesh for every object and sets its transform and animation.
+	// Returns the meshes in object order.
+	std::vector<MeshHandle> addTo(VulkanRenderer& renderer) const;
+
+	// Replaces settings.churn of the meshes that addTo() created with new
+	// ones, a different run of objects every frame, to measure the cost of
+	// scene changes at runtime
+	void churn(VulkanRenderer& renderer, std::vector<MeshHandle>& meshes, uint64_t frame) const;
+
+	// Point lights of random colours scattered through the view, from just in
+	// front of the camera to just behind the last layer of objects, for
+	// measuring how lighting scales with the number of lights. The same
+	// count always gives the same lights.
+	std::vector<PointLight> generateLights(uint32_t count, float aspect) const;
+
+	void printSummary(std::ostream& out) const;
+
+private:
+	StressSceneSettings m_settings;
+	std::vector<Geometry> m_geometries;
+	std::vector<Object> m_objects;
+
+	MeshHandle addObject(VulkanRenderer& renderer, const Object& object, Geometry& geometry) const;
+};
@@ -0,0 +1,90 @@
+#include <future>
+#include <iomanip>
+#include <stdexcept>
+
+#include "TaskGraph.h"
+#include "Profiler.h"
+
+TaskGraph::TaskId TaskGraph::addTask(const std::string& name, std::function<void()> work,
+	const std::vector<TaskId>& dependencies)
+{
+	for (TaskId dependency : dependencies) {
+		if (dependency >= m_tasks.size()) {
+			throw std::runtime_error("Task " + name + " depends on a task that does not exist yet");
+		}
+	}
+
+	Task task{};
+	task.name = name;
+	task.work = std::move(work);
+	task.dependencies = dependencies;
+	m_tasks.push_back(task);
+
+	return m_tasks.size() - 1;
+}
+
+void TaskGraph::run()
+{
+	m_start = Clock::now();
+
+	// Each task waits on the futures of its dependencies, which were all created
+	// before it, so launching them in insertion order is enough to respect the graph
+	std::vector<std::shared_future<void>> futures(m_tasks.size());
+	for (TaskId id = 0; id < m_tasks.size(); id++) {
+		std::vector<std::shared_future<void>> dependencies;
+		for (TaskId dependency : m_tasks[id].dependencies) {
+			dependencies.push_back(futures[dependency]);
+		}
+
+		futures[id] = std::async(std::launch::async, [this, id, dependencies]() {
+			// get() rethrows if a dependency failed, so this task is skipped
+			for (const auto& dependency : dependencies) {
+				dependency.get();
+			}
+			runTask(id);
+		}).share();
+	}
+
+	std::exception_ptr firstError = nullptr;
+	for (const auto& future : futures) {
+		try {
+			future.get();
+		}
+		catch (...) {
+			if (!firstError) {
+				firstError = std::current_exception();
+			}
+		}
+	}
+
+	m_totalMs = elapsedMs();
+
+	if (firstError) {
+		std::rethrow_exception(firstError);
+	}
+}
+
+void TaskGraph::printTrace(std::ostream& out) const
+{
+	out << "Startup trace (" << std::fixed << std::setprecision(2) << m_totalMs << " ms):" << std::endl;
+	for (const auto& task : m_tasks) {
+		out << "  " << std::left << std::setw(28) << task.name << std::right
+			<< std::setw(9) << task.startMs << " -> " << std::setw(9) << task.endMs << " ms"
+			<< "  (" << task.endMs - task.startMs << " ms)" << std::endl;
+	}
+	out << std::defaultfloat;
+}
+
+void TaskGraph::runTask(TaskId id)
+{
+	Task& task = m_tasks[id];
+	PROFILE_ZONE(Profiler::intern(task.name));
+	task.startMs = elapsedMs();
+	task.work();
+	task.endMs = elapsedMs();
+}
+
+double TaskGraph::elapsedMs() const
+{
+	return std::chrono::duration<double, std::milli>(Clock::now() - m_start).count();
+}
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <chrono>
+#include <functional>
+#include <ostream>
+#include <string>
+#include <vector>
+
+// A small dependency graph of named tasks. Every task runs on its own
+// worker as soon as all of its dependencies have completed, and the
+// start/end time of each one is kept so that a timing trace can be
+// printed afterwards.
+class TaskGraph
+{
+public:
+	using TaskId = size_t;
+
+	// Dependencies must refer to tasks that were added before this one,
+	// so the graph can never contain cycles.
+	TaskId addTask(const std::string& name, std::function<void()> work,
+		const std::vector<TaskId>& dependencies = {});
+
+	// Runs all tasks and blocks until they are done. If any task throws,
+	// its dependents are skipped and the first exception is rethrown here.
+	void run();
+
+	void printTrace(std::ostream& out) const;
+
+private:
+	using Clock = std::chrono::steady_clock;
+
+	struct Task {
+		std::string name;
+		std::function<void()> work;
+		std::vector<TaskId> dependencies;
+		double startMs = 0.0;
+		double endMs = 0.0;
+	};
+
+	std::vector<Task> m_tasks;
+	Clock::time_point m_start;
+	double m_totalMs = 0.0;
+
+	void runTask(TaskId id);
+	double elapsedMs() const;
+};
@@ -0,0 +1,286 @@
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+
+#include "TextureFile.h"
+
+namespace {
+
+const uint8_t KTX2_IDENTIFIER[12] = { 0xAB, 'K', 'T', 'X', ' ', '2', '0', 0xBB, '\r', '\n', 0x1A, '\n' };
+const size_t KTX2_HEADER_SIZE = 80;
+const size_t KTX2_LEVEL_INDEX_ENTRY_SIZE = 24;
+
+const size_t DDS_HEADER_SIZE = 128; // including the magic number
+const size_t DDS_DX10_HEADER_SIZE = 20;
+const uint32_t DDSD_MIPMAPCOUNT = 0x20000;
+const uint32_t DDPF_FOURCC = 0x4;
+const uint32_t DDPF_RGB = 0x40;
+const uint32_t DDSCAPS2_CUBEMAP = 0x200;
+const uint32_t DDSCAPS2_VOLUME = 0x200000;
+
+uint32_t fourCC(const char (&code)[5])
+{
+	return static_cast<uint32_t>(code[0]) | static_cast<uint32_t>(code[1]) << 8
+		| static_cast<uint32_t>(code[2]) << 16 | static_cast<uint32_t>(code[3]) << 24;
+}
+
+// Headers are not necessarily aligned within the file
+template <typename T>
+T readAt(const uint8_t* data, size_t offset)
+{
+	T value;
+	memcpy(&value, data + offset, sizeof(T));
+	return value;
+}
+
+// Levels of a full mip chain, down to 1x1: floor(log2(max(width, height))) + 1
+uint32_t getMaxLevelCount(uint32_t width, uint32_t height)
+{
+	uint32_t levelCount = 1;
+	while ((std::max(width, height) >> levelCount) > 0) {
+		levelCount++;
+	}
+	return levelCount;
+}
+
+VkFormat formatFromDxgi(uint32_t dxgiFormat)
+{
+	switch (dxgiFormat) {
+	case 10: return VK_FORMAT_R16G16B16A16_SFLOAT;
+	case 28: return VK_FORMAT_R8G8B8A8_UNORM;
+	case 29: return VK_FORMAT_R8G8B8A8_SRGB;
+	case 71: return VK_FORMAT_BC1_RGBA_UNORM_BLOCK;
+	case 72: return VK_FORMAT_BC1_RGBA_SRGB_BLOCK;
+	case 74: return VK_FORMAT_BC2_UNORM_BLOCK;
+	case 75: return VK_FORMAT_BC2_SRGB_BLOCK;
+	case 77: return VK_FORMAT_BC3_UNORM_BLOCK;
+	case 78: return VK_FORMAT_BC3_SRGB_BLOCK;
+	case 80: return VK_FORMAT_BC4_UNORM_BLOCK;
+	case 81: return VK_FORMAT_BC4_SNORM_BLOCK;
+	case 83: return VK_FORMAT_BC5_UNORM_BLOCK;
+	case 84: return VK_FORMAT_BC5_SNORM_BLOCK;
+	case 87: return VK_FORMAT_B8G8R8A8_UNORM;
+	case 91: return VK_FORMAT_B8G8R8A8_SRGB;
+	case 95: return VK_FORMAT_BC6H_UFLOAT_BLOCK;
+	case 96: return VK_FORMAT_BC6H_SFLOAT_BLOCK;
+	case 98: return VK_FORMAT_BC7_UNORM_BLOCK;
+	case 99: return VK_FORMAT_BC7_SRGB_BLOCK;
+	default: return VK_FORMAT_UNDEFINED;
+	}
+}
+
+}
+
+TextureFile TextureFile::load(const std::string& path)
+{
+	TextureFile texture;
+	texture.m_file = MappedFile(path);
+
+	const uint8_t* data = texture.m_file.data();
+	size_t size = texture.m_file.size();
+
+	if (size >= KTX2_HEADER_SIZE && memcmp(data, KTX2_IDENTIFIER, sizeof(KTX2_IDENTIFIER)) == 0) {
+		texture.loadKtx2(path);
+	}
+	else if (size >= DDS_HEADER_SIZE && readAt<uint32_t>(data, 0) == fourCC("DDS ")) {
+		texture.loadDds(path);
+	}
+	else {
+		throw std::runtime_error(path + " is neither a KTX2 nor a DDS file");
+	}
+
+	return texture;
+}
+
+uint32_t TextureFile::getRowCount(uint32_t level) const
+{
+	return (m_levels[level].height + m_blockExtent - 1) / m_blockExtent;
+}
+
+size_t TextureFile::getRowPitch(uint32_t level) const
+{
+	return static_cast<size_t>((m_levels[level].width + m_blockExtent - 1) / m_blockExtent) * m_blockSize;
+}
+
+void TextureFile::release()
+{
+	m_file.close();
+	for (auto& level : m_levels) {
+		level.data = nullptr;
+	}
+}
+
+void TextureFile::loadKtx2(const std::string& path)
+{
+	const uint8_t* data = m_file.data();
+
+	VkFormat format = static_cast<VkFormat>(readAt<uint32_t>(data, 12));
+	uint32_t width = readAt<uint32_t>(data, 20);
+	uint32_t height = readAt<uint32_t>(data, 24);
+	uint32_t depth = readAt<uint32_t>(data, 28);
+	uint32_t layerCount = readAt<uint32_t>(data, 32);
+	uint32_t faceCount = readAt<uint32_t>(data, 36);
+	uint32_t levelCount = readAt<uint32_t>(data, 40);
+	uint32_t supercompression = readAt<uint32_t>(data, 44);
+
+	if (depth > 1 || layerCount > 1 || faceCount != 1 || width == 0 || height == 0) {
+		throw std::runtime_error(path + ": only single 2D textures are supported");
+	}
+	if (supercompression != 0) {
+		throw std::runtime_error(path + ": supercompressed KTX2 files are not supported");
+	}
+	setFormat(path, format);
+
+	// A level count of zero asks the loader to generate the mip chain
+	m_generateMips = levelCount == 0;
+	levelCount = std::max(levelCount, 1u);
+	if (levelCount > getMaxLevelCount(width, height)) {
+		throw std::runtime_error(path + ": more mip levels than the texture's size allows");
+	}
+
+	if (m_file.size() < KTX2_HEADER_SIZE + levelCount * KTX2_LEVEL_INDEX_ENTRY_SIZE) {
+		throw std::runtime_error(path + ": truncated level index");
+	}
+
+	for (uint32_t i = 0; i < levelCount; i++) {
+		size_t entry = KTX2_HEADER_SIZE + i * KTX2_LEVEL_INDEX_ENTRY_SIZE;
+		uint64_t offset = readAt<uint64_t>(data, entry);
+		uint64_t length = readAt<uint64_t>(data, entry + 8);
+		if (offset > m_file.size() || length > m_file.size() - offset) {
+			throw std::runtime_error(path + ": mip level " + std::to_string(i) + " lies outside the file");
+		}
+		addLevel(path, static_cast<size_t>(offset), static_cast<size_t>(length),
+			std::max(width >> i, 1u), std::max(height >> i, 1u));
+	}
+}
+
+void TextureFile::loadDds(const std::string& path)
+{
+	const uint8_t* data = m_file.data();
+
+	uint32_t flags = readAt<uint32_t>(data, 8);
+	uint32_t height = readAt<uint32_t>(data, 12);
+	uint32_t width = readAt<uint32_t>(data, 16);
+	uint32_t mipMapCount = readAt<uint32_t>(data, 28);
+	uint32_t pixelFlags = readAt<uint32_t>(data, 80);
+	uint32_t pixelFourCC = readAt<uint32_t>(data, 84);
+	uint32_t rgbBitCount = readAt<uint32_t>(data, 88);
+	uint32_t redMask = readAt<uint32_t>(data, 92);
+	uint32_t caps2 = readAt<uint32_t>(data, 112);
+
+	if ((caps2 & (DDSCAPS2_CUBEMAP | DDSCAPS2_VOLUME)) || width == 0 || height == 0) {
+		throw std::runtime_error(path + ": only single 2D textures are supported");
+	}
+
+	size_t dataOffset = DDS_HEADER_SIZE;
+	VkFormat format = VK_FORMAT_UNDEFINED;
+
+	if ((pixelFlags & DDPF_FOURCC) && pixelFourCC == fourCC("DX10")) {
+		if (m_file.size() < DDS_HEADER_SIZE + DDS_DX10_HEADER_SIZE) {
+			throw std::runtime_error(path + ": truncated DX10 header");
+		}
+		uint32_t arraySize = readAt<uint32_t>(data, DDS_HEADER_SIZE + 12);
+		if (arraySize > 1) {
+			throw std::runtime_error(path + ": texture arrays are not supported");
+		}
+		format = formatFromDxgi(readAt<uint32_t>(data, DDS_HEADER_SIZE));
+		dataOffset += DDS_DX10_HEADER_SIZE;
+	}
+	else if (pixelFlags & DDPF_FOURCC) {
+		if (pixelFourCC == fourCC("DXT1")) {
+			format = VK_FORMAT_BC1_RGBA_UNORM_BLOCK;
+		}
+		else if (pixelFourCC == fourCC("DXT3")) {
+			format = VK_FORMAT_BC2_UNORM_BLOCK;
+		}
+		else if (pixelFourCC == fourCC("DXT5")) {
+			format = VK_FORMAT_BC3_UNORM_BLOCK;
+		}
+		else if (pixelFourCC == fourCC("ATI1") || pixelFourCC == fourCC("BC4U")) {
+			format = VK_FORMAT_BC4_UNORM_BLOCK;
+		}
+		else if (pixelFourCC == fourCC("ATI2") || pixelFourCC == fourCC("BC5U")) {
+			format = VK_FORMAT_BC5_UNORM_BLOCK;
+		}
+	}
+	else if ((pixelFlags & DDPF_RGB) && rgbBitCount == 32) {
+		format = redMask == 0x000000ff ? VK_FORMAT_R8G8B8A8_UNORM : VK_FORMAT_B8G8R8A8_UNORM;
+	}
+	setFormat(path, format);
+
+	// DDS can't tell "no mips" from "generate them", a lone level gets a generated chain
+	uint32_t levelCount = (flags & DDSD_MIPMAPCOUNT) ? std::max(mipMapCount, 1u) : 1;
+	m_generateMips = levelCount == 1;
+	if (levelCount > getMaxLevelCount(width, height)) {
+		throw std::runtime_error(path + ": more mip levels than the texture's size allows");
+	}
+
+	// Levels are stored one after the other, largest first. addLevel()
+	// checks that each one fits into the file.
+	for (uint32_t i = 0; i < levelCount; i++) {
+		uint32_t levelWidth = std::max(width >> i, 1u);
+		uint32_t levelHeight = std::max(height >> i, 1u);
+		size_t levelSize = static_cast<size_t>((levelWidth + m_blockExtent - 1) / m_blockExtent)
+			* ((levelHeight + m_blockExtent - 1) / m_blockExtent) * m_blockSize;
+
+		addLevel(path, dataOffset, levelSize, levelWidth, levelHeight);
+		dataOffset += levelSize;
+	}
+}
+
+void TextureFile::setFormat(const std::string& path, VkFormat format)
+{
+	m_format = format;
+
+	switch (format) {
+	case VK_FORMAT_R8G8B8A8_UNORM:
+	case VK_FORMAT_R8G8B8A8_SRGB:
+	case VK_FORMAT_B8G8R8A8_UNORM:
+	case VK_FORMAT_B8G8R8A8_SRGB:
+		m_blockExtent = 1;
+		m_blockSize = 4;
+		break;
+	case VK_FORMAT_R16G16B16A16_SFLOAT:
+		m_blockExtent = 1;
+		m_blockSize = 8;
+		break;
+	case VK_FORMAT_BC1_RGBA_UNORM_BLOCK:
+	case VK_FORMAT_BC1_RGBA_SRGB_BLOCK:
+	case VK_FORMAT_BC4_UNORM_BLOCK:
+	case VK_FORMAT_BC4_SNORM_BLOCK:
+		m_blockExtent = 4;
+		m_blockSize = 8;
+		break;
+	case VK_FORMAT_BC2_UNORM_BLOCK:
+	case VK_FORMAT_BC2_SRGB_BLOCK:
+	case VK_FORMAT_BC3_UNORM_BLOCK:
+	case VK_FORMAT_BC3_SRGB_BLOCK:
+	case VK_FORMAT_BC5_UNORM_BLOCK:
+	case VK_FORMAT_BC5_SNORM_BLOCK:
+	case VK_FORMAT_BC6H_UFLOAT_BLOCK:
+	case VK_FORMAT_BC6H_SFLOAT_BLOCK:
+	case VK_FORMAT_BC7_UNORM_BLOCK:
+	case VK_FORMAT_BC7_SRGB_BLOCK:
+		m_blockExtent = 4;
+		m_blockSize = 16;
+		break;
+	default:
+		throw std::runtime_error(path + ": unsupported texture format");
+	}
+}
+
+void TextureFile::addLevel(const std::string& path, size_t offset, size_t size, uint32_t width, uint32_t height)
+{
+	Level level{};
+	level.width = width;
+	level.height = height;
+	level.size = size;
+
+	m_levels.push_back(level);
+	uint32_t index = static_cast<uint32_t>(m_levels.size() - 1);
+
+	if (size < getRowPitch(index) * getRowCount(index) || offset > m_file.size() || size > m_file.size() - offset) {
+		throw std::runtime_error(path + ": mip level " + std::to_string(index) + " is truncated");
+	}
+	m_levels.back().data = m_file.data() + offset;
+}
@@ -0,0 +1,58 @@
+#pragma once
+
+#define GLFW_INCLUDE_VULKAN
+#include <GLFW/glfw3.h>
+
+#include <string>
+#include <vector>
+
+#include "MappedFile.h"
+
+// A KTX2 or DDS file mapped into memory. Only the headers are parsed; the
+// mip data stays in the mapping and is read straight from there when it is
+// staged for upload. Supported are single 2D images (no arrays, cube maps or
+// supercompression) in RGBA8/BGRA8, RGBA16F or BC1-BC7.
+class TextureFile
+{
+public:
+	struct Level {
+		const uint8_t* data;
+		size_t size;
+		uint32_t width;
+		uint32_t height;
+	};
+
+	static TextureFile load(const std::string& path);
+
+	VkFormat getFormat() const { return m_format; }
+	uint32_t getWidth() const { return m_levels[0].width; }
+	uint32_t getHeight() const { return m_levels[0].height; }
+
+	// Largest level first
+	const std::vector<Level>& getLevels() const { return m_levels; }
+
+	// The file only has the base level and asks for the rest to be generated
+	bool wantsGeneratedMips() const { return m_generateMips; }
+
+	// Block compressed formats are uploaded in rows of 4x4 blocks
+	uint32_t getBlockExtent() const { return m_blockExtent; }
+	uint32_t getRowCount(uint32_t level) const;
+	size_t getRowPitch(uint32_t level) const;
+
+	// The mip data is no longer needed
+	void release();
+	bool isMapped() const { return m_file.data() != nullptr; }
+
+private:
+	MappedFile m_file;
+	VkFormat m_format = VK_FORMAT_UNDEFINED;
+	uint32_t m_blockExtent = 1;
+	uint32_t m_blockSize = 4;
+	bool m_generateMips = false;
+	std::vector<Level> m_levels;
+
+	void loadKtx2(const std::string& path);
+	void loadDds(const std::string& path);
+	void setFormat(const std::string& path, VkFormat format);
+	void addLevel(const std::string& path, size_t offset, size_t size, uint32_t width, uint32_t height);
+};
@@ -0,0 +1,634 @@
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+#include <vector>
+
+#include "TextureStreamer.h"
+#include "Utils.h"
+
+namespace {
+
+VkImageMemoryBarrier imageBarrier(VkImage image, uint32_t baseMipLevel, uint32_t levelCount)
+{
+	VkImageMemoryBarrier barrier{};
+	barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+	barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+	barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+	barrier.image = image;
+	barrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+	barrier.subresourceRange.baseMipLevel = baseMipLevel;
+	barrier.subresourceRange.levelCount = levelCount;
+	barrier.subresourceRange.baseArrayLayer = 0;
+	barrier.subresourceRange.layerCount = 1;
+	return barrier;
+}
+
+}
+
+TextureStreamer::TextureStreamer(VkPhysicalDevice physicalDevice, VkDevice device, uint32_t framesInFlight,
+	VkDescriptorSet descriptorSet, uint32_t binding, uint32_t slotCount, VkSampler sampler, VkDeviceSize bytesPerFrame)
+	: m_physicalDevice(physicalDevice), m_device(device), m_bytesPerFrame(bytesPerFrame),
+	m_descriptorSet(descriptorSet), m_binding(binding), m_slotCount(slotCount), m_sampler(sampler)
+{
+	// One region per frame in flight, each only reused once its frame has retired
+	VkDeviceSize stagingSize = m_bytesPerFrame * framesInFlight;
+	createBuffer(m_physicalDevice, m_device, stagingSize, VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+		VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+		&m_stagingBuffer, &m_stagingBufferMemory);
+
+	void* mapped = nullptr;
+	vkMapMemory(m_device, m_stagingBufferMemory, 0, stagingSize, 0, &mapped);
+	m_stagingMapped = static_cast<uint8_t*>(mapped);
+}
+
+uint32_t TextureStreamer::load(const std::string& path)
+{
+	Texture texture;
+	texture.name = path;
+	texture.file = TextureFile::load(path);
+
+	VkFormatProperties formatProperties;
+	vkGetPhysicalDeviceFormatProperties(m_physicalDevice, texture.file.getFormat(), &formatProperties);
+	VkFormatFeatureFlags features = formatProperties.optimalTilingFeatures;
+	if (!(features & VK_FORMAT_FEATURE_SAMPLED_IMAGE_BIT)) {
+		throw std::runtime_error(path + ": the texture format can't be sampled on this device");
+	}
+
+	// Generating mips needs linear blits, which block compressed formats never support
+	VkFormatFeatureFlags blitFeatures = VK_FORMAT_FEATURE_BLIT_SRC_BIT | VK_FORMAT_FEATURE_BLIT_DST_BIT
+		| VK_FORMAT_FEATURE_SAMPLED_IMAGE_FILTER_LINEAR_BIT;
+	texture.generateMips = texture.file.wantsGeneratedMips() && (features & blitFeatures) == blitFeatures;
+	if (texture.file.wantsGeneratedMips() && !texture.generateMips) {
+		std::cout << path << ": mips can't be generated for this format, using the base level only" << std::endl;
+	}
+
+	uint32_t width = texture.file.getWidth();
+	uint32_t height = texture.file.getHeight();
+	texture.fullMipLevels = texture.generateMips
+		? static_cast<uint32_t>(std::floor(std::log2(std::max(width, height)))) + 1
+		: static_cast<uint32_t>(texture.file.getLevels().size());
+
+	createImage(texture, texture.current, 0);
+	texture.current.nextLevel = static_cast<int>(texture.file.getLevels().size()) - 1;
+
+	uint32_t index = static_cast<uint32_t>(m_textures.size());
+	m_textures.push_back(std::move(texture));
+	m_pending.push_back(index);
+	return index;
+}
+
+bool TextureStreamer::recordUploads(VkCommandBuffer commandBuffer, uint32_t frameIndex, LinearArena& scratch,
+	JobSystem& jobs)
+{
+	if (isIdle()) {
+		return false;
+	}
+
+	if (!m_streaming) {
+		m_streaming = true;
+		m_activeSince = Clock::now();
+	}
+
+	// Copies of this frame, grouped by texture
+	struct Upload {
+		uint32_t texture;
+		ArenaVector<VkBufferImageCopy> regions;
+	};
+	ArenaVector<Upload> uploads(scratch);
+
+	// Reads from the mapped files into the staging buffer, which fault the
+	// files' pages in, run as jobs once the frame's regions are planned
+	struct Copy {
+		uint8_t* destination;
+		const uint8_t* source;
+		size_t size;
+	};
+	ArenaVector<Copy> copies(scratch);
+
+	VkDeviceSize regionStart = frameIndex * m_bytesPerFrame;
+	VkDeviceSize used = 0;
+
+	while (!m_pending.empty()) {
+		uint32_t slot = pickNext();
+		uint32_t index = m_pending[slot];
+		Texture& texture = m_textures[index];
+		Image& image = streamingImage(texture);
+
+		uint32_t level = static_cast<uint32_t>(image.nextLevel);
+		const TextureFile::Level& fileLevel = texture.file.getLevels()[level];
+		size_t rowPitch = texture.file.getRowPitch(level);
+		uint32_t rowCount = texture.file.getRowCount(level);
+
+		// Offsets have to be multiples of 4 and of the texel block size
+		VkDeviceSize offset = (used + 15) & ~static_cast<VkDeviceSize>(15);
+		VkDeviceSize available = offset < m_bytesPerFrame ? m_bytesPerFrame - offset : 0;
+		uint32_t rows = static_cast<uint32_t>(std::min<VkDeviceSize>(rowCount - image.nextRow, available / rowPitch));
+		if (rows == 0) {
+			if (used == 0) {
+				throw std::runtime_error(texture.name + ": a row of texels doesn't fit into the staging buffer");
+			}
+			break;
+		}
+
+		size_t copySize = rows * rowPitch;
+		for (size_t copied = 0; copied < copySize; copied += COPY_JOB_SIZE) {
+			copies.push_back({ m_stagingMapped + regionStart + offset + copied,
+				fileLevel.data + image.nextRow * rowPitch + copied, std::min(COPY_JOB_SIZE, copySize - copied) });
+		}
+
+		uint32_t blockExtent = texture.file.getBlockExtent();
+		uint32_t y = image.nextRow * blockExtent;
+
+		VkBufferImageCopy region{};
+		region.bufferOffset = regionStart + offset;
+		region.bufferRowLength = 0; // tightly packed
+		region.bufferImageHeight = 0;
+		region.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+		region.imageSubresource.mipLevel = level - image.firstLevel;
+		region.imageSubresource.baseArrayLayer = 0;
+		region.imageSubresource.layerCount = 1;
+		region.imageOffset = { 0, static_cast<int32_t>(y), 0 };
+		region.imageExtent = { fileLevel.width, std::min(rows * blockExtent, fileLevel.height - y), 1 };
+
+		auto upload = std::find_if(uploads.begin(), uploads.end(),
+			[index](const Upload& other) { return other.texture == index; });
+		if (upload == uploads.end()) {
+			uploads.push_back({ index, ArenaVector<VkBufferImageCopy>(scratch) });
+			upload = uploads.end() - 1;
+		}
+		upload->regions.push_back(region);
+
+		used = offset + rows * rowPitch;
+		m_bytesUploaded += rows * rowPitch;
+		RenderStats::countTextureUpload(rows * rowPitch);
+
+		image.nextRow += rows;
+		if (image.nextRow == rowCount) {
+			image.nextRow = 0;
+			image.nextLevel--;
+			if (image.nextLevel < static_cast<int>(image.firstLevel)) {
+				m_pending.erase(m_pending.begin() + slot);
+			}
+		}
+	}
+
+	// The files of completed images are released below, so the copies are
+	// waited for here
+	jobs.parallelFor(copies.size(), 1, [&copies](size_t begin, size_t end) {
+		PROFILE_ZONE("textureCopies");
+		for (size_t i = begin; i < end; i++) {
+			memcpy(copies[i].destination, copies[i].source, copies[i].size);
+		}
+	});
+
+	// Every level of an image is in the shader read layout between frames,
+	// so the levels that are still missing can't trip up a sampler either.
+	// Frames still in flight may be sampling the images, hence the fragment
+	// shader stage as the source of the first barrier.
+	ArenaVector<VkImageMemoryBarrier> barriers(scratch);
+	for (const auto& upload : uploads) {
+		Image& image = streamingImage(m_textures[upload.texture]);
+		VkImageMemoryBarrier barrier = imageBarrier(image.image, 0, image.mipLevels);
+		barrier.srcAccessMask = 0;
+		barrier.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+		barrier.oldLayout = image.initialized ? VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL : VK_IMAGE_LAYOUT_UNDEFINED;
+		barrier.newLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+		barriers.push_back(barrier);
+		image.initialized = true;
+	}
+	for (uint32_t index : m_copies) {
+		Texture& texture = m_textures[index];
+
+		VkImageMemoryBarrier source = imageBarrier(texture.current.image, 0, texture.current.mipLevels);
+		source.srcAccessMask = 0;
+		source.dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+		source.oldLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+		source.newLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
+		barriers.push_back(source);
+
+		VkImageMemoryBarrier destination = imageBarrier(texture.next.image, 0, texture.next.mipLevels);
+		destination.srcAccessMask = 0;
+		destination.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+		destination.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+		destination.newLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+		barriers.push_back(destination);
+		texture.next.initialized = true;
+	}
+	vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0,
+		0, nullptr, 0, nullptr, static_cast<uint32_t>(barriers.size()), barriers.data());
+
+	for (const auto& upload : uploads) {
+		vkCmdCopyBufferToImage(commandBuffer, m_stagingBuffer, streamingImage(m_textures[upload.texture]).image,
+			VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, static_cast<uint32_t>(upload.regions.size()), upload.regions.data());
+	}
+	for (uint32_t index : m_copies) {
+		recordLevelCopies(commandBuffer, m_textures[index]);
+	}
+
+	barriers.clear();
+	for (const auto& upload : uploads) {
+		Texture& texture = m_textures[upload.texture];
+		Image& image = streamingImage(texture);
+		bool generated = texture.generateMips && image.nextLevel < 0;
+
+		if (generated) {
+			// Leaves every level but the last one as a blit source
+			recordMipGeneration(commandBuffer, texture, image);
+
+			VkImageMemoryBarrier barrier = imageBarrier(image.image, 0, image.mipLevels - 1);
+			barrier.srcAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+			barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+			barrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
+			barrier.newLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+			barriers.push_back(barrier);
+		}
+
+		uint32_t baseLevel = generated ? image.mipLevels - 1 : 0;
+		VkImageMemoryBarrier barrier = imageBarrier(image.image, baseLevel, image.mipLevels - baseLevel);
+		barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+		barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+		barrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+		barrier.newLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+		barriers.push_back(barrier);
+	}
+	for (uint32_t index : m_copies) {
+		Texture& texture = m_textures[index];
+
+		VkImageMemoryBarrier source = imageBarrier(texture.current.image, 0, texture.current.mipLevels);
+		source.srcAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+		source.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+		source.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
+		source.newLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+		barriers.push_back(source);
+
+		VkImageMemoryBarrier destination = imageBarrier(texture.next.image, 0, texture.next.mipLevels);
+		destination.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+		destination.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+		destination.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+		destination.newLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+		barriers.push_back(destination);
+	}
+	vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, 0,
+		0, nullptr, 0, nullptr, static_cast<uint32_t>(barriers.size()), barriers.data());
+
+	// The levels recorded above are resident by the time anything recorded
+	// after them samples the image
+	for (const auto& upload : uploads) {
+		Texture& texture = m_textures[upload.texture];
+		Image& image = streamingImage(texture);
+		if (image.nextLevel < static_cast<int>(image.firstLevel)) {
+			image.minLod = 0.0f;
+			image.complete = true;
+			texture.file.release();
+			texture.version++;
+		}
+		else if (image.nextLevel + 1 < static_cast<int>(texture.file.getLevels().size())) {
+			image.minLod = static_cast<float>(image.nextLevel + 1 - image.firstLevel);
+			texture.version++;
+		}
+	}
+	for (uint32_t index : m_copies) {
+		m_textures[index].next.minLod = 0.0f;
+		m_textures[index].next.complete = true;
+	}
+	m_copies.clear();
+
+	if (isIdle()) {
+		m_streaming = false;
+		m_activeSeconds += std::chrono::duration<double>(Clock::now() - m_activeSince).count();
+		return true;
+	}
+	return false;
+}
+
+void TextureStreamer::applyReplacements(DeletionQueue& deletionQueue, uint64_t submittedFrames)
+{
+	for (auto& texture : m_textures) {
+		if (!texture.hasNext || !texture.next.complete) {
+			continue;
+		}
+
+		Image retired = texture.current;
+		texture.current = texture.next;
+		texture.next = Image();
+		texture.hasNext = false;
+		texture.nextFromCurrent = false;
+		texture.version++;
+
+		deletionQueue.push(submittedFrames, [this, retired]() {
+			destroyImage(retired);
+			m_freeSlots.push_back(retired.slot);
+		});
+	}
+}
+
+VkDeviceSize TextureStreamer::dropLevels(uint32_t texture, uint32_t maxSize)
+{
+	Texture& entry = m_textures[texture];
+
+	// Only complete images are copied from, and one change at a time
+	if (entry.hasNext || !entry.current.complete) {
+		return getMemorySize(texture);
+	}
+
+	uint32_t width = entry.file.getWidth();
+	uint32_t height = entry.file.getHeight();
+	uint32_t firstLevel = entry.current.firstLevel;
+	while (firstLevel + 1 < entry.fullMipLevels && std::max(width >> firstLevel, height >> firstLevel) > maxSize) {
+		firstLevel++;
+	}
+	if (firstLevel == entry.current.firstLevel) {
+		return getMemorySize(texture);
+	}
+
+	createImage(entry, entry.next, firstLevel);
+	entry.hasNext = true;
+	entry.nextFromCurrent = true;
+	m_copies.push_back(texture);
+
+	return entry.next.memoryRequirements.size;
+}
+
+VkDeviceSize TextureStreamer::restoreLevels(uint32_t texture)
+{
+	Texture& entry = m_textures[texture];
+
+	if (entry.hasNext) {
+		return entry.nextFromCurrent ? getMemorySize(texture) : entry.next.memoryRequirements.size;
+	}
+	if (entry.current.firstLevel == 0) {
+		return getMemorySize(texture);
+	}
+
+	if (!entry.file.isMapped()) {
+		try {
+			entry.file = TextureFile::load(entry.name);
+		}
+		catch (std::runtime_error& e) {
+			std::cout << "Failed to restore texture: " << e.what() << std::endl;
+			return getMemorySize(texture);
+		}
+	}
+
+	createImage(entry, entry.next, 0);
+	entry.next.nextLevel = static_cast<int>(entry.file.getLevels().size()) - 1;
+	entry.hasNext = true;
+	entry.nextFromCurrent = false;
+	m_pending.push_back(texture);
+
+	return entry.next.memoryRequirements.size;
+}
+
+uint32_t TextureStreamer::getBindlessSlot(uint32_t texture) const
+{
+	return texture < m_textures.size() ? m_textures[texture].current.slot : NO_TEXTURE;
+}
+
+float TextureStreamer::getMinLod(uint32_t texture) const
+{
+	return texture < m_textures.size() ? m_textures[texture].current.minLod : -1.0f;
+}
+
+uint64_t TextureStreamer::getVersion(uint32_t texture) const
+{
+	return texture < m_textures.size() ? m_textures[texture].version : 0;
+}
+
+VkDeviceSize TextureStreamer::getMemorySize(uint32_t texture) const
+{
+	const Texture& entry = m_textures[texture];
+	return entry.current.memoryRequirements.size + (entry.hasNext ? entry.next.memoryRequirements.size : 0);
+}
+
+VkMemoryRequirements TextureStreamer::getMemoryRequirements(uint32_t texture) const
+{
+	return m_textures[texture].current.memoryRequirements;
+}
+
+bool TextureStreamer::isIdle() const
+{
+	return m_pending.empty() && m_copies.empty();
+}
+
+double TextureStreamer::getMegabytesPerSecond() const
+{
+	double seconds = m_activeSeconds;
+	if (m_streaming) {
+		seconds += std::chrono::duration<double>(Clock::now() - m_activeSince).count();
+	}
+	return seconds > 0.0 ? m_bytesUploaded / (1024.0 * 1024.0) / seconds : 0.0;
+}
+
+void TextureStreamer::printStats(std::ostream& out) const
+{
+	size_t complete = std::count_if(m_textures.begin(), m_textures.end(),
+		[](const Texture& texture) { return texture.current.complete; });
+
+	out << "Texture streaming: " << complete << " of " << m_textures.size() << " textures, "
+		<< m_bytesUploaded / (1024.0 * 1024.0) << " MB uploaded at " << getMegabytesPerSecond() << " MB/s" << std::endl;
+}
+
+void TextureStreamer::destroy()
+{
+	for (auto& texture : m_textures) {
+		destroyImage(texture.current);
+		if (texture.hasNext) {
+			destroyImage(texture.next);
+		}
+		texture.file.release();
+	}
+	m_textures.clear();
+	m_pending.clear();
+	m_copies.clear();
+
+	if (m_stagingBuffer != VK_NULL_HANDLE) {
+		vkUnmapMemory(m_device, m_stagingBufferMemory);
+		vkDestroyBuffer(m_device, m_stagingBuffer, nullptr);
+		vkFreeMemory(m_device, m_stagingBufferMemory, nullptr);
+		m_stagingBuffer = VK_NULL_HANDLE;
+	}
+}
+
+void TextureStreamer::createImage(const Texture& texture, Image& image, uint32_t firstLevel)
+{
+	uint32_t width = std::max(texture.file.getWidth() >> firstLevel, 1u);
+	uint32_t height = std::max(texture.file.getHeight() >> firstLevel, 1u);
+	image.firstLevel = firstLevel;
+	image.mipLevels = texture.fullMipLevels - firstLevel;
+
+	VkImageCreateInfo imageCreateInfo{};
+	imageCreateInfo.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+	imageCreateInfo.imageType = VK_IMAGE_TYPE_2D;
+	imageCreateInfo.format = texture.file.getFormat();
+	imageCreateInfo.extent = { width, height, 1 };
+	imageCreateInfo.mipLevels = image.mipLevels;
+	imageCreateInfo.arrayLayers = 1;
+	imageCreateInfo.samples = VK_SAMPLE_COUNT_1_BIT;
+	imageCreateInfo.tiling = VK_IMAGE_TILING_OPTIMAL;
+	// Transfer source for generating mips and for copying levels to a smaller image
+	imageCreateInfo.usage = VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT | VK_IMAGE_USAGE_SAMPLED_BIT;
+	imageCreateInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+	imageCreateInfo.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+
+	VkResult result = vkCreateImage(m_device, &imageCreateInfo, nullptr, &image.image);
+	if (result != VK_SUCCESS) {
+		throw std::runtime_error("Failed to create an image for " + texture.name);
+	}
+
+	vkGetImageMemoryRequirements(m_device, image.image, &image.memoryRequirements);
+
+	VkMemoryAllocateInfo allocInfo{};
+	allocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+	allocInfo.allocationSize = image.memoryRequirements.size;
+	allocInfo.memoryTypeIndex = findMemoryTypeIndex(m_physicalDevice, image.memoryRequirements.memoryTypeBits,
+		VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+
+	RenderStats::countAllocation();
+	result = vkAllocateMemory(m_device, &allocInfo, nullptr, &image.memory);
+	if (result != VK_SUCCESS) {
+		throw std::runtime_error("Failed to allocate image memory for " + texture.name);
+	}
+	vkBindImageMemory(m_device, image.image, image.memory, 0);
+
+	VkImageViewCreateInfo viewCreateInfo{};
+	viewCreateInfo.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
+	viewCreateInfo.image = image.image;
+	viewCreateInfo.viewType = VK_IMAGE_VIEW_TYPE_2D;
+	viewCreateInfo.format = texture.file.getFormat();
+	viewCreateInfo.components.r = VK_COMPONENT_SWIZZLE_IDENTITY;
+	viewCreateInfo.components.g = VK_COMPONENT_SWIZZLE_IDENTITY;
+	viewCreateInfo.components.b = VK_COMPONENT_SWIZZLE_IDENTITY;
+	viewCreateInfo.components.a = VK_COMPONENT_SWIZZLE_IDENTITY;
+	viewCreateInfo.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+	viewCreateInfo.subresourceRange.baseMipLevel = 0;
+	viewCreateInfo.subresourceRange.levelCount = image.mipLevels;
+	viewCreateInfo.subresourceRange.baseArrayLayer = 0;
+	viewCreateInfo.subresourceRange.layerCount = 1;
+
+	result = vkCreateImageView(m_device, &viewCreateInfo, nullptr, &image.imageView);
+	if (result != VK_SUCCESS) {
+		throw std::runtime_error("Failed to create an image view for " + texture.name);
+	}
+
+	// A fresh slot: no frame in flight can be sampling it while it is written
+	if (!m_freeSlots.empty()) {
+		image.slot = m_freeSlots.back();
+		m_freeSlots.pop_back();
+	}
+	else if (m_usedSlots < m_slotCount) {
+		image.slot = m_usedSlots++;
+	}
+	else {
+		throw std::runtime_error("Out of bindless texture slots");
+	}
+
+	VkDescriptorImageInfo imageInfo{};
+	imageInfo.sampler = m_sampler;
+	imageInfo.imageView = image.imageView;
+	imageInfo.imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+
+	VkWriteDescriptorSet setWrite{};
+	setWrite.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+	setWrite.dstSet = m_descriptorSet;
+	setWrite.dstBinding = m_binding;
+	setWrite.dstArrayElement = image.slot;
+	setWrite.descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+	setWrite.descriptorCount = 1;
+	setWrite.pImageInfo = &imageInfo;
+
+	vkUpdateDescriptorSets(m_device, 1, &setWrite, 0, nullptr);
+}
+
+void TextureStreamer::destroyImage(const Image& image)
+{
+	vkDestroyImageView(m_device, image.imageView, nullptr);
+	vkDestroyImage(m_device, image.image, nullptr);
+	vkFreeMemory(m_device, image.memory, nullptr);
+}
+
+void TextureStreamer::recordMipGeneration(VkCommandBuffer commandBuffer, const Texture& texture, const Image& image)
+{
+	int32_t width = static_cast<int32_t>(texture.file.getWidth());
+	int32_t height = static_cast<int32_t>(texture.file.getHeight());
+
+	// Each level is downsampled from the one before it
+	for (uint32_t i = 1; i < image.mipLevels; i++) {
+		VkImageMemoryBarrier barrier = imageBarrier(image.image, i - 1, 1);
+		barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+		barrier.dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+		barrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+		barrier.newLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
+		vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0,
+			0, nullptr, 0, nullptr, 1, &barrier);
+
+		int32_t nextWidth = std::max(width / 2, 1);
+		int32_t nextHeight = std::max(height / 2, 1);
+
+		VkImageBlit blit{};
+		blit.srcSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+		blit.srcSubresource.mipLevel = i - 1;
+		blit.srcSubresource.baseArrayLayer = 0;
+		blit.srcSubresource.layerCount = 1;
+		blit.srcOffsets[0] = { 0, 0, 0 };
+		blit.srcOffsets[1] = { width, height, 1 };
+		blit.dstSubresource = blit.srcSubresource;
+		blit.dstSubresource.mipLevel = i;
+		blit.dstOffsets[0] = { 0, 0, 0 };
+		blit.dstOffsets[1] = { nextWidth, nextHeight, 1 };
+
+		vkCmdBlitImage(commandBuffer,
+			image.image, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+			image.image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+			1, &blit, VK_FILTER_LINEAR);
+
+		width = nextWidth;
+		height = nextHeight;
+	}
+}
+
+void TextureStreamer::recordLevelCopies(VkCommandBuffer commandBuffer, const Texture& texture)
+{
+	const Image& source = texture.current;
+	const Image& destination = texture.next;
+
+	std::vector<VkImageCopy> regions;
+	for (uint32_t i = 0; i < destination.mipLevels; i++) {
+		uint32_t level = destination.firstLevel + i;
+
+		VkImageCopy region{};
+		region.srcSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+		region.srcSubresource.mipLevel = level - source.firstLevel;
+		region.srcSubresource.baseArrayLayer = 0;
+		region.srcSubresource.layerCount = 1;
+		region.srcOffset = { 0, 0, 0 };
+		region.dstSubresource = region.srcSubresource;
+		region.dstSubresource.mipLevel = i;
+		region.dstOffset = { 0, 0, 0 };
+		region.extent = { std::max(texture.file.getWidth() >> level, 1u), std::max(texture.file.getHeight() >> level, 1u), 1 };
+		regions.push_back(region);
+	}
+
+	vkCmdCopyImage(commandBuffer,
+		source.image, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+		destination.image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+		static_cast<uint32_t>(regions.size()), regions.data());
+}
+
+uint32_t TextureStreamer::pickNext()
+{
+	// The smallest level still missing anywhere goes first, so every texture
+	// becomes usable at low detail before any of them gets its full detail
+	uint32_t best = 0;
+	size_t bestSize = 0;
+	for (uint32_t i = 0; i < m_pending.size(); i++) {
+		Texture& texture = m_textures[m_pending[i]];
+		size_t size = texture.file.getLevels()[streamingImage(texture).nextLevel].size;
+		if (i == 0 || size < bestSize) {
+			best = i;
+			bestSize = size;
+		}
+	}
+	return best;
+}
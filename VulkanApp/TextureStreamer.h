@@ -0,0 +1,154 @@
+#pragma once
+
+#define GLFW_INCLUDE_VULKAN
+#include <GLFW/glfw3.h>
+
+#include <chrono>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include "DeletionQueue.h"
+#include "JobSystem.h"
+#include "LinearArena.h"
+#include "TextureFile.h"
+
+// Streams textures from mapped KTX2/DDS files into device local images.
+// Every frame a bounded number of bytes is copied into that frame's part of
+// a persistently mapped staging buffer and recorded as buffer to image
+// copies at the start of the frame's command buffer. The smallest mips of
+// every texture go first, so something can be sampled after a frame or two
+// while the detailed levels follow. Files without a mip chain get one
+// generated with blits once their base level has arrived.
+//
+// Each image gets its own slot in the bindless textures array. When a
+// texture's detail is dropped or restored, a replacement image is built in
+// a new slot while the old one stays in use, and swapped in once complete.
+class TextureStreamer
+{
+public:
+	TextureStreamer() {}
+	TextureStreamer(VkPhysicalDevice physicalDevice, VkDevice device, uint32_t framesInFlight,
+		VkDescriptorSet descriptorSet, uint32_t binding, uint32_t slotCount, VkSampler sampler,
+		VkDeviceSize bytesPerFrame = 16 * 1024 * 1024);
+
+	// Maps the file and creates the image. Returns the texture's handle; its
+	// contents arrive over the next frames.
+	uint32_t load(const std::string& path);
+
+	// Records this frame's share of the uploads. The frame's staging region
+	// is reused, so its previous submission must have completed. Returns
+	// true when the last pending upload was recorded. The copies and
+	// barriers are gathered in scratch. Reading the files into the staging
+	// buffer runs on the job system, and is done when this returns.
+	bool recordUploads(VkCommandBuffer commandBuffer, uint32_t frameIndex, LinearArena& scratch, JobSystem& jobs);
+
+	// Swaps in replacement images whose uploads have been submitted. The
+	// images they replace are retired once the submitted frames are done.
+	void applyReplacements(DeletionQueue& deletionQueue, uint64_t submittedFrames);
+
+	// Keeps only the levels no larger than maxSize, copied from the current
+	// image on the GPU. Returns the device memory the texture will use. The
+	// smaller image is allocated right away, while the current one is only
+	// freed once the copy is done and no frame in flight samples it.
+	VkDeviceSize dropLevels(uint32_t texture, uint32_t maxSize);
+
+	// Streams the full mip chain from the file again
+	VkDeviceSize restoreLevels(uint32_t texture);
+
+	// Bindless slot of the texture's current image, NO_TEXTURE if there is none
+	uint32_t getBindlessSlot(uint32_t texture) const;
+
+	// Most detailed mip level of the current image that has been uploaded
+	// (as a LOD clamp for the shaders), or a negative value while there is
+	// nothing to sample yet
+	float getMinLod(uint32_t texture) const;
+
+	// Changes whenever the slot or the LOD clamp above does, 0 for textures
+	// that don't exist
+	uint64_t getVersion(uint32_t texture) const;
+
+	VkDeviceSize getMemorySize(uint32_t texture) const;
+	VkMemoryRequirements getMemoryRequirements(uint32_t texture) const;
+	size_t getTextureCount() const { return m_textures.size(); }
+	bool isIdle() const;
+
+	// Upload throughput, measured from the first recorded upload until the
+	// queue drained
+	double getMegabytesPerSecond() const;
+	void printStats(std::ostream& out) const;
+
+	void destroy();
+
+private:
+	// One GPU copy of (some of) a texture's levels
+	struct Image {
+		VkImage image = VK_NULL_HANDLE;
+		VkDeviceMemory memory = VK_NULL_HANDLE;
+		VkImageView imageView = VK_NULL_HANDLE;
+		VkMemoryRequirements memoryRequirements = {};
+		uint32_t slot = 0;
+		uint32_t firstLevel = 0; // file level that is level 0 of the image
+		uint32_t mipLevels = 1;
+		bool initialized = false; // has left VK_IMAGE_LAYOUT_UNDEFINED
+		bool complete = false;
+
+		// Upload progress: file levels are uploaded from the smallest (last)
+		// down to firstLevel, a row of texels or blocks at a time
+		int nextLevel = 0;
+		uint32_t nextRow = 0;
+		float minLod = -1.0f;
+	};
+
+	struct Texture {
+		std::string name;
+		TextureFile file; // mapped while levels are streamed from it
+		bool generateMips = false;
+		uint32_t fullMipLevels = 1;
+
+		Image current;
+		Image next; // replaces current once complete
+		bool hasNext = false;
+		bool nextFromCurrent = false; // next is copied from current instead of streamed
+		uint64_t version = 1;
+	};
+
+	VkPhysicalDevice m_physicalDevice = VK_NULL_HANDLE;
+	VkDevice m_device = VK_NULL_HANDLE;
+
+	VkBuffer m_stagingBuffer = VK_NULL_HANDLE;
+	VkDeviceMemory m_stagingBufferMemory = VK_NULL_HANDLE;
+	uint8_t* m_stagingMapped = nullptr;
+	VkDeviceSize m_bytesPerFrame = 0;
+
+	// Staging copies are split into jobs of at most this many bytes, so that
+	// a large level is read by many threads
+	static constexpr size_t COPY_JOB_SIZE = 256 * 1024;
+
+	// Bindless slots. Slots of retired images are only reused once the
+	// frames that sampled them are done.
+	VkDescriptorSet m_descriptorSet = VK_NULL_HANDLE;
+	uint32_t m_binding = 0;
+	uint32_t m_slotCount = 0;
+	uint32_t m_usedSlots = 0;
+	std::vector<uint32_t> m_freeSlots;
+	VkSampler m_sampler = VK_NULL_HANDLE;
+
+	std::vector<Texture> m_textures;
+	std::vector<uint32_t> m_pending; // textures with levels to stream from their file
+	std::vector<uint32_t> m_copies;  // textures with a replacement to copy from the current image
+
+	// Statistics
+	using Clock = std::chrono::steady_clock;
+	bool m_streaming = false;
+	Clock::time_point m_activeSince;
+	double m_activeSeconds = 0.0;
+	uint64_t m_bytesUploaded = 0;
+
+	Image& streamingImage(Texture& texture) { return texture.hasNext ? texture.next : texture.current; }
+	void createImage(const Texture& texture, Image& image, uint32_t firstLevel);
+	void destroyImage(const Image& image);
+	void recordMipGeneration(VkCommandBuffer commandBuffer, const Texture& texture, const Image& image);
+	void recordLevelCopies(VkCommandBuffer commandBuffer, const Texture& texture);
+	uint32_t pickNext();
+};
@@ -5,22 +5,70 @@
 #define GLFW_INCLUDE_VULKAN
 #include <GLFW/glfw3.h>
 
+#include "Profiler.h"
+#include "RenderStats.h"
+
 const std::vector<const char*> deviceExtensions { 
 	VK_KHR_SWAPCHAIN_EXTENSION_NAME 
 };
 
-const int MAX_FRAME_DRAWS = 2;
+// Upper bound for RendererSettings::framesInFlight
+const int MAX_FRAME_DRAWS = 4;
+
+// Sizes of the descriptor-indexed arrays in the bindless descriptor set
+const uint32_t MAX_BINDLESS_BUFFERS = 256;
+const uint32_t MAX_BINDLESS_TEXTURES = 1024;
 
-const int MAX_OBJECTS = 2;
+// Material index of objects that aren't textured
+const uint32_t NO_TEXTURE = 0xFFFFFFFF;
 
 struct Vertex {
 	glm::vec3 pos;
 	glm::vec3 col;
+	glm::vec2 tex;
+};
+
+// Per-object record in the object storage buffer, laid out as std430 to
+// match ObjectData in the shaders
+struct ObjectData {
+	glm::mat4 model;
+	glm::vec4 bounds; // bounding sphere in model space: centre, radius
+	uint32_t materialIndex; // bindless texture index or NO_TEXTURE
+	float textureMinLod;    // most detailed mip streamed in so far, negative if none
+	uint32_t padding[2];
+};
+
+// Parametric animation evaluated on the GPU every frame, applied on top of
+// the object's model matrix. Laid out as std430 to match animate.comp.
+struct ObjectAnimation {
+	glm::vec4 spin;        // rotation about the object's own origin: axis, radians per second
+	glm::vec4 orbit;       // rotation about the Y axis through a point: point, radians per second
+	glm::vec4 oscillation; // back and forth movement: direction scaled by amplitude, cycles per second
+	uint32_t objectIndex;
+	uint32_t padding[3];
+};
+
+// Record in the animation storage buffer. The animation pass writes the
+// animated model matrix of the object from base, so the CPU never writes
+// it. Laid out as std430 to match AnimationData in animate.comp.
+struct AnimationData {
+	glm::mat4 base; // the object's model matrix without the animation
+	ObjectAnimation animation;
+};
+
+// Point light in world space, laid out as std430 to match PointLight in
+// the shaders. Its light fades out smoothly to nothing at the radius.
+struct PointLight {
+	glm::vec3 position;
+	float radius;
+	glm::vec3 color;
+	float intensity;
 };
 
 struct QueueFamilyIndices {
 	int graphicsFamily = -1;
 	int presentationFamily = -1;
+	int computeFamily = -1; // compute without graphics, for async compute; optional
 
 	bool isValid() {
 		return graphicsFamily >= 0 && presentationFamily >= 0;
@@ -40,6 +88,11 @@ struct SwapChainDetails {
 struct SwapChainImage {
 	VkImage image;
 	VkImageView imageView;
+
+	// Signalled when rendering to this image is done and waited on by the
+	// present. Keeping it per image makes it safe to reuse: an image is only
+	// acquired again once its previous presentation has finished.
+	VkSemaphore renderFinished;
 };
 
 static uint32_t findMemoryTypeIndex(VkPhysicalDevice physicalDevice, uint32_t allowedTypes, VkMemoryPropertyFlags properties)
@@ -60,18 +113,28 @@ static uint32_t findMemoryTypeIndex(VkPhysicalDevice physicalDevice, uint32_t al
 }
 
 
-static void createBuffer(VkPhysicalDevice physicalDevice, VkDevice device, VkDeviceSize bufferSize, VkBufferUsageFlags bufferUsage,
-	VkMemoryPropertyFlags bufferProperties, VkBuffer* buffer, VkDeviceMemory* bufferMemory)
+// Like createBuffer, but reports failure instead of throwing so that callers
+// can fall back to another kind of memory. Nothing is left allocated on failure.
+// With more than one queue family, the buffer can be used by all of them
+// at once, without ownership transfers.
+static VkResult tryCreateBuffer(VkPhysicalDevice physicalDevice, VkDevice device, VkDeviceSize bufferSize, VkBufferUsageFlags bufferUsage,
+	VkMemoryPropertyFlags bufferProperties, VkBuffer* buffer, VkDeviceMemory* bufferMemory,
+	const std::vector<uint32_t>& queueFamilies = {})
 {
 	VkBufferCreateInfo createInfo{};
 	createInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
 	createInfo.size = bufferSize;
 	createInfo.usage = bufferUsage;
 	createInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+	if (queueFamilies.size() > 1) {
+		createInfo.sharingMode = VK_SHARING_MODE_CONCURRENT;
+		createInfo.queueFamilyIndexCount = static_cast<uint32_t>(queueFamilies.size());
+		createInfo.pQueueFamilyIndices = queueFamilies.data();
+	}
 
 	VkResult result = vkCreateBuffer(device, &createInfo, nullptr, buffer);
 	if (result != VK_SUCCESS) {
-		throw std::runtime_error("Failed to create vertex buffer");
+		return result;
 	}
 
 	// Get memory requirements
@@ -86,17 +149,35 @@ static void createBuffer(VkPhysicalDevice physicalDevice, VkDevice device, VkDev
 		bufferProperties);
 
 	// allocate memory
+	RenderStats::countAllocation();
 	result = vkAllocateMemory(device, &allocInfo, nullptr, bufferMemory);
 	if (result != VK_SUCCESS) {
-		throw std::runtime_error("Failed to allocate vertex buffer memory");
+		vkDestroyBuffer(device, *buffer, nullptr);
+		*buffer = VK_NULL_HANDLE;
+		return result;
 	}
 
 	vkBindBufferMemory(device, *buffer, *bufferMemory, 0);
+	return VK_SUCCESS;
+}
+
+static void createBuffer(VkPhysicalDevice physicalDevice, VkDevice device, VkDeviceSize bufferSize, VkBufferUsageFlags bufferUsage,
+	VkMemoryPropertyFlags bufferProperties, VkBuffer* buffer, VkDeviceMemory* bufferMemory,
+	const std::vector<uint32_t>& queueFamilies = {})
+{
+	VkResult result = tryCreateBuffer(physicalDevice, device, bufferSize, bufferUsage, bufferProperties, buffer, bufferMemory,
+		queueFamilies);
+	if (result != VK_SUCCESS) {
+		throw std::runtime_error("Failed to create buffer");
+	}
 }
 
 static void copyBuffer(VkDevice device, VkQueue transferQueue, VkCommandPool transferCommandPool,
-	VkBuffer srcBuffer, VkBuffer dstBuffer, VkDeviceSize bufferSize) 
+	VkBuffer srcBuffer, VkBuffer dstBuffer, VkDeviceSize bufferSize, VkDeviceSize dstOffset = 0)
 {
+	PROFILE_ZONE("copyBuffer");
+	RenderStats::countBufferUpload(bufferSize);
+
 	// Allocate a one-time copy command buffer (will be released at the end)
 	VkCommandBuffer transferCommandBuffer;
 
@@ -115,7 +196,7 @@ static void copyBuffer(VkDevice device, VkQueue transferQueue, VkCommandPool tra
 	vkBeginCommandBuffer(transferCommandBuffer, &commandBeginInfo);
 	
 	VkBufferCopy copyRegion{};
-	copyRegion.dstOffset = 0;
+	copyRegion.dstOffset = dstOffset;
 	copyRegion.srcOffset = 0;
 	copyRegion.size = bufferSize;
 
@@ -3,9 +3,14 @@
 #include <algorithm>
 #include <fstream>
 #include <array>
+#include <cmath>
 #include <cstring>
+#include <cstddef>
+#include <thread>
 
 #include "VulkanRenderer.h"
+#include "AllocationCounter.h"
+#include "TaskGraph.h"
 
 #ifdef NDEBUG
 const bool enableValidationLayers = false;
@@ -17,6 +22,146 @@ const std::vector<const char*> validationLayers = {
 	"VK_LAYER_KHRONOS_validation"
 };
 
+// Must match local_size_x and the push constants in animate.comp
+const uint32_t ANIMATE_GROUP_SIZE = 64;
+
+// Must match local_size_x (and _y) in cull.comp and depthpyramid.comp
+const uint32_t CULL_GROUP_SIZE = 64;
+const uint32_t DEPTH_PYRAMID_GROUP_SIZE = 8;
+
+const VkFormat DEPTH_FORMAT = VK_FORMAT_D32_SFLOAT;
+
+const float NEAR_PLANE = 0.1f;
+const float FAR_PLANE = 100.0f;
+
+// Must match the cluster grid in lightcull.comp and shader.frag. A cluster's
+// record is its light count and room for MAX_LIGHTS_PER_CLUSTER indices.
+const uint32_t CLUSTER_COUNT_X = 16;
+const uint32_t CLUSTER_COUNT_Y = 9;
+const uint32_t CLUSTER_COUNT_Z = 24;
+const uint32_t MAX_LIGHTS_PER_CLUSTER = 255;
+
+// Frame start and end, the spans below, and a pair for every render graph pass
+const uint32_t MAX_TIMESTAMP_QUERIES = 32;
+
+// Graphics queries after the frame's pair: the scene passes and the upscale,
+// which dynamic resolution is driven by, then the render graph passes. The
+// submission as a whole also waits for the swapchain image and the compute
+// queue, which no resolution would make faster.
+const uint32_t SCENE_BEGIN_QUERY = 2;
+const uint32_t SCENE_END_QUERY = 3;
+const uint32_t UPSCALE_BEGIN_QUERY = 4;
+const uint32_t UPSCALE_END_QUERY = 5;
+const uint32_t FIRST_PASS_QUERY = 6;
+
+// Frames per batch written to the statistics file
+const uint64_t STATS_WRITE_INTERVAL = 60;
+
+// Evicted textures keep the mips up to this size
+const uint32_t EVICTED_TEXTURE_SIZE = 64;
+
+// Objects per job when object data is written and culled
+const size_t OBJECT_UPDATE_GRAIN = 256;
+
+// Fewest draws worth recording into a secondary command buffer of their own,
+// below that the scene pass is recorded on one thread
+const size_t MIN_DRAWS_PER_SECONDARY = 256;
+
+// Initial size of every frame's scratch arena, it grows to fit the biggest frame
+const size_t FRAME_ARENA_SIZE = 64 * 1024;
+
+// Scene calls queued for the render thread before the simulation has to
+// wait for it to catch up
+const size_t SCENE_COMMAND_QUEUE_SIZE = 4096;
+
+// Lets the render thread tell its own calls from the ones it has to queue
+static thread_local const VulkanRenderer* t_renderThreadOf = nullptr;
+
+// Planes of the view frustum, pointing inwards, from a view-projection
+// matrix with Vulkan's 0 to 1 depth range
+static std::array<glm::vec4, 6> getFrustumPlanes(const glm::mat4& viewProjection)
+{
+	auto row = [&viewProjection](int i) {
+		return glm::vec4(viewProjection[0][i], viewProjection[1][i], viewProjection[2][i], viewProjection[3][i]);
+	};
+
+	std::array<glm::vec4, 6> planes = {
+		row(3) + row(0), row(3) - row(0), // left, right
+		row(3) + row(1), row(3) - row(1), // top, bottom
+		row(2), row(3) - row(2)           // near, far
+	};
+	for (auto& plane : planes) {
+		plane = plane / glm::length(glm::vec3(plane.x, plane.y, plane.z));
+	}
+	return planes;
+}
+
+static bool isSphereVisible(const std::array<glm::vec4, 6>& planes, const glm::mat4& model, const glm::vec4& bounds)
+{
+	glm::vec4 centre = model * glm::vec4(bounds.x, bounds.y, bounds.z, 1.0f);
+	float scale = std::max(glm::length(glm::vec3(model[0].x, model[0].y, model[0].z)),
+		std::max(glm::length(glm::vec3(model[1].x, model[1].y, model[1].z)),
+			glm::length(glm::vec3(model[2].x, model[2].y, model[2].z))));
+	float radius = bounds.w * scale;
+
+	for (const auto& plane : planes) {
+		if (plane.x * centre.x + plane.y * centre.y + plane.z * centre.z + plane.w < -radius) {
+			return false;
+		}
+	}
+	return true;
+}
+
+struct AnimatePushConstants {
+	float time;
+	uint32_t animationCount;
+	uint32_t objectBuffer;
+	uint32_t animationBuffer;
+};
+
+struct LightCullPushConstants {
+	glm::mat4 view;
+	glm::vec2 projectionScale;
+	glm::vec2 tileSize;
+	float nearPlane;
+	float farPlane;
+	uint32_t lightCount;
+	uint32_t lightBuffer;
+	uint32_t clusterBuffer;
+};
+
+// Must match DrawCommandBuffer in cull.comp, the draw command buffer
+// starts with these. Reset for each frame, counted up by the cull passes.
+struct DrawCounts {
+	uint32_t early;     // compacted commands of the early pass
+	uint32_t late;      // compacted opaque commands of the late pass
+	uint32_t triangles; // drawn by either pass
+};
+
+// Where a command lies in the draw command buffer
+VkDeviceSize getDrawCommandOffset(uint32_t command)
+{
+	return sizeof(DrawCounts) + sizeof(VkDrawIndexedIndirectCommand) * static_cast<VkDeviceSize>(command);
+}
+
+struct CullPushConstants {
+	glm::mat4 viewProjection;
+	glm::vec2 depthSize;
+	uint32_t drawCount;
+	uint32_t objectBuffer;
+	uint32_t drawCommandBuffer;
+	uint32_t late;
+	uint32_t pyramidValid;
+	uint32_t firstTransparent;
+};
+
+struct DepthPyramidPushConstants {
+	uint32_t sourceWidth;
+	uint32_t sourceHeight;
+	uint32_t destinationWidth;
+	uint32_t destinationHeight;
+};
+
 VulkanRenderer::VulkanRenderer() :
 	m_window(nullptr), 
 	m_instance(nullptr), 
@@ -29,107 +174,205 @@ VulkanRenderer::~VulkanRenderer()
 {
 }
 
-int VulkanRenderer::init(GLFWwindow* window)
+int VulkanRenderer::init(GLFWwindow* window, const RendererSettings& settings)
 {
+	PROFILE_ZONE("init");
 	m_window = window;
+	m_settings = settings;
+	m_dynamicResolution = DynamicResolution(m_settings.targetFrameMs);
+	m_dynamicResolution.setEnabled(m_settings.dynamicResolution);
+
+	uint32_t workerThreads = m_settings.workerThreads < 0 ? JobSystem::getDefaultWorkerCount()
+		: static_cast<uint32_t>(m_settings.workerThreads);
+	m_jobs = std::make_unique<JobSystem>(workerThreads);
+
+	if (!m_settings.statsPath.empty()) {
+		m_statsFile.open(m_settings.statsPath, std::ios::app);
+		if (!m_statsFile) {
+			std::cout << "ERROR: Failed to open " << m_settings.statsPath << " for statistics" << std::endl;
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (m_settings.framesInFlight < 1 || m_settings.framesInFlight > MAX_FRAME_DRAWS) {
+		std::cout << "ERROR: frames in flight must be between 1 and " << MAX_FRAME_DRAWS << std::endl;
+		return EXIT_FAILURE;
+	}
+	m_initStart = std::chrono::steady_clock::now();
+
+	glfwSetWindowUserPointer(m_window, this);
+	glfwSetFramebufferSizeCallback(m_window, framebufferResizeCallback);
+	int width = 0, height = 0;
+	glfwGetFramebufferSize(m_window, &width, &height);
+	m_framebufferWidth = width;
+	m_framebufferHeight = height;
+
+	// The order matters! E.g. an instance is needed to get the
+	// physical device, a physical device to get the logical device
+	// etc. Each step declares what it needs, and steps that don't
+	// depend on each other (e.g. pipeline creation and mesh uploads)
+	// run concurrently.
+	TaskGraph initGraph;
+	auto instance = initGraph.addTask("createInstance", [this] { createInstance(); });
+	auto surface = initGraph.addTask("createSurface", [this] { createSurface(); }, { instance });
+	auto physicalDevice = initGraph.addTask("getPhysicalDevice", [this] { getPhysicalDevice(); }, { surface });
+	auto logicalDevice = initGraph.addTask("createLogicalDevice", [this] { createLogicalDevice(); }, { physicalDevice });
+
+	auto swapChain = initGraph.addTask("createSwapChain", [this] { createSwapChain(VK_NULL_HANDLE); }, { logicalDevice });
+	auto renderPass = initGraph.addTask("createRenderPass", [this] { createRenderPass(); }, { swapChain });
+	initGraph.addTask("createFrameCapture", [this] { createFrameCapture(); }, { swapChain });
+	auto descriptorSetLayout = initGraph.addTask("createDescriptorSetLayout", [this] { createDescriptorSetLayout(); },
+		{ logicalDevice });
+	initGraph.addTask("createGraphicsPipeline", [this] { createGraphicsPipeline(); }, { renderPass, descriptorSetLayout });
+	initGraph.addTask("createAnimatePipeline", [this] { createAnimatePipeline(); }, { descriptorSetLayout });
+	initGraph.addTask("createLightCullPipeline", [this] { createLightCullPipeline(); }, { descriptorSetLayout });
+	initGraph.addTask("createOcclusionPipelines", [this] { createOcclusionPipelines(); }, { descriptorSetLayout });
+	auto renderGraph = initGraph.addTask("createRenderGraph", [this] { createRenderGraph(); }, { swapChain });
+	initGraph.addTask("createFramebuffers", [this] { createFramebuffers(); }, { renderPass, renderGraph });
+	auto commandPool = initGraph.addTask("createCommandPool", [this] { createCommandPool(); }, { logicalDevice });
+
+	auto residency = initGraph.addTask("createResidencyManager", [this] { createResidencyManager(); }, { logicalDevice });
+
+	// Uploads are the only user of the transfer pool and queue during init
+	auto geometryCache = initGraph.addTask("createGeometryCache", [this] { createGeometryCache(); },
+		{ commandPool, residency });
+	initGraph.addTask("createMeshes", [this] { createMeshes(); }, { geometryCache });
+	auto frameContexts = initGraph.addTask("createFrameContexts", [this] { createFrameContexts(); }, { logicalDevice });
+
+	auto uniformBuffers = initGraph.addTask("createUniformBuffers", [this] { createUniformBuffers(); }, { frameContexts });
+	auto descriptorAllocators = initGraph.addTask("createDescriptorAllocators", [this] { createDescriptorAllocators(); },
+		{ frameContexts });
+	auto descriptorSets = initGraph.addTask("createDescriptorSets", [this] { createDescriptorSets(); },
+		{ descriptorAllocators, descriptorSetLayout, uniformBuffers });
+	initGraph.addTask("createTextureStreamer", [this] { createTextureStreamer(); }, { descriptorSets, residency });
+
 	try {
-		// The order matters! E.g. an instance
-		// is needed to get the phsyical device,
-		// a physical device to get the logical 
-		// device etc.
-		createInstance();
-		createSurface();
-		getPhysicalDevice();
-		createLogicalDevice();
-		createSwapChain();
-		createRenderPass();
-		createDescriptorSetLayout();
-		createPushConstantRange();
-		createGraphicsPipeline();
-		createFramebuffers();
-		createCommandPool();
-
-		m_uboViewProjection.projection = glm::perspective(glm::radians(45.0f),
-			(float)m_swapChainExtent.width / (float)m_swapChainExtent.height,
-			0.1f, 100.0f);
-		m_uboViewProjection.view = glm::lookAt(glm::vec3(0.0f, 0.0f, 2.0f), 
-			glm::vec3(0.0f, 0.0f, 0.0f), glm::vec3(0.0f, 1.0f, 0.0f));
-		m_uboViewProjection.projection[1][1] *= -1; // invert Y axis 
-
-		// create mesh
-		std::vector<Vertex> mesh1vertices = {
-			{{-0.4, 0.4, 0.0}, {1.0, 0.0, 0.0}},	// 0
-			{{-0.4, -0.4, 0.0}, {0.0, 0.0, 1.0}},		// 1
-			{{0.4, -0.4, 0.0}, {0.0, 1.0, 0.0}},	// 2
-			{{0.4, 0.4, 0.0}, {1.0, 1.0, 0.0}},	// 3
-		};
-
-		std::vector<Vertex> mesh2vertices = {
-			{{-0.25, 0.6, 0.0}, {1.0, 0.0, 0.0}},	// 0
-			{{-0.25, -0.6, 0.0}, {0.0, 0.0, 1.0}},		// 1
-			{{0.25, -0.6, 0.0}, {0.0, 1.0, 0.0}},	// 2
-			{{0.25, 0.6, 0.0}, {1.0, 1.0, 0.0}},	// 3
-		};
-
-		std::vector<uint32_t> meshIndices = {
-			0, 1, 2,
-			2, 3, 0
-		};
-
-		Mesh mesh1 = Mesh(m_device.physicalDevice, m_device.logicalDevice, m_graphicsQueue, m_graphicsCommandPool,
-			&mesh1vertices, &meshIndices);
-		Mesh mesh2 = Mesh(m_device.physicalDevice, m_device.logicalDevice, m_graphicsQueue, m_graphicsCommandPool,
-			&mesh2vertices, &meshIndices);
-
-		m_meshList.push_back(mesh1);
-		m_meshList.push_back(mesh2);
-
-		createCommandBuffers();
-		createSynchronisation();
-		createUniformBuffers();
-		createDescriptorPool();
-		createDescriptorSets();
+		initGraph.run();
 	}
 	catch (std::runtime_error& e) {
 		std::cout << "ERROR: " << e.what() << std::endl;
 		return EXIT_FAILURE;
 	};
 
+	initGraph.printTrace(std::cout);
+	m_renderGraph->printSummary(std::cout);
+
+	updateProjection();
+	m_uboViewProjection.view = glm::lookAt(glm::vec3(0.0f, 0.0f, 2.0f), 
+		glm::vec3(0.0f, 0.0f, 0.0f), glm::vec3(0.0f, 1.0f, 0.0f));
+
+	// Only calls made from here on are recorded, the demo scene is recreated
+	// from the header's flag
+	if (!m_settings.recordPath.empty()) {
+		SceneLogHeader header;
+		header.extent = m_swapChainExtent;
+		header.demoScene = m_settings.demoScene;
+		try {
+			m_recorder.open(m_settings.recordPath, header);
+		}
+		catch (std::runtime_error& e) {
+			std::cout << "ERROR: " << e.what() << std::endl;
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (m_settings.renderThread) {
+		m_commands = std::make_unique<SpscQueue<SceneCommand>>(SCENE_COMMAND_QUEUE_SIZE);
+		m_renderThread = std::thread([this] { renderLoop(); });
+	}
+
 	return EXIT_SUCCESS;
 }
 
 void VulkanRenderer::cleanup()
 {
+	stopRenderThread();
+
 	// wait until the device is idle before destroying anything
 	vkDeviceWaitIdle(m_device.logicalDevice);
 
-	vkDestroyDescriptorPool(m_device.logicalDevice, m_descriptorPool, nullptr);
+	m_recorder.close();
 
-	for (auto mesh : m_meshList) {
-		mesh.destroyBuffers();
+	// anything retired by a swapchain recreation can go now
+	m_deletionQueue.flushAll();
+
+	// Every captured frame has completed, hand them all to the writer
+	if (m_frameCapture) {
+		m_frameCapture->collect(std::numeric_limits<uint64_t>::max());
+		m_frameCapture->destroy();
+		m_frameCapture->printStats(std::cout);
 	}
 
-	vkDestroyDescriptorSetLayout(m_device.logicalDevice, m_descriptorSetLayout, nullptr);
+	m_renderGraph->destroy();
+	m_depthPyramid.destroy();
 
-	for (size_t i = 0; i < m_swapChainImages.size(); i++) {
-		vkDestroyBuffer(m_device.logicalDevice, m_vpUniformBuffers[i], nullptr);
-		vkFreeMemory(m_device.logicalDevice, m_vpUniformBufferMemory[i], nullptr);
-	}
+	m_textureStreamer.destroy();
+	vkDestroySampler(m_device.logicalDevice, m_textureSampler, nullptr);
+
+	m_bindlessAllocator.destroy();
+	m_descriptorAllocator.destroy();
+	m_descriptorCache.clear();
+
+	m_geometryCache.printStats(std::cout);
+	m_geometryCache.destroy();
+
+	vkDestroyDescriptorSetLayout(m_device.logicalDevice, m_bindlessSetLayout, nullptr);
+	vkDestroyDescriptorSetLayout(m_device.logicalDevice, m_descriptorSetLayout, nullptr);
 
 	// cleanup in reverse creation order
-	for (size_t i = 0; i < MAX_FRAME_DRAWS; i++) {
-		vkDestroySemaphore(m_device.logicalDevice, m_imageAvailable[i], nullptr);
-		vkDestroySemaphore(m_device.logicalDevice, m_renderFinished[i], nullptr);
-		vkDestroyFence(m_device.logicalDevice, m_drawFences[i], nullptr);
-	}
-	vkDestroyCommandPool(m_device.logicalDevice, m_graphicsCommandPool, nullptr);
-	for (auto framebuffer : m_swapChainFramebuffers) {
-		vkDestroyFramebuffer(m_device.logicalDevice, framebuffer, nullptr);
+	for (auto& frame : m_frames) {
+		vkUnmapMemory(m_device.logicalDevice, frame.vpUniformBufferMemory);
+		vkDestroyBuffer(m_device.logicalDevice, frame.vpUniformBuffer, nullptr);
+		vkFreeMemory(m_device.logicalDevice, frame.vpUniformBufferMemory, nullptr);
+		vkUnmapMemory(m_device.logicalDevice, frame.objectBufferMemory);
+		vkDestroyBuffer(m_device.logicalDevice, frame.objectBuffer, nullptr);
+		vkFreeMemory(m_device.logicalDevice, frame.objectBufferMemory, nullptr);
+		vkUnmapMemory(m_device.logicalDevice, frame.animationBufferMemory);
+		vkDestroyBuffer(m_device.logicalDevice, frame.animationBuffer, nullptr);
+		vkFreeMemory(m_device.logicalDevice, frame.animationBufferMemory, nullptr);
+		if (frame.drawCommandBuffer != VK_NULL_HANDLE) {
+			vkUnmapMemory(m_device.logicalDevice, frame.drawCommandBufferMemory);
+			vkDestroyBuffer(m_device.logicalDevice, frame.drawCommandBuffer, nullptr);
+			vkFreeMemory(m_device.logicalDevice, frame.drawCommandBufferMemory, nullptr);
+		}
+		vkUnmapMemory(m_device.logicalDevice, frame.lightBufferMemory);
+		vkDestroyBuffer(m_device.logicalDevice, frame.lightBuffer, nullptr);
+		vkFreeMemory(m_device.logicalDevice, frame.lightBufferMemory, nullptr);
+		vkDestroyBuffer(m_device.logicalDevice, frame.clusterBuffer, nullptr);
+		vkFreeMemory(m_device.logicalDevice, frame.clusterBufferMemory, nullptr);
+		frame.descriptorAllocator.destroy();
+		vkDestroyQueryPool(m_device.logicalDevice, frame.timestampPool, nullptr);
+		vkDestroyQueryPool(m_device.logicalDevice, frame.computeTimestampPool, nullptr);
+		vkDestroySemaphore(m_device.logicalDevice, frame.imageAvailable, nullptr);
+		vkDestroySemaphore(m_device.logicalDevice, frame.computeFinished, nullptr);
+		vkDestroyCommandPool(m_device.logicalDevice, frame.computeCommandPool, nullptr);
+		vkDestroyFence(m_device.logicalDevice, frame.fence, nullptr);
+		vkDestroyCommandPool(m_device.logicalDevice, frame.commandPool, nullptr);
+		for (VkCommandPool pool : frame.scenePools) {
+			vkDestroyCommandPool(m_device.logicalDevice, pool, nullptr);
+		}
 	}
+	vkDestroyCommandPool(m_device.logicalDevice, m_transferCommandPool, nullptr);
+	vkDestroyFramebuffer(m_device.logicalDevice, m_sceneFramebuffer, nullptr);
+	vkDestroySampler(m_device.logicalDevice, m_depthSampler, nullptr);
+	vkDestroyPipeline(m_device.logicalDevice, m_cullPipeline, nullptr);
+	vkDestroyPipelineLayout(m_device.logicalDevice, m_cullPipelineLayout, nullptr);
+	vkDestroyDescriptorSetLayout(m_device.logicalDevice, m_cullSetLayout, nullptr);
+	vkDestroyPipeline(m_device.logicalDevice, m_depthPyramidPipeline, nullptr);
+	vkDestroyPipelineLayout(m_device.logicalDevice, m_depthPyramidPipelineLayout, nullptr);
+	vkDestroyDescriptorSetLayout(m_device.logicalDevice, m_depthPyramidSetLayout, nullptr);
+	vkDestroyPipeline(m_device.logicalDevice, m_lightCullPipeline, nullptr);
+	vkDestroyPipelineLayout(m_device.logicalDevice, m_lightCullPipelineLayout, nullptr);
+	vkDestroyPipeline(m_device.logicalDevice, m_animatePipeline, nullptr);
+	vkDestroyPipelineLayout(m_device.logicalDevice, m_animatePipelineLayout, nullptr);
+	vkDestroyPipeline(m_device.logicalDevice, m_blendedPipeline, nullptr);
+	vkDestroyPipeline(m_device.logicalDevice, m_transparentPipeline, nullptr);
 	vkDestroyPipeline(m_device.logicalDevice, m_graphicsPipeline, nullptr);
 	vkDestroyPipelineLayout(m_device.logicalDevice, m_pipelineLayout, nullptr);
+	vkDestroyRenderPass(m_device.logicalDevice, m_lateRenderPass, nullptr);
 	vkDestroyRenderPass(m_device.logicalDevice, m_renderPass, nullptr);
 	for (const auto& swapChainImage : m_swapChainImages) {
+		vkDestroySemaphore(m_device.logicalDevice, swapChainImage.renderFinished, nullptr);
 		vkDestroyImageView(m_device.logicalDevice, swapChainImage.imageView, nullptr);
 	}
 
@@ -141,153 +384,991 @@ void VulkanRenderer::cleanup()
 
 void VulkanRenderer::draw()
 {
+	if (!isOffRenderThread()) {
+		drawFrame();
+		return;
+	}
+
+	SceneCommand command{};
+	command.type = SceneCommand::EndFrame;
+	command.inputSampledAt = m_simInputSampledAt;
+	command.inputSampled = m_simInputSampled;
+	m_simInputSampled = false;
+	publishBatch(command);
+
+	// Simulation and rendering overlap by one frame: the next one can be
+	// simulated once this one has been picked up
+	std::unique_lock<std::mutex> lock(m_renderMutex);
+	m_frameStarted.wait(lock, [this] { return m_framesStarted >= m_framesPublished || m_renderError; });
+	if (m_renderError) {
+		std::rethrow_exception(m_renderError);
+	}
+}
+
+bool VulkanRenderer::isOffRenderThread() const
+{
+	return m_commands && t_renderThreadOf != this;
+}
+
+void VulkanRenderer::pushCommand(const SceneCommand& command)
+{
+	// A full queue is drained by the render thread between frames
+	while (!m_commands->push(command)) {
+		{
+			std::lock_guard<std::mutex> lock(m_renderMutex);
+			m_commandsWaiting = true;
+		}
+		m_renderWake.notify_one();
+		std::this_thread::yield();
+	}
+}
+
+void VulkanRenderer::publishBatch(const SceneCommand& command)
+{
+	pushCommand(command);
+	{
+		std::lock_guard<std::mutex> lock(m_renderMutex);
+		m_batchesPublished++;
+		if (command.type == SceneCommand::EndFrame) {
+			m_framesPublished++;
+		}
+	}
+	m_renderWake.notify_one();
+}
+
+void VulkanRenderer::runOnRenderThread(const std::function<void()>& call)
+{
+	std::promise<void> done;
+	std::future<void> result = done.get_future();
+
+	SceneCommand command{};
+	command.type = SceneCommand::Call;
+	command.call = &call;
+	command.done = &done;
+	publishBatch(command);
+
+	result.get();
+}
+
+void VulkanRenderer::applyCommand(const SceneCommand& command)
+{
+	switch (command.type) {
+	case SceneCommand::UpdateModel:
+		updateModel(command.mesh, command.matrix);
+		break;
+	case SceneCommand::SetAnimation:
+		setAnimation(command.mesh, command.animation);
+		break;
+	case SceneCommand::SetTexture:
+		setTexture(command.mesh, command.value);
+		break;
+	case SceneCommand::SetTransparent:
+		setTransparent(command.mesh, command.value != 0);
+		break;
+	case SceneCommand::RemoveMesh:
+		removeMesh(command.mesh);
+		break;
+	case SceneCommand::SetView:
+		setView(command.matrix);
+		break;
+	case SceneCommand::SetPresentMode:
+		setPresentMode(static_cast<VkPresentModeKHR>(command.value));
+		break;
+	case SceneCommand::SetAnimationTime:
+		setAnimationTime(command.time);
+		break;
+	default:
+		break;
+	}
+}
+
+void VulkanRenderer::renderLoop()
+{
+	t_renderThreadOf = this;
+	Profiler::setThreadName("render");
+
+	while (true) {
+		{
+			std::unique_lock<std::mutex> lock(m_renderMutex);
+			m_renderWake.wait(lock, [this] {
+				return m_renderStopping || m_commandsWaiting || m_batchesTaken < m_batchesPublished;
+			});
+			if (m_renderStopping) {
+				return;
+			}
+			m_commandsWaiting = false;
+		}
+
+		// Everything up to the end of a frame or a call, or all there is when
+		// woken up by a full queue
+		SceneCommand command;
+		while (m_commands->pop(command)) {
+			if (command.type == SceneCommand::Call) {
+				{
+					std::lock_guard<std::mutex> lock(m_renderMutex);
+					m_batchesTaken++;
+				}
+				try {
+					(*command.call)();
+					command.done->set_value();
+				}
+				catch (...) {
+					command.done->set_exception(std::current_exception());
+				}
+				break;
+			}
+
+			if (command.type == SceneCommand::EndFrame) {
+				bool failed;
+				{
+					std::lock_guard<std::mutex> lock(m_renderMutex);
+					m_batchesTaken++;
+					m_framesStarted++;
+					m_publishedMetrics.frameNumber = m_frameNumber;
+					m_publishedMetrics.inputToPresentMs = m_inputToPresentMs;
+					m_publishedMetrics.resolutionScale = m_dynamicResolution.getScale();
+					m_publishedMetrics.resolutionHitRate = m_dynamicResolution.getHitRate();
+					m_publishedMetrics.gpuFrameMs = m_dynamicResolution.getGpuFrameMs();
+					m_publishedMetrics.textureUploadMBps = m_textureStreamer.getMegabytesPerSecond();
+					failed = m_renderError != nullptr;
+				}
+				m_frameStarted.notify_all();
+
+				// Nothing more is drawn after a failure, draw() keeps rethrowing it
+				if (!failed) {
+					m_inputSampledAt = command.inputSampledAt;
+					m_inputSampled = command.inputSampled;
+					try {
+						drawFrame();
+					}
+					catch (...) {
+						{
+							std::lock_guard<std::mutex> lock(m_renderMutex);
+							m_renderError = std::current_exception();
+						}
+						m_frameStarted.notify_all();
+					}
+				}
+				break;
+			}
+
+			applyCommand(command);
+		}
+	}
+}
+
+void VulkanRenderer::stopRenderThread()
+{
+	if (!m_renderThread.joinable()) {
+		return;
+	}
+	{
+		std::lock_guard<std::mutex> lock(m_renderMutex);
+		m_renderStopping = true;
+	}
+	m_renderWake.notify_one();
+	m_renderThread.join();
+	m_commands.reset();
+}
+
+void VulkanRenderer::drawFrame()
+{
+	if (!m_animationTimeSet) {
+		m_animationTime = std::chrono::duration<double>(Clock::now() - m_initStart).count();
+	}
+	m_animationTimeSet = false;
+	m_recorder.draw(m_frameNumber, m_animationTime);
+
+	// Handle resizes before acquiring, so the image we get already has the
+	// right size. Nothing can be drawn while the window is minimised.
+	if (m_framebufferResized && !recreateSwapChain()) {
+		return;
+	}
+
+	PROFILE_ZONE("draw");
+	auto drawStart = Clock::now();
+	uint64_t heapAllocationsAtStart = AllocationCounter::getCount();
+	FrameContext& frame = m_frames[m_currentFrame];
+
+	// Time spent blocked on the GPU or the display is what low latency mode
+	// moves in front of input sampling. The estimate is of the whole wait,
+	// including what waitForNextFrame already took out of it, or it would
+	// only converge on part of it.
+	auto blockedStart = Clock::now();
+	double blockedMs = m_waitedAheadMs;
+	m_waitedAheadMs = 0.0;
+
+	// Wait until the GPU is done with this context before reusing anything in it
+	{
+		PROFILE_ZONE("waitForFence");
+		vkWaitForFences(m_device.logicalDevice, 1, &frame.fence,
+			VK_TRUE, std::numeric_limits<uint64_t>::max());
+	}
+	RenderStats::addFenceWait(std::chrono::duration<double, std::milli>(Clock::now() - blockedStart).count());
+
+	// Nothing recorded from this context is in use any more
+	frame.arena.reset();
+
+	readGpuFrameTime(frame);
+	readOcclusionResults(frame);
+
+	// The fence guarantees that every frame up to framesInFlight ago is done
+	uint64_t framesInFlight = static_cast<uint64_t>(m_settings.framesInFlight);
+	if (m_frameNumber + 1 >= framesInFlight) {
+		m_deletionQueue.flush(m_frameNumber + 1 - framesInFlight);
+		if (m_frameCapture) {
+			m_frameCapture->collect(m_frameNumber + 1 - framesInFlight);
+		}
+	}
+
+	// Before the object data is written, so that it refers to the
+	// textures' and meshes' current images and buffers
+	{
+		PROFILE_ZONE("residency");
+		m_textureStreamer.applyReplacements(m_deletionQueue, m_frameNumber);
+		m_residency.update(m_frameNumber);
+	}
+
 	// Get next image
 	uint32_t imageIndex;
-	vkAcquireNextImageKHR(m_device.logicalDevice, m_swapchain, std::numeric_limits<uint64_t>::max(),
-		m_imageAvailable[m_currentFrame], VK_NULL_HANDLE, &imageIndex);
+	VkResult result;
+	{
+		PROFILE_ZONE("acquireImage");
+		auto acquireStart = Clock::now();
+		result = vkAcquireNextImageKHR(m_device.logicalDevice, m_swapchain, std::numeric_limits<uint64_t>::max(),
+			frame.imageAvailable, VK_NULL_HANDLE, &imageIndex);
+		RenderStats::addAcquire(std::chrono::duration<double, std::milli>(Clock::now() - acquireStart).count());
+	}
+
+	// Out of date means no image was acquired, so the frame is skipped. A suboptimal
+	// swapchain can still be presented to, and gets recreated after this frame.
+	if (result == VK_ERROR_OUT_OF_DATE_KHR) {
+		recreateSwapChain();
+		return;
+	}
+	if (result != VK_SUCCESS && result != VK_SUBOPTIMAL_KHR) {
+		throw std::runtime_error("Failed to acquire swapchain image");
+	}
+
+	// With more swapchain images than frames in flight (or images returned out
+	// of order) the image may still be in use by another context's frame
+	if (m_imagesInFlight[imageIndex] != VK_NULL_HANDLE && m_imagesInFlight[imageIndex] != frame.fence) {
+		PROFILE_ZONE("waitForImage");
+		auto waitStart = Clock::now();
+		vkWaitForFences(m_device.logicalDevice, 1, &m_imagesInFlight[imageIndex],
+			VK_TRUE, std::numeric_limits<uint64_t>::max());
+		RenderStats::addFenceWait(std::chrono::duration<double, std::milli>(Clock::now() - waitStart).count());
+	}
+	m_imagesInFlight[imageIndex] = frame.fence;
+	blockedMs += std::chrono::duration<double, std::milli>(Clock::now() - blockedStart).count();
 
-	vkWaitForFences(m_device.logicalDevice, 1, &m_drawFences[m_currentFrame], 
-		VK_TRUE, std::numeric_limits<uint32_t>::max());
-	vkResetFences(m_device.logicalDevice, 1, &m_drawFences[m_currentFrame]);
+	// Only reset once we know work will be submitted with this fence
+	vkResetFences(m_device.logicalDevice, 1, &frame.fence);
 
-	recordCommands(imageIndex);
-	updateUniformBuffers(imageIndex);
+	// One call recycles every command buffer allocated from this frame's pool
+	vkResetCommandPool(m_device.logicalDevice, frame.commandPool, 0);
+	for (VkCommandPool pool : frame.scenePools) {
+		vkResetCommandPool(m_device.logicalDevice, pool, 0);
+	}
+	frame.descriptorAllocator.reset();
+
+	float scale = m_dynamicResolution.getScale();
+	m_renderExtent.width = std::max(1u, static_cast<uint32_t>(m_swapChainExtent.width * scale));
+	m_renderExtent.height = std::max(1u, static_cast<uint32_t>(m_swapChainExtent.height * scale));
+
+	updateUniformBuffers(frame);
+
+	// The compute queue can start right away, while this frame's graphics
+	// work is still being recorded and the previous frame's still runs
+	bool asyncCompute = m_computeQueue != VK_NULL_HANDLE && m_renderGraph->hasAsyncCompute();
+	if (asyncCompute) {
+		submitAsyncCompute(frame);
+	}
+	recordCommands(frame, imageIndex);
 
 	// Submit command buffer
 	VkSubmitInfo submitInfo{};
 	submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
-	submitInfo.waitSemaphoreCount = 1;
-	submitInfo.pWaitSemaphores = &m_imageAvailable[m_currentFrame];
+	// The swapchain image is first touched by the upscale blit, the scene
+	// can be drawn before it has been acquired. The stages that use what
+	// the compute queue produced wait for it.
+	VkSemaphore waitSemaphores[] = { frame.imageAvailable, frame.computeFinished };
 	VkPipelineStageFlags waitStages[] = {
-		VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT
+		VK_PIPELINE_STAGE_TRANSFER_BIT,
+		m_renderGraph->getAsyncComputeWaitStages()
 	};
+	submitInfo.waitSemaphoreCount = asyncCompute ? 2 : 1;
+	submitInfo.pWaitSemaphores = waitSemaphores;
 	submitInfo.pWaitDstStageMask = waitStages;
 	submitInfo.commandBufferCount = 1;
-	submitInfo.pCommandBuffers = &m_commandBuffers[imageIndex];
+	submitInfo.pCommandBuffers = &frame.commandBuffer;
 	submitInfo.signalSemaphoreCount = 1;
-	submitInfo.pSignalSemaphores = &m_renderFinished[m_currentFrame];
+	submitInfo.pSignalSemaphores = &m_swapChainImages[imageIndex].renderFinished;
 
-	VkResult result = vkQueueSubmit(m_graphicsQueue, 1, &submitInfo, m_drawFences[m_currentFrame]);
+	{
+		PROFILE_ZONE("submit");
+		result = vkQueueSubmit(m_graphicsQueue, 1, &submitInfo, frame.fence);
+	}
 	if (result != VK_SUCCESS) {
 		throw std::runtime_error("Failed to submit command buffer to queue.");
 	}
+	frame.frameNumber = m_frameNumber;
+	m_frameNumber++;
 
 	// Present rendered image to screen
 	VkPresentInfoKHR presentInfo{};
 	presentInfo.sType = VK_STRUCTURE_TYPE_PRESENT_INFO_KHR;
 	presentInfo.waitSemaphoreCount = 1;
-	presentInfo.pWaitSemaphores = &m_renderFinished[m_currentFrame];
+	presentInfo.pWaitSemaphores = &m_swapChainImages[imageIndex].renderFinished;
 	presentInfo.swapchainCount = 1;
 	presentInfo.pSwapchains = &m_swapchain;
 	presentInfo.pImageIndices = &imageIndex;
 
-	result = vkQueuePresentKHR(m_presentationQueue, &presentInfo);
-	if (result != VK_SUCCESS) {
+	recordInputToPresent();
+
+	auto presentStart = Clock::now();
+	{
+		PROFILE_ZONE("present");
+		result = vkQueuePresentKHR(m_presentationQueue, &presentInfo);
+	}
+	blockedMs += std::chrono::duration<double, std::milli>(Clock::now() - presentStart).count();
+	m_blockedEstimateMs = 0.9 * m_blockedEstimateMs + 0.1 * blockedMs;
+	if (result == VK_ERROR_OUT_OF_DATE_KHR || result == VK_SUBOPTIMAL_KHR) {
+		m_framebufferResized = true;
+	}
+	else if (result != VK_SUCCESS) {
 		throw std::runtime_error("Failed to present image");
 	}
 
-	m_currentFrame = (m_currentFrame + 1) % MAX_FRAME_DRAWS;
+	if (!m_firstFramePresented) {
+		m_firstFramePresented = true;
+		std::cout << "Time to first frame: " << std::chrono::duration<double, std::milli>(
+			std::chrono::steady_clock::now() - m_initStart).count() << " ms" << std::endl;
+	}
 
-}
+	m_currentFrame = (m_currentFrame + 1) % m_settings.framesInFlight;
 
-void VulkanRenderer::updateModel(int modelId, glm::mat4 newModel)
-{
-	if (modelId < m_meshList.size()) {
-		m_meshList[modelId].setModel(newModel);
-	}
+	RenderStats::countHeapAllocations(AllocationCounter::getCount() - heapAllocationsAtStart);
+	RenderStats::endFrame(frame.frameNumber, std::chrono::duration<double, std::milli>(Clock::now() - drawStart).count());
+	writeFrameStats();
 }
 
-void VulkanRenderer::createInstance()
+void VulkanRenderer::writeFrameStats()
 {
-	// Application metadata
-	VkApplicationInfo appInfo{};
-	appInfo.sType = VK_STRUCTURE_TYPE_APPLICATION_INFO;
-	appInfo.pApplicationName = "Vulkan Course Application";
-	appInfo.applicationVersion = VK_MAKE_VERSION(1, 0, 0);
-	appInfo.pEngineName = "Balengine";
-	appInfo.engineVersion = VK_MAKE_VERSION(0, 1, 0);
-	appInfo.apiVersion = VK_API_VERSION_1_0; // 1.2 is the latest
+	if (!m_statsFile.is_open()) {
+		return;
+	}
 
-	// Instance parameters
-	VkInstanceCreateInfo createInfo{};
-	createInfo.sType = VK_STRUCTURE_TYPE_INSTANCE_CREATE_INFO;
-	createInfo.pApplicationInfo = &appInfo;
+	// In batches, and only frames whose GPU times have had time to arrive,
+	// so that every frame is written once and complete
+	uint64_t lastComplete = m_frameNumber > MAX_FRAME_DRAWS ? m_frameNumber - MAX_FRAME_DRAWS : 0;
+	if (lastComplete < m_statsWrittenUpTo + STATS_WRITE_INTERVAL) {
+		return;
+	}
 
-	// Query instance extensions
-	NameList_t instanceExtensions{};
+	for (const auto& stats : RenderStats::getHistory()) {
+		if (stats.frameNumber >= m_statsWrittenUpTo && stats.frameNumber < lastComplete) {
+			RenderStats::writeJson(m_statsFile, stats);
+		}
+	}
+	m_statsWrittenUpTo = lastComplete;
+}
 
-	uint32_t glfwExtensionCount = 0;
-	const char** glfwExtensions;
-	glfwExtensions = glfwGetRequiredInstanceExtensions(&glfwExtensionCount);
+void VulkanRenderer::waitForNextFrame()
+{
+	if (!m_settings.lowLatency || isOffRenderThread()) {
+		return;
+	}
+	PROFILE_ZONE("waitForNextFrame");
+
+	// Do the fence wait that draw() would do anyway up front, then sleep for
+	// as long as the CPU usually ends up blocked on the display. That way the
+	// waiting happens before input is sampled instead of after.
+	auto waitStart = Clock::now();
+	vkWaitForFences(m_device.logicalDevice, 1, &m_frames[m_currentFrame].fence,
+		VK_TRUE, std::numeric_limits<uint64_t>::max());
+
+	// Keep a margin so that a late wake-up doesn't miss the next vblank
+	const double marginMs = 1.0;
+	if (m_blockedEstimateMs > marginMs) {
+		std::this_thread::sleep_for(std::chrono::duration<double, std::milli>(m_blockedEstimateMs - marginMs));
+	}
+	m_waitedAheadMs = std::chrono::duration<double, std::milli>(Clock::now() - waitStart).count();
+}
 
-	for (size_t i = 0; i < glfwExtensionCount; i++) {
-		instanceExtensions.push_back(glfwExtensions[i]);
+void VulkanRenderer::markInputSampled()
+{
+	if (isOffRenderThread()) {
+		m_simInputSampledAt = Clock::now();
+		m_simInputSampled = true;
+		return;
 	}
+	m_inputSampledAt = Clock::now();
+	m_inputSampled = true;
+}
 
-	if (!checkInstanceExtensionSupport(instanceExtensions)) {
-		throw std::runtime_error("VkInstance does not support the required extensions");
+double VulkanRenderer::getInputToPresentMs() const
+{
+	if (isOffRenderThread()) {
+		std::lock_guard<std::mutex> lock(m_renderMutex);
+		return m_publishedMetrics.inputToPresentMs;
 	}
+	return m_inputToPresentMs;
+}
 
-	createInfo.enabledExtensionCount = glfwExtensionCount;
-	createInfo.ppEnabledExtensionNames = instanceExtensions.data();
+void VulkanRenderer::setPresentMode(VkPresentModeKHR presentMode)
+{
+	if (isOffRenderThread()) {
+		SceneCommand command{};
+		command.type = SceneCommand::SetPresentMode;
+		command.value = static_cast<uint32_t>(presentMode);
+		pushCommand(command);
+		return;
+	}
+	m_recorder.setPresentMode(m_frameNumber, presentMode);
+	m_settings.presentMode = presentMode;
+	m_framebufferResized = true;
+}
 
-	// Check and create validation layers if needed
-	if (enableValidationLayers) {
+float VulkanRenderer::getResolutionScale() const
+{
+	if (isOffRenderThread()) {
+		std::lock_guard<std::mutex> lock(m_renderMutex);
+		return m_publishedMetrics.resolutionScale;
+	}
+	return m_dynamicResolution.getScale();
+}
 
-		if (!checkValidationLayers()) {
-			throw std::runtime_error("Validation layers requested, but not available!");
-		}
+double VulkanRenderer::getResolutionHitRate() const
+{
+	if (isOffRenderThread()) {
+		std::lock_guard<std::mutex> lock(m_renderMutex);
+		return m_publishedMetrics.resolutionHitRate;
+	}
+	return m_dynamicResolution.getHitRate();
+}
 
-		createInfo.enabledLayerCount = static_cast<uint32_t>(validationLayers.size());
-		createInfo.ppEnabledLayerNames = validationLayers.data();
+double VulkanRenderer::getGpuFrameMs() const
+{
+	if (isOffRenderThread()) {
+		std::lock_guard<std::mutex> lock(m_renderMutex);
+		return m_publishedMetrics.gpuFrameMs;
 	}
-	else {
-		createInfo.enabledLayerCount = 0;
-		createInfo.ppEnabledLayerNames = nullptr;
+	return m_dynamicResolution.getGpuFrameMs();
+}
+
+void VulkanRenderer::readGpuFrameTime(FrameContext& frame)
+{
+	if (!frame.timestampsWritten) {
+		return;
 	}
 
-	VkResult result = vkCreateInstance(&createInfo, nullptr, &m_instance);
+	// Each submission's results are read once, even when the next one is
+	// never made (an out of date swapchain skips it)
+	bool computeTimestampsWritten = frame.computeTimestampsWritten;
+	frame.timestampsWritten = false;
+	frame.computeTimestampsWritten = false;
 
+	// Called right after the fence wait, the closest we get to when it signalled
+	uint64_t fenceSeenNs = Profiler::now();
+
+	// The frame's fence has signalled, so the results are available without waiting
+	uint64_t timestamps[MAX_TIMESTAMP_QUERIES] = {};
+	uint32_t count = FIRST_PASS_QUERY + frame.passTimestamps;
+	VkResult result = vkGetQueryPoolResults(m_device.logicalDevice, frame.timestampPool, 0, count,
+		sizeof(timestamps), timestamps, sizeof(uint64_t), VK_QUERY_RESULT_64_BIT);
 	if (result != VK_SUCCESS) {
-		throw std::runtime_error("Failed to create a Vulkan instance");
+		return;
 	}
-}
 
-void VulkanRenderer::getPhysicalDevice()
-{
-	uint32_t deviceCount;
-	vkEnumeratePhysicalDevices(m_instance, &deviceCount, nullptr);
+	auto toMs = [this](uint64_t begin, uint64_t end) {
+		return static_cast<double>(end - begin) * m_timestampPeriod / 1e6;
+	};
+	double gpuMs = toMs(timestamps[0], timestamps[1]);
+	m_dynamicResolution.update(toMs(timestamps[SCENE_BEGIN_QUERY], timestamps[SCENE_END_QUERY])
+		+ toMs(timestamps[UPSCALE_BEGIN_QUERY], timestamps[UPSCALE_END_QUERY]));
+	RenderStats::setGpuTime(frame.frameNumber, gpuMs);
 
-	if (deviceCount == 0) {
-		throw std::runtime_error("No Vulkan physical devices available");
+	if (!Profiler::isCapturing()) {
+		return;
 	}
 
-	std::vector<VkPhysicalDevice> devices(deviceCount);
-	vkEnumeratePhysicalDevices(m_instance, &deviceCount, devices.data());
+	auto toCpuNs = [this](uint64_t timestamp) {
+		return static_cast<int64_t>(static_cast<double>(timestamp) * m_timestampPeriod);
+	};
 
-	// Pick the first suitable device
-	for (const auto& device : devices) {
-		if (checkDeviceSuitable(device)) {
-			m_device.physicalDevice = device;
+	int64_t offset = static_cast<int64_t>(fenceSeenNs) - toCpuNs(timestamps[1]);
+	if (!m_gpuClockCalibrated || offset < m_gpuClockOffsetNs) {
+		m_gpuClockOffsetNs = offset;
+		m_gpuClockCalibrated = true;
+	}
+
+	auto recordGpuZone = [&](const char* name, uint64_t begin, uint64_t end, uint32_t queue) {
+		int64_t beginNs = toCpuNs(begin) + m_gpuClockOffsetNs;
+		int64_t endNs = toCpuNs(end) + m_gpuClockOffsetNs;
+		if (beginNs > 0 && endNs >= beginNs) {
+			Profiler::recordGpuZone(name, static_cast<uint64_t>(beginNs), static_cast<uint64_t>(endNs), queue);
 		}
+	};
+
+	recordGpuZone("frame", timestamps[0], timestamps[1], Profiler::GPU_QUEUE_GRAPHICS);
+	for (uint32_t i = 0; i < frame.passTimestamps / 2 && i < m_gpuPassNames.size(); i++) {
+		recordGpuZone(m_gpuPassNames[i], timestamps[FIRST_PASS_QUERY + 2 * i], timestamps[FIRST_PASS_QUERY + 1 + 2 * i],
+			Profiler::GPU_QUEUE_GRAPHICS);
 	}
 
-	if (m_device.physicalDevice == nullptr) {
-		throw std::runtime_error("No suitable physical device found");
+	// The graphics work waited for the compute work, so it is done too.
+	// Desktop GPUs share one timestamp clock between their queues, which
+	// lets the same offset place both tracks.
+	if (!computeTimestampsWritten) {
+		return;
+	}
+	count = 2 + frame.computePassTimestamps;
+	result = vkGetQueryPoolResults(m_device.logicalDevice, frame.computeTimestampPool, 0, count,
+		sizeof(timestamps), timestamps, sizeof(uint64_t), VK_QUERY_RESULT_64_BIT);
+	if (result != VK_SUCCESS) {
+		return;
+	}
+	recordGpuZone("async compute", timestamps[0], timestamps[1], Profiler::GPU_QUEUE_COMPUTE);
+	for (uint32_t i = 0; i < frame.computePassTimestamps / 2 && i < m_gpuComputePassNames.size(); i++) {
+		recordGpuZone(m_gpuComputePassNames[i], timestamps[2 + 2 * i], timestamps[3 + 2 * i], Profiler::GPU_QUEUE_COMPUTE);
 	}
+}
 
-	VkPhysicalDeviceProperties deviceProperties{};
-	vkGetPhysicalDeviceProperties(m_device.physicalDevice, &deviceProperties);
-	std::cout << "Selected physical device " << deviceProperties.deviceName << std::endl;
+void VulkanRenderer::readOcclusionResults(FrameContext& frame)
+{
+	if (frame.drawCommandCount == 0) {
+		return;
+	}
 
+	// The fence has signalled and the graph made the counts visible to the
+	// host. An entry drawn by neither pass was occluded. Transparent entries
+	// are always left to the late pass, so only the opaque ones count.
+	const DrawCounts* counts = static_cast<const DrawCounts*>(frame.drawCommandBufferMapped);
+	uint32_t occluded = frame.firstTransparentDraw - counts->early - counts->late;
+	RenderStats::setOcclusion(frame.frameNumber, occluded, counts->late, counts->triangles);
+	frame.drawCommandCount = 0;
 }
 
-void VulkanRenderer::createLogicalDevice()
+void VulkanRenderer::recordInputToPresent()
 {
-	QueueFamilyIndices indices = getQueueFamilyIndices(m_device.physicalDevice);
+	if (!m_inputSampled) {
+		return;
+	}
+	m_inputSampled = false;
 
-	std::vector<VkDeviceQueueCreateInfo> queueCreateInfos;
+	auto now = Clock::now();
+	m_inputToPresentMs = std::chrono::duration<double, std::milli>(now - m_inputSampledAt).count();
+
+	if (m_latencyReport.frames == 0) {
+		m_latencyReport.windowStart = now;
+		m_latencyReport.totalMs = 0.0;
+		m_latencyReport.minMs = m_inputToPresentMs;
+		m_latencyReport.maxMs = m_inputToPresentMs;
+	}
+	m_latencyReport.totalMs += m_inputToPresentMs;
+	m_latencyReport.minMs = std::min(m_latencyReport.minMs, m_inputToPresentMs);
+	m_latencyReport.maxMs = std::max(m_latencyReport.maxMs, m_inputToPresentMs);
+	m_latencyReport.frames++;
+
+	// Report every few seconds
+	if (now - m_latencyReport.windowStart >= std::chrono::seconds(5)) {
+		std::cout << "Input to present: avg " << m_latencyReport.totalMs / m_latencyReport.frames
+			<< " ms, min " << m_latencyReport.minMs << " ms, max " << m_latencyReport.maxMs
+			<< " ms over " << m_latencyReport.frames << " frames" << std::endl;
+		if (m_dynamicResolution.isEnabled()) {
+			std::cout << "Resolution scale: " << static_cast<int>(m_dynamicResolution.getScale() * 100.0f)
+				<< "%, GPU " << m_dynamicResolution.getGpuFrameMs() << " ms, "
+				<< static_cast<int>(m_dynamicResolution.getHitRate() * 100.0) << "% of frames within "
+				<< m_dynamicResolution.getTargetFrameMs() << " ms" << std::endl;
+		}
+		m_residency.printStats(std::cout);
+		m_geometryCache.printStats(std::cout);
+		if (m_frameCapture) {
+			m_frameCapture->printStats(std::cout);
+		}
+		size_t frames = std::min<size_t>(m_latencyReport.frames, RenderStats::HISTORY_SIZE);
+		std::cout << "Average of the last " << frames << " frames: ";
+		RenderStats::writeText(std::cout, RenderStats::getAverage(frames));
+		m_latencyReport.frames = 0;
+	}
+}
+
+void VulkanRenderer::updateModel(MeshHandle mesh, glm::mat4 newModel)
+{
+	if (isOffRenderThread()) {
+		SceneCommand command{};
+		command.type = SceneCommand::UpdateModel;
+		command.mesh = mesh;
+		command.matrix = newModel;
+		pushCommand(command);
+		return;
+	}
+	m_recorder.updateModel(m_frameNumber, mesh, newModel);
+	if (MeshObject* object = m_meshes.get(mesh)) {
+		object->mesh.setModel(newModel);
+		object->stamp = ++m_objectStamp;
+		if (object->animated) {
+			m_animationVersion++; // the animation starts from the new model
+		}
+	}
+}
+
+void VulkanRenderer::setView(const glm::mat4& view)
+{
+	if (isOffRenderThread()) {
+		SceneCommand command{};
+		command.type = SceneCommand::SetView;
+		command.matrix = view;
+		pushCommand(command);
+		return;
+	}
+	m_recorder.setView(m_frameNumber, view);
+	m_uboViewProjection.view = view;
+}
+
+void VulkanRenderer::setAnimation(MeshHandle mesh, const ObjectAnimation& animation)
+{
+	if (isOffRenderThread()) {
+		SceneCommand command{};
+		command.type = SceneCommand::SetAnimation;
+		command.mesh = mesh;
+		command.animation = animation;
+		pushCommand(command);
+		return;
+	}
+	m_recorder.setAnimation(m_frameNumber, mesh, animation);
+	MeshObject* object = m_meshes.get(mesh);
+	if (!object) {
+		return;
+	}
+	object->animated = true;
+
+	ObjectAnimation entry = animation;
+	entry.objectIndex = m_meshes.getDenseIndex(mesh);
+
+	auto it = std::find_if(m_animations.begin(), m_animations.end(),
+		[&entry](const ObjectAnimation& other) { return other.objectIndex == entry.objectIndex; });
+	if (it != m_animations.end()) {
+		*it = entry;
+	}
+	else {
+		m_animations.push_back(entry);
+	}
+	m_animationVersion++;
+}
+
+uint32_t VulkanRenderer::loadTexture(const std::string& path)
+{
+	if (isOffRenderThread()) {
+		uint32_t texture = 0;
+		runOnRenderThread([&]() { texture = loadTexture(path); });
+		return texture;
+	}
+
+	PROFILE_ZONE("loadTexture");
+	m_recorder.loadTexture(m_frameNumber, path);
+	uint32_t texture = m_textureStreamer.load(path);
+
+	// Evicted textures keep their smallest levels, so they are still
+	// sampled (blurred) while they wait to be restored
+	VkMemoryRequirements requirements = m_textureStreamer.getMemoryRequirements(texture);
+	uint32_t heap = m_residency.getHeapIndex(requirements.memoryTypeBits, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+	m_textureResidency.push_back(m_residency.add(path, heap, requirements.size,
+		[this, texture]() { return m_textureStreamer.dropLevels(texture, EVICTED_TEXTURE_SIZE); },
+		[this, texture]() { return m_textureStreamer.restoreLevels(texture); }));
+
+	return texture;
+}
+
+void VulkanRenderer::setTexture(MeshHandle mesh, uint32_t texture)
+{
+	if (isOffRenderThread()) {
+		SceneCommand command{};
+		command.type = SceneCommand::SetTexture;
+		command.mesh = mesh;
+		command.value = texture;
+		pushCommand(command);
+		return;
+	}
+	m_recorder.setTexture(m_frameNumber, mesh, texture);
+	if (MeshObject* object = m_meshes.get(mesh)) {
+		object->mesh.setMaterialIndex(texture);
+		object->stamp = ++m_objectStamp;
+	}
+}
+
+void VulkanRenderer::setTransparent(MeshHandle mesh, bool transparent)
+{
+	if (isOffRenderThread()) {
+		SceneCommand command{};
+		command.type = SceneCommand::SetTransparent;
+		command.mesh = mesh;
+		command.value = transparent ? 1 : 0;
+		pushCommand(command);
+		return;
+	}
+	m_recorder.setTransparent(m_frameNumber, mesh, transparent);
+	if (MeshObject* object = m_meshes.get(mesh)) {
+		object->mesh.setTransparent(transparent);
+	}
+}
+
+double VulkanRenderer::getTextureUploadMBps() const
+{
+	if (isOffRenderThread()) {
+		std::lock_guard<std::mutex> lock(m_renderMutex);
+		return m_publishedMetrics.textureUploadMBps;
+	}
+	return m_textureStreamer.getMegabytesPerSecond();
+}
+
+void VulkanRenderer::setLights(const std::vector<PointLight>& lights)
+{
+	if (isOffRenderThread()) {
+		runOnRenderThread([this, &lights]() { setLights(lights); });
+		return;
+	}
+
+	m_recorder.setLights(m_frameNumber, lights);
+	m_lights = lights;
+	m_lightVersion++;
+}
+
+void VulkanRenderer::setAnimationTime(double seconds)
+{
+	if (isOffRenderThread()) {
+		SceneCommand command{};
+		command.type = SceneCommand::SetAnimationTime;
+		command.time = seconds;
+		pushCommand(command);
+		return;
+	}
+	m_animationTime = seconds;
+	m_animationTimeSet = true;
+}
+
+uint64_t VulkanRenderer::getFrameNumber() const
+{
+	if (isOffRenderThread()) {
+		std::lock_guard<std::mutex> lock(m_renderMutex);
+		return m_publishedMetrics.frameNumber;
+	}
+	return m_frameNumber;
+}
+
+JobSystem& VulkanRenderer::getJobSystem()
+{
+	return *m_jobs;
+}
+
+void VulkanRenderer::setWorkerThreads(uint32_t count)
+{
+	if (isOffRenderThread()) {
+		runOnRenderThread([this, count]() { setWorkerThreads(count); });
+		return;
+	}
+
+	m_jobs.reset();
+	m_jobs = std::make_unique<JobSystem>(count);
+}
+
+void VulkanRenderer::setRenderQueue(bool enabled)
+{
+	if (isOffRenderThread()) {
+		runOnRenderThread([this, enabled]() { setRenderQueue(enabled); });
+		return;
+	}
+
+	m_settings.renderQueue = enabled;
+}
+
+bool VulkanRenderer::recreateSwapChain()
+{
+	PROFILE_ZONE("recreateSwapChain");
+
+	// A minimised window has a zero sized framebuffer, which no swapchain
+	// can be created for. Keep the flag set and try again on a later frame.
+	int width = m_framebufferWidth;
+	int height = m_framebufferHeight;
+	if (width == 0 || height == 0) {
+		m_framebufferResized = true;
+		return false;
+	}
+	m_framebufferResized = false;
+
+	// Nothing is destroyed right away: frames in flight may still use the old
+	// objects, so they go to the deletion queue and are freed once those frames
+	// have retired. This avoids waiting for the device to go idle.
+	VkDevice device = m_device.logicalDevice;
+	VkSwapchainKHR oldSwapchain = m_swapchain;
+	VkFormat oldFormat = m_swapChainImageFormat;
+	auto oldImages = m_swapChainImages;
+
+	createSwapChain(oldSwapchain);
+
+	m_deletionQueue.push(m_frameNumber, [device, oldSwapchain, oldImages]() {
+		for (const auto& swapChainImage : oldImages) {
+			vkDestroySemaphore(device, swapChainImage.renderFinished, nullptr);
+			vkDestroyImageView(device, swapChainImage.imageView, nullptr);
+		}
+		vkDestroySwapchainKHR(device, oldSwapchain, nullptr);
+	});
+
+	// The render pass and the pipeline only depend on the image format,
+	// which normally stays the same across a resize
+	if (m_swapChainImageFormat != oldFormat) {
+		VkRenderPass oldRenderPass = m_renderPass;
+		VkRenderPass oldLateRenderPass = m_lateRenderPass;
+		std::array<VkPipeline, 3> oldPipelines = { m_graphicsPipeline, m_transparentPipeline, m_blendedPipeline };
+		VkPipelineLayout oldPipelineLayout = m_pipelineLayout;
+		m_deletionQueue.push(m_frameNumber, [device, oldRenderPass, oldLateRenderPass, oldPipelines, oldPipelineLayout]() {
+			for (VkPipeline oldPipeline : oldPipelines) {
+				vkDestroyPipeline(device, oldPipeline, nullptr);
+			}
+			vkDestroyPipelineLayout(device, oldPipelineLayout, nullptr);
+			vkDestroyRenderPass(device, oldLateRenderPass, nullptr);
+			vkDestroyRenderPass(device, oldRenderPass, nullptr);
+		});
+
+		createRenderPass();
+		createGraphicsPipeline();
+	}
+
+	// Transient images are sized to the swapchain, so the graph and the
+	// framebuffer of the scene target are rebuilt, as is the depth pyramid
+	auto oldRenderGraph = m_renderGraph;
+	VkFramebuffer oldFramebuffer = m_sceneFramebuffer;
+	DepthPyramid oldDepthPyramid = m_depthPyramid;
+	m_deletionQueue.push(m_frameNumber, [device, oldRenderGraph, oldFramebuffer, oldDepthPyramid]() mutable {
+		vkDestroyFramebuffer(device, oldFramebuffer, nullptr);
+		oldRenderGraph->destroy();
+		oldDepthPyramid.destroy();
+	});
+	createRenderGraph();
+	createFramebuffers();
+
+	updateProjection();
+
+	return true;
+}
+
+void VulkanRenderer::updateProjection()
+{
+	m_uboViewProjection.projection = glm::perspective(glm::radians(45.0f),
+		(float)m_swapChainExtent.width / (float)m_swapChainExtent.height,
+		NEAR_PLANE, FAR_PLANE);
+	m_uboViewProjection.projection[1][1] *= -1; // invert Y axis 
+
+	// Depth slices of the light clusters are spaced exponentially
+	float depthRange = std::log(FAR_PLANE / NEAR_PLANE);
+	m_uboViewProjection.clusterDepthScale = CLUSTER_COUNT_Z / depthRange;
+	m_uboViewProjection.clusterDepthBias = CLUSTER_COUNT_Z * std::log(NEAR_PLANE) / depthRange;
+}
+
+void VulkanRenderer::framebufferResizeCallback(GLFWwindow* window, int width, int height)
+{
+	auto renderer = reinterpret_cast<VulkanRenderer*>(glfwGetWindowUserPointer(window));
+	renderer->m_framebufferWidth = width;
+	renderer->m_framebufferHeight = height;
+	renderer->m_framebufferResized = true;
+}
+
+void VulkanRenderer::createInstance()
+{
+	// Application metadata
+	VkApplicationInfo appInfo{};
+	appInfo.sType = VK_STRUCTURE_TYPE_APPLICATION_INFO;
+	appInfo.pApplicationName = "Vulkan Course Application";
+	appInfo.applicationVersion = VK_MAKE_VERSION(1, 0, 0);
+	appInfo.pEngineName = "Balengine";
+	appInfo.engineVersion = VK_MAKE_VERSION(0, 1, 0);
+	appInfo.apiVersion = VK_API_VERSION_1_2; // for descriptor indexing
+
+	// Instance parameters
+	VkInstanceCreateInfo createInfo{};
+	createInfo.sType = VK_STRUCTURE_TYPE_INSTANCE_CREATE_INFO;
+	createInfo.pApplicationInfo = &appInfo;
+
+	// Query instance extensions
+	NameList_t instanceExtensions{};
+
+	uint32_t glfwExtensionCount = 0;
+	const char** glfwExtensions;
+	glfwExtensions = glfwGetRequiredInstanceExtensions(&glfwExtensionCount);
+
+	for (size_t i = 0; i < glfwExtensionCount; i++) {
+		instanceExtensions.push_back(glfwExtensions[i]);
+	}
+
+	if (!checkInstanceExtensionSupport(instanceExtensions)) {
+		throw std::runtime_error("VkInstance does not support the required extensions");
+	}
+
+	createInfo.enabledExtensionCount = glfwExtensionCount;
+	createInfo.ppEnabledExtensionNames = instanceExtensions.data();
+
+	// Check and create validation layers if needed
+	if (enableValidationLayers) {
+
+		if (!checkValidationLayers()) {
+			throw std::runtime_error("Validation layers requested, but not available!");
+		}
+
+		createInfo.enabledLayerCount = static_cast<uint32_t>(validationLayers.size());
+		createInfo.ppEnabledLayerNames = validationLayers.data();
+	}
+	else {
+		createInfo.enabledLayerCount = 0;
+		createInfo.ppEnabledLayerNames = nullptr;
+	}
+
+	VkResult result = vkCreateInstance(&createInfo, nullptr, &m_instance);
+
+	if (result != VK_SUCCESS) {
+		throw std::runtime_error("Failed to create a Vulkan instance");
+	}
+}
+
+void VulkanRenderer::getPhysicalDevice()
+{
+	uint32_t deviceCount;
+	vkEnumeratePhysicalDevices(m_instance, &deviceCount, nullptr);
+
+	if (deviceCount == 0) {
+		throw std::runtime_error("No Vulkan physical devices available");
+	}
+
+	std::vector<VkPhysicalDevice> devices(deviceCount);
+	vkEnumeratePhysicalDevices(m_instance, &deviceCount, devices.data());
+
+	// Pick the first suitable device
+	for (const auto& device : devices) {
+		if (checkDeviceSuitable(device)) {
+			m_device.physicalDevice = device;
+		}
+	}
+
+	if (m_device.physicalDevice == nullptr) {
+		throw std::runtime_error("No suitable physical device found");
+	}
+
+	VkPhysicalDeviceProperties deviceProperties{};
+	vkGetPhysicalDeviceProperties(m_device.physicalDevice, &deviceProperties);
+	std::cout << "Selected physical device " << deviceProperties.deviceName << std::endl;
+
+}
+
+void VulkanRenderer::createLogicalDevice()
+{
+	QueueFamilyIndices indices = getQueueFamilyIndices(m_device.physicalDevice);
+
+	std::vector<VkDeviceQueueCreateInfo> queueCreateInfos;
 	std::set<int> queueFamilyIndices = { indices.graphicsFamily, indices.presentationFamily };
+	bool asyncCompute = m_settings.asyncCompute && indices.computeFamily >= 0;
+	if (asyncCompute) {
+		queueFamilyIndices.insert(indices.computeFamily);
+	}
 
 	for (int index : queueFamilyIndices) {
 		VkDeviceQueueCreateInfo queueCreateInfo{};
@@ -302,13 +1383,63 @@ void VulkanRenderer::createLogicalDevice()
 	deviceCreateInfo.sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO;
 	deviceCreateInfo.queueCreateInfoCount = static_cast<uint32_t> (queueCreateInfos.size());
 	deviceCreateInfo.pQueueCreateInfos = queueCreateInfos.data();
-	deviceCreateInfo.enabledExtensionCount = deviceExtensions.size();
-	deviceCreateInfo.ppEnabledExtensionNames = deviceExtensions.data();
 
+	// Memory budgets are optional, the residency manager estimates without them
+	std::vector<const char*> extensions(deviceExtensions.begin(), deviceExtensions.end());
+	uint32_t extensionCount = 0;
+	vkEnumerateDeviceExtensionProperties(m_device.physicalDevice, nullptr, &extensionCount, nullptr);
+	std::vector<VkExtensionProperties> availableExtensions(extensionCount);
+	vkEnumerateDeviceExtensionProperties(m_device.physicalDevice, nullptr, &extensionCount, availableExtensions.data());
+	for (const auto& extension : availableExtensions) {
+		if (strcmp(extension.extensionName, VK_EXT_MEMORY_BUDGET_EXTENSION_NAME) == 0) {
+			extensions.push_back(VK_EXT_MEMORY_BUDGET_EXTENSION_NAME);
+			m_hasMemoryBudget = true;
+		}
+	}
+
+	deviceCreateInfo.enabledExtensionCount = static_cast<uint32_t>(extensions.size());
+	deviceCreateInfo.ppEnabledExtensionNames = extensions.data();
+
+	VkPhysicalDeviceFeatures supportedFeatures;
+	vkGetPhysicalDeviceFeatures(m_device.physicalDevice, &supportedFeatures);
+
+	// BC compressed textures are used when the device can sample them
 	VkPhysicalDeviceFeatures deviceFeatures{};
+	deviceFeatures.textureCompressionBC = supportedFeatures.textureCompressionBC;
+
+	VkPhysicalDeviceVulkan12Features supported12{};
+	supported12.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_2_FEATURES;
+	VkPhysicalDeviceFeatures2 supportedFeatures2{};
+	supportedFeatures2.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2;
+	supportedFeatures2.pNext = &supported12;
+	vkGetPhysicalDeviceFeatures2(m_device.physicalDevice, &supportedFeatures2);
+
+	// Culled objects are drawn by a few indirect draws, whose commands find
+	// the object through firstInstance and whose count the GPU writes
+	bool canCull = supportedFeatures.drawIndirectFirstInstance && supportedFeatures.multiDrawIndirect
+		&& supported12.drawIndirectCount;
+	deviceFeatures.drawIndirectFirstInstance = supportedFeatures.drawIndirectFirstInstance;
+	deviceFeatures.multiDrawIndirect = supportedFeatures.multiDrawIndirect;
+	if (m_settings.occlusionCulling && !canCull) {
+		std::cout << "No support for indirect draw counts, occlusion culling is off" << std::endl;
+		m_settings.occlusionCulling = false;
+	}
 
 	deviceCreateInfo.pEnabledFeatures = &deviceFeatures;
 
+	// Descriptor indexing for the bindless set. Vulkan 1.2 features can't be
+	// enabled through both this and the structs they came from.
+	VkPhysicalDeviceVulkan12Features features12{};
+	features12.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_2_FEATURES;
+	features12.runtimeDescriptorArray = VK_TRUE;
+	features12.descriptorBindingPartiallyBound = VK_TRUE;
+	features12.descriptorBindingUpdateUnusedWhilePending = VK_TRUE;
+	features12.descriptorBindingStorageBufferUpdateAfterBind = VK_TRUE;
+	features12.descriptorBindingSampledImageUpdateAfterBind = VK_TRUE;
+	features12.shaderSampledImageArrayNonUniformIndexing = VK_TRUE;
+	features12.drawIndirectCount = supported12.drawIndirectCount;
+	deviceCreateInfo.pNext = &features12;
+
 	VkResult result = vkCreateDevice(m_device.physicalDevice, &deviceCreateInfo, nullptr, &m_device.logicalDevice);
 
 	if (result != VK_SUCCESS) {
@@ -317,6 +1448,16 @@ void VulkanRenderer::createLogicalDevice()
 
 	vkGetDeviceQueue(m_device.logicalDevice, indices.graphicsFamily, 0, &m_graphicsQueue);
 	vkGetDeviceQueue(m_device.logicalDevice, indices.presentationFamily, 0, &m_presentationQueue);
+
+	m_objectQueueFamilies = { static_cast<uint32_t>(indices.graphicsFamily) };
+	if (asyncCompute) {
+		vkGetDeviceQueue(m_device.logicalDevice, indices.computeFamily, 0, &m_computeQueue);
+		m_objectQueueFamilies.push_back(static_cast<uint32_t>(indices.computeFamily));
+		std::cout << "Async compute on queue family " << indices.computeFamily << std::endl;
+	}
+	else if (m_settings.asyncCompute) {
+		std::cout << "No compute-only queue family, compute runs on the graphics queue" << std::endl;
+	}
 }
 
 void VulkanRenderer::createSurface()
@@ -327,7 +1468,7 @@ void VulkanRenderer::createSurface()
 	}
 }
 
-void VulkanRenderer::createSwapChain()
+void VulkanRenderer::createSwapChain(VkSwapchainKHR oldSwapchain)
 {
 	auto swapChainDetails = getSwapChainDetails(m_device.physicalDevice);
 
@@ -353,7 +1494,15 @@ void VulkanRenderer::createSwapChain()
 	createInfo.imageExtent = extent;
 	createInfo.minImageCount = imageCount;
 	createInfo.imageArrayLayers = 1;
-	createInfo.imageUsage = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT;
+	createInfo.imageUsage = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT; // upscale blit
+
+	// Frames are captured by copying out of the swapchain image
+	m_canCapture = !m_settings.capturePath.empty()
+		&& (swapChainDetails.surfaceCapabilities.supportedUsageFlags & VK_IMAGE_USAGE_TRANSFER_SRC_BIT)
+		&& FrameCapture::isSupported(surfaceFormat.format);
+	if (m_canCapture) {
+		createInfo.imageUsage |= VK_IMAGE_USAGE_TRANSFER_SRC_BIT;
+	}
 	createInfo.preTransform = swapChainDetails.surfaceCapabilities.currentTransform;
 	createInfo.compositeAlpha = VK_COMPOSITE_ALPHA_OPAQUE_BIT_KHR;
 	createInfo.clipped = VK_TRUE;
@@ -376,7 +1525,9 @@ void VulkanRenderer::createSwapChain()
 		createInfo.pQueueFamilyIndices = nullptr;
 	}
 
-	createInfo.oldSwapchain = VK_NULL_HANDLE;
+	// Passing the old swapchain lets the driver reuse its resources, and
+	// lets images that are still queued for presentation finish
+	createInfo.oldSwapchain = oldSwapchain;
 
 	VkResult result = vkCreateSwapchainKHR(m_device.logicalDevice, &createInfo, nullptr, &m_swapchain);
 
@@ -392,13 +1543,25 @@ void VulkanRenderer::createSwapChain()
 	std::vector<VkImage> images(swapChainImageCount);
 	vkGetSwapchainImagesKHR(m_device.logicalDevice, m_swapchain, &swapChainImageCount, images.data());
 
+	VkSemaphoreCreateInfo semaphoreInfo{};
+	semaphoreInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+
+	m_swapChainImages.clear();
 	for (const auto& image : images) {
 		SwapChainImage swapChainImage{};
 		swapChainImage.image = image;
 		swapChainImage.imageView = createImageView(image, m_swapChainImageFormat, VK_IMAGE_ASPECT_COLOR_BIT);
 
+		result = vkCreateSemaphore(m_device.logicalDevice, &semaphoreInfo, nullptr, &swapChainImage.renderFinished);
+		if (result != VK_SUCCESS) {
+			throw std::runtime_error("Failed to create semaphore");
+		}
+
 		m_swapChainImages.push_back(swapChainImage);
 	}
+
+	// None of the new images is in use yet
+	m_imagesInFlight.assign(m_swapChainImages.size(), VK_NULL_HANDLE);
 }
 
 void VulkanRenderer::createRenderPass()
@@ -411,65 +1574,64 @@ void VulkanRenderer::createRenderPass()
 	colorAttachment.storeOp = VK_ATTACHMENT_STORE_OP_STORE;
 	colorAttachment.stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
 	colorAttachment.stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
-	colorAttachment.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
-	colorAttachment.finalLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
-
-	// reference to the attachment in the render pass, for subpass
+	colorAttachment.initialLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+	colorAttachment.finalLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+
+	// describe depth attachment, read back by the depth pyramid once the pass is done
+	VkAttachmentDescription depthAttachment{};
+	depthAttachment.format = DEPTH_FORMAT;
+	depthAttachment.samples = VK_SAMPLE_COUNT_1_BIT;
+	depthAttachment.loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;
+	depthAttachment.storeOp = VK_ATTACHMENT_STORE_OP_STORE;
+	depthAttachment.stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
+	depthAttachment.stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+	depthAttachment.initialLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
+	depthAttachment.finalLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
+
+	std::array<VkAttachmentDescription, 2> attachments = { colorAttachment, depthAttachment };
+
+	// reference to the attachments in the render pass, for subpass
 	VkAttachmentReference colorAttachmentReference{};
 	colorAttachmentReference.attachment = 0;
 	colorAttachmentReference.layout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
 
+	VkAttachmentReference depthAttachmentReference{};
+	depthAttachmentReference.attachment = 1;
+	depthAttachmentReference.layout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
+
 	// describe subpass (could be many, we have only one)
 	VkSubpassDescription subpass{};
 	subpass.pipelineBindPoint = VK_PIPELINE_BIND_POINT_GRAPHICS;
 	subpass.colorAttachmentCount = 1;
 	subpass.pColorAttachments = &colorAttachmentReference;
+	subpass.pDepthStencilAttachment = &depthAttachmentReference;
 
-	// Subpass dependenciues
-
-	// Conversion from VK_IMAGE_LAYOUT_UNDEFINED to VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL
-	//
-	// Must happen after the input pipeline has completed and before the subpass color attachment
-	// output
-	std::array<VkSubpassDependency, 2> subpassDependencies;
-	subpassDependencies[0].srcSubpass = VK_SUBPASS_EXTERNAL;
-	subpassDependencies[0].srcStageMask = VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT;
-	subpassDependencies[0].srcAccessMask = VK_ACCESS_MEMORY_READ_BIT;
-
-	subpassDependencies[0].dstSubpass = 0;
-	subpassDependencies[0].dstStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
-	subpassDependencies[0].dstAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT | VK_ACCESS_COLOR_ATTACHMENT_READ_BIT;
-	subpassDependencies[0].dependencyFlags = 0;
-
-	// Conversion from VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL to VK_IMAGE_LAYOUT_PRESENT_SRC_KHR
-	//
-	// Must happen after the subpass color attachment output and before the input pipeline
-	// has completed
-	subpassDependencies[1].srcSubpass = 0;
-	subpassDependencies[1].srcStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
-	subpassDependencies[1].srcAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT | VK_ACCESS_COLOR_ATTACHMENT_READ_BIT;
-
-	subpassDependencies[1].dstSubpass = VK_SUBPASS_EXTERNAL;
-	subpassDependencies[1].dstStageMask = VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT; 
-	subpassDependencies[1].dstAccessMask = VK_ACCESS_MEMORY_READ_BIT;
-	subpassDependencies[1].dependencyFlags = 0;
+	// No subpass dependencies: the render graph records the barriers and
+	// layout transitions around the pass (see createRenderGraph)
 
 	// Create information for renderpass
 	VkRenderPassCreateInfo createInfo{};
 	createInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO;
-	createInfo.attachmentCount = 1;
-	createInfo.pAttachments = &colorAttachment;
+	createInfo.attachmentCount = static_cast<uint32_t>(attachments.size());
+	createInfo.pAttachments = attachments.data();
 	createInfo.subpassCount = 1;
 	createInfo.pSubpasses = &subpass;
-	createInfo.dependencyCount = static_cast<uint32_t>(subpassDependencies.size());
-	createInfo.pDependencies = subpassDependencies.data();
 
 	VkResult result = vkCreateRenderPass(m_device.logicalDevice, &createInfo, nullptr, &m_renderPass);
 	if (result != VK_SUCCESS) {
 		throw std::runtime_error("Failed to create render pass");
 	}
 
+	// The late pass of occlusion culling draws on top of what the early
+	// pass left, so it keeps both attachments. It is compatible with the
+	// first one, so the same pipeline and framebuffer are used with it.
+	attachments[0].loadOp = VK_ATTACHMENT_LOAD_OP_LOAD;
+	attachments[1].loadOp = VK_ATTACHMENT_LOAD_OP_LOAD;
 
+	result = vkCreateRenderPass(m_device.logicalDevice, &createInfo, nullptr, &m_lateRenderPass);
+	if (result != VK_SUCCESS) {
+		throw std::runtime_error("Failed to create late render pass");
+	}
 }
 
 void VulkanRenderer::createDescriptorSetLayout()
@@ -478,7 +1640,7 @@ void VulkanRenderer::createDescriptorSetLayout()
 	vpLayoutBinding.binding = 0; // As in the vertex shader
 	vpLayoutBinding.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
 	vpLayoutBinding.descriptorCount = 1;
-	vpLayoutBinding.stageFlags = VK_SHADER_STAGE_VERTEX_BIT;
+	vpLayoutBinding.stageFlags = VK_SHADER_STAGE_VERTEX_BIT | VK_SHADER_STAGE_FRAGMENT_BIT; // lighting reads it too
 	vpLayoutBinding.pImmutableSamplers = nullptr; // used only for textures
 
 	/*
@@ -500,13 +1662,42 @@ void VulkanRenderer::createDescriptorSetLayout()
 	if (result != VK_SUCCESS) {
 		throw std::runtime_error("Unable to create descriptor set layout."); 
 	}
-}
 
-void VulkanRenderer::createPushConstantRange()
-{
-	m_pushConstantRange.stageFlags = VK_SHADER_STAGE_VERTEX_BIT;
-	m_pushConstantRange.offset = 0;
-	m_pushConstantRange.size = sizeof(Model);
+	// Bindless set. Entries are filled in as resources are registered, and may
+	// be written while the set is bound by frames that don't use them.
+	VkDescriptorSetLayoutBinding buffersLayoutBinding{};
+	buffersLayoutBinding.binding = 0;
+	buffersLayoutBinding.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+	buffersLayoutBinding.descriptorCount = MAX_BINDLESS_BUFFERS;
+	buffersLayoutBinding.stageFlags = VK_SHADER_STAGE_ALL;
+
+	VkDescriptorSetLayoutBinding texturesLayoutBinding{};
+	texturesLayoutBinding.binding = 1;
+	texturesLayoutBinding.descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+	texturesLayoutBinding.descriptorCount = MAX_BINDLESS_TEXTURES;
+	texturesLayoutBinding.stageFlags = VK_SHADER_STAGE_ALL;
+
+	std::array<VkDescriptorSetLayoutBinding, 2> bindlessBindings = { buffersLayoutBinding, texturesLayoutBinding };
+	VkDescriptorBindingFlags bindlessFlags = VK_DESCRIPTOR_BINDING_PARTIALLY_BOUND_BIT
+		| VK_DESCRIPTOR_BINDING_UPDATE_AFTER_BIND_BIT | VK_DESCRIPTOR_BINDING_UPDATE_UNUSED_WHILE_PENDING_BIT;
+	std::array<VkDescriptorBindingFlags, 2> bindingFlags = { bindlessFlags, bindlessFlags };
+
+	VkDescriptorSetLayoutBindingFlagsCreateInfo bindingFlagsInfo{};
+	bindingFlagsInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_BINDING_FLAGS_CREATE_INFO;
+	bindingFlagsInfo.bindingCount = static_cast<uint32_t>(bindingFlags.size());
+	bindingFlagsInfo.pBindingFlags = bindingFlags.data();
+
+	VkDescriptorSetLayoutCreateInfo bindlessCreateInfo{};
+	bindlessCreateInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+	bindlessCreateInfo.pNext = &bindingFlagsInfo;
+	bindlessCreateInfo.flags = VK_DESCRIPTOR_SET_LAYOUT_CREATE_UPDATE_AFTER_BIND_POOL_BIT;
+	bindlessCreateInfo.bindingCount = static_cast<uint32_t>(bindlessBindings.size());
+	bindlessCreateInfo.pBindings = bindlessBindings.data();
+
+	result = vkCreateDescriptorSetLayout(m_device.logicalDevice, &bindlessCreateInfo, nullptr, &m_bindlessSetLayout);
+	if (result != VK_SUCCESS) {
+		throw std::runtime_error("Unable to create bindless descriptor set layout.");
+	}
 }
 
 VkImageView VulkanRenderer::createImageView(VkImage image, VkFormat format, VkImageAspectFlags flags)
@@ -590,7 +1781,7 @@ void VulkanRenderer::createGraphicsPipeline()
 	bindingDescription.inputRate = VK_VERTEX_INPUT_RATE_VERTEX;
 
 	// Describe how data for an attribute is defined within the vertex
-	std::array<VkVertexInputAttributeDescription, 2> attributeDescriptions;
+	std::array<VkVertexInputAttributeDescription, 3> attributeDescriptions;
 
 	// Position attribute
 	attributeDescriptions[0].binding = 0;
@@ -604,6 +1795,12 @@ void VulkanRenderer::createGraphicsPipeline()
 	attributeDescriptions[1].format = VK_FORMAT_R32G32B32_SFLOAT;
 	attributeDescriptions[1].offset = offsetof(Vertex, col);
 
+	// Texture coordinate attribute
+	attributeDescriptions[2].binding = 0;
+	attributeDescriptions[2].location = 2;
+	attributeDescriptions[2].format = VK_FORMAT_R32G32_SFLOAT;
+	attributeDescriptions[2].offset = offsetof(Vertex, tex);
+
 	// Vertex Input
 	VkPipelineVertexInputStateCreateInfo vertexInputInfo {};
 	vertexInputInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO;
@@ -616,27 +1813,27 @@ void VulkanRenderer::createGraphicsPipeline()
 	VkPipelineInputAssemblyStateCreateInfo inputAssemblyInfo{};
 	inputAssemblyInfo.primitiveRestartEnable = VK_FALSE;
 
-	// Viewport & scissor
-	VkViewport viewport{};
-	viewport.x = 0.0f;
-	viewport.y = 0.0f;
-	viewport.width = static_cast<float>(m_swapChainExtent.width);
 	inputAssemblyInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_INPUT_ASSEMBLY_STATE_CREATE_INFO;
 	inputAssemblyInfo.topology = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST;
-	viewport.height = static_cast<float>(m_swapChainExtent.height);
-	viewport.minDepth = 0.0f;
-	viewport.maxDepth = 1.0f;
-
-	VkRect2D scissor{};
-	scissor.offset = { 0, 0 };
-	scissor.extent = m_swapChainExtent;
 
+	// Viewport & scissor are dynamic, so the pipeline survives swapchain
+	// recreation. They are set when recording the command buffer.
 	VkPipelineViewportStateCreateInfo viewportInfo{};
 	viewportInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_VIEWPORT_STATE_CREATE_INFO;
 	viewportInfo.viewportCount = 1;
-	viewportInfo.pViewports = &viewport;
+	viewportInfo.pViewports = nullptr;
 	viewportInfo.scissorCount = 1;
-	viewportInfo.pScissors = &scissor;
+	viewportInfo.pScissors = nullptr;
+
+	std::array<VkDynamicState, 2> dynamicStates = {
+		VK_DYNAMIC_STATE_VIEWPORT,
+		VK_DYNAMIC_STATE_SCISSOR
+	};
+
+	VkPipelineDynamicStateCreateInfo dynamicStateInfo{};
+	dynamicStateInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_DYNAMIC_STATE_CREATE_INFO;
+	dynamicStateInfo.dynamicStateCount = static_cast<uint32_t>(dynamicStates.size());
+	dynamicStateInfo.pDynamicStates = dynamicStates.data();
 
 	// Rasterizer
 	VkPipelineRasterizationStateCreateInfo rasterizerInfo{};
@@ -649,305 +1846,1668 @@ void VulkanRenderer::createGraphicsPipeline()
 	rasterizerInfo.frontFace = VK_FRONT_FACE_COUNTER_CLOCKWISE;
 	rasterizerInfo.depthBiasEnable = VK_FALSE;
 
-	// Multi-sampling
-	VkPipelineMultisampleStateCreateInfo multisamplingInfo{};
-	multisamplingInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_MULTISAMPLE_STATE_CREATE_INFO;
-	multisamplingInfo.sampleShadingEnable = VK_FALSE;
-	multisamplingInfo.rasterizationSamples = VK_SAMPLE_COUNT_1_BIT;
+	// Multi-sampling
+	VkPipelineMultisampleStateCreateInfo multisamplingInfo{};
+	multisamplingInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_MULTISAMPLE_STATE_CREATE_INFO;
+	multisamplingInfo.sampleShadingEnable = VK_FALSE;
+	multisamplingInfo.rasterizationSamples = VK_SAMPLE_COUNT_1_BIT;
+
+	// Blending, for transparent objects. Opaque ones replace what is behind
+	// them, which saves reading the colour target back.
+	VkPipelineColorBlendAttachmentState colorState{};
+	colorState.colorWriteMask = VK_COLOR_COMPONENT_R_BIT | VK_COLOR_COMPONENT_G_BIT
+		| VK_COLOR_COMPONENT_B_BIT | VK_COLOR_COMPONENT_A_BIT;
+	colorState.blendEnable = VK_TRUE;
+	colorState.srcColorBlendFactor = VK_BLEND_FACTOR_SRC_ALPHA;
+	colorState.dstColorBlendFactor = VK_BLEND_FACTOR_ONE_MINUS_SRC_ALPHA;
+	colorState.colorBlendOp = VK_BLEND_OP_ADD;
+	colorState.srcAlphaBlendFactor = VK_BLEND_FACTOR_ONE;
+	colorState.dstAlphaBlendFactor = VK_BLEND_FACTOR_ZERO;
+	colorState.alphaBlendOp = VK_BLEND_OP_ADD;
+
+	VkPipelineColorBlendStateCreateInfo colorBlendInfo{};
+	colorBlendInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_COLOR_BLEND_STATE_CREATE_INFO;
+	colorBlendInfo.logicOpEnable = VK_FALSE;
+	colorBlendInfo.attachmentCount = 1;
+	colorBlendInfo.pAttachments = &colorState;
+
+	VkPipelineColorBlendAttachmentState opaqueColorState = colorState;
+	opaqueColorState.blendEnable = VK_FALSE;
+
+	VkPipelineColorBlendStateCreateInfo opaqueBlendInfo = colorBlendInfo;
+	opaqueBlendInfo.pAttachments = &opaqueColorState;
+
+	// Depth testing. Equal passes so that of two coplanar surfaces the one
+	// drawn last still shows, as it did before there was a depth buffer.
+	VkPipelineDepthStencilStateCreateInfo depthStencilInfo{};
+	depthStencilInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_DEPTH_STENCIL_STATE_CREATE_INFO;
+	depthStencilInfo.depthTestEnable = VK_TRUE;
+	depthStencilInfo.depthWriteEnable = VK_TRUE;
+	depthStencilInfo.depthCompareOp = VK_COMPARE_OP_LESS_OR_EQUAL;
+	depthStencilInfo.depthBoundsTestEnable = VK_FALSE;
+	depthStencilInfo.stencilTestEnable = VK_FALSE;
+
+	// Transparent objects are tested against the opaque ones but don't hide
+	// what is behind them, which is blended over later
+	VkPipelineDepthStencilStateCreateInfo transparentDepthStencilInfo = depthStencilInfo;
+	transparentDepthStencilInfo.depthWriteEnable = VK_FALSE;
+
+	// Pipeline layout 
+	VkPipelineLayoutCreateInfo layoutInfo{};
+	layoutInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+	// Set 0 is per frame, set 1 the bindless set. Per-object data comes from
+	// the object buffer, so there are no push constants.
+	std::array<VkDescriptorSetLayout, 2> setLayouts = { m_descriptorSetLayout, m_bindlessSetLayout };
+	layoutInfo.pushConstantRangeCount = 0;
+	layoutInfo.pSetLayouts = setLayouts.data();
+	layoutInfo.setLayoutCount = static_cast<uint32_t>(setLayouts.size());
+
+VkResult result = vkCreatePipelineLayout(m_device.logicalDevice, &layoutInfo, nullptr, &m_pipelineLayout);
+if (result != VK_SUCCESS) {
+	throw std::runtime_error("Could not create pipeline layout");
+}
+
+VkGraphicsPipelineCreateInfo createInfo{};
+createInfo.sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO;
+createInfo.stageCount = 2;
+createInfo.pStages = shaderStageInfos;
+createInfo.pVertexInputState = &vertexInputInfo;
+createInfo.pInputAssemblyState = &inputAssemblyInfo;
+createInfo.pViewportState = &viewportInfo;
+createInfo.pDynamicState = &dynamicStateInfo;
+createInfo.pRasterizationState = &rasterizerInfo;
+createInfo.pMultisampleState = &multisamplingInfo;
+createInfo.pColorBlendState = &colorBlendInfo;
+createInfo.pDepthStencilState = &depthStencilInfo;
+createInfo.layout = m_pipelineLayout;
+createInfo.renderPass = m_renderPass;
+createInfo.subpass = 0;
+createInfo.basePipelineHandle = VK_NULL_HANDLE;
+createInfo.basePipelineIndex = -1;
+
+// Opaque, transparent, and blended with depth writes for when the render
+// queue is off
+std::array<VkGraphicsPipelineCreateInfo, 3> createInfos = { createInfo, createInfo, createInfo };
+createInfos[0].pColorBlendState = &opaqueBlendInfo;
+createInfos[1].pDepthStencilState = &transparentDepthStencilInfo;
+
+std::array<VkPipeline, 3> pipelines;
+result = vkCreateGraphicsPipelines(m_device.logicalDevice, VK_NULL_HANDLE, static_cast<uint32_t>(createInfos.size()),
+	createInfos.data(), nullptr, pipelines.data());
+
+if (result != VK_SUCCESS) {
+	throw std::runtime_error("Failed to create graphics pipeline");
+}
+m_graphicsPipeline = pipelines[0];
+m_transparentPipeline = pipelines[1];
+m_blendedPipeline = pipelines[2];
+
+// Destroy shader modules
+vkDestroyShaderModule(m_device.logicalDevice, fragmentShaderModule, nullptr);
+vkDestroyShaderModule(m_device.logicalDevice, vertexShaderModule, nullptr);
+}
+
+void VulkanRenderer::createAnimatePipeline()
+{
+	auto computeShaderCode = readFile("../../shaders/animate.spv");
+	VkShaderModule computeShaderModule = createShaderModule(computeShaderCode);
+
+	VkPushConstantRange pushConstantRange{};
+	pushConstantRange.stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+	pushConstantRange.offset = 0;
+	pushConstantRange.size = sizeof(AnimatePushConstants);
+
+	// Reads the animations and writes the objects through the bindless set
+	VkPipelineLayoutCreateInfo layoutInfo{};
+	layoutInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+	layoutInfo.setLayoutCount = 1;
+	layoutInfo.pSetLayouts = &m_bindlessSetLayout;
+	layoutInfo.pushConstantRangeCount = 1;
+	layoutInfo.pPushConstantRanges = &pushConstantRange;
+
+	VkResult result = vkCreatePipelineLayout(m_device.logicalDevice, &layoutInfo, nullptr, &m_animatePipelineLayout);
+	if (result != VK_SUCCESS) {
+		throw std::runtime_error("Could not create animation pipeline layout");
+	}
+
+	VkComputePipelineCreateInfo createInfo{};
+	createInfo.sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
+	createInfo.stage.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+	createInfo.stage.stage = VK_SHADER_STAGE_COMPUTE_BIT;
+	createInfo.stage.module = computeShaderModule;
+	createInfo.stage.pName = "main";
+	createInfo.layout = m_animatePipelineLayout;
+
+	result = vkCreateComputePipelines(m_device.logicalDevice, VK_NULL_HANDLE, 1, &createInfo, nullptr, &m_animatePipeline);
+	if (result != VK_SUCCESS) {
+		throw std::runtime_error("Failed to create animation pipeline");
+	}
+
+	vkDestroyShaderModule(m_device.logicalDevice, computeShaderModule, nullptr);
+}
+
+void VulkanRenderer::createOcclusionPipelines()
+{
+	if (!m_settings.occlusionCulling) {
+		return;
+	}
+
+	// Depth is read texel by texel, and the cull shader picks the level itself
+	VkSamplerCreateInfo samplerCreateInfo{};
+	samplerCreateInfo.sType = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO;
+	samplerCreateInfo.magFilter = VK_FILTER_NEAREST;
+	samplerCreateInfo.minFilter = VK_FILTER_NEAREST;
+	samplerCreateInfo.mipmapMode = VK_SAMPLER_MIPMAP_MODE_NEAREST;
+	samplerCreateInfo.addressModeU = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+	samplerCreateInfo.addressModeV = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+	samplerCreateInfo.addressModeW = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+	samplerCreateInfo.maxAnisotropy = 1.0f;
+	samplerCreateInfo.minLod = 0.0f;
+	samplerCreateInfo.maxLod = VK_LOD_CLAMP_NONE;
+	samplerCreateInfo.borderColor = VK_BORDER_COLOR_FLOAT_OPAQUE_WHITE;
+
+	VkResult result = vkCreateSampler(m_device.logicalDevice, &samplerCreateInfo, nullptr, &m_depthSampler);
+	if (result != VK_SUCCESS) {
+		throw std::runtime_error("Failed to create depth sampler");
+	}
+
+	// Pyramid: the level below (or the depth buffer) in, the next level out
+	VkDescriptorSetLayoutBinding sourceBinding{};
+	sourceBinding.binding = 0;
+	sourceBinding.descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+	sourceBinding.descriptorCount = 1;
+	sourceBinding.stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+
+	VkDescriptorSetLayoutBinding destinationBinding{};
+	destinationBinding.binding = 1;
+	destinationBinding.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
+	destinationBinding.descriptorCount = 1;
+	destinationBinding.stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+
+	std::array<VkDescriptorSetLayoutBinding, 2> pyramidBindings = { sourceBinding, destinationBinding };
+	VkDescriptorSetLayoutCreateInfo layoutCreateInfo{};
+	layoutCreateInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+	layoutCreateInfo.bindingCount = static_cast<uint32_t>(pyramidBindings.size());
+	layoutCreateInfo.pBindings = pyramidBindings.data();
+
+	result = vkCreateDescriptorSetLayout(m_device.logicalDevice, &layoutCreateInfo, nullptr, &m_depthPyramidSetLayout);
+	if (result != VK_SUCCESS) {
+		throw std::runtime_error("Unable to create depth pyramid descriptor set layout.");
+	}
+
+	// Cull: the whole pyramid, the objects and draws come from the bindless set
+	layoutCreateInfo.bindingCount = 1;
+	layoutCreateInfo.pBindings = &sourceBinding;
+
+	result = vkCreateDescriptorSetLayout(m_device.logicalDevice, &layoutCreateInfo, nullptr, &m_cullSetLayout);
+	if (result != VK_SUCCESS) {
+		throw std::runtime_error("Unable to create cull descriptor set layout.");
+	}
+
+	VkPushConstantRange pushConstantRange{};
+	pushConstantRange.stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+	pushConstantRange.offset = 0;
+	pushConstantRange.size = sizeof(DepthPyramidPushConstants);
+
+	VkPipelineLayoutCreateInfo layoutInfo{};
+	layoutInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+	layoutInfo.setLayoutCount = 1;
+	layoutInfo.pSetLayouts = &m_depthPyramidSetLayout;
+	layoutInfo.pushConstantRangeCount = 1;
+	layoutInfo.pPushConstantRanges = &pushConstantRange;
+
+	result = vkCreatePipelineLayout(m_device.logicalDevice, &layoutInfo, nullptr, &m_depthPyramidPipelineLayout);
+	if (result != VK_SUCCESS) {
+		throw std::runtime_error("Could not create depth pyramid pipeline layout");
+	}
+
+	std::array<VkDescriptorSetLayout, 2> cullSetLayouts = { m_bindlessSetLayout, m_cullSetLayout };
+	pushConstantRange.size = sizeof(CullPushConstants);
+	layoutInfo.setLayoutCount = static_cast<uint32_t>(cullSetLayouts.size());
+	layoutInfo.pSetLayouts = cullSetLayouts.data();
+
+	result = vkCreatePipelineLayout(m_device.logicalDevice, &layoutInfo, nullptr, &m_cullPipelineLayout);
+	if (result != VK_SUCCESS) {
+		throw std::runtime_error("Could not create cull pipeline layout");
+	}
+
+	auto pyramidShaderCode = readFile("../../shaders/depthpyramid.spv");
+	VkShaderModule pyramidShaderModule = createShaderModule(pyramidShaderCode);
+	auto cullShaderCode = readFile("../../shaders/cull.spv");
+	VkShaderModule cullShaderModule = createShaderModule(cullShaderCode);
+
+	VkComputePipelineCreateInfo createInfo{};
+	createInfo.sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
+	createInfo.stage.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+	createInfo.stage.stage = VK_SHADER_STAGE_COMPUTE_BIT;
+	createInfo.stage.module = pyramidShaderModule;
+	createInfo.stage.pName = "main";
+	createInfo.layout = m_depthPyramidPipelineLayout;
+
+	result = vkCreateComputePipelines(m_device.logicalDevice, VK_NULL_HANDLE, 1, &createInfo, nullptr, &m_depthPyramidPipeline);
+	if (result != VK_SUCCESS) {
+		throw std::runtime_error("Failed to create depth pyramid pipeline");
+	}
+
+	createInfo.stage.module = cullShaderModule;
+	createInfo.layout = m_cullPipelineLayout;
+
+	result = vkCreateComputePipelines(m_device.logicalDevice, VK_NULL_HANDLE, 1, &createInfo, nullptr, &m_cullPipeline);
+	if (result != VK_SUCCESS) {
+		throw std::runtime_error("Failed to create cull pipeline");
+	}
+
+	vkDestroyShaderModule(m_device.logicalDevice, cullShaderModule, nullptr);
+	vkDestroyShaderModule(m_device.logicalDevice, pyramidShaderModule, nullptr);
+}
+
+void VulkanRenderer::createLightCullPipeline()
+{
+	auto computeShaderCode = readFile("../../shaders/lightcull.spv");
+	VkShaderModule computeShaderModule = createShaderModule(computeShaderCode);
+
+	VkPushConstantRange pushConstantRange{};
+	pushConstantRange.stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+	pushConstantRange.offset = 0;
+	pushConstantRange.size = sizeof(LightCullPushConstants);
+
+	// Reads the lights and writes the clusters through the bindless set
+	VkPipelineLayoutCreateInfo layoutInfo{};
+	layoutInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+	layoutInfo.setLayoutCount = 1;
+	layoutInfo.pSetLayouts = &m_bindlessSetLayout;
+	layoutInfo.pushConstantRangeCount = 1;
+	layoutInfo.pPushConstantRanges = &pushConstantRange;
+
+	VkResult result = vkCreatePipelineLayout(m_device.logicalDevice, &layoutInfo, nullptr, &m_lightCullPipelineLayout);
+	if (result != VK_SUCCESS) {
+		throw std::runtime_error("Could not create light cull pipeline layout");
+	}
+
+	VkComputePipelineCreateInfo createInfo{};
+	createInfo.sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
+	createInfo.stage.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+	createInfo.stage.stage = VK_SHADER_STAGE_COMPUTE_BIT;
+	createInfo.stage.module = computeShaderModule;
+	createInfo.stage.pName = "main";
+	createInfo.layout = m_lightCullPipelineLayout;
+
+	result = vkCreateComputePipelines(m_device.logicalDevice, VK_NULL_HANDLE, 1, &createInfo, nullptr, &m_lightCullPipeline);
+	if (result != VK_SUCCESS) {
+		throw std::runtime_error("Failed to create light cull pipeline");
+	}
+
+	vkDestroyShaderModule(m_device.logicalDevice, computeShaderModule, nullptr);
+}
+
+void VulkanRenderer::createFramebuffers()
+{
+	std::array<VkImageView, 2> attachments = {
+		m_renderGraph->getImageView(m_sceneColor),
+		m_renderGraph->getImageView(m_sceneDepth)
+	};
+
+	VkFramebufferCreateInfo createInfo{};
+	createInfo.sType = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO;
+	createInfo.renderPass = m_renderPass;
+	createInfo.attachmentCount = static_cast<uint32_t>(attachments.size());
+	createInfo.pAttachments = attachments.data();
+	createInfo.width = m_swapChainExtent.width;
+	createInfo.height = m_swapChainExtent.height;
+	createInfo.layers = 1;
+
+	VkResult result = vkCreateFramebuffer(m_device.logicalDevice, &createInfo, nullptr, &m_sceneFramebuffer);
+	if (result != VK_SUCCESS) {
+		throw std::runtime_error("Failed to create framebuffer!");
+	}
+}
+
+void VulkanRenderer::createRenderGraph()
+{
+	m_renderGraph = std::make_shared<RenderGraph>(m_device.physicalDevice, m_device.logicalDevice);
+
+	// The swapchain image is acquired with a semaphore waited on at the transfer
+	// stage, so the first barrier has to start from that stage
+	RenderGraph::ImageDesc backbufferDesc;
+	backbufferDesc.format = m_swapChainImageFormat;
+	backbufferDesc.extent = m_swapChainExtent;
+
+	RenderGraph::ImportState acquired;
+	acquired.layout = VK_IMAGE_LAYOUT_UNDEFINED;
+	acquired.stage = VK_PIPELINE_STAGE_TRANSFER_BIT;
+
+	RenderGraph::ImportState presentable;
+	presentable.layout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
+	presentable.stage = VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT;
+
+	m_backbuffer = m_renderGraph->importImage("backbuffer", backbufferDesc, acquired, presentable);
+	m_renderGraph->markOutput(m_backbuffer);
+
+	// Full size so it never has to be reallocated when the scale changes
+	RenderGraph::ImageDesc sceneColorDesc;
+	sceneColorDesc.format = m_swapChainImageFormat;
+	sceneColorDesc.extent = m_swapChainExtent;
+	m_sceneColor = m_renderGraph->createImage("sceneColor", sceneColorDesc);
+
+	RenderGraph::ImageDesc sceneDepthDesc;
+	sceneDepthDesc.format = DEPTH_FORMAT;
+	sceneDepthDesc.extent = m_swapChainExtent;
+	sceneDepthDesc.aspect = VK_IMAGE_ASPECT_DEPTH_BIT;
+	m_sceneDepth = m_renderGraph->createImage("sceneDepth", sceneDepthDesc);
+
+	VkFormatProperties formatProperties;
+	vkGetPhysicalDeviceFormatProperties(m_device.physicalDevice, m_swapChainImageFormat, &formatProperties);
+	bool canFilter = formatProperties.optimalTilingFeatures & VK_FORMAT_FEATURE_SAMPLED_IMAGE_FILTER_LINEAR_BIT;
+	m_upscaleFilter = canFilter ? VK_FILTER_LINEAR : VK_FILTER_NEAREST;
+
+	// The object buffer changes every frame, it is set before the graph runs
+	m_objects = m_renderGraph->importBuffer("objects");
+
+	// Filled in by the light cull pass, read when shading
+	m_clusters = m_renderGraph->importBuffer("clusters");
+
+	// The pyramid outlives the graph: the early pass of the next frame
+	// culls against it, so it is left where the cull passes read it
+	bool occlusionCulling = m_settings.occlusionCulling;
+	if (occlusionCulling) {
+		m_depthPyramid = DepthPyramid(m_device.physicalDevice, m_device.logicalDevice, m_swapChainExtent);
+		m_depthPyramidValid = false;
+
+		RenderGraph::ImageDesc pyramidDesc;
+		pyramidDesc.format = DepthPyramid::FORMAT;
+		pyramidDesc.mipLevels = m_depthPyramid.getLevelCount();
+
+		RenderGraph::ImportState sampled;
+		sampled.layout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+		sampled.stage = 0;
+
+		m_pyramid = m_renderGraph->importImage("depthPyramid", pyramidDesc, sampled, sampled);
+		m_renderGraph->markOutput(m_pyramid);
+		m_renderGraph->setImage(m_pyramid, m_depthPyramid.getImage(), m_depthPyramid.getImageView());
+
+		m_drawCommands = m_renderGraph->importBuffer("drawCommands");
+	}
+
+	// Texture uploads synchronise the images they touch themselves
+	m_renderGraph->addPass("textureUpload")
+		.hasSideEffects()
+		.execute([this](VkCommandBuffer commandBuffer) { recordTextureUploads(commandBuffer); });
+
+	RenderGraph::PassBuilder animate = m_renderGraph->addPass("animate")
+		.write(m_objects, RenderGraph::Usage::ComputeStorageWrite)
+		.execute([this](VkCommandBuffer commandBuffer) { recordAnimatePass(commandBuffer); });
+	if (m_computeQueue != VK_NULL_HANDLE) {
+		animate.asyncCompute();
+	}
+
+	RenderGraph::PassBuilder lightCull = m_renderGraph->addPass("lightCull")
+		.write(m_clusters, RenderGraph::Usage::ComputeStorageWrite)
+		.execute([this](VkCommandBuffer commandBuffer) { recordLightCullPass(commandBuffer); });
+	if (m_computeQueue != VK_NULL_HANDLE) {
+		lightCull.asyncCompute();
+	}
+
+	// Two-phase occlusion culling: the early pass draws what was visible
+	// against last frame's pyramid, the pyramid is rebuilt from that depth
+	// and the late pass draws whatever the early pass wrongly left out
+	if (occlusionCulling) {
+		m_renderGraph->addPass("earlyCull")
+			.read(m_objects, RenderGraph::Usage::ComputeStorageRead)
+			.read(m_pyramid, RenderGraph::Usage::ComputeSampled)
+			.write(m_drawCommands, RenderGraph::Usage::ComputeStorageWrite)
+			.execute([this](VkCommandBuffer commandBuffer) { recordCullPass(commandBuffer, false); });
+	}
+
+	RenderGraph::PassBuilder scene = m_renderGraph->addPass("scene")
+		.read(m_objects, RenderGraph::Usage::VertexStorageRead)
+		.read(m_clusters, RenderGraph::Usage::FragmentStorageRead)
+		.write(m_sceneColor, RenderGraph::Usage::ColorAttachment)
+		.write(m_sceneDepth, RenderGraph::Usage::DepthAttachment)
+		.execute([this, occlusionCulling](VkCommandBuffer commandBuffer) {
+			writeTimestamp(commandBuffer, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, SCENE_BEGIN_QUERY);
+			recordScenePass(commandBuffer, false);
+			if (!occlusionCulling) {
+				writeTimestamp(commandBuffer, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, SCENE_END_QUERY);
+			}
+		});
+
+	if (occlusionCulling) {
+		scene.read(m_drawCommands, RenderGraph::Usage::IndirectRead);
+
+		m_renderGraph->addPass("depthPyramid")
+			.read(m_sceneDepth, RenderGraph::Usage::ComputeSampled)
+			.write(m_pyramid, RenderGraph::Usage::ComputeStorageWrite)
+			.execute([this](VkCommandBuffer commandBuffer) { recordDepthPyramidPass(commandBuffer); });
+
+		m_renderGraph->addPass("lateCull")
+			.read(m_objects, RenderGraph::Usage::ComputeStorageRead)
+			.read(m_pyramid, RenderGraph::Usage::ComputeSampled)
+			.write(m_drawCommands, RenderGraph::Usage::ComputeStorageWrite)
+			.execute([this](VkCommandBuffer commandBuffer) { recordCullPass(commandBuffer, true); });
+
+		m_renderGraph->addPass("sceneLate")
+			.read(m_objects, RenderGraph::Usage::VertexStorageRead)
+			.read(m_clusters, RenderGraph::Usage::FragmentStorageRead)
+			.read(m_drawCommands, RenderGraph::Usage::IndirectRead)
+			.write(m_sceneColor, RenderGraph::Usage::ColorAttachment)
+			.write(m_sceneDepth, RenderGraph::Usage::DepthAttachment)
+			.execute([this](VkCommandBuffer commandBuffer) {
+				recordScenePass(commandBuffer, true);
+				writeTimestamp(commandBuffer, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, SCENE_END_QUERY);
+			});
+
+		// Nothing to record, the pass only makes the instance counts the
+		// cull passes wrote visible to the host for the statistics
+		m_renderGraph->addPass("occlusionReadback")
+			.read(m_drawCommands, RenderGraph::Usage::HostRead)
+			.hasSideEffects();
+	}
+
+	m_renderGraph->addPass("upscale")
+		.read(m_sceneColor, RenderGraph::Usage::TransferSrc)
+		.write(m_backbuffer, RenderGraph::Usage::TransferDst)
+		.execute([this](VkCommandBuffer commandBuffer) {
+			writeTimestamp(commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT, UPSCALE_BEGIN_QUERY);
+			recordUpscalePass(commandBuffer);
+			writeTimestamp(commandBuffer, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, UPSCALE_END_QUERY);
+		});
+
+	if (m_canCapture) {
+		m_renderGraph->addPass("capture")
+			.read(m_backbuffer, RenderGraph::Usage::TransferSrc)
+			.hasSideEffects()
+			.execute([this](VkCommandBuffer commandBuffer) { recordCapturePass(commandBuffer); });
+	}
+
+	m_renderGraph->compile();
+	m_gpuPassNames = m_renderGraph->getExecutedPasses();
+	m_gpuComputePassNames = m_renderGraph->getExecutedPasses(true);
+}
+
+void VulkanRenderer::createCommandPool()
+{
+	auto indices = getQueueFamilyIndices(m_device.physicalDevice);
+	VkCommandPoolCreateInfo poolInfo{};
+	poolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+	poolInfo.flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT;
+	poolInfo.queueFamilyIndex = indices.graphicsFamily;
+
+	// Uploads get a pool of their own, separate from the per-frame pools
+	VkResult result = vkCreateCommandPool(m_device.logicalDevice, &poolInfo, nullptr, &m_transferCommandPool);
+
+	if (result != VK_SUCCESS) {
+		throw std::runtime_error("Failed to create the transfer command pool!");
+	}
+}
+
+void VulkanRenderer::createMeshes()
+{
+	if (!m_settings.demoScene) {
+		return;
+	}
+
+	std::vector<Vertex> mesh1vertices = {
+		{{-0.4, 0.4, 0.0}, {1.0, 0.0, 0.0}, {0.0, 0.0}},	// 0
+		{{-0.4, -0.4, 0.0}, {0.0, 0.0, 1.0}, {0.0, 1.0}},	// 1
+		{{0.4, -0.4, 0.0}, {0.0, 1.0, 0.0}, {1.0, 1.0}},	// 2
+		{{0.4, 0.4, 0.0}, {1.0, 1.0, 0.0}, {1.0, 0.0}},	// 3
+	};
+
+	std::vector<Vertex> mesh2vertices = {
+		{{-0.25, 0.6, 0.0}, {1.0, 0.0, 0.0}, {0.0, 0.0}},	// 0
+		{{-0.25, -0.6, 0.0}, {0.0, 0.0, 1.0}, {0.0, 1.0}},	// 1
+		{{0.25, -0.6, 0.0}, {0.0, 1.0, 0.0}, {1.0, 1.0}},	// 2
+		{{0.25, 0.6, 0.0}, {1.0, 1.0, 0.0}, {1.0, 0.0}},	// 3
+	};
+
+	std::vector<uint32_t> meshIndices = {
+		0, 1, 2,
+		2, 3, 0
+	};
+
+	// Both quads share the index buffer
+	addMesh(&mesh1vertices, &meshIndices);
+	addMesh(&mesh2vertices, &meshIndices);
+}
+
+MeshHandle VulkanRenderer::addMesh(std::vector<Vertex>* vertices, std::vector<uint32_t>* indices)
+{
+	if (isOffRenderThread()) {
+		MeshHandle mesh;
+		runOnRenderThread([&]() { mesh = addMesh(vertices, indices); });
+		return mesh;
+	}
+
+	PROFILE_ZONE("addMesh");
+	m_recorder.addMesh(m_frameNumber, *vertices, *indices);
+
+	// Data that is already on the GPU isn't uploaded again
+	Mesh mesh = Mesh(&m_geometryCache, vertices, indices, m_frameNumber);
+	return m_meshes.insert({ mesh, false, ++m_objectStamp });
+}
+
+void VulkanRenderer::removeMesh(MeshHandle mesh)
+{
+	if (isOffRenderThread()) {
+		SceneCommand command{};
+		command.type = SceneCommand::RemoveMesh;
+		command.mesh = mesh;
+		pushCommand(command);
+		return;
+	}
+	m_recorder.removeMesh(m_frameNumber, mesh);
+	MeshObject* object = m_meshes.get(mesh);
+	if (!object) {
+		return;
+	}
+
+	// Frames in flight may still draw from the buffers, and other meshes
+	// may share them
+	object->mesh.releaseBuffers();
+
+	// The last mesh takes the removed one's dense index, and its animation
+	// has to follow it there
+	uint32_t removedIndex = m_meshes.getDenseIndex(mesh);
+	uint32_t lastIndex = static_cast<uint32_t>(m_meshes.size() - 1);
+	if (object->animated) {
+		auto animation = std::find_if(m_animations.begin(), m_animations.end(),
+			[removedIndex](const ObjectAnimation& other) { return other.objectIndex == removedIndex; });
+		if (animation != m_animations.end()) {
+			m_animations.erase(animation);
+			m_animationVersion++;
+		}
+	}
+	if (m_meshes[lastIndex].animated && lastIndex != removedIndex) {
+		for (auto& animation : m_animations) {
+			if (animation.objectIndex == lastIndex) {
+				animation.objectIndex = removedIndex;
+			}
+		}
+		m_animationVersion++;
+	}
+	m_meshes.remove(mesh);
+}
+
+std::vector<MeshHandle> VulkanRenderer::getMeshes()
+{
+	if (isOffRenderThread()) {
+		std::vector<MeshHandle> meshes;
+		runOnRenderThread([&]() { meshes = getMeshes(); });
+		return meshes;
+	}
+
+	std::vector<MeshHandle> meshes;
+	meshes.reserve(m_meshes.size());
+	for (size_t i = 0; i < m_meshes.size(); i++) {
+		meshes.push_back(m_meshes.getHandle(i));
+	}
+	return meshes;
+}
+
+void VulkanRenderer::createFrameContexts()
+{
+	auto indices = getQueueFamilyIndices(m_device.physicalDevice);
+	m_frames.resize(m_settings.framesInFlight);
+
+	// Command buffers are never reset one by one: the whole pool
+	// is reset at the start of the frame instead
+	VkCommandPoolCreateInfo poolInfo{};
+	poolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+	poolInfo.flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT;
+	poolInfo.queueFamilyIndex = indices.graphicsFamily;
+
+	VkSemaphoreCreateInfo semaphoreInfo{};
+	semaphoreInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+
+	// Fences start signalled so that the first wait on each context returns
+	VkFenceCreateInfo fenceInfo{};
+	fenceInfo.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+	fenceInfo.flags = VK_FENCE_CREATE_SIGNALED_BIT;
+
+	VkQueryPoolCreateInfo queryPoolInfo{};
+	queryPoolInfo.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO;
+	queryPoolInfo.queryType = VK_QUERY_TYPE_TIMESTAMP;
+	queryPoolInfo.queryCount = MAX_TIMESTAMP_QUERIES;
+
+	VkPhysicalDeviceProperties properties;
+	vkGetPhysicalDeviceProperties(m_device.physicalDevice, &properties);
+	m_timestampPeriod = properties.limits.timestampPeriod;
+
+	uint32_t queueFamilyCount = 0;
+	vkGetPhysicalDeviceQueueFamilyProperties(m_device.physicalDevice, &queueFamilyCount, nullptr);
+	std::vector<VkQueueFamilyProperties> queueFamilies(queueFamilyCount);
+	vkGetPhysicalDeviceQueueFamilyProperties(m_device.physicalDevice, &queueFamilyCount, queueFamilies.data());
+	if (queueFamilies[indices.graphicsFamily].timestampValidBits == 0 && m_dynamicResolution.isEnabled()) {
+		std::cout << "The graphics queue has no timestamps, dynamic resolution is disabled" << std::endl;
+		m_dynamicResolution.setEnabled(false);
+	}
+
+	VkCommandPoolCreateInfo computePoolInfo = poolInfo;
+	if (m_computeQueue != VK_NULL_HANDLE) {
+		computePoolInfo.queueFamilyIndex = indices.computeFamily;
+		m_computeTimestamps = queueFamilies[indices.computeFamily].timestampValidBits != 0;
+	}
+
+	for (auto& frame : m_frames) {
+		VkResult result = vkCreateCommandPool(m_device.logicalDevice, &poolInfo, nullptr, &frame.commandPool);
+		if (result != VK_SUCCESS) {
+			throw std::runtime_error("Failed to create a command pool!");
+		}
+
+		VkCommandBufferAllocateInfo allocInfo{};
+		allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+		allocInfo.commandPool = frame.commandPool;
+		allocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY; // Can only be submitted directly to a queue
+		allocInfo.commandBufferCount = 1;
+
+		result = vkAllocateCommandBuffers(m_device.logicalDevice, &allocInfo, &frame.commandBuffer);
+		if (result != VK_SUCCESS) {
+			throw std::runtime_error("Failed to allocate command buffers");
+		}
+
+		if ((vkCreateSemaphore(m_device.logicalDevice, &semaphoreInfo, nullptr, &frame.imageAvailable) != VK_SUCCESS) ||
+			(vkCreateFence(m_device.logicalDevice, &fenceInfo, nullptr, &frame.fence) != VK_SUCCESS))
+		{
+			throw std::runtime_error("Failed to create semaphore or fence");
+		}
+
+		result = vkCreateQueryPool(m_device.logicalDevice, &queryPoolInfo, nullptr, &frame.timestampPool);
+		if (result != VK_SUCCESS) {
+			throw std::runtime_error("Failed to create a timestamp query pool");
+		}
+		frame.timestampsWritten = false;
+		frame.passTimestamps = 0;
+		frame.frameNumber = 0;
+		frame.arena = LinearArena(FRAME_ARENA_SIZE);
+
+		frame.computeTimestampsWritten = false;
+		frame.computePassTimestamps = 0;
+		if (m_computeQueue == VK_NULL_HANDLE) {
+			continue;
+		}
+
+		result = vkCreateCommandPool(m_device.logicalDevice, &computePoolInfo, nullptr, &frame.computeCommandPool);
+		if (result != VK_SUCCESS) {
+			throw std::runtime_error("Failed to create a compute command pool!");
+		}
+
+		allocInfo.commandPool = frame.computeCommandPool;
+		result = vkAllocateCommandBuffers(m_device.logicalDevice, &allocInfo, &frame.computeCommandBuffer);
+		if (result != VK_SUCCESS) {
+			throw std::runtime_error("Failed to allocate a compute command buffer");
+		}
+
+		if (vkCreateSemaphore(m_device.logicalDevice, &semaphoreInfo, nullptr, &frame.computeFinished) != VK_SUCCESS) {
+			throw std::runtime_error("Failed to create the compute semaphore");
+		}
+
+		if (m_computeTimestamps) {
+			result = vkCreateQueryPool(m_device.logicalDevice, &queryPoolInfo, nullptr, &frame.computeTimestampPool);
+			if (result != VK_SUCCESS) {
+				throw std::runtime_error("Failed to create a compute timestamp query pool");
+			}
+		}
+	}
+}
+
+void VulkanRenderer::createUniformBuffers()
+{
+	// View/Projection buffer (regular, one for the camera)
+	VkDeviceSize vpBufferSize = sizeof(UboViewProjection);
 
-	// Blending
-	VkPipelineColorBlendAttachmentState colorState{};
-	colorState.colorWriteMask = VK_COLOR_COMPONENT_R_BIT | VK_COLOR_COMPONENT_G_BIT
-		| VK_COLOR_COMPONENT_B_BIT | VK_COLOR_COMPONENT_A_BIT;
-	colorState.blendEnable = VK_TRUE;
-	colorState.srcColorBlendFactor = VK_BLEND_FACTOR_SRC_ALPHA;
-	colorState.dstColorBlendFactor = VK_BLEND_FACTOR_ONE_MINUS_SRC_ALPHA;
-	colorState.colorBlendOp = VK_BLEND_OP_ADD;
-	colorState.srcAlphaBlendFactor = VK_BLEND_FACTOR_ONE;
-	colorState.dstAlphaBlendFactor = VK_BLEND_FACTOR_ZERO;
-	colorState.alphaBlendOp = VK_BLEND_OP_ADD;
+	// One uniform buffer for each frame context, to avoid updating a uniform
+	// while it's bound. They stay mapped for the lifetime of the renderer.
+	for (auto& frame : m_frames) {
+		createBuffer(m_device.physicalDevice, m_device.logicalDevice, vpBufferSize, VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT,
+			VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, &frame.vpUniformBuffer, 
+			&frame.vpUniformBufferMemory);
+		vkMapMemory(m_device.logicalDevice, frame.vpUniformBufferMemory, 0, vpBufferSize, 0, &frame.vpUniformBufferMapped);
+
+		// Meshes may still be loading at this point, the buffers grow on demand
+		createObjectBuffer(frame, 64);
+		createAnimationBuffer(frame, 64);
+		frame.animationVersion = 0;
+		if (m_settings.occlusionCulling) {
+			createDrawCommandBuffer(frame, 64);
+		}
 
-	VkPipelineColorBlendStateCreateInfo colorBlendInfo{};
-	colorBlendInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_COLOR_BLEND_STATE_CREATE_INFO;
-	colorBlendInfo.logicOpEnable = VK_FALSE;
-	colorBlendInfo.attachmentCount = 1;
-	colorBlendInfo.pAttachments = &colorState;
+		// Written by the light cull pass, which may run on the compute queue
+		createLightBuffer(frame, 64);
+		frame.lightVersion = 0;
+		VkDeviceSize clusterBufferSize = sizeof(uint32_t) * (MAX_LIGHTS_PER_CLUSTER + 1)
+			* CLUSTER_COUNT_X * CLUSTER_COUNT_Y * CLUSTER_COUNT_Z;
+		createBuffer(m_device.physicalDevice, m_device.logicalDevice, clusterBufferSize, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+			VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &frame.clusterBuffer, &frame.clusterBufferMemory, m_objectQueueFamilies);
+	}
 
-	// Pipeline layout 
-	VkPipelineLayoutCreateInfo layoutInfo{};
-	layoutInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
-	layoutInfo.pPushConstantRanges = &m_pushConstantRange;
-	layoutInfo.pushConstantRangeCount = 1;
-	layoutInfo.pSetLayouts = &m_descriptorSetLayout;
-	layoutInfo.setLayoutCount = 1;
+}
 
-VkResult result = vkCreatePipelineLayout(m_device.logicalDevice, &layoutInfo, nullptr, &m_pipelineLayout);
-if (result != VK_SUCCESS) {
-	throw std::runtime_error("Could not create pipeline layout");
+void VulkanRenderer::createObjectBuffer(FrameContext& frame, uint32_t capacity)
+{
+	VkDeviceSize bufferSize = sizeof(ObjectData) * capacity;
+	// Written by the animation on the compute queue, read by the graphics queue
+	createBuffer(m_device.physicalDevice, m_device.logicalDevice, bufferSize, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+		VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, &frame.objectBuffer,
+		&frame.objectBufferMemory, m_objectQueueFamilies);
+	vkMapMemory(m_device.logicalDevice, frame.objectBufferMemory, 0, bufferSize, 0, &frame.objectBufferMapped);
+	frame.objectCapacity = capacity;
+	frame.objectStamps.clear(); // nothing is written to it yet
 }
 
-// TODO - add depth stencil testing
-VkGraphicsPipelineCreateInfo createInfo{};
-createInfo.sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO;
-createInfo.stageCount = 2;
-createInfo.pStages = shaderStageInfos;
-createInfo.pVertexInputState = &vertexInputInfo;
-createInfo.pInputAssemblyState = &inputAssemblyInfo;
-createInfo.pViewportState = &viewportInfo;
-createInfo.pDynamicState = nullptr;
-createInfo.pRasterizationState = &rasterizerInfo;
-createInfo.pMultisampleState = &multisamplingInfo;
-createInfo.pColorBlendState = &colorBlendInfo;
-createInfo.pDepthStencilState = nullptr;
-createInfo.layout = m_pipelineLayout;
-createInfo.renderPass = m_renderPass;
-createInfo.subpass = 0;
-createInfo.basePipelineHandle = VK_NULL_HANDLE;
-createInfo.basePipelineIndex = -1;
+void VulkanRenderer::createAnimationBuffer(FrameContext& frame, uint32_t capacity)
+{
+	VkDeviceSize bufferSize = sizeof(AnimationData) * capacity;
+	createBuffer(m_device.physicalDevice, m_device.logicalDevice, bufferSize, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+		VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, &frame.animationBuffer,
+		&frame.animationBufferMemory);
+	vkMapMemory(m_device.logicalDevice, frame.animationBufferMemory, 0, bufferSize, 0, &frame.animationBufferMapped);
+	frame.animationCapacity = capacity;
+}
 
-result = vkCreateGraphicsPipelines(m_device.logicalDevice, VK_NULL_HANDLE, 1,
-	&createInfo, nullptr, &m_graphicsPipeline);
+void VulkanRenderer::createLightBuffer(FrameContext& frame, uint32_t capacity)
+{
+	VkDeviceSize bufferSize = sizeof(PointLight) * capacity;
+	createBuffer(m_device.physicalDevice, m_device.logicalDevice, bufferSize, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+		VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, &frame.lightBuffer,
+		&frame.lightBufferMemory, m_objectQueueFamilies);
+	vkMapMemory(m_device.logicalDevice, frame.lightBufferMemory, 0, bufferSize, 0, &frame.lightBufferMapped);
+	frame.lightCapacity = capacity;
+}
 
-if (result != VK_SUCCESS) {
-	throw std::runtime_error("Failed to create graphics pipeline");
+void VulkanRenderer::createDrawCommandBuffer(FrameContext& frame, uint32_t capacity)
+{
+	// The counts, then the commands of the entries, of the early pass and of
+	// the late pass
+	VkDeviceSize bufferSize = getDrawCommandOffset(capacity * 3);
+	createBuffer(m_device.physicalDevice, m_device.logicalDevice, bufferSize,
+		VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT,
+		VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, &frame.drawCommandBuffer,
+		&frame.drawCommandBufferMemory);
+	vkMapMemory(m_device.logicalDevice, frame.drawCommandBufferMemory, 0, bufferSize, 0, &frame.drawCommandBufferMapped);
+	frame.drawCommandCapacity = capacity;
+	frame.drawCommandCount = 0;
 }
 
-// Destroy shader modules
-vkDestroyShaderModule(m_device.logicalDevice, fragmentShaderModule, nullptr);
-vkDestroyShaderModule(m_device.logicalDevice, vertexShaderModule, nullptr);
+uint32_t VulkanRenderer::registerBindlessBuffer(VkBuffer buffer)
+{
+	if (m_bindlessBufferCount >= MAX_BINDLESS_BUFFERS) {
+		throw std::runtime_error("Out of bindless buffer slots");
+	}
+
+	uint32_t index = m_bindlessBufferCount++;
+	updateBindlessBuffer(index, buffer);
+	return index;
 }
 
-void VulkanRenderer::createFramebuffers()
+void VulkanRenderer::updateBindlessBuffer(uint32_t index, VkBuffer buffer)
 {
-	m_swapChainFramebuffers.resize(m_swapChainImages.size());
-	for (size_t i = 0; i < m_swapChainFramebuffers.size(); i++) {
+	VkDescriptorBufferInfo bufferInfo{};
+	bufferInfo.buffer = buffer;
+	bufferInfo.offset = 0;
+	bufferInfo.range = VK_WHOLE_SIZE;
+
+	VkWriteDescriptorSet setWrite{};
+	setWrite.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+	setWrite.dstSet = m_bindlessDescriptorSet;
+	setWrite.dstBinding = 0;
+	setWrite.dstArrayElement = index;
+	setWrite.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+	setWrite.descriptorCount = 1;
+	setWrite.pBufferInfo = &bufferInfo;
+
+	vkUpdateDescriptorSets(m_device.logicalDevice, 1, &setWrite, 0, nullptr);
+}
 
-		std::array<VkImageView, 1> attachments = {
-			m_swapChainImages[i].imageView
-		};
+void VulkanRenderer::createDescriptorAllocators()
+{
+	// Pools are sized for a mix of typical sets and grow as needed
+	std::vector<DescriptorAllocator::PoolRatio> ratios = {
+		{ VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, 1.0f },
+		{ VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 2.0f },
+		{ VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, 2.0f },
+		{ VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, 1.0f }
+	};
 
-		VkFramebufferCreateInfo createInfo{};
-		createInfo.sType = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO;
-		createInfo.renderPass = m_renderPass;
-		createInfo.attachmentCount = static_cast<uint32_t>(attachments.size());
-		createInfo.pAttachments = attachments.data();
-		createInfo.width = m_swapChainExtent.width;
-		createInfo.height = m_swapChainExtent.height;
-		createInfo.layers = 1;
+	m_descriptorAllocator = DescriptorAllocator(m_device.logicalDevice, ratios);
+	m_descriptorCache.setAllocator(&m_descriptorAllocator);
 
-		VkResult result = vkCreateFramebuffer(m_device.logicalDevice, &createInfo, nullptr, &m_swapChainFramebuffers[i]);
-		if (result != VK_SUCCESS) {
-			throw std::runtime_error("Failed to create framebuffer!");
-		}
+	for (auto& frame : m_frames) {
+		frame.descriptorAllocator = DescriptorAllocator(m_device.logicalDevice, ratios);
 	}
+
+	// The bindless set needs a pool of its own that allows updates after bind
+	std::vector<DescriptorAllocator::PoolRatio> bindlessRatios = {
+		{ VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, static_cast<float>(MAX_BINDLESS_BUFFERS) },
+		{ VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, static_cast<float>(MAX_BINDLESS_TEXTURES) }
+	};
+	m_bindlessAllocator = DescriptorAllocator(m_device.logicalDevice, bindlessRatios, 1,
+		VK_DESCRIPTOR_POOL_CREATE_UPDATE_AFTER_BIND_BIT);
 }
 
-void VulkanRenderer::createCommandPool()
+void VulkanRenderer::createDescriptorSets()
 {
-	auto indices = getQueueFamilyIndices(m_device.physicalDevice);
-	VkCommandPoolCreateInfo poolInfo{};
-	poolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
-	poolInfo.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;
-	poolInfo.queueFamilyIndex = indices.graphicsFamily;
+	for (auto& frame : m_frames) {
+		// View projection descriptor set
+		frame.descriptorSet = m_descriptorCache.getSet(m_descriptorSetLayout, {
+			DescriptorSetCache::Binding::buffer(0, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, frame.vpUniformBuffer,
+				0, sizeof(UboViewProjection))
+		});
+	}
 
-	VkResult result = vkCreateCommandPool(m_device.logicalDevice, &poolInfo, nullptr, &m_graphicsCommandPool);
+	m_bindlessDescriptorSet = m_bindlessAllocator.allocate(m_bindlessSetLayout);
 
-	if (result != VK_SUCCESS) {
-		throw std::runtime_error("Failed to create a command pool!");
+	for (auto& frame : m_frames) {
+		frame.objectBufferIndex = registerBindlessBuffer(frame.objectBuffer);
+		frame.animationBufferIndex = registerBindlessBuffer(frame.animationBuffer);
+		if (frame.drawCommandBuffer != VK_NULL_HANDLE) {
+			frame.drawCommandBufferIndex = registerBindlessBuffer(frame.drawCommandBuffer);
+		}
+		frame.lightBufferIndex = registerBindlessBuffer(frame.lightBuffer);
+		frame.clusterBufferIndex = registerBindlessBuffer(frame.clusterBuffer);
 	}
 }
 
-void VulkanRenderer::createCommandBuffers()
+void VulkanRenderer::createResidencyManager()
 {
-	m_commandBuffers.resize(m_swapChainFramebuffers.size());
-	VkCommandBufferAllocateInfo allocInfo{};
-	allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
-	allocInfo.commandPool = m_graphicsCommandPool;
-	allocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY; // Can only be submitted directly to a queue
-	allocInfo.commandBufferCount = static_cast<uint32_t>(m_commandBuffers.size());
+	m_residency = ResidencyManager(m_device.physicalDevice, m_hasMemoryBudget);
+	if (!m_hasMemoryBudget) {
+		std::cout << "VK_EXT_memory_budget not available, estimating memory use" << std::endl;
+	}
+}
 
-	VkResult result = vkAllocateCommandBuffers(m_device.logicalDevice, &allocInfo, m_commandBuffers.data());
+void VulkanRenderer::createGeometryCache()
+{
+	// Evicted buffers are drawn from host visible memory. The ones they
+	// replace, and the ranges no mesh uses any more, are freed once the
+	// frames using them are done.
+	m_geometryCache = GeometryCache(m_device.physicalDevice, m_device.logicalDevice, m_graphicsQueue,
+		m_transferCommandPool, &m_residency, [this](std::function<void()> work) {
+			m_deletionQueue.push(m_frameNumber, std::move(work));
+		});
+}
 
+void VulkanRenderer::createTextureStreamer()
+{
+	// Shared by every texture. Levels that haven't been streamed in yet are
+	// kept out of reach by a LOD clamp in the fragment shader.
+	VkSamplerCreateInfo samplerCreateInfo{};
+	samplerCreateInfo.sType = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO;
+	samplerCreateInfo.magFilter = VK_FILTER_LINEAR;
+	samplerCreateInfo.minFilter = VK_FILTER_LINEAR;
+	samplerCreateInfo.mipmapMode = VK_SAMPLER_MIPMAP_MODE_LINEAR;
+	samplerCreateInfo.addressModeU = VK_SAMPLER_ADDRESS_MODE_REPEAT;
+	samplerCreateInfo.addressModeV = VK_SAMPLER_ADDRESS_MODE_REPEAT;
+	samplerCreateInfo.addressModeW = VK_SAMPLER_ADDRESS_MODE_REPEAT;
+	samplerCreateInfo.mipLodBias = 0.0f;
+	samplerCreateInfo.anisotropyEnable = VK_FALSE;
+	samplerCreateInfo.maxAnisotropy = 1.0f;
+	samplerCreateInfo.compareEnable = VK_FALSE;
+	samplerCreateInfo.minLod = 0.0f;
+	samplerCreateInfo.maxLod = VK_LOD_CLAMP_NONE;
+	samplerCreateInfo.borderColor = VK_BORDER_COLOR_INT_OPAQUE_BLACK;
+	samplerCreateInfo.unnormalizedCoordinates = VK_FALSE;
+
+	VkResult result = vkCreateSampler(m_device.logicalDevice, &samplerCreateInfo, nullptr, &m_textureSampler);
 	if (result != VK_SUCCESS) {
-		throw std::runtime_error("Failed to allocate command buffers");
+		throw std::runtime_error("Failed to create the texture sampler");
 	}
+
+	m_textureStreamer = TextureStreamer(m_device.physicalDevice, m_device.logicalDevice,
+		static_cast<uint32_t>(m_settings.framesInFlight), m_bindlessDescriptorSet, 1, MAX_BINDLESS_TEXTURES,
+		m_textureSampler);
 }
 
-void VulkanRenderer::createSynchronisation()
+void VulkanRenderer::createFrameCapture()
 {
-	m_imageAvailable.resize(MAX_FRAME_DRAWS);
-	m_renderFinished.resize(MAX_FRAME_DRAWS);
-	m_drawFences.resize(MAX_FRAME_DRAWS);
+	if (m_settings.capturePath.empty()) {
+		return;
+	}
+	if (!m_canCapture) {
+		std::cout << "Frame capture is not supported by this swapchain, no frames will be captured" << std::endl;
+		return;
+	}
 
-	VkSemaphoreCreateInfo semaphoreInfo{};
-	semaphoreInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+	// A frame's copy is collected framesInFlight frames later, so that many
+	// buffers keep up with every frame; one more absorbs a late fence
+	m_frameCapture = std::make_unique<FrameCapture>(m_device.physicalDevice, m_device.logicalDevice,
+		static_cast<uint32_t>(m_settings.framesInFlight) + 1, m_settings.capturePath, m_settings.captureFrames);
+}
 
-	VkFenceCreateInfo fenceInfo{};
-	fenceInfo.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
-	fenceInfo.flags = VK_FENCE_CREATE_SIGNALED_BIT;
+void VulkanRenderer::updateUniformBuffers(FrameContext& frame)
+{
+	PROFILE_ZONE("updateUniformBuffers");
+
+	// The frame's previous submission has finished, so a buffer that is too
+	// small can be replaced right away
+	uint32_t objectCount = static_cast<uint32_t>(m_meshes.size());
+	if (objectCount > frame.objectCapacity) {
+		uint32_t capacity = frame.objectCapacity;
+		while (capacity < objectCount) {
+			capacity *= 2;
+		}
 
-	for (size_t i = 0; i < MAX_FRAME_DRAWS; i++) {
-		if ((vkCreateSemaphore(m_device.logicalDevice, &semaphoreInfo, nullptr, &m_imageAvailable[i]) != VK_SUCCESS) ||
-			(vkCreateSemaphore(m_device.logicalDevice, &semaphoreInfo, nullptr, &m_renderFinished[i]) != VK_SUCCESS) ||
-			(vkCreateFence(m_device.logicalDevice, &fenceInfo, nullptr, &m_drawFences[i]) != VK_SUCCESS))
-		{
-			throw std::runtime_error("Failed to create semaphore or fence");
+		vkUnmapMemory(m_device.logicalDevice, frame.objectBufferMemory);
+		vkDestroyBuffer(m_device.logicalDevice, frame.objectBuffer, nullptr);
+		vkFreeMemory(m_device.logicalDevice, frame.objectBufferMemory, nullptr);
+
+		createObjectBuffer(frame, capacity);
+		updateBindlessBuffer(frame.objectBufferIndex, frame.objectBuffer);
+	}
+	if (m_settings.occlusionCulling && objectCount > frame.drawCommandCapacity) {
+		uint32_t capacity = frame.drawCommandCapacity;
+		while (capacity < objectCount) {
+			capacity *= 2;
 		}
+
+		vkUnmapMemory(m_device.logicalDevice, frame.drawCommandBufferMemory);
+		vkDestroyBuffer(m_device.logicalDevice, frame.drawCommandBuffer, nullptr);
+		vkFreeMemory(m_device.logicalDevice, frame.drawCommandBufferMemory, nullptr);
+
+		createDrawCommandBuffer(frame, capacity);
+		updateBindlessBuffer(frame.drawCommandBufferIndex, frame.drawCommandBuffer);
 	}
-}
 
-void VulkanRenderer::createUniformBuffers()
-{
-	// View/Projection buffer (regular, one for the camera)
-	VkDeviceSize vpBufferSize = sizeof(UboViewProjection);
+	// Animations only change when set, so each frame's copy is only rewritten when stale
+	if (frame.animationVersion != m_animationVersion) {
+		uint32_t animationCount = static_cast<uint32_t>(m_animations.size());
+		if (animationCount > frame.animationCapacity) {
+			uint32_t capacity = frame.animationCapacity;
+			while (capacity < animationCount) {
+				capacity *= 2;
+			}
 
-	// One uniform buffer for each image
-	m_vpUniformBuffers.resize(m_swapChainImages.size());
-	m_vpUniformBufferMemory.resize(m_swapChainImages.size());
+			vkUnmapMemory(m_device.logicalDevice, frame.animationBufferMemory);
+			vkDestroyBuffer(m_device.logicalDevice, frame.animationBuffer, nullptr);
+			vkFreeMemory(m_device.logicalDevice, frame.animationBufferMemory, nullptr);
 
-	// Create uniform buffers
-	for (size_t i = 0; i < m_swapChainImages.size(); i++) {
-		createBuffer(m_device.physicalDevice, m_device.logicalDevice, vpBufferSize, VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT,
-			VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, &m_vpUniformBuffers[i], 
-			&m_vpUniformBufferMemory[i]);
+			createAnimationBuffer(frame, capacity);
+			updateBindlessBuffer(frame.animationBufferIndex, frame.animationBuffer);
+		}
+
+		AnimationData* animations = static_cast<AnimationData*>(frame.animationBufferMapped);
+		for (uint32_t i = 0; i < animationCount; i++) {
+			animations[i].base = m_meshes[m_animations[i].objectIndex].mesh.getModel().model;
+			animations[i].animation = m_animations[i];
+		}
+		frame.animationVersion = m_animationVersion;
+	}
+
+	// Lights likewise
+	uint32_t lightCount = static_cast<uint32_t>(m_lights.size());
+	if (frame.lightVersion != m_lightVersion) {
+		if (lightCount > frame.lightCapacity) {
+			uint32_t capacity = frame.lightCapacity;
+			while (capacity < lightCount) {
+				capacity *= 2;
+			}
+
+			vkUnmapMemory(m_device.logicalDevice, frame.lightBufferMemory);
+			vkDestroyBuffer(m_device.logicalDevice, frame.lightBuffer, nullptr);
+			vkFreeMemory(m_device.logicalDevice, frame.lightBufferMemory, nullptr);
+
+			createLightBuffer(frame, capacity);
+			updateBindlessBuffer(frame.lightBufferIndex, frame.lightBuffer);
+		}
+
+		memcpy(frame.lightBufferMapped, m_lights.data(), sizeof(PointLight) * lightCount);
+		frame.lightVersion = m_lightVersion;
+	}
+
+	// Object records are written and culled in parallel. A record is only
+	// written when its object or texture changed since this frame's buffer
+	// last held it; the model matrix of an animated object is left to the
+	// animation pass.
+	std::array<glm::vec4, 6> frustum = getFrustumPlanes(m_uboViewProjection.projection * m_uboViewProjection.view);
+	ObjectData* objects = static_cast<ObjectData*>(frame.objectBufferMapped);
+	frame.objectStamps.resize(objectCount);
+	ArenaVector<uint8_t> visible(objectCount, 0, frame.arena);
+	ArenaVector<float> viewDepth(objectCount, 0.0f, frame.arena); // of the bounding sphere's centre
+	const glm::mat4& view = m_uboViewProjection.view;
+	m_jobs->parallelFor(objectCount, OBJECT_UPDATE_GRAIN, [&](size_t begin, size_t end) {
+		PROFILE_ZONE("updateObjects");
+		for (size_t i = begin; i < end; i++) {
+			MeshObject& object = m_meshes[i];
+			glm::mat4 model = object.mesh.getModel().model;
+			glm::vec4 bounds = object.mesh.getBounds();
+			uint32_t texture = object.mesh.getMaterialIndex();
+
+			std::pair<uint64_t, uint64_t> stamps(object.stamp, m_textureStreamer.getVersion(texture));
+			if (frame.objectStamps[i] != stamps) {
+				if (!object.animated) {
+					objects[i].model = model;
+				}
+				objects[i].bounds = bounds;
+				objects[i].materialIndex = m_textureStreamer.getBindlessSlot(texture);
+				objects[i].textureMinLod = m_textureStreamer.getMinLod(texture);
+				frame.objectStamps[i] = stamps;
+			}
+
+			visible[i] = object.animated || isSphereVisible(frustum, model, bounds);
+			viewDepth[i] = -(view * (model * glm::vec4(bounds.x, bounds.y, bounds.z, 1.0f))).z;
+		}
+	});
+
+	// Only what is in view counts as used, whether or not it ends up
+	// occluded
+	m_drawList = ArenaVector<uint32_t>(frame.arena);
+	m_drawList.reserve(objectCount);
+	m_geometryCache.markUsed(m_frameNumber);
+	for (uint32_t i = 0; i < objectCount; i++) {
+		if (!visible[i]) {
+			continue;
+		}
+		m_drawList.push_back(i);
+		uint32_t texture = m_meshes[i].mesh.getMaterialIndex();
+		if (texture < m_textureResidency.size()) {
+			m_residency.markUsed(m_textureResidency[texture], m_frameNumber);
+		}
+	}
+
+	// Opaque objects are drawn nearest first, so that the depth test rejects
+	// what they hide before it is shaded, then the transparent ones farthest
+	// first, each blended over what is behind it. Ties go by index to keep
+	// the order the same from frame to frame.
+	m_opaqueDrawCount = m_drawList.size();
+	if (m_settings.renderQueue) {
+		auto firstTransparent = std::partition(m_drawList.begin(), m_drawList.end(),
+			[this](uint32_t i) { return !m_meshes[i].mesh.isTransparent(); });
+		std::sort(m_drawList.begin(), firstTransparent, [&viewDepth](uint32_t a, uint32_t b) {
+			return viewDepth[a] < viewDepth[b] || (viewDepth[a] == viewDepth[b] && a < b);
+		});
+		std::sort(firstTransparent, m_drawList.end(), [&viewDepth](uint32_t a, uint32_t b) {
+			return viewDepth[a] > viewDepth[b] || (viewDepth[a] == viewDepth[b] && a < b);
+		});
+		m_opaqueDrawCount = static_cast<size_t>(firstTransparent - m_drawList.begin());
+	}
+
+	// A command for each entry, which the cull passes copy to the commands
+	// they draw when the entry is visible
+	if (m_settings.occlusionCulling) {
+		uint32_t drawCount = static_cast<uint32_t>(m_drawList.size());
+		*static_cast<DrawCounts*>(frame.drawCommandBufferMapped) = DrawCounts{};
+		VkDrawIndexedIndirectCommand* commands = reinterpret_cast<VkDrawIndexedIndirectCommand*>(
+			static_cast<uint8_t*>(frame.drawCommandBufferMapped) + getDrawCommandOffset(0));
+		for (uint32_t i = 0; i < drawCount; i++) {
+			uint32_t j = m_drawList[i];
+			Mesh& mesh = m_meshes[j].mesh;
+			commands[i] = { static_cast<uint32_t>(mesh.getIndexCount()), 0, mesh.getFirstIndex(), mesh.getVertexOffset(), j };
+		}
+		frame.drawCommandCount = drawCount;
+		frame.firstTransparentDraw = static_cast<uint32_t>(m_opaqueDrawCount);
 	}
 
+	// Copy View-Projection data
+	m_uboViewProjection.objectBuffer = frame.objectBufferIndex;
+	m_uboViewProjection.lightBuffer = frame.lightBufferIndex;
+	m_uboViewProjection.clusterBuffer = frame.clusterBufferIndex;
+	m_uboViewProjection.lightCount = lightCount;
+	m_uboViewProjection.clusterTileSize = glm::vec2(
+		static_cast<float>((m_renderExtent.width + CLUSTER_COUNT_X - 1) / CLUSTER_COUNT_X),
+		static_cast<float>((m_renderExtent.height + CLUSTER_COUNT_Y - 1) / CLUSTER_COUNT_Y));
+	memcpy(frame.vpUniformBufferMapped, &m_uboViewProjection, sizeof(UboViewProjection));
 }
 
-void VulkanRenderer::createDescriptorPool()
+void VulkanRenderer::submitAsyncCompute(FrameContext& frame)
 {
-	VkDescriptorPoolSize vpPoolSize{};
-	vpPoolSize.type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
-	vpPoolSize.descriptorCount = static_cast<uint32_t>(m_vpUniformBuffers.size());
+	PROFILE_ZONE("submitAsyncCompute");
+
+	// The fence has signalled, so the graphics work that waited for this
+	// context's last compute submission is done, and so is that submission
+	vkResetCommandPool(m_device.logicalDevice, frame.computeCommandPool, 0);
 
-	std::vector< VkDescriptorPoolSize> poolSizes = { vpPoolSize /* , modelPoolSize */};
+	VkCommandBufferBeginInfo bufferBeginInfo{};
+	bufferBeginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+	bufferBeginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+	if (vkBeginCommandBuffer(frame.computeCommandBuffer, &bufferBeginInfo) != VK_SUCCESS) {
+		throw std::runtime_error("Failed to start recording the compute command buffer");
+	}
 
-	VkDescriptorPoolCreateInfo createInfo{};
-	createInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
-	createInfo.maxSets = static_cast<uint32_t>(m_swapChainImages.size());
-	createInfo.poolSizeCount = static_cast<uint32_t>(poolSizes.size());
-	createInfo.pPoolSizes = poolSizes.data();
+	bool timed = frame.computeTimestampPool != VK_NULL_HANDLE;
+	uint32_t passTimestamps = static_cast<uint32_t>(m_gpuComputePassNames.size()) * 2;
+	bool timePasses = timed && Profiler::isCapturing() && 2 + passTimestamps <= MAX_TIMESTAMP_QUERIES;
+	frame.computePassTimestamps = timePasses ? passTimestamps : 0;
+	if (timed) {
+		vkCmdResetQueryPool(frame.computeCommandBuffer, frame.computeTimestampPool, 0, MAX_TIMESTAMP_QUERIES);
+		vkCmdWriteTimestamp(frame.computeCommandBuffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, frame.computeTimestampPool, 0);
+	}
 
-	VkResult result = vkCreateDescriptorPool(m_device.logicalDevice, &createInfo, nullptr, &m_descriptorPool);
+	m_renderGraph->setBuffer(m_objects, frame.objectBuffer);
+	m_renderGraph->setBuffer(m_clusters, frame.clusterBuffer);
+	if (m_settings.occlusionCulling) {
+		m_renderGraph->setBuffer(m_drawCommands, frame.drawCommandBuffer);
+	}
+	m_renderGraph->executeAsyncCompute(frame.computeCommandBuffer, frame.arena,
+		timePasses ? frame.computeTimestampPool : VK_NULL_HANDLE, 2);
 
-	if (result != VK_SUCCESS) {
-		throw std::runtime_error("Failed to create descriptor pool.");
+	if (timed) {
+		vkCmdWriteTimestamp(frame.computeCommandBuffer, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, frame.computeTimestampPool, 1);
+		frame.computeTimestampsWritten = true;
+	}
+
+	if (vkEndCommandBuffer(frame.computeCommandBuffer) != VK_SUCCESS) {
+		throw std::runtime_error("Failed to stop recording the compute command buffer");
+	}
+
+	// No fence: the graphics submission waits for the semaphore, and its
+	// fence covers both
+	VkSubmitInfo submitInfo{};
+	submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+	submitInfo.commandBufferCount = 1;
+	submitInfo.pCommandBuffers = &frame.computeCommandBuffer;
+	submitInfo.signalSemaphoreCount = 1;
+	submitInfo.pSignalSemaphores = &frame.computeFinished;
+	if (vkQueueSubmit(m_computeQueue, 1, &submitInfo, VK_NULL_HANDLE) != VK_SUCCESS) {
+		throw std::runtime_error("Failed to submit the compute command buffer");
 	}
 }
 
-void VulkanRenderer::createDescriptorSets()
+void VulkanRenderer::recordCommands(FrameContext& frame, uint32_t currentImage)
 {
-	m_descriptorSets.resize(m_swapChainImages.size());
+	PROFILE_ZONE("recordCommands");
+
+	// information about how to begin each command buffer (same for each command)
+
+	VkCommandBufferBeginInfo bufferBeginInfo{};
+	bufferBeginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+	bufferBeginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT; // re-recorded every frame
+
+	VkResult result = vkBeginCommandBuffer(frame.commandBuffer, &bufferBeginInfo);
+	if (result != VK_SUCCESS) {
+		throw std::runtime_error("Failed to start recording a command buffer");
+	}
 
-	std::vector<VkDescriptorSetLayout> setLayouts(m_swapChainImages.size(), m_descriptorSetLayout);
+	vkCmdResetQueryPool(frame.commandBuffer, frame.timestampPool, 0, MAX_TIMESTAMP_QUERIES);
+	vkCmdWriteTimestamp(frame.commandBuffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, frame.timestampPool, 0);
 
-	VkDescriptorSetAllocateInfo setAllocInfo{};
-	setAllocInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
-	setAllocInfo.descriptorPool = m_descriptorPool;
-	setAllocInfo.descriptorSetCount = static_cast<uint32_t>(m_swapChainImages.size());
-	setAllocInfo.pSetLayouts = setLayouts.data();
+	// Pass timestamps are only worth reading back for a trace
+	uint32_t passTimestamps = static_cast<uint32_t>(m_gpuPassNames.size()) * 2;
+	bool timePasses = Profiler::isCapturing() && FIRST_PASS_QUERY + passTimestamps <= MAX_TIMESTAMP_QUERIES;
+	frame.passTimestamps = timePasses ? passTimestamps : 0;
+
+	m_imageIndex = currentImage;
+	m_renderGraph->setImage(m_backbuffer, m_swapChainImages[currentImage].image, m_swapChainImages[currentImage].imageView);
+	m_renderGraph->setBuffer(m_objects, frame.objectBuffer);
+	m_renderGraph->setBuffer(m_clusters, frame.clusterBuffer);
+	if (m_settings.occlusionCulling) {
+		m_renderGraph->setBuffer(m_drawCommands, frame.drawCommandBuffer);
+	}
+	m_renderGraph->execute(frame.commandBuffer, frame.arena, timePasses ? frame.timestampPool : VK_NULL_HANDLE,
+		FIRST_PASS_QUERY);
 
-	VkResult result = vkAllocateDescriptorSets(m_device.logicalDevice, &setAllocInfo, m_descriptorSets.data());
+	vkCmdWriteTimestamp(frame.commandBuffer, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, frame.timestampPool, 1);
+	frame.timestampsWritten = true;
 
+	result = vkEndCommandBuffer(frame.commandBuffer);
 	if (result != VK_SUCCESS) {
-		throw std::runtime_error("Failed to allocate descriptor sets.") ;
+		throw std::runtime_error("Failed to stop recording a command buffer");
 	}
+	
 
-	for (size_t i = 0; i < m_swapChainImages.size(); i++) {
+}
 
-		// View projection descriptor set
-		VkDescriptorBufferInfo vpBufferInfo{};
-		vpBufferInfo.buffer = m_vpUniformBuffers[i];
-		vpBufferInfo.offset = 0;
-		vpBufferInfo.range = sizeof(UboViewProjection);
+void VulkanRenderer::recordTextureUploads(VkCommandBuffer commandBuffer)
+{
+	if (m_textureStreamer.recordUploads(commandBuffer, m_currentFrame, m_frames[m_currentFrame].arena, *m_jobs)) {
+		m_textureStreamer.printStats(std::cout);
+	}
+}
 
-		VkWriteDescriptorSet vpSetWrite{};
-		vpSetWrite.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
-		vpSetWrite.dstSet = m_descriptorSets[i];
-		vpSetWrite.dstBinding = 0;
-		vpSetWrite.dstArrayElement = 0;
-		vpSetWrite.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
-		vpSetWrite.descriptorCount = 1;
-		vpSetWrite.pBufferInfo = &vpBufferInfo;
+void VulkanRenderer::recordAnimatePass(VkCommandBuffer commandBuffer)
+{
+	if (m_animations.empty()) {
+		return;
+	}
 
-		std::vector<VkWriteDescriptorSet> writeSets = { vpSetWrite };
+	FrameContext& frame = m_frames[m_currentFrame];
+
+	AnimatePushConstants pushConstants{};
+	pushConstants.time = static_cast<float>(m_animationTime);
+	pushConstants.animationCount = static_cast<uint32_t>(m_animations.size());
+	pushConstants.objectBuffer = frame.objectBufferIndex;
+	pushConstants.animationBuffer = frame.animationBufferIndex;
+
+	vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, m_animatePipeline);
+	vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, m_animatePipelineLayout,
+		0, 1, &m_bindlessDescriptorSet, 0, nullptr);
+	vkCmdPushConstants(commandBuffer, m_animatePipelineLayout, VK_SHADER_STAGE_COMPUTE_BIT,
+		0, sizeof(AnimatePushConstants), &pushConstants);
+	RenderStats::countPipelineBind();
+	RenderStats::countDescriptorSetBinds(1);
+	RenderStats::countPushConstants(sizeof(AnimatePushConstants));
+
+	uint32_t groupCount = (pushConstants.animationCount + ANIMATE_GROUP_SIZE - 1) / ANIMATE_GROUP_SIZE;
+	vkCmdDispatch(commandBuffer, groupCount, 1, 1);
+	RenderStats::countDispatch();
+}
 
-		vkUpdateDescriptorSets(m_device.logicalDevice, 
-			static_cast<uint32_t>(writeSets.size()),
-			writeSets.data(), 0, nullptr);
+void VulkanRenderer::recordLightCullPass(VkCommandBuffer commandBuffer)
+{
+	// Shading doesn't look at the clusters without lights
+	if (m_lights.empty()) {
+		return;
 	}
+
+	FrameContext& frame = m_frames[m_currentFrame];
+
+	LightCullPushConstants pushConstants{};
+	pushConstants.view = m_uboViewProjection.view;
+	pushConstants.projectionScale = glm::vec2(m_uboViewProjection.projection[0][0], m_uboViewProjection.projection[1][1]);
+	pushConstants.tileSize = 2.0f * m_uboViewProjection.clusterTileSize
+		/ glm::vec2(static_cast<float>(m_renderExtent.width), static_cast<float>(m_renderExtent.height));
+	pushConstants.nearPlane = NEAR_PLANE;
+	pushConstants.farPlane = FAR_PLANE;
+	pushConstants.lightCount = static_cast<uint32_t>(m_lights.size());
+	pushConstants.lightBuffer = frame.lightBufferIndex;
+	pushConstants.clusterBuffer = frame.clusterBufferIndex;
+
+	vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, m_lightCullPipeline);
+	vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, m_lightCullPipelineLayout,
+		0, 1, &m_bindlessDescriptorSet, 0, nullptr);
+	vkCmdPushConstants(commandBuffer, m_lightCullPipelineLayout, VK_SHADER_STAGE_COMPUTE_BIT,
+		0, sizeof(LightCullPushConstants), &pushConstants);
+	RenderStats::countPipelineBind();
+	RenderStats::countDescriptorSetBinds(1);
+	RenderStats::countPushConstants(sizeof(LightCullPushConstants));
+
+	// A work group per cluster
+	vkCmdDispatch(commandBuffer, CLUSTER_COUNT_X, CLUSTER_COUNT_Y, CLUSTER_COUNT_Z);
+	RenderStats::countDispatch();
 }
 
-void VulkanRenderer::updateUniformBuffers(uint32_t imageIndex)
+void VulkanRenderer::recordCullPass(VkCommandBuffer commandBuffer, bool late)
 {
-	// Copy View-Projection data
-	void* data;
-	vkMapMemory(m_device.logicalDevice, m_vpUniformBufferMemory[imageIndex], 0, sizeof(UboViewProjection), 0, &data);
-	memcpy(data, &m_uboViewProjection, sizeof(UboViewProjection));
-	vkUnmapMemory(m_device.logicalDevice, m_vpUniformBufferMemory[imageIndex]);
+	FrameContext& frame = m_frames[m_currentFrame];
+
+	// Before the first pyramid is built the image holds nothing, and the
+	// early pass draws everything without looking at it
+	if (!late && !m_depthPyramidValid) {
+		VkImageMemoryBarrier barrier{};
+		barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+		barrier.srcAccessMask = 0;
+		barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+		barrier.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+		barrier.newLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+		barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+		barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+		barrier.image = m_depthPyramid.getImage();
+		barrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+		barrier.subresourceRange.baseMipLevel = 0;
+		barrier.subresourceRange.levelCount = m_depthPyramid.getLevelCount();
+		barrier.subresourceRange.baseArrayLayer = 0;
+		barrier.subresourceRange.layerCount = 1;
+
+		vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+			0, 0, nullptr, 0, nullptr, 1, &barrier);
+	}
+
+	if (frame.drawCommandCount == 0) {
+		return;
+	}
+
+	VkDescriptorImageInfo pyramidInfo{};
+	pyramidInfo.sampler = m_depthSampler;
+	pyramidInfo.imageView = m_depthPyramid.getImageView();
+	pyramidInfo.imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+
+	VkDescriptorSet cullSet = frame.descriptorAllocator.allocate(m_cullSetLayout);
+	VkWriteDescriptorSet setWrite{};
+	setWrite.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+	setWrite.dstSet = cullSet;
+	setWrite.dstBinding = 0;
+	setWrite.descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+	setWrite.descriptorCount = 1;
+	setWrite.pImageInfo = &pyramidInfo;
+	vkUpdateDescriptorSets(m_device.logicalDevice, 1, &setWrite, 0, nullptr);
+
+	CullPushConstants pushConstants{};
+	pushConstants.viewProjection = m_uboViewProjection.projection * m_uboViewProjection.view;
+	pushConstants.depthSize = glm::vec2(m_depthPyramidExtent.width, m_depthPyramidExtent.height);
+	pushConstants.drawCount = frame.drawCommandCount;
+	pushConstants.objectBuffer = frame.objectBufferIndex;
+	pushConstants.drawCommandBuffer = frame.drawCommandBufferIndex;
+	pushConstants.late = late ? 1 : 0;
+	pushConstants.pyramidValid = m_depthPyramidValid ? 1 : 0;
+	pushConstants.firstTransparent = static_cast<uint32_t>(m_opaqueDrawCount);
+
+	std::array<VkDescriptorSet, 2> descriptorSets = { m_bindlessDescriptorSet, cullSet };
+	vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, m_cullPipeline);
+	vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, m_cullPipelineLayout,
+		0, static_cast<uint32_t>(descriptorSets.size()), descriptorSets.data(), 0, nullptr);
+	vkCmdPushConstants(commandBuffer, m_cullPipelineLayout, VK_SHADER_STAGE_COMPUTE_BIT,
+		0, sizeof(CullPushConstants), &pushConstants);
+	RenderStats::countPipelineBind();
+	RenderStats::countDescriptorSetBinds(static_cast<uint32_t>(descriptorSets.size()));
+	RenderStats::countPushConstants(sizeof(CullPushConstants));
+
+	uint32_t groupCount = (pushConstants.drawCount + CULL_GROUP_SIZE - 1) / CULL_GROUP_SIZE;
+	vkCmdDispatch(commandBuffer, groupCount, 1, 1);
+	RenderStats::countDispatch();
 }
 
-void VulkanRenderer::recordCommands(uint32_t currentImage)
+void VulkanRenderer::recordDepthPyramidPass(VkCommandBuffer commandBuffer)
 {
-	// information about how to begin each command buffer (same for each command)
+	FrameContext& frame = m_frames[m_currentFrame];
+
+	vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, m_depthPyramidPipeline);
+	RenderStats::countPipelineBind();
+
+	// Only the part of the depth buffer rendered at the current scale is
+	// reduced, level by level, each one from the one before it
+	VkExtent2D sourceExtent = m_renderExtent;
+	uint32_t levelCount = m_depthPyramid.getLevelCount();
+	for (uint32_t level = 0; level < levelCount; level++) {
+		VkExtent2D levelExtent = DepthPyramid::getCoveringExtent(m_renderExtent, level);
+
+		VkDescriptorImageInfo sourceInfo{};
+		sourceInfo.sampler = m_depthSampler;
+		if (level == 0) {
+			sourceInfo.imageView = m_renderGraph->getImageView(m_sceneDepth);
+			sourceInfo.imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+		}
+		else {
+			sourceInfo.imageView = m_depthPyramid.getLevelView(level - 1);
+			sourceInfo.imageLayout = VK_IMAGE_LAYOUT_GENERAL;
+		}
 
-	VkCommandBufferBeginInfo bufferBeginInfo{};
-	bufferBeginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+		VkDescriptorImageInfo destinationInfo{};
+		destinationInfo.imageView = m_depthPyramid.getLevelView(level);
+		destinationInfo.imageLayout = VK_IMAGE_LAYOUT_GENERAL;
+
+		VkDescriptorSet set = frame.descriptorAllocator.allocate(m_depthPyramidSetLayout);
+		std::array<VkWriteDescriptorSet, 2> setWrites{};
+		setWrites[0].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+		setWrites[0].dstSet = set;
+		setWrites[0].dstBinding = 0;
+		setWrites[0].descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+		setWrites[0].descriptorCount = 1;
+		setWrites[0].pImageInfo = &sourceInfo;
+		setWrites[1].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+		setWrites[1].dstSet = set;
+		setWrites[1].dstBinding = 1;
+		setWrites[1].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
+		setWrites[1].descriptorCount = 1;
+		setWrites[1].pImageInfo = &destinationInfo;
+		vkUpdateDescriptorSets(m_device.logicalDevice, static_cast<uint32_t>(setWrites.size()), setWrites.data(), 0, nullptr);
+
+		DepthPyramidPushConstants pushConstants{};
+		pushConstants.sourceWidth = sourceExtent.width;
+		pushConstants.sourceHeight = sourceExtent.height;
+		pushConstants.destinationWidth = levelExtent.width;
+		pushConstants.destinationHeight = levelExtent.height;
+
+		vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, m_depthPyramidPipelineLayout,
+			0, 1, &set, 0, nullptr);
+		vkCmdPushConstants(commandBuffer, m_depthPyramidPipelineLayout, VK_SHADER_STAGE_COMPUTE_BIT,
+			0, sizeof(DepthPyramidPushConstants), &pushConstants);
+		RenderStats::countDescriptorSetBinds(1);
+		RenderStats::countPushConstants(sizeof(DepthPyramidPushConstants));
+
+		vkCmdDispatch(commandBuffer, (levelExtent.width + DEPTH_PYRAMID_GROUP_SIZE - 1) / DEPTH_PYRAMID_GROUP_SIZE,
+			(levelExtent.height + DEPTH_PYRAMID_GROUP_SIZE - 1) / DEPTH_PYRAMID_GROUP_SIZE, 1);
+		RenderStats::countDispatch();
+
+		// The next level reads this one, the graph takes care of the last
+		if (level + 1 < levelCount) {
+			VkImageMemoryBarrier barrier{};
+			barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+			barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+			barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+			barrier.oldLayout = VK_IMAGE_LAYOUT_GENERAL;
+			barrier.newLayout = VK_IMAGE_LAYOUT_GENERAL;
+			barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+			barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+			barrier.image = m_depthPyramid.getImage();
+			barrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+			barrier.subresourceRange.baseMipLevel = level;
+			barrier.subresourceRange.levelCount = 1;
+			barrier.subresourceRange.baseArrayLayer = 0;
+			barrier.subresourceRange.layerCount = 1;
+
+			vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+				0, 0, nullptr, 0, nullptr, 1, &barrier);
+		}
+
+		sourceExtent = levelExtent;
+	}
+
+	m_depthPyramidValid = true;
+	m_depthPyramidExtent = m_renderExtent;
+}
+
+void VulkanRenderer::recordScenePass(VkCommandBuffer commandBuffer, bool late)
+{
+	FrameContext& frame = m_frames[m_currentFrame];
 
 	// information about how to begin a render pass
 	VkRenderPassBeginInfo renderPassBeginInfo{};
 	renderPassBeginInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
-	renderPassBeginInfo.renderPass = m_renderPass;
+	renderPassBeginInfo.renderPass = late ? m_lateRenderPass : m_renderPass;
 	renderPassBeginInfo.renderArea.offset = { 0,0 };
-	renderPassBeginInfo.renderArea.extent = m_swapChainExtent;
+	renderPassBeginInfo.renderArea.extent = m_renderExtent;
 
-	VkClearValue clearValues[] = {
-		{0.6f, 0.65f, 0.4f, 1.0f}
-	};
+	// The late pass loads both attachments, the clear values go unused
+	VkClearValue clearValues[2] = {};
+	clearValues[0].color = { 0.6f, 0.65f, 0.4f, 1.0f };
+	clearValues[1].depthStencil = { 1.0f, 0 };
 	renderPassBeginInfo.pClearValues = clearValues;
-	renderPassBeginInfo.clearValueCount = 1;
+	renderPassBeginInfo.clearValueCount = 2;
 
 
 	// associate this command buffer with the corresponding framebuffer.
-	renderPassBeginInfo.framebuffer = m_swapChainFramebuffers[currentImage];
+	renderPassBeginInfo.framebuffer = m_sceneFramebuffer;
+
+	// Culled objects are drawn by a few indirect draws however big the
+	// scene is
+	if (m_settings.occlusionCulling) {
+		vkCmdBeginRenderPass(commandBuffer, &renderPassBeginInfo, VK_SUBPASS_CONTENTS_INLINE);
+		bindSceneState(commandBuffer, frame, 0);
+		recordCulledDraws(commandBuffer, frame, late);
+		vkCmdEndRenderPass(commandBuffer);
+		return;
+	}
 
-	VkResult result = vkBeginCommandBuffer(m_commandBuffers[currentImage], &bufferBeginInfo);
-	if (result != VK_SUCCESS) {
-		throw std::runtime_error("Failed to start recording a command buffer");
+	// Big scenes are split into secondary command buffers recorded on
+	// several threads, and executed in order
+	size_t drawCount = m_drawList.size();
+	size_t secondaryCount = std::min<size_t>(m_jobs->getThreadCount(),
+		drawCount / MIN_DRAWS_PER_SECONDARY);
+	if (secondaryCount <= 1) {
+		vkCmdBeginRenderPass(commandBuffer, &renderPassBeginInfo, VK_SUBPASS_CONTENTS_INLINE);
+		bindSceneState(commandBuffer, frame, 0);
+		recordSceneDraws(commandBuffer, 0, drawCount);
+		vkCmdEndRenderPass(commandBuffer);
+		return;
 	}
 
-	vkCmdBeginRenderPass(m_commandBuffers[currentImage], &renderPassBeginInfo, VK_SUBPASS_CONTENTS_INLINE);
+	// Pools are created up front, only the recording happens in parallel
+	while (frame.scenePools.size() < secondaryCount) {
+		auto indices = getQueueFamilyIndices(m_device.physicalDevice);
+		VkCommandPoolCreateInfo poolInfo{};
+		poolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+		poolInfo.flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT;
+		poolInfo.queueFamilyIndex = indices.graphicsFamily;
+
+		VkCommandPool pool;
+		if (vkCreateCommandPool(m_device.logicalDevice, &poolInfo, nullptr, &pool) != VK_SUCCESS) {
+			throw std::runtime_error("Failed to create a scene command pool");
+		}
+		frame.scenePools.push_back(pool);
 
-	// Actually draw something using the graphics pipeline
-	vkCmdBindPipeline(m_commandBuffers[currentImage], VK_PIPELINE_BIND_POINT_GRAPHICS, m_graphicsPipeline);
+		VkCommandBufferAllocateInfo allocInfo{};
+		allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+		allocInfo.commandPool = pool;
+		allocInfo.level = VK_COMMAND_BUFFER_LEVEL_SECONDARY;
+		allocInfo.commandBufferCount = 1;
 
-	// Bind buffers
-	for (size_t j = 0; j < m_meshList.size(); j++) {
-		VkBuffer vertexBuffers[] = { m_meshList[j].getVertexBuffer() };
-		VkDeviceSize offsets[] = { 0 };
-		vkCmdBindVertexBuffers(m_commandBuffers[currentImage], 0, 1, vertexBuffers, offsets);
-		vkCmdBindIndexBuffer(m_commandBuffers[currentImage], m_meshList[j].getIndexBuffer(), 0, VK_INDEX_TYPE_UINT32);
+		VkCommandBuffer secondary;
+		if (vkAllocateCommandBuffers(m_device.logicalDevice, &allocInfo, &secondary) != VK_SUCCESS) {
+			throw std::runtime_error("Failed to allocate a scene command buffer");
+		}
+		frame.sceneCommandBuffers.push_back(secondary);
+	}
+
+	vkCmdBeginRenderPass(commandBuffer, &renderPassBeginInfo, VK_SUBPASS_CONTENTS_SECONDARY_COMMAND_BUFFERS);
+	m_jobs->parallelFor(secondaryCount, 1, [&](size_t begin, size_t end) {
+		for (size_t i = begin; i < end; i++) {
+			recordSceneSecondary(frame, i, drawCount * i / secondaryCount, drawCount * (i + 1) / secondaryCount);
+		}
+	});
+	vkCmdExecuteCommands(commandBuffer, static_cast<uint32_t>(secondaryCount), frame.sceneCommandBuffers.data());
+	vkCmdEndRenderPass(commandBuffer);
+}
+
+VkPipeline VulkanRenderer::getScenePipeline(bool transparent) const
+{
+	if (!m_settings.renderQueue) {
+		return m_blendedPipeline;
+	}
+	return transparent ? m_transparentPipeline : m_graphicsPipeline;
+}
 
-		Model thisModel = m_meshList[j].getModel();
-		vkCmdPushConstants(m_commandBuffers[currentImage], m_pipelineLayout,
-			VK_SHADER_STAGE_VERTEX_BIT, 0, sizeof(Model), &thisModel);
+void VulkanRenderer::bindSceneState(VkCommandBuffer commandBuffer, const FrameContext& frame, size_t begin)
+{
+	// Actually draw something using the graphics pipeline, the one for the
+	// first object in the range
+	vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, getScenePipeline(begin >= m_opaqueDrawCount));
+	RenderStats::countPipelineBind();
+
+	VkViewport viewport{};
+	viewport.x = 0.0f;
+	viewport.y = 0.0f;
+	viewport.width = static_cast<float>(m_renderExtent.width);
+	viewport.height = static_cast<float>(m_renderExtent.height);
+	viewport.minDepth = 0.0f;
+	viewport.maxDepth = 1.0f;
+	vkCmdSetViewport(commandBuffer, 0, 1, &viewport);
+
+	VkRect2D scissor{};
+	scissor.offset = { 0, 0 };
+	scissor.extent = m_renderExtent;
+	vkCmdSetScissor(commandBuffer, 0, 1, &scissor);
+
+	// Both sets are bound once, the vertex shader finds the object record
+	// through the instance index
+	std::array<VkDescriptorSet, 2> descriptorSets = { frame.descriptorSet, m_bindlessDescriptorSet };
+	vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, m_pipelineLayout,
+		0, static_cast<uint32_t>(descriptorSets.size()), descriptorSets.data(), 0, nullptr);
+	RenderStats::countDescriptorSetBinds(static_cast<uint32_t>(descriptorSets.size()));
+
+	// Every mesh is a range of the same two buffers, which only exist once
+	// there is a mesh
+	if (m_geometryCache.getIndexBuffer() != VK_NULL_HANDLE) {
+		VkBuffer vertexBuffers[] = { m_geometryCache.getVertexBuffer() };
+		VkDeviceSize offsets[] = { 0 };
+		vkCmdBindVertexBuffers(commandBuffer, 0, 1, vertexBuffers, offsets);
+		vkCmdBindIndexBuffer(commandBuffer, m_geometryCache.getIndexBuffer(), 0, VK_INDEX_TYPE_UINT32);
+		RenderStats::countVertexBufferBind();
+		RenderStats::countIndexBufferBind();
+	}
+}
 
-		// Bind descriptor sets
-		vkCmdBindDescriptorSets(m_commandBuffers[currentImage], VK_PIPELINE_BIND_POINT_GRAPHICS, m_pipelineLayout,
-			0, 1, &m_descriptorSets[currentImage], 0, nullptr);
+void VulkanRenderer::recordSceneDraws(VkCommandBuffer commandBuffer, size_t begin, size_t end)
+{
+	for (size_t i = begin; i < end; i++) {
+		uint32_t j = m_drawList[i];
+		Mesh& mesh = m_meshes[j].mesh;
+
+		// The transparent objects follow the opaque ones
+		if (i == m_opaqueDrawCount && i > begin) {
+			vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, getScenePipeline(true));
+			RenderStats::countPipelineBind();
+		}
 
 		// Execute pipeline
-		vkCmdDrawIndexed(m_commandBuffers[currentImage], m_meshList[j].getIndexCount(), 1, 0, 0, 0);
+		vkCmdDrawIndexed(commandBuffer, mesh.getIndexCount(), 1, mesh.getFirstIndex(), mesh.getVertexOffset(), j);
+		RenderStats::countDraw(mesh.getIndexCount() / 3);
 	}
+}
 
-	vkCmdEndRenderPass(m_commandBuffers[currentImage]);
+void VulkanRenderer::recordCulledDraws(VkCommandBuffer commandBuffer, const FrameContext& frame, bool late)
+{
+	// The cull passes compacted the visible opaque entries' commands and
+	// counted them. The transparent entries are only drawn by the late pass,
+	// each command where it was so that they stay farthest first, with an
+	// instance count of 0 when culled. Triangles are counted by the GPU.
+	uint32_t drawCount = frame.drawCommandCount;
+	uint32_t opaqueCount = frame.firstTransparentDraw;
+	uint32_t firstCommand = late ? drawCount * 2 : drawCount;
+	if (opaqueCount > 0) {
+		VkDeviceSize countOffset = late ? offsetof(DrawCounts, late) : offsetof(DrawCounts, early);
+		vkCmdDrawIndexedIndirectCount(commandBuffer, frame.drawCommandBuffer, getDrawCommandOffset(firstCommand),
+			frame.drawCommandBuffer, countOffset, opaqueCount, sizeof(VkDrawIndexedIndirectCommand));
+		RenderStats::countDraw(0);
+	}
+	if (late && opaqueCount < drawCount) {
+		if (opaqueCount > 0) {
+			vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, getScenePipeline(true));
+			RenderStats::countPipelineBind();
+		}
+		vkCmdDrawIndexedIndirect(commandBuffer, frame.drawCommandBuffer, getDrawCommandOffset(firstCommand + opaqueCount),
+			drawCount - opaqueCount, sizeof(VkDrawIndexedIndirectCommand));
+		RenderStats::countDraw(0);
+	}
+}
 
-	result = vkEndCommandBuffer(m_commandBuffers[currentImage]);
-	if (result != VK_SUCCESS) {
-		throw std::runtime_error("Failed to stop recording a command buffer");
+void VulkanRenderer::recordSceneSecondary(FrameContext& frame, size_t index, size_t begin, size_t end)
+{
+	PROFILE_ZONE("recordSceneSecondary");
+	VkCommandBuffer commandBuffer = frame.sceneCommandBuffers[index];
+
+	VkCommandBufferInheritanceInfo inheritanceInfo{};
+	inheritanceInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_INHERITANCE_INFO;
+	inheritanceInfo.renderPass = m_renderPass;
+	inheritanceInfo.subpass = 0;
+	inheritanceInfo.framebuffer = m_sceneFramebuffer;
+
+	VkCommandBufferBeginInfo beginInfo{};
+	beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+	beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT | VK_COMMAND_BUFFER_USAGE_RENDER_PASS_CONTINUE_BIT;
+	beginInfo.pInheritanceInfo = &inheritanceInfo;
+
+	if (vkBeginCommandBuffer(commandBuffer, &beginInfo) != VK_SUCCESS) {
+		throw std::runtime_error("Failed to start recording a scene command buffer");
 	}
-	
+	bindSceneState(commandBuffer, frame, begin);
+	recordSceneDraws(commandBuffer, begin, end);
+	if (vkEndCommandBuffer(commandBuffer) != VK_SUCCESS) {
+		throw std::runtime_error("Failed to stop recording a scene command buffer");
+	}
+}
+
+void VulkanRenderer::recordUpscalePass(VkCommandBuffer commandBuffer)
+{
+	VkImageBlit region{};
+	region.srcSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+	region.srcSubresource.mipLevel = 0;
+	region.srcSubresource.baseArrayLayer = 0;
+	region.srcSubresource.layerCount = 1;
+	region.srcOffsets[0] = { 0, 0, 0 };
+	region.srcOffsets[1] = { static_cast<int32_t>(m_renderExtent.width), static_cast<int32_t>(m_renderExtent.height), 1 };
+	region.dstSubresource = region.srcSubresource;
+	region.dstOffsets[0] = { 0, 0, 0 };
+	region.dstOffsets[1] = { static_cast<int32_t>(m_swapChainExtent.width), static_cast<int32_t>(m_swapChainExtent.height), 1 };
+
+	vkCmdBlitImage(commandBuffer,
+		m_renderGraph->getImage(m_sceneColor), VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+		m_renderGraph->getImage(m_backbuffer), VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+		1, &region, m_upscaleFilter);
+}
+
+void VulkanRenderer::writeTimestamp(VkCommandBuffer commandBuffer, VkPipelineStageFlagBits stage, uint32_t query)
+{
+	// The scene starts at the bottom of the pipe, once the work before it is
+	// done, so that none of the waits for other queues falls into it. The
+	// upscale starts at the transfer stage, which is what waits for the
+	// swapchain image.
+	vkCmdWriteTimestamp(commandBuffer, stage, m_frames[m_currentFrame].timestampPool, query);
+}
 
+void VulkanRenderer::recordCapturePass(VkCommandBuffer commandBuffer)
+{
+	if (m_frameCapture) {
+		m_frameCapture->recordCopy(commandBuffer, m_renderGraph->getImage(m_backbuffer), m_swapChainImageFormat,
+			m_swapChainExtent, m_frameNumber);
+	}
 }
 
 bool VulkanRenderer::checkInstanceExtensionSupport(const NameList_t& requiredExtensions) 
@@ -1000,6 +3560,30 @@ bool VulkanRenderer::checkDeviceExtensionSupport(VkPhysicalDevice device)
 	return true;
 }
 
+bool VulkanRenderer::checkDeviceFeatureSupport(VkPhysicalDevice device)
+{
+	VkPhysicalDeviceProperties properties;
+	vkGetPhysicalDeviceProperties(device, &properties);
+	if (properties.apiVersion < VK_API_VERSION_1_2) {
+		return false;
+	}
+
+	VkPhysicalDeviceDescriptorIndexingFeatures indexingFeatures{};
+	indexingFeatures.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_DESCRIPTOR_INDEXING_FEATURES;
+
+	VkPhysicalDeviceFeatures2 features{};
+	features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2;
+	features.pNext = &indexingFeatures;
+	vkGetPhysicalDeviceFeatures2(device, &features);
+
+	return	indexingFeatures.runtimeDescriptorArray &&
+			indexingFeatures.descriptorBindingPartiallyBound &&
+			indexingFeatures.descriptorBindingUpdateUnusedWhilePending &&
+			indexingFeatures.descriptorBindingStorageBufferUpdateAfterBind &&
+			indexingFeatures.descriptorBindingSampledImageUpdateAfterBind &&
+			indexingFeatures.shaderSampledImageArrayNonUniformIndexing;
+}
+
 bool VulkanRenderer::checkDeviceSuitable(VkPhysicalDevice device)
 {
 	auto indices = getQueueFamilyIndices(device);
@@ -1007,6 +3591,7 @@ bool VulkanRenderer::checkDeviceSuitable(VkPhysicalDevice device)
 
 	return	indices.isValid() && 
 			checkDeviceExtensionSupport(device) &&
+			checkDeviceFeatureSupport(device) &&
 			swapChainDetails.isValid();
 }
 
@@ -1055,13 +3640,14 @@ VkSurfaceFormatKHR VulkanRenderer::chooseBestSurfaceFormat(const std::vector<VkS
 VkPresentModeKHR VulkanRenderer::chooseBestPresentationMode(const std::vector<VkPresentModeKHR>& presentationModes)
 {
 	for (const auto& presentationMode : presentationModes) {
-		if (presentationMode == VK_PRESENT_MODE_MAILBOX_KHR) {
+		if (presentationMode == m_settings.presentMode) {
 			return presentationMode;
 		}
 	}
 
 	// The standard says that FIFO presentation mode must always 
 	// be supported
+	std::cout << "Requested presentation mode not supported, falling back to FIFO" << std::endl;
 	return VK_PRESENT_MODE_FIFO_KHR;
 }
 
@@ -1072,11 +3658,8 @@ VkExtent2D VulkanRenderer::chooseSwapExtent(const VkSurfaceCapabilitiesKHR& surf
 	}
 
 	// return window size clamped to min/max image size
-	int width, height;
-	glfwGetFramebufferSize(m_window, &width, &height);
-
-	uint32_t width32 = static_cast<uint32_t>(width);
-	uint32_t height32 = static_cast<uint32_t>(width);
+	uint32_t width32 = static_cast<uint32_t>(m_framebufferWidth.load());
+	uint32_t height32 = static_cast<uint32_t>(m_framebufferHeight.load());
 
 	VkExtent2D newExtent = {};
 	newExtent.height = std::clamp(height32, surfaceCapabilities.minImageExtent.height, surfaceCapabilities.maxImageExtent.height);
@@ -1098,17 +3681,25 @@ QueueFamilyIndices VulkanRenderer::getQueueFamilyIndices(VkPhysicalDevice device
 	int i = 0;
 	for (const auto& family : queueFamilies) 
 	{
-		if (family.queueCount > 0 && family.queueFlags & VK_QUEUE_GRAPHICS_BIT) {
-			indices.graphicsFamily = i;
+		if (!indices.isValid()) {
+			if (family.queueCount > 0 && family.queueFlags & VK_QUEUE_GRAPHICS_BIT) {
+				indices.graphicsFamily = i;
+			}
+
+			VkBool32 presentationSupported = false;
+			vkGetPhysicalDeviceSurfaceSupportKHR(device, i, m_surface, &presentationSupported);
+			if (family.queueCount > 0 && presentationSupported) {
+				indices.presentationFamily = i;
+			}
 		}
 
-		VkBool32 presentationSupported = false;
-		vkGetPhysicalDeviceSurfaceSupportKHR(device, i, m_surface, &presentationSupported);
-		if (family.queueCount > 0 && presentationSupported) {
-			indices.presentationFamily = i;
+		// A family without graphics is what runs alongside the graphics queue
+		bool computeOnly = (family.queueFlags & VK_QUEUE_COMPUTE_BIT) && !(family.queueFlags & VK_QUEUE_GRAPHICS_BIT);
+		if (indices.computeFamily < 0 && family.queueCount > 0 && computeOnly) {
+			indices.computeFamily = i;
 		}
 
-		if (indices.isValid()) {
+		if (indices.isValid() && indices.computeFamily >= 0) {
 			break;
 		}
 
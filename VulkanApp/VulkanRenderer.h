@@ -3,11 +3,94 @@
 #define GLFW_INCLUDE_VULKAN
 #include <GLFW/glfw3.h>
 #include <glm/gtc/matrix_transform.hpp>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <exception>
+#include <fstream>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
 #include <stdexcept>
+#include <thread>
 #include <vector>
 
 #include "Utils.h"
 #include "Mesh.h"
+#include "DeletionQueue.h"
+#include "DescriptorAllocator.h"
+#include "RenderGraph.h"
+#include "DynamicResolution.h"
+#include "DepthPyramid.h"
+#include "TextureStreamer.h"
+#include "ResidencyManager.h"
+#include "GeometryCache.h"
+#include "Profiler.h"
+#include "RenderStats.h"
+#include "FrameCapture.h"
+#include "SceneRecorder.h"
+#include "JobSystem.h"
+#include "LinearArena.h"
+#include "SpscQueue.h"
+
+struct RendererSettings {
+	// Preferred presentation mode. FIFO is used if the surface doesn't support it.
+	VkPresentModeKHR presentMode = VK_PRESENT_MODE_MAILBOX_KHR;
+
+	// How many frames the CPU may record ahead of the GPU, 1 to MAX_FRAME_DRAWS
+	int framesInFlight = 2;
+
+	// Delay the work for the next frame until just before the GPU needs it,
+	// trading some throughput for lower input latency
+	bool lowLatency = false;
+
+	// Render the scene at a lower resolution when the GPU can't keep up with
+	// targetFrameMs, and upscale it to the window. Only the passes whose cost
+	// follows the resolution count, from the scene to the upscale.
+	bool dynamicResolution = false;
+	double targetFrameMs = 16.6;
+
+	// Create the two demo quads. Off when the scene is built with addMesh.
+	bool demoScene = true;
+
+	// Per-frame statistics (see RenderStats) are appended to this file as
+	// JSON lines, a line per frame
+	std::string statsPath;
+
+	// Rendered frames are written to image files named after this pattern
+	// (see FrameCapture), captureFrames of them, or all if 0
+	std::string capturePath;
+	uint32_t captureFrames = 0;
+
+	// Every scene API call is logged to this file for SceneReplay
+	std::string recordPath;
+
+	// Threads the job system runs besides the one calling draw(), or -1 for
+	// one less than the number of hardware threads
+	int workerThreads = -1;
+
+	// Draw on a thread owned by the renderer. Scene calls made on the
+	// thread that called init() are queued for it, and draw() returns as
+	// soon as the previous frame has started, so that the next frame can be
+	// simulated while this one is drawn.
+	bool renderThread = false;
+
+	// Run compute passes (the GPU animation) on a compute-only queue, if the
+	// device has one, so that they overlap the graphics work of the
+	// previous frame
+	bool asyncCompute = true;
+
+	// Skip objects hidden behind others. They are tested on the GPU against
+	// a hierarchical-Z pyramid of the depth buffer (see DepthPyramid) and
+	// drawn indirectly.
+	bool occlusionCulling = true;
+
+	// Draw opaque objects first, front to back and without blending, then
+	// the transparent ones back to front. Off, everything is blended and
+	// drawn in submission order, as a baseline to measure against.
+	bool renderQueue = true;
+};
 
 class VulkanRenderer
 {
@@ -15,24 +98,216 @@ public:
 	VulkanRenderer();
 	~VulkanRenderer();
 
-	int init(GLFWwindow* window);
+	int init(GLFWwindow* window, const RendererSettings& settings = {});
 	void cleanup();
 	void draw();
 
-	void updateModel(int modelId, glm::mat4 newModel);
+	// Frame pacing: call waitForNextFrame() before polling input and
+	// markInputSampled() right after, so that the time from input to
+	// present can be measured. In low latency mode waitForNextFrame()
+	// blocks until the GPU is about to need the next frame, except with a
+	// render thread, where the frame being drawn already hides that wait.
+	void waitForNextFrame();
+	void markInputSampled();
+	double getInputToPresentMs() const;
+
+	// Takes effect on the next frame by recreating the swapchain
+	void setPresentMode(VkPresentModeKHR presentMode);
+
+	// Dynamic resolution metrics
+	float getResolutionScale() const;
+	double getResolutionHitRate() const;
+	double getGpuFrameMs() const;
+
+	// Uploads a mesh and returns its handle. Vertices or indices identical
+	// to those of a live mesh aren't uploaded again but shared with it (see
+	// GeometryCache). Must not be called while a frame is being recorded.
+	// With a render thread this waits for the frame being drawn to finish,
+	// as does loadTexture().
+	MeshHandle addMesh(std::vector<Vertex>* vertices, std::vector<uint32_t>* indices);
+
+	// The mesh stops being drawn right away, its buffers are freed once the
+	// frames in flight are done with them. Calls with a removed mesh's
+	// handle are ignored.
+	void removeMesh(MeshHandle mesh);
+
+	// Live meshes, in drawing order
+	std::vector<MeshHandle> getMeshes();
+
+	// Only queued with a render thread, like the other setters
+	void updateModel(MeshHandle mesh, glm::mat4 newModel);
+
+	// Camera transform, looking down -Z from (0, 0, 2) until set
+	void setView(const glm::mat4& view);
+
+	// Animate an object on the GPU. Its model matrix (see updateModel) stays
+	// the base transform that the animation is applied to.
+	void setAnimation(MeshHandle mesh, const ObjectAnimation& animation);
+
+	// Textures are streamed in over the next frames; until their first mips
+	// have arrived, textured objects show their vertex colours
+	uint32_t loadTexture(const std::string& path);
+	void setTexture(MeshHandle mesh, uint32_t texture);
+	double getTextureUploadMBps() const;
+
+	// See Mesh::setTransparent
+	void setTransparent(MeshHandle mesh, bool transparent);
+
+	// Replaces every light in the scene. Lights are assigned to clusters of
+	// the view frustum on the GPU, so each fragment only shades with the
+	// ones that can reach it. Without lights the scene is drawn unlit.
+	// Not part of a --record log.
+	void setLights(const std::vector<PointLight>& lights);
+
+	// Animations are normally evaluated at the time since init. This sets
+	// the time used by the next draw() instead, e.g. for a replay.
+	void setAnimationTime(double seconds);
+
+	// Frames submitted so far. With a render thread this and the other
+	// metrics are as of the start of the frame being drawn.
+	uint64_t getFrameNumber() const;
+
+	// Spreads the CPU side of a frame over several cores. Also free for
+	// other work, like generating assets, between frames.
+	JobSystem& getJobSystem();
+
+	// Replaces the job system with one of this many workers. Must not be
+	// called while a frame is being drawn.
+	void setWorkerThreads(uint32_t count);
+
+	// See RendererSettings::renderQueue. Takes effect on the next frame.
+	void setRenderQueue(bool enabled);
 
 private:
 	GLFWwindow* m_window;
+	RendererSettings m_settings;
 
 	int m_currentFrame = 0;
+	uint64_t m_frameNumber = 0; // number of frames submitted so far
+
+	// Set when the window is resized or the swapchain stops matching the surface
+	std::atomic<bool> m_framebufferResized{ false };
+
+	// Kept up to date by the resize callback, GLFW can only be asked on the
+	// thread that polls events
+	std::atomic<int> m_framebufferWidth{ 0 };
+	std::atomic<int> m_framebufferHeight{ 0 };
+
+	// GPU objects waiting for the frames that use them to retire
+	DeletionQueue m_deletionQueue;
+
+	// Latency measurement
+	using Clock = std::chrono::steady_clock;
+	Clock::time_point m_inputSampledAt;
+	bool m_inputSampled = false;
+	double m_blockedEstimateMs = 0.0; // how long the CPU usually waits for the GPU or the display
+	double m_waitedAheadMs = 0.0; // by waitForNextFrame for the next draw(), counted as blocked
+	double m_inputToPresentMs = 0.0;
+	struct {
+		Clock::time_point windowStart;
+		double totalMs = 0.0;
+		double minMs = 0.0;
+		double maxMs = 0.0;
+		int frames = 0;
+	} m_latencyReport;
+
+	// Statistics export, see RendererSettings::statsPath
+	std::ofstream m_statsFile;
+	uint64_t m_statsWrittenUpTo = 0;
+
+	// Startup timing, also the time animations are evaluated from
+	std::chrono::steady_clock::time_point m_initStart;
+	bool m_firstFramePresented = false;
 
-	// Meshes
-	std::vector<Mesh> m_meshList;
+	// Meshes and what is kept per mesh. The dense index of a mesh is also
+	// its object's index in the frame's object buffer.
+	struct MeshObject {
+		Mesh mesh;
+		bool animated; // moves on the GPU, so it is never culled
+		uint64_t stamp; // new whenever what its object record holds changes
+	};
+	SlotMap<MeshObject> m_meshes;
+	uint64_t m_objectStamp = 0; // last stamp handed out
+
+	// Objects that survived frustum culling this frame, the opaque ones
+	// front to back followed by the transparent ones back to front (see
+	// RendererSettings::renderQueue). Lives in the frame's arena, like the
+	// rest of the frame's scratch data.
+	LinearArena m_emptyArena; // what the draw list refers to before the first frame
+	ArenaVector<uint32_t> m_drawList{ m_emptyArena };
+	size_t m_opaqueDrawCount = 0; // where the transparent objects start
+
+	// GPU animations, at most one per mesh, each referring to its mesh by
+	// dense index
+	std::vector<ObjectAnimation> m_animations;
+	uint64_t m_animationVersion = 1;
+	double m_animationTime = 0.0; // of the frame being drawn, in seconds
+	bool m_animationTimeSet = false;
+
+	std::vector<PointLight> m_lights;
+	uint64_t m_lightVersion = 1;
+
+	// See RendererSettings::recordPath
+	SceneRecorder m_recorder;
+
+	std::unique_ptr<JobSystem> m_jobs;
+
+	// Render thread, see RendererSettings::renderThread. Calls that can't be
+	// queued by value (addMesh, for instance) are queued as a function to
+	// run, and the calling thread waits for it.
+	struct SceneCommand {
+		enum Type : uint8_t {
+			UpdateModel, SetAnimation, SetTexture, SetTransparent, RemoveMesh, SetView, SetPresentMode,
+			SetAnimationTime, EndFrame, Call
+		} type;
+		MeshHandle mesh;
+		uint32_t value;  // texture, present mode or transparency
+		double time;     // animation time
+		glm::mat4 matrix;
+		ObjectAnimation animation;
+		Clock::time_point inputSampledAt;
+		bool inputSampled;
+		const std::function<void()>* call;
+		std::promise<void>* done;
+	};
+	std::unique_ptr<SpscQueue<SceneCommand>> m_commands;
+	std::thread m_renderThread;
+	mutable std::mutex m_renderMutex; // guards the fields below
+	std::condition_variable m_renderWake;
+	std::condition_variable m_frameStarted;
+	uint64_t m_framesPublished = 0;
+	uint64_t m_framesStarted = 0;
+	uint64_t m_batchesPublished = 0; // frames and calls, which the render thread wakes up for
+	uint64_t m_batchesTaken = 0;
+	bool m_commandsWaiting = false;  // the queue is full
+	bool m_renderStopping = false;
+	std::exception_ptr m_renderError;
+
+	// Copied at the start of every frame for the getters on the other thread
+	struct {
+		uint64_t frameNumber;
+		double inputToPresentMs;
+		float resolutionScale;
+		double resolutionHitRate;
+		double gpuFrameMs;
+		double textureUploadMBps;
+	} m_publishedMetrics{};
+
+	// Input timing of the frame being simulated
+	Clock::time_point m_simInputSampledAt;
+	bool m_simInputSampled = false;
 
 	// Scene settings
 	struct UboViewProjection {
 		glm::mat4 projection;
 		glm::mat4 view;
+		uint32_t objectBuffer; // bindless index of this frame's object buffer
+		uint32_t lightBuffer;   // and of its lights
+		uint32_t clusterBuffer; // and of the lights of each cluster
+		uint32_t lightCount;
+		glm::vec2 clusterTileSize;   // in pixels, as the render extent changes
+		float clusterDepthScale;     // depth slice = log(view depth) * scale - bias
+		float clusterDepthBias;
 	} m_uboViewProjection;
 
 	// Vulkan data structures
@@ -45,36 +320,202 @@ private:
 
 	VkQueue m_graphicsQueue;
 	VkQueue m_presentationQueue;
+	VkQueue m_computeQueue = VK_NULL_HANDLE; // only with async compute
+	std::vector<uint32_t> m_objectQueueFamilies; // queue families sharing the object, light and cluster buffers concurrently: graphics, and async compute when used
+	bool m_computeTimestamps = false;
 	VkSurfaceKHR m_surface;
 	VkSwapchainKHR m_swapchain;
 
-	// Elements in the below vectors are mapped 1:1 - command buffer
-	// at index i will only ever use framebuffer i and swapchainimage i
+	// Elements in the below vectors are mapped 1:1 - m_imagesInFlight[i] is
+	// the fence of the frame that last rendered to swapchain image i (or null)
 	std::vector<SwapChainImage> m_swapChainImages;
-	std::vector<VkFramebuffer> m_swapChainFramebuffers;
-	std::vector<VkCommandBuffer> m_commandBuffers;
+	std::vector<VkFence> m_imagesInFlight;
+
+	// Everything a frame needs while it is being recorded and executed.
+	// Contexts are used as a ring of framesInFlight entries, and a context
+	// is only touched again once its fence has signalled.
+	struct FrameContext {
+		VkCommandPool commandPool; // reset as a whole every frame
+		VkCommandBuffer commandBuffer;
+		VkSemaphore imageAvailable;
+		VkFence fence;
+
+		// GPU timestamps at the start and the end of the frame, followed by
+		// a pair for every render graph pass while profiling
+		VkQueryPool timestampPool;
+		bool timestampsWritten;
+		uint32_t passTimestamps;
+		uint64_t frameNumber; // of the frame last submitted with this context
+
+		// Transient allocations
+		VkBuffer vpUniformBuffer;
+		VkDeviceMemory vpUniformBufferMemory;
+		void* vpUniformBufferMapped; // persistently mapped
+		VkDescriptorSet descriptorSet;
+
+		// Sets that only live for this frame, reset once the fence has signalled
+		DescriptorAllocator descriptorAllocator;
+
+		// CPU scratch memory for recording the frame (draw list, barriers,
+		// upload regions), reset once the fence has signalled
+		LinearArena arena;
+
+		// Async compute work, submitted ahead of the graphics work, which
+		// waits for computeFinished. Once the fence has signalled, both are
+		// done. Timestamps work like the graphics ones.
+		VkCommandPool computeCommandPool;
+		VkCommandBuffer computeCommandBuffer;
+		VkSemaphore computeFinished;
+		VkQueryPool computeTimestampPool;
+		bool computeTimestampsWritten;
+		uint32_t computePassTimestamps;
+
+		// Secondary command buffers the scene pass is recorded into in
+		// parallel, each from a pool of its own since a pool can only be
+		// used by one thread at a time
+		std::vector<VkCommandPool> scenePools;
+		std::vector<VkCommandBuffer> sceneCommandBuffers;
+
+		// One ObjectData record per mesh, read by the shaders through the
+		// bindless set. Grows when the scene outgrows it.
+		VkBuffer objectBuffer;
+		VkDeviceMemory objectBufferMemory;
+		void* objectBufferMapped;
+		uint32_t objectCapacity;
+		uint32_t objectBufferIndex;
+
+		// Object and texture stamps each record was last written with, so
+		// only records that changed since are written again
+		std::vector<std::pair<uint64_t, uint64_t>> objectStamps;
+
+		// Copy of m_animations with the base transform of each object,
+		// rewritten when this frame's copy is out of date
+		VkBuffer animationBuffer;
+		VkDeviceMemory animationBufferMemory;
+		void* animationBufferMapped;
+		uint32_t animationCapacity;
+		uint32_t animationBufferIndex;
+		uint64_t animationVersion;
 
-	// Descriptors
+		// With occlusion culling, the draw counts followed by a command per
+		// draw list entry, and room for as many for each scene pass. The cull
+		// passes copy the visible entries' commands into the passes' lists
+		// and count them; the counts are read back for the statistics once
+		// the fence has signalled.
+		VkBuffer drawCommandBuffer;
+		VkDeviceMemory drawCommandBufferMemory;
+		void* drawCommandBufferMapped;
+		uint32_t drawCommandCapacity; // entries
+		uint32_t drawCommandBufferIndex;
+		uint32_t drawCommandCount;    // entries of the last submission
+		uint32_t firstTransparentDraw; // of the last submission, the rest aren't drawn early
+
+		// Copy of m_lights, rewritten when out of date, and the lights of
+		// each cluster, which the light cull pass fills in
+		VkBuffer lightBuffer;
+		VkDeviceMemory lightBufferMemory;
+		void* lightBufferMapped;
+		uint32_t lightCapacity;
+		uint32_t lightBufferIndex;
+		uint64_t lightVersion;
+		VkBuffer clusterBuffer;
+		VkDeviceMemory clusterBufferMemory;
+		uint32_t clusterBufferIndex;
+	};
+	std::vector<FrameContext> m_frames;
+
+	// Descriptors. Long lived sets come from the cache, which reuses a set
+	// whenever the same layout and bindings are asked for again.
 	VkDescriptorSetLayout m_descriptorSetLayout;
-	VkPushConstantRange m_pushConstantRange;
-	VkDescriptorPool m_descriptorPool;
-	std::vector<VkDescriptorSet> m_descriptorSets;
+	DescriptorAllocator m_descriptorAllocator;
+	DescriptorSetCache m_descriptorCache;
+
+	// Bindless set: descriptor-indexed arrays of buffers and textures,
+	// bound once per frame and shared by all draws
+	VkDescriptorSetLayout m_bindlessSetLayout;
+	DescriptorAllocator m_bindlessAllocator;
+	VkDescriptorSet m_bindlessDescriptorSet;
+	uint32_t m_bindlessBufferCount = 0;
+
+	// Textures, each image in its own slot of the bindless textures array
+	TextureStreamer m_textureStreamer;
+	VkSampler m_textureSampler;
+
+	// Meshes and textures are evicted to stay within the memory budget
+	ResidencyManager m_residency;
+	bool m_hasMemoryBudget = false;
+	std::vector<ResidencyManager::ResourceId> m_textureResidency; // per texture
 
-	std::vector<VkBuffer> m_vpUniformBuffers; // one per swapchain, to avoid updating a uniform while it's bound
-	std::vector<VkDeviceMemory> m_vpUniformBufferMemory;
+	// Vertex and index buffers of every mesh, uploaded once for all the
+	// meshes made of the same data
+	GeometryCache m_geometryCache;
 
 	VkFormat m_swapChainImageFormat;
 	VkExtent2D m_swapChainExtent;
+
+	// The scene is drawn to an offscreen target as big as the swapchain, but
+	// only the m_renderExtent corner of it is used, and then upscaled
+	VkFramebuffer m_sceneFramebuffer;
+	VkExtent2D m_renderExtent;
+	VkFilter m_upscaleFilter = VK_FILTER_LINEAR;
+	DynamicResolution m_dynamicResolution;
+	double m_timestampPeriod = 1.0; // nanoseconds per timestamp tick
+
+	// GPU timestamps are placed on the profiler's clock with the smallest
+	// difference seen between a frame's last timestamp and the CPU noticing
+	// its fence, which approaches the true offset from above
+	std::vector<const char*> m_gpuPassNames;
+	std::vector<const char*> m_gpuComputePassNames;
+	int64_t m_gpuClockOffsetNs = 0;
+	bool m_gpuClockCalibrated = false;
 	VkPipelineLayout m_pipelineLayout;
 	VkRenderPass m_renderPass;
-	VkPipeline m_graphicsPipeline;
+	VkRenderPass m_lateRenderPass; // keeps what the first scene pass drew
+	VkPipeline m_graphicsPipeline;    // opaque objects, no blending
+	VkPipeline m_transparentPipeline; // blended, doesn't write depth
+	VkPipeline m_blendedPipeline;     // blended and writes depth, without the render queue
+
+	// Compute pipeline that writes animated model matrices into the object buffer
+	VkPipelineLayout m_animatePipelineLayout;
+	VkPipeline m_animatePipeline;
+
+	// Compute pipeline that assigns the lights to clusters
+	VkPipelineLayout m_lightCullPipelineLayout;
+	VkPipeline m_lightCullPipeline;
 
-	VkCommandPool m_graphicsCommandPool;
+	// Occlusion culling. The scene is drawn in two passes: the early one
+	// draws what last frame's depth pyramid doesn't hide, the pyramid is
+	// rebuilt from the result, and the late one draws whatever the early
+	// one left out but the new pyramid shows, so nothing that comes into
+	// view pops in a frame late.
+	VkDescriptorSetLayout m_depthPyramidSetLayout = VK_NULL_HANDLE;
+	VkPipelineLayout m_depthPyramidPipelineLayout = VK_NULL_HANDLE;
+	VkPipeline m_depthPyramidPipeline = VK_NULL_HANDLE;
+	VkDescriptorSetLayout m_cullSetLayout = VK_NULL_HANDLE;
+	VkPipelineLayout m_cullPipelineLayout = VK_NULL_HANDLE;
+	VkPipeline m_cullPipeline = VK_NULL_HANDLE;
+	VkSampler m_depthSampler = VK_NULL_HANDLE;
+	DepthPyramid m_depthPyramid;
+	bool m_depthPyramidValid = false; // built by a frame since it was created
+	VkExtent2D m_depthPyramidExtent = {}; // render extent of the frame that built it
 
-	// Synchronization structures
-	std::vector<VkSemaphore> m_imageAvailable;
-	std::vector<VkSemaphore> m_renderFinished;
-	std::vector<VkFence> m_drawFences;
+	VkCommandPool m_transferCommandPool;
+
+	// Passes of a frame and the resources they use. Shared so that a graph
+	// replaced on resize can be kept alive by the deletion queue.
+	std::shared_ptr<RenderGraph> m_renderGraph;
+	RenderGraph::ResourceId m_backbuffer = 0;
+	RenderGraph::ResourceId m_sceneColor = 0;
+	RenderGraph::ResourceId m_sceneDepth = 0;
+	RenderGraph::ResourceId m_objects = 0;
+	RenderGraph::ResourceId m_pyramid = 0;      // m_depthPyramid
+	RenderGraph::ResourceId m_drawCommands = 0; // the frame's drawCommandBuffer
+	RenderGraph::ResourceId m_clusters = 0;     // the frame's clusterBuffer
+	uint32_t m_imageIndex = 0; // swapchain image the graph is being recorded for
+
+	// Frame capture, when asked for and the swapchain images can be copied from
+	std::unique_ptr<FrameCapture> m_frameCapture;
+	bool m_canCapture = false;
 
 	// Vulkan helpers
 
@@ -83,29 +524,86 @@ private:
 	void getPhysicalDevice();
 	void createLogicalDevice();
 	void createSurface();
-	void createSwapChain();
+	void createSwapChain(VkSwapchainKHR oldSwapchain);
 	void createRenderPass();
 	void createDescriptorSetLayout();
-	void createPushConstantRange();
 	void createGraphicsPipeline();
+	void createAnimatePipeline();
+	void createLightCullPipeline();
+	void createOcclusionPipelines();
 	void createFramebuffers();
+	void createRenderGraph();
 	void createCommandPool();
-	void createCommandBuffers();
-	void createSynchronisation();
+	void createResidencyManager();
+	void createGeometryCache();
+	void createMeshes();
+	void createFrameContexts();
 
 	void createUniformBuffers();
-	void createDescriptorPool();
+	void createDescriptorAllocators();
 	void createDescriptorSets();
+	void createTextureStreamer();
+	void createFrameCapture();
+
+	void createObjectBuffer(FrameContext& frame, uint32_t capacity);
+	void createAnimationBuffer(FrameContext& frame, uint32_t capacity);
+	void createDrawCommandBuffer(FrameContext& frame, uint32_t capacity);
+	void createLightBuffer(FrameContext& frame, uint32_t capacity);
+	uint32_t registerBindlessBuffer(VkBuffer buffer);
+	void updateBindlessBuffer(uint32_t index, VkBuffer buffer);
+
+	void updateUniformBuffers(FrameContext& frame);
+	void updateProjection();
+
+	// Swapchain recreation
+	bool recreateSwapChain();
+	static void framebufferResizeCallback(GLFWwindow* window, int width, int height);
 
-	void updateUniformBuffers(uint32_t imageIndex);
+	// Latency
+	void recordInputToPresent();
+
+	// Render thread
+	bool isOffRenderThread() const;
+	void pushCommand(const SceneCommand& command);
+	void publishBatch(const SceneCommand& command);
+	void runOnRenderThread(const std::function<void()>& call);
+	void applyCommand(const SceneCommand& command);
+	void renderLoop();
+	void stopRenderThread();
+	void drawFrame();
+
+	// Statistics
+	void writeFrameStats();
 
 	// Record commands
-	void recordCommands(uint32_t currentImage);
+	void submitAsyncCompute(FrameContext& frame);
+	void recordCommands(FrameContext& frame, uint32_t currentImage);
+	void recordTextureUploads(VkCommandBuffer commandBuffer);
+	void recordAnimatePass(VkCommandBuffer commandBuffer);
+	void recordLightCullPass(VkCommandBuffer commandBuffer);
+	void recordCullPass(VkCommandBuffer commandBuffer, bool late);
+	void recordScenePass(VkCommandBuffer commandBuffer, bool late);
+	void bindSceneState(VkCommandBuffer commandBuffer, const FrameContext& frame, size_t begin);
+	VkPipeline getScenePipeline(bool transparent) const;
+	void recordSceneDraws(VkCommandBuffer commandBuffer, size_t begin, size_t end);
+	void recordSceneSecondary(FrameContext& frame, size_t index, size_t begin, size_t end);
+	void recordCulledDraws(VkCommandBuffer commandBuffer, const FrameContext& frame, bool late);
+	void recordDepthPyramidPass(VkCommandBuffer commandBuffer);
+	void recordUpscalePass(VkCommandBuffer commandBuffer);
+	void recordCapturePass(VkCommandBuffer commandBuffer);
+	void writeTimestamp(VkCommandBuffer commandBuffer, VkPipelineStageFlagBits stage, uint32_t query);
+
+	// Dynamic resolution
+	void readGpuFrameTime(FrameContext& frame);
+
+	// Occlusion culling statistics
+	void readOcclusionResults(FrameContext& frame);
 
 	// Check
 	using NameList_t = std::vector<const char*>;
 	bool checkInstanceExtensionSupport(const NameList_t& extensionNames);
 	bool checkDeviceExtensionSupport(VkPhysicalDevice device);
+	bool checkDeviceFeatureSupport(VkPhysicalDevice device);
 	bool checkDeviceSuitable(VkPhysicalDevice device);
 	bool checkValidationLayers();
 
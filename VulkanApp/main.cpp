@@ -4,63 +4,339 @@
 #define GLM_FORCE_RADIANS
 #define GLM_FORCE_DEPTH_ZERO_TO_ONE
 
+#include <algorithm>
+#include <chrono>
 #include <iostream>
+#include <limits>
+#include <memory>
+#include <sstream>
 #include <stdexcept>
+#include <string>
+#include <type_traits>
 #include <vector>
 
 #include "VulkanRenderer.h"
+#include "StressScene.h"
+#include "SceneReplay.h"
 
-GLFWwindow* initWindow(std::string name = "Vulkan Window", int width = 800, int height = 600);
+const int WINDOW_WIDTH = 800;
+const int WINDOW_HEIGHT = 600;
 
-int main() 
+GLFWwindow* initWindow(std::string name = "Vulkan Window", int width = WINDOW_WIDTH, int height = WINDOW_HEIGHT,
+	bool visible = true);
+bool parseArguments(int argc, char* argv[], RendererSettings& settings, std::string& texturePath,
+	StressSceneSettings& stressSettings, std::string& tracePath, std::string& replayPath, uint32_t& scalingFrames,
+	uint32_t& allocationFrames, uint32_t& lightFrames, uint32_t& fillRateFrames);
+void printUsage(const char* program);
+void setUpDemoScene(VulkanRenderer& vkRenderer);
+int replay(const std::string& path, RendererSettings settings);
+void measureJobScaling(VulkanRenderer& vkRenderer, GLFWwindow* window, uint32_t frames);
+void measureLightScaling(VulkanRenderer& vkRenderer, GLFWwindow* window, uint32_t frames, const StressScene& scene);
+void measureFillRate(VulkanRenderer& vkRenderer, GLFWwindow* window, uint32_t frames);
+bool checkAllocations(VulkanRenderer& vkRenderer, GLFWwindow* window, uint32_t frames);
+
+int main(int argc, char* argv[]) 
 {
+	RendererSettings settings{};
+	std::string texturePath;
+	StressSceneSettings stressSettings{};
+	std::string tracePath;
+	std::string replayPath;
+	uint32_t scalingFrames = 0;
+	uint32_t allocationFrames = 0;
+	uint32_t lightFrames = 0;
+	uint32_t fillRateFrames = 0;
+	if (!parseArguments(argc, argv, settings, texturePath, stressSettings, tracePath, replayPath, scalingFrames,
+		allocationFrames, lightFrames, fillRateFrames)) {
+		return EXIT_FAILURE;
+	}
+
+	Profiler::setThreadName("main");
+	if (!tracePath.empty()) {
+		Profiler::start();
+	}
+
+	if (!replayPath.empty()) {
+		int result = replay(replayPath, settings);
+		if (!tracePath.empty()) {
+			Profiler::stop();
+			Profiler::writeChromeTrace(tracePath);
+		}
+		return result;
+	}
+
+	// The scaling measurements and the allocation check read the statistics between frames
+	bool measuring = scalingFrames > 0 || allocationFrames > 0 || lightFrames > 0 || fillRateFrames > 0;
+	if (measuring) {
+		settings.renderThread = false;
+	}
+
 	GLFWwindow* window = initWindow();
 	VulkanRenderer vkRenderer{};
 
-	if (vkRenderer.init(window) == EXIT_FAILURE) {
+	if (vkRenderer.init(window, settings) == EXIT_FAILURE) {
 		return EXIT_FAILURE;
 	};
 
-	float delta = 0.0f;
-	float lastTime = 0.0f;
-	float angle = 0.0f;
+	StressScene scene;
+	std::vector<MeshHandle> sceneMeshes;
+	if (settings.demoScene) {
+		setUpDemoScene(vkRenderer);
+	}
+	else {
+		try {
+			scene = StressScene::generate(stressSettings,
+				static_cast<float>(WINDOW_WIDTH) / static_cast<float>(WINDOW_HEIGHT), &vkRenderer.getJobSystem());
+			scene.printSummary(std::cout);
+			sceneMeshes = scene.addTo(vkRenderer);
+		}
+		catch (std::runtime_error& e) {
+			std::cout << "ERROR: " << e.what() << std::endl;
+			vkRenderer.cleanup();
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (!texturePath.empty()) {
+		try {
+			uint32_t texture = vkRenderer.loadTexture(texturePath);
+			for (MeshHandle mesh : vkRenderer.getMeshes()) {
+				vkRenderer.setTexture(mesh, texture);
+			}
+		}
+		catch (std::runtime_error& e) {
+			std::cout << "ERROR: " << e.what() << std::endl;
+		}
+	}
+
+	if (scalingFrames > 0) {
+		measureJobScaling(vkRenderer, window, scalingFrames);
+	}
+	if (lightFrames > 0) {
+		measureLightScaling(vkRenderer, window, lightFrames, scene);
+	}
+	if (fillRateFrames > 0) {
+		measureFillRate(vkRenderer, window, fillRateFrames);
+	}
+	int result = EXIT_SUCCESS;
+	if (allocationFrames > 0 && !checkAllocations(vkRenderer, window, allocationFrames)) {
+		result = EXIT_FAILURE;
+	}
 
 	// main loop
-	while (!glfwWindowShouldClose(window)) {
+	for (uint64_t frame = 0; !measuring && !glfwWindowShouldClose(window); frame++) {
+		vkRenderer.waitForNextFrame();
 		glfwPollEvents();
+		vkRenderer.markInputSampled();
+
+		if (stressSettings.churn > 0) {
+			scene.churn(vkRenderer, sceneMeshes, frame);
+		}
+		vkRenderer.draw();
+	}
+
+	if (!tracePath.empty()) {
+		Profiler::stop();
+		Profiler::writeChromeTrace(tracePath);
+	}
+
+	// Clean after ourselves
+	vkRenderer.cleanup();
+	glfwDestroyWindow(window);
+	glfwTerminate();
 
-		float now = glfwGetTime();
-		delta = now - lastTime;
-		lastTime = now;
+	return result;
+}
+
+void setUpDemoScene(VulkanRenderer& vkRenderer)
+{
+	// Both quads are animated on the GPU, the CPU only sets the base transforms
+	glm::mat4 firstModel(1.0f);
+	glm::mat4 secondModel(1.0f);
 
-		// rotate camera around Y axis
-		angle += delta * 10.f;
-		if (angle > 360.0f) { angle -= 360.0f; }
+	firstModel = glm::translate(firstModel, glm::vec3(-2.0f, 0.0, -5.0f));
+	secondModel = glm::translate(secondModel, glm::vec3(2.0f, 0.0, -5.0f));
 
-		glm::mat4 firstModel(1.0f);
-		glm::mat4 secondModel(1.0f);
+	std::vector<MeshHandle> meshes = vkRenderer.getMeshes();
+	vkRenderer.updateModel(meshes[0], firstModel);
+	vkRenderer.updateModel(meshes[1], secondModel);
 
-		firstModel = glm::translate(firstModel, glm::vec3(-2.0f, 0.0, -5.0f));
-		firstModel = glm::rotate(firstModel, glm::radians(angle), glm::vec3(0.0f, 0.0f, 1.0f));
+	ObjectAnimation firstAnimation{};
+	firstAnimation.spin = glm::vec4(0.0f, 0.0f, 1.0f, glm::radians(10.0f));
+	vkRenderer.setAnimation(meshes[0], firstAnimation);
 
-		secondModel = glm::translate(secondModel, glm::vec3(2.0f, 0.0, -5.0f));
-		secondModel = glm::rotate(secondModel, glm::radians(-angle*100), glm::vec3(0.0f, 0.0f, 1.0f));
+	ObjectAnimation secondAnimation{};
+	secondAnimation.spin = glm::vec4(0.0f, 0.0f, 1.0f, glm::radians(-1000.0f));
+	vkRenderer.setAnimation(meshes[1], secondAnimation);
+}
+
+void measureJobScaling(VulkanRenderer& vkRenderer, GLFWwindow* window, uint32_t frames)
+{
+	// Frame CPU time without the time spent waiting for the GPU or the
+	// display, which more threads can't shorten
+	const uint32_t warmUpFrames = 30;
+	frames = std::min<uint32_t>(frames, RenderStats::HISTORY_SIZE);
+	uint32_t maxThreads = JobSystem::getDefaultWorkerCount() + 1;
+	double singleThreadMs = 0.0;
 
-		vkRenderer.updateModel(0, firstModel);
-		vkRenderer.updateModel(1, secondModel);
+	std::cout << "Job system scaling over " << frames << " frames:" << std::endl;
+	for (uint32_t threads = 1; threads <= maxThreads && !glfwWindowShouldClose(window); threads++) {
+		vkRenderer.setWorkerThreads(threads - 1);
+		for (uint32_t i = 0; i < warmUpFrames + frames; i++) {
+			glfwPollEvents();
+			vkRenderer.draw();
+		}
+
+		FrameStats average = RenderStats::getAverage(frames);
+		double workMs = average.cpuMs - average.fenceWaitMs - average.acquireMs;
+		if (threads == 1) {
+			singleThreadMs = workMs;
+		}
+		std::cout << "  " << threads << " threads: " << workMs << " ms CPU per frame, "
+			<< singleThreadMs / std::max(workMs, 1e-6) << "x" << std::endl;
+	}
+}
+
+void measureLightScaling(VulkanRenderer& vkRenderer, GLFWwindow* window, uint32_t frames, const StressScene& scene)
+{
+	// GPU times arrive a few frames late, the average is over the frames
+	// that have one. No lights at all is the unlit baseline.
+	const uint32_t warmUpFrames = 30;
+	const uint32_t lightCounts[] = { 0, 1, 10, 100, 1000, 10000 };
+	frames = std::min<uint32_t>(frames, RenderStats::HISTORY_SIZE);
+	float aspect = static_cast<float>(WINDOW_WIDTH) / static_cast<float>(WINDOW_HEIGHT);
+
+	std::cout << "Clustered lighting scaling over " << frames << " frames:" << std::endl;
+	for (uint32_t lightCount : lightCounts) {
+		if (glfwWindowShouldClose(window)) {
+			break;
+		}
+		vkRenderer.setLights(scene.generateLights(lightCount, aspect));
+		for (uint32_t i = 0; i < warmUpFrames + frames; i++) {
+			glfwPollEvents();
+			vkRenderer.draw();
+		}
+
+		FrameStats average = RenderStats::getAverage(frames);
+		std::cout << "  " << lightCount << " lights: " << average.gpuMs << " ms GPU, "
+			<< average.cpuMs - average.fenceWaitMs - average.acquireMs << " ms CPU per frame" << std::endl;
+	}
+	vkRenderer.setLights({});
+}
+
+void measureFillRate(VulkanRenderer& vkRenderer, GLFWwindow* window, uint32_t frames)
+{
+	// The same scene with everything blended in submission order, as before
+	// there was a render queue, and then sorted with opaque objects
+	// unblended. Most telling on a stress scene of several depth layers.
+	const uint32_t warmUpFrames = 30;
+	frames = std::min<uint32_t>(frames, RenderStats::HISTORY_SIZE);
+	double baselineMs = 0.0;
 
+	std::cout << "Render queue fill rate over " << frames << " frames:" << std::endl;
+	for (bool renderQueue : { false, true }) {
+		if (glfwWindowShouldClose(window)) {
+			break;
+		}
+		vkRenderer.setRenderQueue(renderQueue);
+		for (uint32_t i = 0; i < warmUpFrames + frames; i++) {
+			glfwPollEvents();
+			vkRenderer.draw();
+		}
+
+		FrameStats average = RenderStats::getAverage(frames);
+		if (!renderQueue) {
+			baselineMs = average.gpuMs;
+			std::cout << "  all blended, unsorted: " << average.gpuMs << " ms GPU per frame" << std::endl;
+		}
+		else {
+			std::cout << "  render queue: " << average.gpuMs << " ms GPU per frame, "
+				<< (1.0 - average.gpuMs / std::max(baselineMs, 1e-6)) * 100.0 << "% saved" << std::endl;
+		}
+	}
+	vkRenderer.setRenderQueue(true);
+}
+
+bool checkAllocations(VulkanRenderer& vkRenderer, GLFWwindow* window, uint32_t frames)
+{
+	// Long enough for the frame arenas to have grown to fit and for the
+	// texture streamer to have finished
+	const uint32_t warmUpFrames = 120;
+	frames = std::min<uint32_t>(frames, RenderStats::HISTORY_SIZE);
+
+	for (uint32_t i = 0; i < warmUpFrames + frames && !glfwWindowShouldClose(window); i++) {
+		glfwPollEvents();
 		vkRenderer.draw();
 	}
 
-	// Clean after ourselves
+	FrameStats maximum = RenderStats::getMaximum(frames);
+	FrameStats average = RenderStats::getAverage(frames);
+	std::cout << "Heap allocations in draw() over " << frames << " frames: " << average.heapAllocations
+		<< " per frame on average, " << maximum.heapAllocations << " at most" << std::endl;
+	if (maximum.heapAllocations > 0) {
+		std::cout << "ERROR: the steady state frame loop allocates" << std::endl;
+		return false;
+	}
+	return true;
+}
+
+int replay(const std::string& path, RendererSettings settings)
+{
+	std::unique_ptr<SceneReplay> sceneReplay;
+	try {
+		sceneReplay = std::make_unique<SceneReplay>(path);
+	}
+	catch (std::runtime_error& e) {
+		std::cout << "ERROR: " << e.what() << std::endl;
+		return EXIT_FAILURE;
+	}
+
+	// Headless as far as the window system allows: an invisible window of
+	// the recorded size, presenting without waiting for vertical blank
+	const SceneLogHeader& header = sceneReplay->getHeader();
+	settings.demoScene = header.demoScene;
+	settings.presentMode = VK_PRESENT_MODE_IMMEDIATE_KHR;
+	settings.recordPath.clear();
+	settings.renderThread = false; // frames have to be drawn in step with the log
+
+	GLFWwindow* window = initWindow("Replay", static_cast<int>(header.extent.width),
+		static_cast<int>(header.extent.height), false);
+	VulkanRenderer vkRenderer{};
+	if (vkRenderer.init(window, settings) == EXIT_FAILURE) {
+		return EXIT_FAILURE;
+	}
+
+	int result = EXIT_SUCCESS;
+	auto start = std::chrono::steady_clock::now();
+	uint64_t frames = 0;
+	try {
+		frames = sceneReplay->run(vkRenderer, window);
+	}
+	catch (std::runtime_error& e) {
+		std::cout << "ERROR: " << e.what() << std::endl;
+		result = EXIT_FAILURE;
+	}
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+	std::cout << "Replayed " << frames << " frames of " << path << " in " << seconds << " s ("
+		<< frames / std::max(seconds, 1e-9) << " frames/s)" << std::endl;
+	if (sceneReplay->getFramesOutOfStep() > 0) {
+		std::cout << sceneReplay->getFramesOutOfStep()
+			<< " frames were drawn out of step with the recording, their statistics won't match" << std::endl;
+	}
+	size_t statsFrames = std::min<size_t>(frames, RenderStats::HISTORY_SIZE);
+	if (statsFrames > 0) {
+		std::cout << "Average of the last " << statsFrames << " frames: ";
+		RenderStats::writeText(std::cout, RenderStats::getAverage(statsFrames));
+	}
+
 	vkRenderer.cleanup();
 	glfwDestroyWindow(window);
 	glfwTerminate();
-
-	return EXIT_SUCCESS;
+	return result;
 }
 
-GLFWwindow* initWindow(std::string name, int width, int height)
+GLFWwindow* initWindow(std::string name, int width, int height, bool visible)
 {
 	// Init GLFW
 	glfwInit();
@@ -68,8 +344,173 @@ GLFWwindow* initWindow(std::string name, int width, int height)
 	// Declare that we don't use openGL
 	glfwWindowHint(GLFW_CLIENT_API, GLFW_NO_API);
 
-	// Make the window unresizable for now to make things simpler
-	glfwWindowHint(GLFW_RESIZABLE, GLFW_FALSE);
+	// The renderer recreates its swapchain when the window is resized
+	glfwWindowHint(GLFW_RESIZABLE, GLFW_TRUE);
+	glfwWindowHint(GLFW_VISIBLE, visible ? GLFW_TRUE : GLFW_FALSE);
 
 	return glfwCreateWindow(width, height, name.c_str(), nullptr, nullptr);
-}
\ No newline at end of file
+}
+
+// Reads all of text as a number from minimum to maximum into value, which
+// is left as it was otherwise. Integers are read as long long, so that a
+// negative count can't wrap around into an unsigned one.
+template <typename T>
+bool parseNumber(const char* text, T& value, double minimum, double maximum)
+{
+	using Wide = typename std::conditional<std::is_floating_point<T>::value, double, long long>::type;
+	std::istringstream stream(text);
+	Wide parsed;
+	if (!(stream >> parsed) || !(stream >> std::ws).eof()) {
+		return false;
+	}
+	if (static_cast<double>(parsed) < minimum || static_cast<double>(parsed) > maximum) {
+		return false;
+	}
+	value = static_cast<T>(parsed);
+	return true;
+}
+
+bool parseArguments(int argc, char* argv[], RendererSettings& settings, std::string& texturePath,
+	StressSceneSettings& stressSettings, std::string& tracePath, std::string& replayPath, uint32_t& scalingFrames,
+	uint32_t& allocationFrames, uint32_t& lightFrames, uint32_t& fillRateFrames)
+{
+	const double maxCount = std::numeric_limits<uint32_t>::max();
+
+	for (int i = 1; i < argc; i++) {
+		std::string arg = argv[i];
+		bool hasValue = i + 1 < argc;
+		bool valid = true; // the option's value, if it has one
+
+		if (arg == "--present-mode" && hasValue) {
+			std::string mode = argv[++i];
+			if (mode == "fifo") {
+				settings.presentMode = VK_PRESENT_MODE_FIFO_KHR;
+			}
+			else if (mode == "fifo-relaxed") {
+				settings.presentMode = VK_PRESENT_MODE_FIFO_RELAXED_KHR;
+			}
+			else if (mode == "mailbox") {
+				settings.presentMode = VK_PRESENT_MODE_MAILBOX_KHR;
+			}
+			else if (mode == "immediate") {
+				settings.presentMode = VK_PRESENT_MODE_IMMEDIATE_KHR;
+			}
+			else {
+				std::cout << "Unknown present mode " << mode << std::endl;
+				return false;
+			}
+		}
+		else if (arg == "--frames-in-flight" && hasValue) {
+			valid = parseNumber(argv[++i], settings.framesInFlight, 1, MAX_FRAME_DRAWS);
+		}
+		else if (arg == "--low-latency") {
+			settings.lowLatency = true;
+		}
+		else if (arg == "--dynamic-resolution" && hasValue) {
+			settings.dynamicResolution = true;
+			valid = parseNumber(argv[++i], settings.targetFrameMs, 0.1, 1000.0);
+		}
+		else if (arg == "--texture" && hasValue) {
+			texturePath = argv[++i];
+		}
+		else if (arg == "--stress" && hasValue) {
+			settings.demoScene = false;
+			valid = parseNumber(argv[++i], stressSettings.meshCount, 1, maxCount);
+		}
+		else if (arg == "--stress-geometries" && hasValue) {
+			valid = parseNumber(argv[++i], stressSettings.geometryCount, 1, maxCount);
+		}
+		else if (arg == "--stress-triangles" && hasValue) {
+			valid = parseNumber(argv[++i], stressSettings.trianglesPerMesh, 1, maxCount);
+		}
+		else if (arg == "--stress-animated") {
+			stressSettings.animated = true;
+		}
+		else if (arg == "--stress-overlap" && hasValue) {
+			valid = parseNumber(argv[++i], stressSettings.overlap, 0.0, 1.0);
+		}
+		else if (arg == "--stress-depth" && hasValue) {
+			valid = parseNumber(argv[++i], stressSettings.depthLayers, 1, maxCount);
+		}
+		else if (arg == "--stress-transparent" && hasValue) {
+			valid = parseNumber(argv[++i], stressSettings.transparent, 0.0, 1.0);
+		}
+		else if (arg == "--stress-churn" && hasValue) {
+			valid = parseNumber(argv[++i], stressSettings.churn, 0, maxCount);
+		}
+		else if (arg == "--seed" && hasValue) {
+			valid = parseNumber(argv[++i], stressSettings.seed, 0, maxCount);
+		}
+		else if (arg == "--profile" && hasValue) {
+			tracePath = argv[++i];
+		}
+		else if (arg == "--stats" && hasValue) {
+			settings.statsPath = argv[++i];
+		}
+		else if (arg == "--jobs" && hasValue) {
+			valid = parseNumber(argv[++i], settings.workerThreads, -1, 1024);
+		}
+		else if (arg == "--job-scaling" && hasValue) {
+			valid = parseNumber(argv[++i], scalingFrames, 1, maxCount);
+		}
+		else if (arg == "--fill-rate" && hasValue) {
+			valid = parseNumber(argv[++i], fillRateFrames, 1, maxCount);
+		}
+		else if (arg == "--light-scaling" && hasValue) {
+			valid = parseNumber(argv[++i], lightFrames, 1, maxCount);
+		}
+		else if (arg == "--check-allocations" && hasValue) {
+			valid = parseNumber(argv[++i], allocationFrames, 1, maxCount);
+		}
+		else if (arg == "--record" && hasValue) {
+			settings.recordPath = argv[++i];
+		}
+		else if (arg == "--replay" && hasValue) {
+			replayPath = argv[++i];
+		}
+		else if (arg == "--render-thread") {
+			settings.renderThread = true;
+		}
+		else if (arg == "--no-async-compute") {
+			settings.asyncCompute = false;
+		}
+		else if (arg == "--no-occlusion-culling") {
+			settings.occlusionCulling = false;
+		}
+		else if (arg == "--capture" && hasValue) {
+			settings.capturePath = argv[++i];
+		}
+		else if (arg == "--capture-count" && hasValue) {
+			valid = parseNumber(argv[++i], settings.captureFrames, 0, maxCount);
+		}
+		else {
+			printUsage(argv[0]);
+			return false;
+		}
+
+		if (!valid) {
+			std::cout << "Invalid value " << argv[i] << " for " << arg << std::endl;
+			printUsage(argv[0]);
+			return false;
+		}
+	}
+
+	return true;
+}
+
+void printUsage(const char* program)
+{
+	std::cout << "Usage: " << program << " [--present-mode fifo|fifo-relaxed|mailbox|immediate]"
+		<< " [--frames-in-flight 1-" << MAX_FRAME_DRAWS << "] [--low-latency]"
+		<< " [--dynamic-resolution target-ms] [--texture file.ktx2|file.dds]"
+		<< " [--stress meshes [--stress-geometries count] [--stress-triangles per-mesh]"
+		<< " [--stress-animated] [--stress-overlap 0-1] [--stress-depth layers] [--stress-transparent 0-1]"
+		<< " [--seed n]"
+		<< " [--stress-churn meshes-per-frame]]"
+		<< " [--profile trace.json] [--stats stats.jsonl]"
+		<< " [--capture frame_####.png|.ppm [--capture-count frames]]"
+		<< " [--record scene.log | --replay scene.log] [--jobs workers] [--job-scaling frames]"
+		<< " [--light-scaling frames] [--fill-rate frames]"
+		<< " [--check-allocations frames] [--render-thread] [--no-async-compute]"
+		<< " [--no-occlusion-culling]" << std::endl;
+}
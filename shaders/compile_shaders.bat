@@ -1,3 +1,7 @@
 C:\VulkanSDK\1.2.170.0\Bin32\glslangValidator.exe -V shader.vert
 C:\VulkanSDK\1.2.170.0\Bin32\glslangValidator.exe -V shader.frag
+C:\VulkanSDK\1.2.170.0\Bin32\glslangValidator.exe -V animate.comp -o animate.spv
+C:\VulkanSDK\1.2.170.0\Bin32\glslangValidator.exe -V depthpyramid.comp -o depthpyramid.spv
+C:\VulkanSDK\1.2.170.0\Bin32\glslangValidator.exe -V cull.comp -o cull.spv
+C:\VulkanSDK\1.2.170.0\Bin32\glslangValidator.exe -V lightcull.comp -o lightcull.spv
 pause
\ No newline at end of file
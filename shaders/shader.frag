@@ -1,8 +1,101 @@
 #version 450
+#extension GL_EXT_nonuniform_qualifier : require
 
 layout(location = 0) in vec3 fragCol;
+layout(location = 1) in vec2 fragTex;
+layout(location = 2) flat in uint fragTexture;
+layout(location = 3) flat in float fragMinLod;
+layout(location = 4) in vec3 fragWorldPos;
+layout(location = 5) in float fragViewDepth;
+
+// Must match UboViewProjection in VulkanRenderer.h
+layout(set = 0, binding = 0) uniform UboViewProjection {
+	mat4 projection;
+	mat4 view;
+	uint objectBuffer;
+	uint lightBuffer;
+	uint clusterBuffer;
+	uint lightCount;
+	vec2 clusterTileSize;    // pixels
+	float clusterDepthScale; // depth slice = log(view depth) * scale - bias
+	float clusterDepthBias;
+} uboViewProjection;
+
+// Must match the cluster grid in lightcull.comp
+const uvec3 CLUSTER_COUNT = uvec3(16, 9, 24);
+const uint CLUSTER_STRIDE = 256;
+
+const float AMBIENT_LIGHT = 0.05;
+
+// Must match PointLight in Utils.h
+struct PointLight {
+	vec3 position;
+	float radius;
+	vec3 color;
+	float intensity;
+};
+
+// Bindless set: every registered buffer and every streamed texture
+layout(std430, set = 1, binding = 0) readonly buffer LightBuffer {
+	PointLight lights[];
+} lightBuffers[];
+
+layout(std430, set = 1, binding = 0) readonly buffer ClusterBuffer {
+	uint clusters[];
+} clusterBuffers[];
+
+layout(set = 1, binding = 1) uniform sampler2D textures[];
+
 layout(location = 0) out vec4 outColor;
 
+// Light reaching the fragment from the lights of its cluster, which
+// lightcull.comp has picked out
+vec3 getLight(vec3 normal) {
+	uvec2 tile = min(uvec2(gl_FragCoord.xy / uboViewProjection.clusterTileSize), CLUSTER_COUNT.xy - 1);
+	float slice = log(fragViewDepth) * uboViewProjection.clusterDepthScale - uboViewProjection.clusterDepthBias;
+	uint cluster = tile.x + CLUSTER_COUNT.x * (tile.y + CLUSTER_COUNT.y * uint(clamp(slice, 0.0, float(CLUSTER_COUNT.z - 1))));
+	uint record = cluster * CLUSTER_STRIDE;
+
+	vec3 light = vec3(AMBIENT_LIGHT);
+	uint count = clusterBuffers[uboViewProjection.clusterBuffer].clusters[record];
+	for (uint i = 0; i < count; i++) {
+		uint index = clusterBuffers[uboViewProjection.clusterBuffer].clusters[record + 1 + i];
+		PointLight pointLight = lightBuffers[uboViewProjection.lightBuffer].lights[index];
+
+		vec3 toLight = pointLight.position - fragWorldPos;
+		float lightDistance = length(toLight);
+		float falloff = clamp(1.0 - (lightDistance * lightDistance) / (pointLight.radius * pointLight.radius), 0.0, 1.0);
+		float diffuse = max(dot(normal, toLight / max(lightDistance, 1e-4)), 0.0);
+		light += pointLight.color * (pointLight.intensity * diffuse * falloff * falloff);
+	}
+	return light;
+}
+
 void main() {
 	outColor = vec4(fragCol, 1.0);
-}
\ No newline at end of file
+
+	// Derivatives are taken outside the branch, where the whole quad is active
+	vec2 dx = dFdx(fragTex);
+	vec2 dy = dFdy(fragTex);
+
+	// Vertices have no normals, so surfaces are lit flat, from the side
+	// that faces the camera
+	vec3 normal = normalize(cross(dFdx(fragWorldPos), dFdy(fragWorldPos)));
+	vec3 cameraPos = -transpose(mat3(uboViewProjection.view)) * uboViewProjection.view[3].xyz;
+	if (dot(normal, cameraPos - fragWorldPos) < 0.0) {
+		normal = -normal;
+	}
+
+	// Negative while none of the texture's mips have been streamed in
+	if (fragMinLod >= 0.0) {
+		// Pick the level as the sampler would, but never one that hasn't arrived yet
+		vec2 size = vec2(textureSize(textures[nonuniformEXT(fragTexture)], 0));
+		float lod = log2(max(length(dx * size), length(dy * size)));
+		outColor *= textureLod(textures[nonuniformEXT(fragTexture)], fragTex, max(lod, fragMinLod));
+	}
+
+	// Unlit until lights are set
+	if (uboViewProjection.lightCount > 0) {
+		outColor.rgb *= getLight(normal);
+	}
+}
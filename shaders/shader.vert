@@ -1,20 +1,53 @@
 #version 450 // GLSL 4.5
+#extension GL_EXT_nonuniform_qualifier : require
 
 layout(location = 0) in vec3 pos;
 layout(location = 1) in vec3 col;
+layout(location = 2) in vec2 tex;
 
-layout(binding = 0) uniform UboViewProjection {
+// Must match UboViewProjection in VulkanRenderer.h
+layout(set = 0, binding = 0) uniform UboViewProjection {
 	mat4 projection;
 	mat4 view;
+	uint objectBuffer;
+	uint lightBuffer;
+	uint clusterBuffer;
+	uint lightCount;
+	vec2 clusterTileSize;
+	float clusterDepthScale;
+	float clusterDepthBias;
 } uboViewProjection;
 
-layout(push_constant) uniform PushModel {
+// Must match ObjectData in Utils.h
+struct ObjectData {
 	mat4 model;
-} pushModel;
+	vec4 bounds;
+	uint materialIndex;
+	float textureMinLod;
+};
+
+// Bindless set: every registered buffer, the object buffer of this frame is
+// selected by the UBO and the object by the instance index of the draw
+layout(std430, set = 1, binding = 0) readonly buffer ObjectBuffer {
+	ObjectData objects[];
+} objectBuffers[];
 
 layout(location = 0) out vec3 fragCol;
+layout(location = 1) out vec2 fragTex;
+layout(location = 2) flat out uint fragTexture;
+layout(location = 3) flat out float fragMinLod;
+layout(location = 4) out vec3 fragWorldPos;
+layout(location = 5) out float fragViewDepth;
 
 void main() {
-	gl_Position = uboViewProjection.projection * uboViewProjection.view * pushModel.model * vec4(pos, 1.0);
+	ObjectData object = objectBuffers[uboViewProjection.objectBuffer].objects[gl_InstanceIndex];
+	vec4 worldPos = object.model * vec4(pos, 1.0);
+	vec4 viewPos = uboViewProjection.view * worldPos;
+	gl_Position = uboViewProjection.projection * viewPos;
+	fragWorldPos = worldPos.xyz;
+	fragViewDepth = -viewPos.z;
 	fragCol = col;
-}
\ No newline at end of file
+	fragTex = tex;
+	fragTexture = object.materialIndex;
+	fragMinLod = object.textureMinLod;
+}